@@ -38,8 +38,12 @@
 #include <byteswap.h>
 #include <endian.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
 #include <string.h>
 #include <assert.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
 
 #include "unix/osd.h"
 #include "rdma/fi_errno.h"
@@ -53,4 +57,27 @@ static inline int ofi_shm_remap(struct util_shm *shm,
 	return shm->ptr == MAP_FAILED ? -FI_EINVAL : FI_SUCCESS;
 }
 
+/*
+ * Futexes on shared mappings are keyed by the underlying page, so they work
+ * across processes.  A negative timeout waits forever.
+ */
+static inline int ofi_futex_wait(int *addr, int val, int timeout)
+{
+	struct timespec ts, *tsp = NULL;
+
+	if (timeout >= 0) {
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = (timeout % 1000) * 1000000;
+		tsp = &ts;
+	}
+
+	return syscall(SYS_futex, addr, FUTEX_WAIT, val, tsp, NULL, 0) ?
+	       -errno : 0;
+}
+
+static inline int ofi_futex_wake(int *addr, int count)
+{
+	return syscall(SYS_futex, addr, FUTEX_WAKE, count, NULL, NULL, 0);
+}
+
 #endif /* _LINUX_OSD_H_ */
@@ -96,6 +96,10 @@ enum {
 
 int ofi_cpu_supports(unsigned func, unsigned reg, unsigned bit);
 
+#define OFI_CACHE_LINE_SIZE	64
+#define OFI_CACHE_ALIGN(size)	(((size) + OFI_CACHE_LINE_SIZE - 1) &	\
+				 ~((size_t) OFI_CACHE_LINE_SIZE - 1))
+
 
 /* Restrict to size of struct fi_context */
 struct fi_prov_context {
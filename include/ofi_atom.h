@@ -71,6 +71,8 @@ typedef atomic_int	ofi_atomic_int32_t;
 typedef atomic_long	ofi_atomic_int64_t;
 #endif
 
+#define ofi_atomic_fence() atomic_thread_fence(memory_order_seq_cst)
+
 #define OFI_ATOMIC_DEFINE(radix)									\
 	typedef struct {										\
 		ofi_atomic_int##radix##_t val;								\
@@ -123,6 +125,15 @@ typedef atomic_long	ofi_atomic_int64_t;
 		ATOMIC_IS_INITIALIZED(atomic);								\
 		return (int##radix##_t)atomic_fetch_sub_explicit(&atomic->val, val,			\
 								 memory_order_acq_rel) - val;		\
+	}												\
+	static inline											\
+	int ofi_atomic_cas_bool##radix(ofi_atomic##radix##_t *atomic,					\
+				       int##radix##_t expected, int##radix##_t desired)		\
+	{												\
+		ATOMIC_IS_INITIALIZED(atomic);								\
+		return atomic_compare_exchange_strong_explicit(&atomic->val, &expected, desired,	\
+							       memory_order_acq_rel,			\
+							       memory_order_relaxed);			\
 	}
 
 #elif defined HAVE_BUILTIN_ATOMICS
@@ -139,6 +150,8 @@ typedef atomic_long	ofi_atomic_int64_t;
 #    define ofi_atomic_ptr(atomic) (atomic)
 #  endif
 
+#define ofi_atomic_fence() ofi_atomic_mb()
+
 #define OFI_ATOMIC_DEFINE(radix)									\
 	typedef ATOMIC_T(radix) ofi_atomic##radix##_t;							\
 													\
@@ -184,10 +197,20 @@ typedef atomic_long	ofi_atomic_int64_t;
 	{												\
 		*(ofi_atomic_ptr(atomic)) = value;							\
 		ATOMIC_INIT(atomic);									\
+	}												\
+	static inline											\
+	int ofi_atomic_cas_bool##radix(ofi_atomic##radix##_t *atomic,					\
+				       int##radix##_t expected, int##radix##_t desired)		\
+	{												\
+		ATOMIC_IS_INITIALIZED(atomic);								\
+		return ofi_atomic_cas_bool(radix, ofi_atomic_ptr(atomic), expected, desired);		\
 	}
 	
 #else /* HAVE_ATOMICS */
 
+/* Every operation takes the lock, which already orders memory */
+#define ofi_atomic_fence() do { } while (0)
+
 #define OFI_ATOMIC_DEFINE(radix)								\
 	typedef	struct {									\
 		fastlock_t lock;								\
@@ -261,6 +284,20 @@ typedef atomic_long	ofi_atomic_int64_t;
 		v = atomic->val;								\
 		fastlock_release(&atomic->lock);						\
 		return v;									\
+	}											\
+	static inline										\
+	int ofi_atomic_cas_bool##radix(ofi_atomic##radix##_t *atomic,				\
+				       int##radix##_t expected, int##radix##_t desired)	\
+	{											\
+		int ret = 0;									\
+		ATOMIC_IS_INITIALIZED(atomic);							\
+		fastlock_acquire(&atomic->lock);						\
+		if (atomic->val == expected) {							\
+			atomic->val = desired;							\
+			ret = 1;								\
+		}										\
+		fastlock_release(&atomic->lock);						\
+		return ret;									\
 	}
 #endif // HAVE_ATOMICS
 
@@ -40,6 +40,7 @@
 #include <string.h>
 #include <ofi_list.h>
 #include <ofi_osd.h>
+#include <ofi_atom.h>
 
 
 #ifdef INCLUDE_VALGRIND
@@ -131,35 +132,63 @@ static inline void name ## _free(struct name *fs)		\
 
 /*
  * Buffer pool (free stack) template for shared memory regions
+ *
+ * The stack is lock-free and position independent.  Free entries are
+ * linked by index, and the top of the stack packs the index of the first
+ * free entry with a generation count to avoid ABA races between processes
+ * pushing and popping concurrently.
  */
-#define SMR_FREESTACK_EMPTY	NULL
+#define SMR_FREESTACK_EMPTY	UINT32_MAX
 
 #define SMR_FREESTACK_HEADER 					\
-	void		*base_addr;				\
-	size_t		size;					\
-	void		*next;					\
-
-#define smr_freestack_isempty(fs)	((fs)->next == SMR_FREESTACK_EMPTY)
+	union {							\
+		struct {					\
+			size_t		size;			\
+			ofi_atomic64_t	top;			\
+		};						\
+		uint8_t		pad[OFI_CACHE_LINE_SIZE];	\
+	};							\
+
+#define smr_freestack_top(gen, index)	(((gen) << 32) | (index))
+#define smr_freestack_isempty(fs)				\
+	((uint32_t) ofi_atomic_get64(&(fs)->top) == SMR_FREESTACK_EMPTY)
 #define smr_freestack_push(fs, local_p)				\
-do {								\
-	void *p = (char **) fs->base_addr + ((char **) local_p - (char **) fs); \
-	*(void **) local_p = (fs)->next;				\
-	(fs)->next = p;						\
-} while (0)
-#define smr_freestack_pop(fs) smr_freestack_pop_impl(fs, fs->next)
+	smr_freestack_push_impl(&(fs)->top, (fs)->buf,		\
+				sizeof((fs)->buf[0]),		\
+				(uint32_t) ((local_p) - (fs)->buf))
+#define smr_freestack_pop(fs)					\
+	smr_freestack_pop_impl(&(fs)->top, (fs)->buf, sizeof((fs)->buf[0]))
+
+static inline void smr_freestack_push_impl(ofi_atomic64_t *top, void *buf,
+					   size_t entry_size, uint32_t index)
+{
+	uint64_t old;
+
+	do {
+		old = (uint64_t) ofi_atomic_get64(top);
+		*(uint32_t *) ((char *) buf + index * entry_size) =
+			(uint32_t) old;
+	} while (!ofi_atomic_cas_bool64(top, (int64_t) old,
+			(int64_t) smr_freestack_top((old >> 32) + 1, index)));
+}
 
-static inline void* smr_freestack_pop_impl(void *fs, void *next)
+/* Returns NULL if the stack is empty */
+static inline void *smr_freestack_pop_impl(ofi_atomic64_t *top, void *buf,
+					   size_t entry_size)
 {
+	uint64_t old;
+	uint32_t index;
 	void *local;
 
-	struct {
-		SMR_FREESTACK_HEADER
-	} *freestack = fs;
-	assert(next != NULL);
-
-	local = (char **) fs + ((char **) next -
-		(char **) freestack->base_addr);
-	next = *((void **) local);
+	do {
+		old = (uint64_t) ofi_atomic_get64(top);
+		index = (uint32_t) old;
+		if (index == SMR_FREESTACK_EMPTY)
+			return NULL;
+		local = (char *) buf + index * entry_size;
+	} while (!ofi_atomic_cas_bool64(top, (int64_t) old,
+			(int64_t) smr_freestack_top((old >> 32) + 1,
+						    *(uint32_t *) local)));
 	return local;
 }
 
@@ -173,10 +202,9 @@ static inline void name ## _init(struct name *fs, size_t size)	\
 {								\
 	ssize_t i;						\
 	assert(size == roundup_power_of_two(size));		\
-	assert(sizeof(fs->buf[0]) >= sizeof(void *));		\
+	assert(sizeof(fs->buf[0]) >= sizeof(uint32_t));		\
 	fs->size = size;					\
-	fs->next = SMR_FREESTACK_EMPTY;				\
-	fs->base_addr = fs;					\
+	ofi_atomic_initialize64(&fs->top, SMR_FREESTACK_EMPTY);	\
 	for (i = size - 1; i >= 0; i--)				\
 		smr_freestack_push(fs, &fs->buf[i]);		\
 }								\
@@ -118,6 +118,7 @@ struct ofi_notification_queue {
 struct ofi_subscription {
 	struct ofi_notification_queue	*nq;
 	struct dlist_entry		entry;
+	struct dlist_entry		mon_entry;
 	void				*addr;
 	size_t				len;
 };
@@ -134,6 +135,16 @@ int ofi_monitor_subscribe(struct ofi_notification_queue *nq,
 void ofi_monitor_unsubscribe(struct ofi_subscription *subscription);
 struct ofi_subscription *ofi_monitor_get_event(struct ofi_notification_queue *nq);
 
+/*
+ * Process-wide monitor backed by userfaultfd.  It reports unmap, remap
+ * and madvise remove events on subscribed ranges.  Users must call
+ * ofi_uffd_init() before adding a queue to it and ofi_uffd_cleanup() once
+ * the queue is gone; -FI_ENOSYS means no such monitor is available.
+ */
+extern struct ofi_mem_monitor *uffd_monitor;
+int ofi_uffd_init(void);
+void ofi_uffd_cleanup(void);
+
 
 /*
  * MR map
@@ -59,6 +59,10 @@ enum {
 	ofi_ctrl_nack,
 	ofi_ctrl_discard,
 	ofi_ctrl_seg_data,
+	ofi_ctrl_close_req,
+	ofi_ctrl_close_ack,
+	ofi_ctrl_close_nack,
+	ofi_ctrl_credit,
 };
 
 /*
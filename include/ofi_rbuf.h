@@ -99,6 +99,115 @@ static inline void name ## _free(struct name *cq)		\
 #define ofi_cirque_commit(cq)		((cq)->wcnt++)
 
 
+/*
+ * Lock-free multi-producer, single-consumer circular queue template
+ *
+ * Producers reserve one or more consecutive slots by advancing wcnt with a
+ * compare and swap, fill them in, and publish each slot by updating its
+ * sequence number.  A slot at position pos is free when its sequence is
+ * pos, ready to be read when it is pos + 1, and still in use by the
+ * previous lap otherwise.  The consumer owns rcnt and must be serialized
+ * by the caller.  Producer and consumer counters live on separate cache
+ * lines, and each entry is padded to a whole number of cache lines so
+ * producers filling neighboring slots do not share a line.  The queue
+ * holds no pointers, so it may be placed in shared memory.
+ */
+#define OFI_DECLARE_ATOMIC_Q(entrytype, name)			\
+struct name ## _entry {						\
+	union {							\
+		struct {					\
+			ofi_atomic64_t	seq;			\
+			entrytype	buf;			\
+		};						\
+		uint8_t	pad[OFI_CACHE_ALIGN(sizeof(ofi_atomic64_t) +\
+					    sizeof(entrytype))];\
+	};							\
+};								\
+								\
+struct name {							\
+	union {							\
+		struct {					\
+			size_t	size;				\
+			size_t	size_mask;			\
+		};						\
+		uint8_t		pad0[OFI_CACHE_LINE_SIZE];	\
+	};							\
+	union {							\
+		ofi_atomic64_t	wcnt;				\
+		uint8_t		pad1[OFI_CACHE_LINE_SIZE];	\
+	};							\
+	union {							\
+		int64_t		rcnt;				\
+		uint8_t		pad2[OFI_CACHE_LINE_SIZE];	\
+	};							\
+	struct name ## _entry entry[];				\
+};								\
+								\
+static inline void name ## _init(struct name *q, size_t size)	\
+{								\
+	size_t i;						\
+	assert(size == roundup_power_of_two(size));		\
+	q->size = size;						\
+	q->size_mask = q->size - 1;				\
+	q->rcnt = 0;						\
+	for (i = 0; i < size; i++)				\
+		ofi_atomic_initialize64(&q->entry[i].seq, i);	\
+	ofi_atomic_initialize64(&q->wcnt, 0);			\
+}								\
+								\
+static inline int name ## _reserve(struct name *q, size_t count,\
+				   int64_t *pos)		\
+{								\
+	int64_t wcnt, last, seq;				\
+	assert(count && count <= q->size);			\
+	for (;;) {						\
+		wcnt = ofi_atomic_get64(&q->wcnt);		\
+		last = wcnt + count - 1;			\
+		seq = ofi_atomic_get64(				\
+			&q->entry[last & q->size_mask].seq);	\
+		if (seq < last)					\
+			return -FI_EAGAIN;			\
+		if (seq == last && ofi_atomic_cas_bool64(&q->wcnt,\
+					wcnt, wcnt + count)) {	\
+			*pos = wcnt;				\
+			return 0;				\
+		}						\
+	}							\
+}								\
+								\
+static inline entrytype *name ## _slot(struct name *q, int64_t pos)\
+{								\
+	return &q->entry[pos & q->size_mask].buf;		\
+}								\
+								\
+static inline void name ## _publish(struct name *q, int64_t pos)\
+{								\
+	ofi_atomic_set64(&q->entry[pos & q->size_mask].seq, pos + 1);\
+}								\
+								\
+static inline entrytype *name ## _peek(struct name *q,		\
+				       size_t offset)		\
+{								\
+	struct name ## _entry *entry;				\
+	int64_t pos = q->rcnt + offset;				\
+	entry = &q->entry[pos & q->size_mask];			\
+	return (ofi_atomic_get64(&entry->seq) == pos + 1) ?	\
+		&entry->buf : NULL;				\
+}								\
+								\
+static inline entrytype *name ## _head(struct name *q)		\
+{								\
+	return name ## _peek(q, 0);				\
+}								\
+								\
+static inline void name ## _discard(struct name *q)		\
+{								\
+	ofi_atomic_set64(&q->entry[q->rcnt & q->size_mask].seq,	\
+			 q->rcnt + q->size);			\
+	q->rcnt++;						\
+}
+
+
 /*
  * Simple ring buffer
  */
@@ -37,12 +37,14 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <limits.h>
 
 #include <ofi_atom.h>
 #include <ofi_proto.h>
 #include <ofi_mem.h>
 #include <ofi_rbuf.h>
 
+#include <rdma/fi_errno.h>
 #include <rdma/providers/fi_prov.h>
 
 #ifdef __cplusplus
@@ -50,7 +52,7 @@ extern "C" {
 #endif
 
 
-#define SMR_VERSION	1
+#define SMR_VERSION	7
 
 #ifdef HAVE_ATOMICS
 #define SMR_FLAG_ATOMIC	(1 << 0)
@@ -64,6 +66,9 @@ extern "C" {
 #define SMR_FLAG_DEBUG	(0 << 1)
 #endif
 
+/* Region is a hugetlbfs file rather than a POSIX shm object */
+#define SMR_FLAG_HUGEPAGE	(1 << 2)
+
 
 #define SMR_CMD_SIZE		128	/* align with 64-byte cache line */
 
@@ -72,6 +77,7 @@ enum {
 	smr_src_inline,	/* command data */
 	smr_src_inject,	/* inject buffers */
 	smr_src_iov,	/* reference iovec via CMA */
+	smr_src_sar,	/* segmentation and reassembly via bounce buffers */
 };
 
 #define SMR_REMOTE_CQ_DATA	(1 << 0)
@@ -118,6 +124,7 @@ union smr_cmd_data {
 		uint8_t		buf[SMR_COMP_DATA_LEN];
 		uint8_t		comp[SMR_COMP_DATA_LEN];
 	};
+	uint64_t		sar;	/* offset of smr_sar_msg in peer */
 };
 
 struct smr_cmd_msg {
@@ -154,37 +161,129 @@ struct smr_addr {
 
 struct smr_region;
 
+enum {
+	SMR_CMA_CAP_NA,		/* not probed yet */
+	SMR_CMA_CAP_ON,
+	SMR_CMA_CAP_OFF,
+};
+
 struct smr_peer {
 	struct smr_addr		peer;
 	struct smr_region	*region;
+	int			cma_cap;
+	ofi_atomic32_t		ref;
+	uint64_t		last_use;
+	struct dlist_entry	entry;
 };
 
-#define SMR_MAX_PEERS	256
+/*
+ * The map is indexed by fi_addr and sized by the AV.  Peers are kept in
+ * fixed size chunks that are allocated on first insert, so lookups stay a
+ * direct index and existing entries never move.
+ *
+ * With SMR_MAP_LAZY, a peer region is only mapped the first time it is
+ * used rather than when it is inserted.  When max_mapped is set, mapping a
+ * new peer past that many regions first unmaps the least recently used
+ * peer that holds no references.  References are only counted when
+ * max_mapped is set, since regions are otherwise never unmapped behind
+ * the user's back.
+ */
+#define SMR_PEER_CHUNK_SHIFT	6
+#define SMR_PEER_CHUNK_SIZE	(1 << SMR_PEER_CHUNK_SHIFT)
+
+#define SMR_MAP_LAZY		(1 << 0)
+
+#define SMR_PEER_EVICTING	(INT32_MIN / 2)
 
 struct smr_map {
-	fastlock_t	lock;
-	struct smr_peer	peers[SMR_MAX_PEERS];
+	fastlock_t		lock;
+	int			num_peers;
+	int			flags;
+	int			max_mapped;
+	int			num_mapped;
+	ofi_atomic64_t		clock;
+	struct dlist_entry	mapped_list;
+	struct smr_peer		**peers;
 };
 
+static inline struct smr_peer *smr_map_peer(struct smr_map *map, int id)
+{
+	return &map->peers[id >> SMR_PEER_CHUNK_SHIFT]
+			  [id & (SMR_PEER_CHUNK_SIZE - 1)];
+}
+
+static inline int smr_map_valid(struct smr_map *map, int id)
+{
+	return id >= 0 && id < map->num_peers &&
+	       map->peers[id >> SMR_PEER_CHUNK_SHIFT];
+}
+
+/* Takes a reference on the peer region if it is currently mapped */
+static inline int smr_map_try_acquire(struct smr_map *map, int id)
+{
+	struct smr_peer *peer = smr_map_peer(map, id);
+
+	if (!map->max_mapped)
+		return peer->region ? 0 : -FI_ENOENT;
+
+	if (ofi_atomic_inc32(&peer->ref) > 0 && peer->region) {
+		peer->last_use = ofi_atomic_inc64(&map->clock);
+		return 0;
+	}
+	ofi_atomic_dec32(&peer->ref);
+	return -FI_ENOENT;
+}
+
+static inline void smr_map_release(struct smr_map *map, int id)
+{
+	if (map->max_mapped)
+		ofi_atomic_dec32(&smr_map_peer(map, id)->ref);
+}
+
+/*
+ * The command queue, response queue, and inject pool are lock-free.  Any
+ * number of peers may post commands and take inject buffers concurrently;
+ * the owner of the region is the only consumer of its command queue.
+ *
+ * The header is written once at creation and only read afterwards, so it
+ * is kept apart from the doorbell, which peers write while the owner
+ * sleeps.  Every queue and pool starts on a cache line boundary.
+ */
+#define SMR_HDR_SIZE	(2 * OFI_CACHE_LINE_SIZE)
+
 struct smr_region {
-	uint8_t		version;
-	uint8_t		resv;
-	uint16_t	flags;
-	int		pid;
-	fastlock_t	lock; /* lock for shm access
-				 Must hold smr->lock before tx/rx cq locks
-				 in order to progress or post recv */
-	struct smr_map	*map;
-
-	size_t		total_size;
-	size_t		cmd_cnt;
-
-	/* offsets from start of smr_region */
-	size_t		cmd_queue_offset;
-	size_t		resp_queue_offset;
-	size_t		inject_pool_offset;
-	size_t		peer_addr_offset;
-	size_t		name_offset;
+	union {
+		struct {
+			uint8_t		version;
+			uint8_t		resv;
+			uint16_t	flags;
+			int		pid;
+			struct smr_map	*map;
+			void		*base_addr;	/* owner's VA */
+
+			size_t		total_size;
+			int		num_peers;
+
+			/* offsets from start of smr_region */
+			size_t		cmd_queue_offset;
+			size_t		resp_queue_offset;
+			size_t		inject_pool_offset;
+			size_t		sar_pool_offset;
+			size_t		peer_addr_offset;
+			size_t		peer_cma_offset;
+			size_t		name_offset;
+		};
+		uint8_t		hdr_pad[SMR_HDR_SIZE];
+	};
+
+	/* doorbell is a futex word, see smr_signal() */
+	union {
+		struct {
+			ofi_atomic32_t	doorbell;
+			ofi_atomic32_t	waiting;
+		};
+		uint8_t		bell_pad[OFI_CACHE_LINE_SIZE];
+	};
 };
 
 struct smr_resp {
@@ -202,13 +301,44 @@ struct smr_inject_buf {
 	};
 };
 
-OFI_DECLARE_CIRQUE(struct smr_cmd, smr_cmd_queue);
-OFI_DECLARE_CIRQUE(struct smr_resp, smr_resp_queue);
+/*
+ * SAR (segmentation and reassembly) moves transfers larger than the inject
+ * size through a ring of bounce buffers when CMA is unavailable.  The
+ * filling side copies a chunk in and marks it ready; the draining side
+ * copies it out and marks it free, so both copies overlap chunk by chunk.
+ * Chunks are used in order, and a sar msg is owned by a single transfer
+ * from the time it is taken from the target's pool until it is returned.
+ */
+#define SMR_SAR_CHUNK_SIZE	16384
+#define SMR_SAR_CHUNKS		4
+#define SMR_SAR_COUNT		8
+
+enum {
+	SMR_SAR_FREE,		/* chunk may be filled */
+	SMR_SAR_READY,		/* chunk holds data to drain */
+	SMR_SAR_ERROR,		/* filling side failed, transfer aborted */
+};
+
+struct smr_sar_chunk {
+	union {
+		ofi_atomic32_t	status;
+		uint8_t		pad[OFI_CACHE_LINE_SIZE];
+	};
+	uint8_t			buf[SMR_SAR_CHUNK_SIZE];
+};
+
+struct smr_sar_msg {
+	struct smr_sar_chunk	chunk[SMR_SAR_CHUNKS];
+};
+
+OFI_DECLARE_ATOMIC_Q(struct smr_cmd, smr_cmd_queue);
+OFI_DECLARE_ATOMIC_Q(struct smr_resp, smr_resp_queue);
 DECLARE_SMR_FREESTACK(struct smr_inject_buf, smr_inject_pool);
+DECLARE_SMR_FREESTACK(struct smr_sar_msg, smr_sar_pool);
 
 static inline struct smr_region *smr_peer_region(struct smr_region *smr, int i)
 {
-	return smr->map->peers[i].region;
+	return smr_map_peer(smr->map, i)->region;
 }
 static inline struct smr_cmd_queue *smr_cmd_queue(struct smr_region *smr)
 {
@@ -222,15 +352,51 @@ static inline struct smr_inject_pool *smr_inject_pool(struct smr_region *smr)
 {
 	return (struct smr_inject_pool *) ((char *) smr + smr->inject_pool_offset);
 }
+static inline struct smr_sar_pool *smr_sar_pool(struct smr_region *smr)
+{
+	return (struct smr_sar_pool *) ((char *) smr + smr->sar_pool_offset);
+}
 static inline struct smr_addr *smr_peer_addr(struct smr_region *smr)
 {
 	return (struct smr_addr *) ((char *) smr + smr->peer_addr_offset); 
 }
+/*
+ * Transfers through the peer's address space are copied by the receiving
+ * side, so each owner publishes whether it can reach each of its peers
+ * with CMA.  Indexed like the peer address table, values SMR_CMA_CAP_*.
+ */
+static inline uint8_t *smr_peer_cma(struct smr_region *smr)
+{
+	return (uint8_t *) smr + smr->peer_cma_offset;
+}
 static inline const char *smr_name(struct smr_region *smr)
 {
 	return (const char *) smr + smr->name_offset;
 }
 
+/*
+ * A region owner that is about to block sets waiting and then checks its
+ * queues once more.  Peers that publish work for the owner ring the
+ * doorbell only if they see waiting set, and only the first of them pays
+ * for the wakeup.  The owner sleeps on the doorbell with a futex, so an
+ * idle owner costs nothing and a busy one is never signaled.
+ */
+static inline int *smr_doorbell(struct smr_region *smr)
+{
+	/* the futex word is the counter at the start of the atomic */
+	return (int *) &smr->doorbell;
+}
+
+static inline void smr_signal(struct smr_region *smr)
+{
+	ofi_atomic_fence();
+	if (ofi_atomic_get32(&smr->waiting) &&
+	    ofi_atomic_cas_bool32(&smr->waiting, 1, 0)) {
+		ofi_atomic_inc32(&smr->doorbell);
+		ofi_futex_wake(smr_doorbell(smr), INT_MAX);
+	}
+}
+
 static inline void smr_set_map(struct smr_region *smr, struct smr_map *map)
 {
 	smr->map = map;
@@ -240,10 +406,11 @@ struct smr_attr {
 	const char	*name;
 	size_t		rx_count;
 	size_t		tx_count;
+	int		huge_pages;
 };
 
 int	smr_map_create(const struct fi_provider *prov, int peer_count,
-		       struct smr_map **map);
+		       int flags, int max_mapped, struct smr_map **map);
 int	smr_map_to_region(const struct fi_provider *prov,
 			  struct smr_peer *peer_buf);
 void	smr_map_to_endpoint(struct smr_region *region, int index);
@@ -252,6 +419,8 @@ void	smr_exchange_all_peers(struct smr_region *region);
 int	smr_map_add(const struct fi_provider *prov,
 		    struct smr_map *map, const char *name, int id);
 void	smr_map_del(struct smr_map *map, int id);
+int	smr_map_acquire(const struct fi_provider *prov,
+			struct smr_map *map, int id);
 void	smr_map_free(struct smr_map *map);
 
 struct smr_region *smr_map_get(struct smr_map *map, int id);
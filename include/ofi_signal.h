@@ -118,6 +118,7 @@ static inline int fd_signal_poll(struct fd_signal *signal, int timeout)
 
 #define FI_EPOLL_IN  EPOLLIN
 #define FI_EPOLL_OUT EPOLLOUT
+#define FI_EPOLL_ET  EPOLLET
 
 typedef int fi_epoll_t;
 
@@ -140,6 +141,15 @@ static inline int fi_epoll_add(int ep, int fd, uint32_t events, void *context)
 	return 0;
 }
 
+static inline int fi_epoll_mod(int ep, int fd, uint32_t events, void *context)
+{
+	struct epoll_event event;
+
+	event.data.ptr = context;
+	event.events = events;
+	return epoll_ctl(ep, EPOLL_CTL_MOD, fd, &event) ? -ofi_syserr() : 0;
+}
+
 static inline int fi_epoll_del(int ep, int fd)
 {
 	return epoll_ctl(ep, EPOLL_CTL_DEL, fd, NULL) ? -ofi_syserr() : 0;
@@ -171,6 +181,8 @@ static inline void fi_epoll_close(int ep)
 
 #define FI_EPOLL_IN  POLLIN
 #define FI_EPOLL_OUT POLLOUT
+/* poll is level-triggered only */
+#define FI_EPOLL_ET  0
 
 typedef struct fi_epoll {
 	int		size;
@@ -182,6 +194,7 @@ typedef struct fi_epoll {
 
 int fi_epoll_create(struct fi_epoll **ep);
 int fi_epoll_add(struct fi_epoll *ep, int fd, uint32_t events, void *context);
+int fi_epoll_mod(struct fi_epoll *ep, int fd, uint32_t events, void *context);
 int fi_epoll_del(struct fi_epoll *ep, int fd);
 int fi_epoll_wait(struct fi_epoll *ep, void **contexts, int max_contexts,
                   int timeout);
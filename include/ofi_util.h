@@ -479,6 +479,14 @@ int ofi_av_get_index(struct util_av *av, const void *addr);
 
 #define UTIL_CMAP_IDX_BITS OFI_IDX_INDEX_BITS
 
+/* Times a rejected connection request is sent again, see
+ * ofi_cmap_process_reject */
+#define OFI_CMAP_CONNECT_RETRY 4
+
+/* Interval in ms at which eviction is retried while the number of
+ * connections exceeds max_conn, see ofi_cmap_reap_idle */
+#define OFI_CMAP_REAP_INTERVAL 10
+
 enum ofi_cmap_signal {
 	OFI_CMAP_FREE,
 	OFI_CMAP_EXIT,
@@ -491,6 +499,8 @@ enum util_cmap_state {
 	CMAP_ACCEPT,
 	CMAP_CONNECTED_NOTIFY,
 	CMAP_CONNECTED,
+	/* Closing with the peer's agreement, no new transfers are started */
+	CMAP_CLOSING,
 	CMAP_SHUTDOWN,
 };
 
@@ -505,6 +515,14 @@ struct util_cmap_handle {
 	uint64_t remote_key;
 	fi_addr_t fi_addr;
 	struct util_cmap_peer *peer;
+	/* Connected handles, least recently used first. Only linked if the
+	 * number of connections is bounded */
+	struct dlist_entry lru_entry;
+	uint64_t last_use;
+	/* Replaces a handle whose connection was evicted or shut down */
+	uint8_t reconnect;
+	/* Connection requests sent again after being rejected */
+	uint8_t connect_retry;
 };
 
 struct util_cmap_peer {
@@ -521,6 +539,8 @@ typedef int (*ofi_cmap_connect_func)(struct util_ep *cmap,
 typedef void *(*ofi_cmap_event_handler_func)(void *arg);
 typedef int (*ofi_cmap_signal_func)(struct util_ep *ep, void *context,
 				    enum ofi_cmap_signal signal);
+typedef int (*ofi_cmap_idle_func)(struct util_cmap_handle *handle);
+typedef int (*ofi_cmap_close_req_func)(struct util_cmap_handle *handle);
 
 struct util_cmap_attr {
 	void 				*name;
@@ -531,6 +551,15 @@ struct util_cmap_attr {
 	ofi_cmap_handle_func		connected_handler;
 	ofi_cmap_event_handler_func	event_handler;
 	ofi_cmap_signal_func		signal;
+	/* Optional. Connected handles beyond max_conn are evicted, least
+	 * recently used first, once unused for idle_time ms and reported
+	 * idle by the provider. 0 doesn't bound the number of connections.
+	 * Eviction asks the peer with close_req first, which is required
+	 * if max_conn is set, see util_cmap_evict_idle */
+	ofi_cmap_idle_func		idle;
+	ofi_cmap_close_req_func		close_req;
+	size_t				max_conn;
+	uint64_t			idle_time;
 };
 
 struct util_cmap {
@@ -551,6 +580,12 @@ struct util_cmap {
 	pthread_t event_handler_thread;
 	int av_updated;
 	fastlock_t lock;
+
+	struct dlist_entry lru_list;
+	size_t conn_cnt;
+	uint64_t reap_time;
+	uint64_t evict_cnt;
+	uint64_t reconnect_cnt;
 };
 
 struct util_cmap_handle *ofi_cmap_key2handle(struct util_cmap *cmap, uint64_t key);
@@ -569,6 +604,11 @@ int ofi_cmap_process_connreq(struct util_cmap *cmap, void *addr,
 			     struct util_cmap_handle **handle);
 void ofi_cmap_process_shutdown(struct util_cmap *cmap,
 			       struct util_cmap_handle *handle);
+int ofi_cmap_process_close_req(struct util_cmap *cmap,
+			       struct util_cmap_handle *handle);
+int ofi_cmap_process_close_resp(struct util_cmap *cmap,
+				struct util_cmap_handle *handle, int accepted);
+void ofi_cmap_reap_idle(struct util_cmap *cmap);
 void ofi_cmap_del_handle(struct util_cmap_handle *handle);
 void ofi_cmap_free(struct util_cmap *cmap);
 struct util_cmap *ofi_cmap_alloc(struct util_ep *ep,
@@ -590,6 +630,34 @@ ofi_cmap_acquire_handle(struct util_cmap *cmap, fi_addr_t fi_addr)
 	return cmap->handles_av[fi_addr];
 }
 
+/* Caller must hold cmap->lock.  Never allocates, returns NULL if unset */
+static inline struct util_cmap_handle *
+ofi_cmap_lookup_handle(struct util_cmap *cmap, fi_addr_t fi_addr)
+{
+	if (fi_addr >= cmap->av->count)
+		return NULL;
+	return cmap->handles_av[fi_addr];
+}
+
+/* Read without cmap->lock, as a hint that ofi_cmap_reap_idle has work */
+static inline int ofi_cmap_over_limit(struct util_cmap *cmap)
+{
+	return cmap->conn_cnt > cmap->attr.max_conn;
+}
+
+/* Caller must hold cmap->lock */
+static inline void
+ofi_cmap_touch_handle(struct util_cmap *cmap, struct util_cmap_handle *handle)
+{
+	if (OFI_LIKELY(!cmap->attr.max_conn) ||
+	    dlist_empty(&handle->lru_entry))
+		return;
+
+	dlist_remove(&handle->lru_entry);
+	dlist_insert_tail(&handle->lru_entry, &cmap->lru_list);
+	handle->last_use = fi_gettime_ms();
+}
+
 /*
  * Poll set
  */
@@ -67,6 +67,16 @@ static inline int ofi_shm_remap(struct util_shm *shm, size_t newsize, void **map
 	return -1;
 }
 
+static inline int ofi_futex_wait(int *addr, int val, int timeout)
+{
+	return -FI_ENOSYS;
+}
+
+static inline int ofi_futex_wake(int *addr, int count)
+{
+	return -FI_ENOSYS;
+}
+
 #ifdef __cplusplus
 }
 #endif
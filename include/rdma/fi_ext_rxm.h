@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2018 Intel Corporation, Inc.  All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _FI_EXT_RXM_H_
+#define _FI_EXT_RXM_H_
+
+/*
+ * See the fi_rxm.7 man page for information about the rxm provider
+ * extensions provided in this header.
+ */
+
+#include <stddef.h>
+#include <rdma/fabric.h>
+
+/* FI_OPT_ENDPOINT option, struct fi_rxm_proto_limits, get only */
+#define FI_OPT_RXM_PROTO_LIMITS ((int) (1U | FI_PROV_SPECIFIC))
+
+/*
+ * Protocol thresholds of the connection to addr.  Messages of up to
+ * eager_limit bytes are sent eagerly, those of up to sar_limit bytes by
+ * segmentation and reassembly, and larger ones by rendezvous.  Set addr
+ * to FI_ADDR_UNSPEC for the thresholds new connections start from.
+ */
+struct fi_rxm_proto_limits {
+	fi_addr_t addr;
+	size_t eager_limit;
+	size_t sar_limit;
+};
+
+/* FI_OPT_ENDPOINT option, struct fi_rxm_mr_cache_stats, get only */
+#define FI_OPT_RXM_MR_CACHE_STATS ((int) (2U | FI_PROV_SPECIFIC))
+
+/*
+ * Counters of the rendezvous registration cache of the endpoint's domain,
+ * and the registrations it currently holds.
+ */
+struct fi_rxm_mr_cache_stats {
+	size_t hits;
+	size_t misses;
+	size_t cached_cnt;
+	size_t cached_size;
+};
+
+#endif /* _FI_EXT_RXM_H_ */
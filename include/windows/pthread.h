@@ -129,6 +129,32 @@ static inline int pthread_cancel(pthread_t thread)
 	return ENOSYS;
 }
 
+typedef DWORD pthread_key_t;
+
+/* Destructors aren't run when threads exit */
+static inline int pthread_key_create(pthread_key_t *key,
+				     void (*destructor)(void *))
+{
+	(void) destructor;
+	*key = TlsAlloc();
+	return (*key == TLS_OUT_OF_INDEXES) ? EAGAIN : 0;
+}
+
+static inline int pthread_key_delete(pthread_key_t key)
+{
+	return TlsFree(key) ? 0 : EINVAL;
+}
+
+static inline void *pthread_getspecific(pthread_key_t key)
+{
+	return TlsGetValue(key);
+}
+
+static inline int pthread_setspecific(pthread_key_t key, const void *value)
+{
+	return TlsSetValue(key, (void *) value) ? 0 : ENOMEM;
+}
+
 static inline pthread_t pthread_self(void)
 {
 	/*
@@ -52,6 +52,8 @@
 #include <ofi_proto.h>
 #include <ofi_iov.h>
 
+#include <rdma/fi_ext_rxm.h>
+
 #ifndef _RXM_H_
 #define _RXM_H_
 
@@ -61,12 +63,31 @@
 #define RXM_MINOR_VERSION 0
 
 #define RXM_OP_VERSION		3
-#define RXM_CTRL_VERSION	3
+#define RXM_CTRL_VERSION	5
 
 #define RXM_BUF_SIZE	16384
 #define RXM_SAR_LIMIT	262144
+#define RXM_SAR_WINDOW	8
+#define RXM_SAR_WINDOW_MAX	64
+#define RXM_RX_CREDITS	64
+#define RXM_RX_CREDITS_MIN	4
+#define RXM_RX_POOL_SIZE	4096
+#define RXM_CONN_IDLE_TIME	1000
 #define RXM_IOV_LIMIT 4
 
+/* Injected messages up to this size are formatted on the stack */
+#define RXM_INJECT_INLINE_SIZE	64
+
+/* Max MSG CQ entries fetched by one fi_cq_read in rxm_ep_progress_multi */
+#define RXM_MSG_CQ_READ_BATCH	32
+
+/* Bounds of the per connection copy/rendezvous threshold */
+#define RXM_PROTO_LIMIT_MAX	(4 * 1024 * 1024)
+
+/* Every n-th message around the threshold probes the other protocol */
+#define RXM_PROTO_PROBE_INTERVAL	64
+#define RXM_PROTO_PROBE_LEN		8
+
 #define RXM_MR_MODES	(OFI_MR_BASIC_MAP | FI_MR_LOCAL)
 #define RXM_MR_VIRT_ADDR(info) ((info->domain_attr->mr_mode == FI_MR_BASIC) ||\
 				info->domain_attr->mr_mode & FI_MR_VIRT_ADDR)
@@ -112,6 +133,29 @@ struct rxm_fabric {
 	struct fid_fabric *msg_fabric;
 };
 
+/*
+ * Messages of up to limit bytes are copied through transmit buffers, eagerly
+ * or by SAR, and larger ones are sent by rendezvous.  Sends of sizes within
+ * a factor of two of the limit add up the bytes and the time they took on
+ * either side, the last RXM_PROTO_PROBE_LEN of every RXM_PROTO_PROBE_INTERVAL
+ * of them going with the other side, and the limit is halved or doubled
+ * within the endpoint's bounds towards whichever side moved more bytes per
+ * us.  Completions come in bursts, so only the totals give a usable
+ * bandwidth.  Updates are made with the cmap lock held.
+ */
+struct rxm_proto_limit {
+	size_t limit;
+	uint64_t copy_bytes;
+	uint64_t copy_usec;
+	uint64_t copy_cnt;
+	uint64_t lmt_bytes;
+	uint64_t lmt_usec;
+	uint64_t lmt_cnt;
+	uint64_t msg_cnt;
+	uint64_t last_comp;
+	int last_lmt;
+};
+
 struct rxm_conn {
 	struct fid_ep *msg_ep;
 	struct dlist_entry postponed_tx_list;
@@ -119,12 +163,51 @@ struct rxm_conn {
 	/* This is saved MSG EP fid, that hasn't been closed during
 	 * handling of CONN_RECV in CMAP_CONNREQ_SENT for passive side */
 	struct fid_ep *saved_msg_ep;
+	/* First segments of SAR messages being received on this connection */
+	struct dlist_entry sar_rx_msg_list;
+	/* Last msg_id of the SAR messages sent on this connection */
+	ofi_atomic64_t sar_tx_id;
+	struct rxm_proto_limit proto;
+	/* Send carried in the connection request, completed on accept */
+	struct rxm_tx_entry *cm_tx_entry;
+	/* Receive buffers posted to msg_ep, and those consumed by messages
+	 * that haven't been reposted yet */
+	size_t rx_posted;
+	size_t rx_held;
+	/* Close request or answer waiting on rxm_ep::conn_close_list */
+	struct dlist_entry close_entry;
+	uint8_t close_type;
+	/* Credits of the receive buffers the peer has left posted for us,
+	 * unless tx_flow_ctrl is clear, and those of the buffers we posted
+	 * since we last returned credits, see rxm_conn_get_credit */
+	uint8_t tx_flow_ctrl;
+	ofi_atomic32_t tx_credits;
+	ofi_atomic32_t rx_owed;
+	int32_t credit_thresh;
+	/* Credit message or postponed sends waiting for credits on
+	 * rxm_ep::conn_credit_list */
+	struct dlist_entry credit_entry;
+	/* RMA operations posted to msg_ep that haven't completed */
+	ofi_atomic32_t rma_pending;
 };
 
 struct rxm_domain {
 	struct util_domain util_domain;
 	struct fid_domain *msg_domain;
 	uint8_t mr_local;
+	/* Internal registrations of rendezvous buffers */
+	uint8_t mr_cache_enabled;
+	fastlock_t mr_cache_lock;
+	struct ofi_mr_cache mr_cache;
+	/* Receive buffers of all endpoints and connections of the domain.
+	 * Connections are only replenished while fewer than rx_pool_max
+	 * buffers are in use */
+	uint8_t msg_mr_local;
+	fastlock_t rx_pool_lock;
+	struct util_buf_pool *rx_pool;
+	size_t rx_pool_max;
+	size_t rx_pool_used;
+	size_t rx_pool_peak;
 };
 
 struct rxm_mr {
@@ -136,7 +219,10 @@ struct rxm_ep_wire_proto {
 	uint8_t	ctrl_version;
 	uint8_t	op_version;
 	uint8_t endianness;
-	uint8_t padding[6];
+	uint8_t padding[5];
+	/* Receive buffers posted for the peer, 0 if it isn't flow
+	 * controlled, see rxm_conn_get_credit */
+	uint32_t rx_credits;
 	uint64_t eager_size;
 };
 
@@ -146,6 +232,10 @@ struct rxm_cm_data {
 	struct rxm_ep_wire_proto proto;
 };
 
+/* A connection request's CM data may be followed by an eager message
+ * (struct rxm_pkt and its payload), if the MSG provider allows for it */
+#define RXM_CM_DATA_MAX 256
+
 struct rxm_rma_iov {
 	uint8_t count;
 	struct ofi_rma_iov iov[];
@@ -195,16 +285,12 @@ struct rxm_pkt {
 	char data[];
 };
 
-struct rxm_recv_match_attr {
-	fi_addr_t addr;
-	uint64_t tag;
-	uint64_t ignore;
-};
-
 struct rxm_unexp_msg {
 	struct dlist_entry entry;
+	struct dlist_entry hash_entry;
 	fi_addr_t addr;
 	uint64_t tag;
+	uint64_t seq;
 };
 
 struct rxm_iov {
@@ -219,9 +305,7 @@ struct rxm_rma_iov_storage {
 };
 
 enum rxm_buf_pool_type {
-	RXM_BUF_POOL_RX		= 0,
-	RXM_BUF_POOL_START	= RXM_BUF_POOL_RX,
-	RXM_BUF_POOL_TX_MSG,
+	RXM_BUF_POOL_TX_MSG	= 0,
 	RXM_BUF_POOL_TX_START	= RXM_BUF_POOL_TX_MSG,
 	RXM_BUF_POOL_TX_TAGGED,
 	RXM_BUF_POOL_TX_ACK,
@@ -262,6 +346,12 @@ struct rxm_rx_buf {
 	size_t index;
 	struct fid_mr *mr[RXM_IOV_LIMIT];
 
+	/* Used for SAR protocol */
+	struct dlist_entry sar_entry;
+	struct dlist_entry sar_seg_list;
+	size_t sar_recv_len;
+	int sar_discard;
+
 	/* Must stay at bottom */
 	struct rxm_pkt pkt;
 };
@@ -273,7 +363,8 @@ struct rxm_tx_buf {
 	enum rxm_buf_pool_type type;
 
 	/* Used for SAR protocol */
-	struct dlist_entry in_flight_entry;
+	struct rxm_tx_entry *tx_entry;
+	struct dlist_entry deferred_entry;
 
 	/* Must stay at bottom */
 	struct rxm_pkt pkt;
@@ -310,6 +401,10 @@ struct rxm_tx_entry {
 		struct rxm_rma_buf *rma_buf;
 	};
 
+	/* Used for SAR and rendezvous bandwidth estimates */
+	struct rxm_conn *conn;
+	uint64_t start;
+
 	union {
 		/* Used for large messages and RMA */
 		struct {
@@ -318,11 +413,13 @@ struct rxm_tx_entry {
 		};
 		/* Used for SAR protocol */
 		struct {
+			size_t segs;
+			/* Segments not completed yet, posted or not */
 			size_t segs_left;
-			uint64_t msg_id;
-			struct dlist_entry in_flight_tx_buf_list;
+			size_t next_seg;
+			size_t total_len;
+			int sar_err;
 			struct rxm_iov rxm_iov;
-			uint64_t iov_offset;
 		};
 	};
 };
@@ -339,6 +436,7 @@ struct rxm_recv_entry {
 	uint64_t comp_flags;
 	size_t total_len;
 	struct rxm_recv_queue *recv_queue;
+	uint64_t seq;
 	void *multi_recv_buf;
 	/* Used for SAR protocol */
 	struct {
@@ -348,9 +446,56 @@ struct rxm_recv_entry {
 };
 DECLARE_FREESTACK(struct rxm_recv_entry, rxm_recv_fs);
 
+/*
+ * Thread-safe endpoints put magazines in front of their transmit buffer
+ * pools and entry freestacks, so that threads don't serialize on the lock of
+ * the shared pool.  Every thread using the endpoint gets its own set of
+ * magazines, found through the endpoint's thread-specific key, and only
+ * takes the shared lock to refill or flush half a magazine at a time.  The
+ * set is flushed back to the shared pools when the thread exits or the
+ * endpoint is closed.  Freestacks don't grow, so a magazine in front of one
+ * holds at most 1/RXM_MAG_FS_SHARE of its entries.
+ */
+#define RXM_MAG_SIZE		32
+#define RXM_MAG_FS_SHARE	16
+
+enum {
+	RXM_MAG_SEND_QUEUE = RXM_BUF_POOL_MAX,
+	RXM_MAG_RECV_QUEUE,
+	RXM_MAG_TRECV_QUEUE,
+	RXM_MAG_MAX,
+};
+
+typedef void *(*rxm_mag_alloc_func)(void *pool);
+typedef void (*rxm_mag_free_func)(void *pool, void *obj);
+
+/* The shared pool a magazine is refilled from and flushed to */
+struct rxm_mag_depot {
+	struct rxm_ep *rxm_ep;
+	void *pool;
+	fastlock_t *lock;
+	rxm_mag_alloc_func alloc_obj;
+	rxm_mag_free_func free_obj;
+	size_t idx;
+	/* Objects a magazine holds, 0 without magazines */
+	size_t size;
+};
+
+struct rxm_mag {
+	size_t cnt;
+	void *objs[RXM_MAG_SIZE];
+};
+
+struct rxm_mag_set {
+	struct rxm_ep *rxm_ep;
+	struct dlist_entry entry;
+	struct rxm_mag mags[RXM_MAG_MAX];
+};
+
 struct rxm_send_queue {
 	struct rxm_ep *rxm_ep;
 	struct rxm_txe_fs *fs;
+	struct rxm_mag_depot depot;
 	fastlock_t lock;
 };
 
@@ -359,14 +504,31 @@ enum rxm_recv_queue_type {
 	RXM_RECV_QUEUE_TAGGED,
 };
 
+/*
+ * Posted receives are split by how they match: receives for one tag from
+ * one source are hashed on (source, tag), and receives from any source
+ * (recv_list) or for a set of tags (any_tag_list) are kept in lists.  An
+ * incoming message takes the oldest, by seq, of the first match found in
+ * its bucket and in each list, which keeps receives matched in the order
+ * they were posted.  Without FI_DIRECTED_RECV the source never matters, so
+ * every single tag receive is hashed with FI_ADDR_UNSPEC as its source.
+ *
+ * Unexpected messages are kept in arrival order on unexp_msg_list and
+ * hashed on (source, tag) the same way.
+ */
 struct rxm_recv_queue {
 	struct rxm_ep *rxm_ep;
 	enum rxm_recv_queue_type type;
 	struct rxm_recv_fs *fs;
 	struct dlist_entry recv_list;
+	struct dlist_entry any_tag_list;
+	struct dlist_entry *recv_hash;
 	struct dlist_entry unexp_msg_list;
-	dlist_func_t *match_recv;
-	dlist_func_t *match_unexp;
+	struct dlist_entry *unexp_hash;
+	size_t hash_mask;
+	uint64_t seq;
+	int directed;
+	struct rxm_mag_depot depot;
 	fastlock_t lock;
 };
 
@@ -374,6 +536,7 @@ struct rxm_buf_pool {
 	struct util_buf_pool *pool;
 	enum rxm_buf_pool_type type;
 	struct rxm_ep *rxm_ep;
+	struct rxm_mag_depot depot;
 	fastlock_t lock;
 };
 
@@ -393,11 +556,29 @@ struct rxm_ep {
 	int			rxm_mr_local;
 	size_t			min_multi_recv_size;
 	size_t			sar_limit;
+	/* Bounds of rxm_proto_limit::limit, which starts at sar_limit */
+	size_t			proto_limit_min;
+	size_t			proto_limit_max;
+	size_t			sar_window;
+	/* Data carried by each SAR segment, sent in ctrl_hdr::seg_size */
+	size_t			sar_seg_size;
+	/* Receive buffers kept posted to each connection's MSG EP */
+	size_t			rx_credits;
 
 	struct rxm_buf_pool	buf_pools[RXM_BUF_POOL_MAX];
 
 	struct dlist_entry	post_rx_list;
 	struct dlist_entry	repost_ready_list;
+	/* SAR segments the MSG EP had no room for, sent on progress */
+	struct dlist_entry	sar_deferred_list;
+	/* Eager messages received with connection requests */
+	struct dlist_entry	cm_rx_list;
+	/* Connections with a close message to send, under the cmap lock */
+	struct dlist_entry	conn_close_list;
+	/* Connections waiting for credits, under the cmap lock */
+	struct dlist_entry	conn_credit_list;
+	/* Rendezvous reads whose ack couldn't be sent yet */
+	struct dlist_entry	lmt_ack_deferred_list;
 
 	struct rxm_send_queue	send_queue;
 	struct rxm_recv_queue	recv_queue;
@@ -405,6 +586,13 @@ struct rxm_ep {
 
 	ofi_fastlock_acquire_t	res_fastlock_acquire;
 	ofi_fastlock_release_t	res_fastlock_release;
+
+	/* Threads' magazine sets, valid with FI_THREAD_SAFE */
+	int			mag_key_valid;
+	pthread_key_t		mag_key;
+	fastlock_t		mag_lock;
+	struct dlist_entry	mag_set_list;
+	struct rxm_mag_depot	*mag_depots[RXM_MAG_MAX];
 };
 
 struct rxm_ep_wait_ref {
@@ -455,6 +643,36 @@ void rxm_ep_progress_one(struct util_ep *util_ep);
 void rxm_ep_progress_multi(struct util_ep *util_ep);
 
 int rxm_ep_prepost_buf(struct rxm_ep *rxm_ep, struct fid_ep *msg_ep);
+int rxm_conn_post_rx(struct rxm_ep *rxm_ep, struct rxm_conn *rxm_conn,
+		     struct fid_ep *msg_ep);
+void rxm_conn_release_rx(struct rxm_ep *rxm_ep, struct rxm_conn *rxm_conn);
+void rxm_conn_queue_close(struct rxm_ep *rxm_ep, struct rxm_conn *rxm_conn,
+			  uint8_t type);
+void rxm_conn_progress_close(struct rxm_ep *rxm_ep);
+void rxm_conn_queue_credit(struct rxm_ep *rxm_ep, struct rxm_conn *rxm_conn);
+void rxm_conn_progress_credits(struct rxm_ep *rxm_ep);
+
+/* Callers of the recv queue functions below must hold recv_queue->lock */
+void rxm_recv_entry_insert(struct rxm_recv_queue *recv_queue,
+			   struct rxm_recv_entry *recv_entry);
+struct rxm_recv_entry *
+rxm_recv_entry_match(struct rxm_recv_queue *recv_queue, fi_addr_t addr,
+		     uint64_t tag);
+struct rxm_recv_entry *
+rxm_recv_entry_remove_ctx(struct rxm_recv_queue *recv_queue, void *context);
+void rxm_unexp_msg_insert(struct rxm_recv_queue *recv_queue,
+			  struct rxm_rx_buf *rx_buf);
+struct rxm_rx_buf *
+rxm_unexp_msg_match(struct rxm_recv_queue *recv_queue, fi_addr_t addr,
+		    uint64_t tag, uint64_t ignore);
+void rxm_unexp_msg_set_addr(struct rxm_recv_queue *recv_queue,
+			    struct rxm_rx_buf *rx_buf, fi_addr_t addr);
+
+static inline void rxm_unexp_msg_remove(struct rxm_rx_buf *rx_buf)
+{
+	dlist_remove(&rx_buf->unexp_msg.entry);
+	dlist_remove(&rx_buf->unexp_msg.hash_entry);
+}
 
 static inline
 void rxm_ep_msg_mr_closev(struct fid_mr **mr, size_t count)
@@ -494,6 +712,61 @@ err:
 	return ret;
 }
 
+int rxm_lmt_mr_regv(struct rxm_ep *rxm_ep, const struct iovec *iov,
+		    size_t count, uint64_t access, struct fid_mr **mr);
+void rxm_lmt_mr_closev(struct rxm_ep *rxm_ep, struct fid_mr **mr,
+		       size_t count);
+int rxm_mr_cache_get_stats(struct rxm_domain *rxm_domain,
+			   struct fi_rxm_mr_cache_stats *stats);
+
+void rxm_ep_sar_tx_next_seg(struct rxm_tx_entry *tx_entry,
+			    struct rxm_tx_buf *tx_buf);
+void rxm_ep_sar_tx_seg_error(struct rxm_tx_buf *tx_buf, int err);
+void rxm_ep_sar_tx_progress(struct rxm_ep *rxm_ep);
+void rxm_sar_rx_discard(struct rxm_rx_buf *rx_buf);
+
+static inline int rxm_proto_near_limit(struct rxm_proto_limit *proto,
+					size_t len)
+{
+	return (len >= proto->limit / 2) && (len / 2 <= proto->limit);
+}
+
+static inline void
+rxm_conn_update_bw(struct rxm_conn *rxm_conn, size_t len, uint64_t start,
+		   int lmt)
+{
+	struct rxm_proto_limit *proto = &rxm_conn->proto;
+	uint64_t now;
+
+	if (!rxm_proto_near_limit(proto, len))
+		return;
+
+	/* Streamed sends overlap, so only count the time since the last one
+	 * completed rather than the time spent queued behind it.  Copied
+	 * sends complete once they are written out, so the first send after
+	 * a switch waits for them to drain and its time goes to the side
+	 * that ran before. */
+	now = fi_gettime_us();
+	fastlock_acquire(&rxm_conn->handle.cmap->lock);
+	if (lmt != proto->last_lmt) {
+		if (lmt)
+			proto->copy_usec += now - MAX(start, proto->last_comp);
+		else
+			proto->lmt_usec += now - MAX(start, proto->last_comp);
+		proto->last_lmt = lmt;
+	} else if (lmt) {
+		proto->lmt_bytes += len;
+		proto->lmt_usec += now - MAX(start, proto->last_comp);
+		proto->lmt_cnt++;
+	} else {
+		proto->copy_bytes += len;
+		proto->copy_usec += now - MAX(start, proto->last_comp);
+		proto->copy_cnt++;
+	}
+	proto->last_comp = now;
+	fastlock_release(&rxm_conn->handle.cmap->lock);
+}
+
 void rxm_ep_handle_postponed_tx_op(struct rxm_ep *rxm_ep,
 				   struct rxm_conn *rxm_conn,
 				   struct rxm_tx_entry *tx_entry);
@@ -525,32 +798,6 @@ static inline void rxm_cq_log_comp(uint64_t flags)
 #endif
 }
 
-/* Caller must hold recv_queue->lock */
-static inline struct rxm_rx_buf *
-rxm_check_unexp_msg_list(struct rxm_recv_queue *recv_queue, fi_addr_t addr,
-			 uint64_t tag, uint64_t ignore)
-{
-	struct rxm_recv_match_attr match_attr;
-	struct dlist_entry *entry;
-
-	if (dlist_empty(&recv_queue->unexp_msg_list))
-		return NULL;
-
-	match_attr.addr 	= addr;
-	match_attr.tag 		= tag;
-	match_attr.ignore 	= ignore;
-
-	entry = dlist_find_first_match(&recv_queue->unexp_msg_list,
-				       recv_queue->match_unexp, &match_attr);
-	if (!entry)
-		return NULL;
-
-	RXM_DBG_ADDR_TAG(FI_LOG_EP_DATA, "Match for posted recv found in unexp"
-			 " msg list\n", match_attr.addr, match_attr.tag);
-
-	return container_of(entry, struct rxm_rx_buf, unexp_msg.entry);
-}
-
 static inline int
 rxm_process_recv_entry(struct rxm_recv_queue *recv_queue,
 		       struct rxm_recv_entry *recv_entry)
@@ -558,10 +805,10 @@ rxm_process_recv_entry(struct rxm_recv_queue *recv_queue,
 	struct rxm_rx_buf *rx_buf;
 
 	recv_queue->rxm_ep->res_fastlock_acquire(&recv_queue->lock);
-	rx_buf = rxm_check_unexp_msg_list(recv_queue, recv_entry->addr,
-					  recv_entry->tag, recv_entry->ignore);
+	rx_buf = rxm_unexp_msg_match(recv_queue, recv_entry->addr,
+				     recv_entry->tag, recv_entry->ignore);
 	if (rx_buf) {
-		dlist_remove(&rx_buf->unexp_msg.entry);
+		rxm_unexp_msg_remove(rx_buf);
 		rx_buf->recv_entry = recv_entry;
 		recv_queue->rxm_ep->res_fastlock_release(&recv_queue->lock);
 		return rxm_cq_handle_rx_buf(rx_buf);
@@ -569,7 +816,7 @@ rxm_process_recv_entry(struct rxm_recv_queue *recv_queue,
 
 	RXM_DBG_ADDR_TAG(FI_LOG_EP_DATA, "Enqueuing recv", recv_entry->addr,
 			 recv_entry->tag);
-	dlist_insert_tail(&recv_entry->entry, &recv_queue->recv_list);
+	rxm_recv_entry_insert(recv_queue, recv_entry);
 	recv_queue->rxm_ep->res_fastlock_release(&recv_queue->lock);
 
 	return FI_SUCCESS;
@@ -578,9 +825,105 @@ rxm_process_recv_entry(struct rxm_recv_queue *recv_queue,
 static inline struct rxm_conn *
 rxm_acquire_conn(struct rxm_ep *rxm_ep, fi_addr_t fi_addr)
 {
-	return container_of(ofi_cmap_acquire_handle(rxm_ep->util_ep.cmap,
-						    fi_addr),
-			    struct rxm_conn, handle);
+	struct util_cmap_handle *handle =
+		ofi_cmap_acquire_handle(rxm_ep->util_ep.cmap, fi_addr);
+
+	ofi_cmap_touch_handle(rxm_ep->util_ep.cmap, handle);
+	return container_of(handle, struct rxm_conn, handle);
+}
+
+/*
+ * Credit based flow control keeps us from sending more messages than the
+ * peer has receive buffers posted to the connection for, which would make
+ * the MSG provider retry (RNR) or stall the connection.  Each side posts
+ * buffers to a connection when it is set up and advertises them in the CM
+ * data.  Every message takes a credit, and the buffers posted since are
+ * returned as credits in ofi_op_hdr::rx_index of any message going the
+ * other way, or in a credit message once they are half of those posted.
+ * The last RXM_CREDITS_RSVD credits are kept for credit messages, so that
+ * returning credits never waits for credits.
+ *
+ * rsvd is RXM_CREDIT_TAKEN if the caller already holds the credit.
+ */
+#define RXM_CREDITS_RSVD	1
+#define RXM_CREDIT_TAKEN	(-1)
+#define RXM_CREDITS_MAX		UINT8_MAX
+
+static inline int rxm_conn_get_credit(struct rxm_conn *rxm_conn, int32_t rsvd)
+{
+	int32_t credits;
+
+	if (!rxm_conn->tx_flow_ctrl || (rsvd == RXM_CREDIT_TAKEN))
+		return 0;
+
+	do {
+		credits = ofi_atomic_get32(&rxm_conn->tx_credits);
+		if (credits <= rsvd)
+			return -FI_EAGAIN;
+	} while (!ofi_atomic_cas_bool32(&rxm_conn->tx_credits, credits,
+					credits - 1));
+	return 0;
+}
+
+/* Whether the peer may run short of credits if we don't send them */
+static inline int rxm_conn_owes_credits(struct rxm_conn *rxm_conn)
+{
+	return ofi_atomic_get32(&rxm_conn->rx_owed) >=
+		MIN(rxm_conn->credit_thresh,
+		    MAX((int32_t) rxm_conn->rx_posted / 2, 1));
+}
+
+/* Returns the credits owed to the peer in the header of pkt */
+static inline int32_t
+rxm_conn_return_credits(struct rxm_conn *rxm_conn, struct rxm_pkt *pkt)
+{
+	int32_t owed, credits;
+
+	do {
+		owed = ofi_atomic_get32(&rxm_conn->rx_owed);
+		credits = (owed > 0) ? MIN(owed, RXM_CREDITS_MAX) : 0;
+	} while (credits && !ofi_atomic_cas_bool32(&rxm_conn->rx_owed, owed,
+						   owed - credits));
+	pkt->hdr.rx_index = (uint8_t) credits;
+	return credits;
+}
+
+/* Both the credit taken for a message and those it returned are given
+ * back if it couldn't be sent */
+static inline void
+rxm_conn_send_failed(struct rxm_conn *rxm_conn, int32_t credits)
+{
+	if (rxm_conn->tx_flow_ctrl)
+		ofi_atomic_inc32(&rxm_conn->tx_credits);
+	if (credits)
+		ofi_atomic_add32(&rxm_conn->rx_owed, credits);
+}
+
+/* The caller holds a credit for the message */
+static inline ssize_t
+rxm_conn_msg_send(struct rxm_conn *rxm_conn, struct rxm_pkt *pkt, size_t len,
+		  void *desc, void *context)
+{
+	int32_t credits = rxm_conn_return_credits(rxm_conn, pkt);
+	ssize_t ret;
+
+	ret = fi_send(rxm_conn->msg_ep, pkt, len, desc, 0, context);
+	if (OFI_UNLIKELY(ret))
+		rxm_conn_send_failed(rxm_conn, credits);
+	return ret;
+}
+
+/* The caller holds a credit for the message */
+static inline ssize_t
+rxm_conn_msg_inject(struct rxm_conn *rxm_conn, struct rxm_pkt *pkt, size_t len)
+{
+	int32_t credits = rxm_conn_return_credits(rxm_conn, pkt);
+	ssize_t ret;
+
+	ret = fi_inject(rxm_conn->msg_ep, pkt, len, 0);
+	if (OFI_UNLIKELY(ret))
+		rxm_conn_send_failed(rxm_conn, credits);
+	return ret;
 }
 
 
@@ -605,11 +948,85 @@ rxm_ep_handle_unconnected(struct rxm_ep *rxm_ep, struct util_cmap_handle *handle
 	return -FI_EAGAIN;
 }
 
+struct rxm_mag_set *rxm_mag_set_create(struct rxm_ep *rxm_ep);
+
+static inline struct rxm_mag *rxm_mag_local(struct rxm_mag_depot *depot)
+{
+	struct rxm_mag_set *set;
+
+	set = pthread_getspecific(depot->rxm_ep->mag_key);
+	if (OFI_UNLIKELY(!set)) {
+		set = rxm_mag_set_create(depot->rxm_ep);
+		if (!set)
+			return NULL;
+	}
+	return &set->mags[depot->idx];
+}
+
+/* Caller must not hold the depot's lock */
+static inline void *rxm_mag_get(struct rxm_mag_depot *depot)
+{
+	struct rxm_mag *mag = rxm_mag_local(depot);
+	void *obj;
+
+	if (OFI_UNLIKELY(!mag)) {
+		fastlock_acquire(depot->lock);
+		obj = depot->alloc_obj(depot->pool);
+		fastlock_release(depot->lock);
+		return obj;
+	}
+
+	if (OFI_UNLIKELY(!mag->cnt)) {
+		fastlock_acquire(depot->lock);
+		while ((mag->cnt < depot->size / 2) &&
+		       (obj = depot->alloc_obj(depot->pool)))
+			mag->objs[mag->cnt++] = obj;
+		fastlock_release(depot->lock);
+		if (!mag->cnt)
+			return NULL;
+	}
+	return mag->objs[--mag->cnt];
+}
+
+/* Caller must not hold the depot's lock */
+static inline void rxm_mag_put(struct rxm_mag_depot *depot, void *obj)
+{
+	struct rxm_mag *mag = rxm_mag_local(depot);
+
+	if (OFI_UNLIKELY(!mag)) {
+		fastlock_acquire(depot->lock);
+		depot->free_obj(depot->pool, obj);
+		fastlock_release(depot->lock);
+		return;
+	}
+
+	if (OFI_UNLIKELY(mag->cnt == depot->size)) {
+		fastlock_acquire(depot->lock);
+		while (mag->cnt > depot->size / 2)
+			depot->free_obj(depot->pool, mag->objs[--mag->cnt]);
+		fastlock_release(depot->lock);
+	}
+	mag->objs[mag->cnt++] = obj;
+}
+
+static inline void *rxm_buf_pool_alloc(void *pool)
+{
+	return util_buf_alloc(pool);
+}
+
+static inline void rxm_buf_pool_free(void *pool, void *buf)
+{
+	util_buf_release(pool, buf);
+}
+
 static inline
 struct rxm_buf *rxm_buf_get(struct rxm_buf_pool *pool)
 {
 	struct rxm_buf *buf;
 
+	if (pool->depot.size)
+		return rxm_mag_get(&pool->depot);
+
 	pool->rxm_ep->res_fastlock_acquire(&pool->lock);
 	buf = util_buf_alloc(pool->pool);
 	pool->rxm_ep->res_fastlock_release(&pool->lock);
@@ -619,6 +1036,11 @@ struct rxm_buf *rxm_buf_get(struct rxm_buf_pool *pool)
 static inline
 void rxm_buf_release(struct rxm_buf_pool *pool, struct rxm_buf *buf)
 {
+	if (pool->depot.size) {
+		rxm_mag_put(&pool->depot, buf);
+		return;
+	}
+
 	pool->rxm_ep->res_fastlock_acquire(&pool->lock);
 	util_buf_release(pool->pool, buf);
 	pool->rxm_ep->res_fastlock_release(&pool->lock);
@@ -645,23 +1067,60 @@ rxm_tx_buf_release(struct rxm_ep *rxm_ep, struct rxm_tx_buf *tx_buf)
 	       (tx_buf->type == RXM_BUF_POOL_TX_SAR));
 	assert((tx_buf->pkt.ctrl_hdr.type == ofi_ctrl_data) ||
 	       (tx_buf->pkt.ctrl_hdr.type == ofi_ctrl_large_data) ||
+	       (tx_buf->pkt.ctrl_hdr.type == ofi_ctrl_seg_data) ||
 	       (tx_buf->pkt.ctrl_hdr.type == ofi_ctrl_ack));
 	tx_buf->pkt.hdr.flags &= ~OFI_REMOTE_CQ_DATA;
 	rxm_buf_release(&rxm_ep->buf_pools[tx_buf->type],
 			(struct rxm_buf *)tx_buf);
 }
 
+/* Caller must hold rx_pool_lock */
+static inline struct rxm_rx_buf *rxm_rx_buf_alloc(struct rxm_domain *rxm_domain)
+{
+	struct rxm_rx_buf *rx_buf;
+
+	rx_buf = util_buf_alloc(rxm_domain->rx_pool);
+	if (rx_buf && (++rxm_domain->rx_pool_used > rxm_domain->rx_pool_peak))
+		rxm_domain->rx_pool_peak = rxm_domain->rx_pool_used;
+	return rx_buf;
+}
+
+/* Caller must hold rx_pool_lock */
+static inline void
+rxm_rx_buf_free(struct rxm_domain *rxm_domain, struct rxm_rx_buf *rx_buf)
+{
+	util_buf_release(rxm_domain->rx_pool, rx_buf);
+	rxm_domain->rx_pool_used--;
+}
+
 static inline struct rxm_rx_buf *rxm_rx_buf_get(struct rxm_ep *rxm_ep)
 {
-	return (struct rxm_rx_buf *)rxm_buf_get(
-			&rxm_ep->buf_pools[RXM_BUF_POOL_RX]);
+	struct rxm_domain *rxm_domain = container_of(rxm_ep->util_ep.domain,
+						     struct rxm_domain,
+						     util_domain);
+	struct rxm_rx_buf *rx_buf;
+
+	fastlock_acquire(&rxm_domain->rx_pool_lock);
+	rx_buf = rxm_rx_buf_alloc(rxm_domain);
+	fastlock_release(&rxm_domain->rx_pool_lock);
+
+	if (rx_buf) {
+		rx_buf->ep = rxm_ep;
+		rx_buf->conn = NULL;
+	}
+	return rx_buf;
 }
 
 static inline void
 rxm_rx_buf_release(struct rxm_ep *rxm_ep, struct rxm_rx_buf *rx_buf)
 {
-	rxm_buf_release(&rxm_ep->buf_pools[RXM_BUF_POOL_RX],
-			(struct rxm_buf *)rx_buf);
+	struct rxm_domain *rxm_domain = container_of(rxm_ep->util_ep.domain,
+						     struct rxm_domain,
+						     util_domain);
+
+	fastlock_acquire(&rxm_domain->rx_pool_lock);
+	rxm_rx_buf_free(rxm_domain, rx_buf);
+	fastlock_release(&rxm_domain->rx_pool_lock);
 }
 
 static inline struct rxm_rma_buf *rxm_rma_buf_get(struct rxm_ep *rxm_ep)
@@ -677,8 +1136,30 @@ rxm_rma_buf_release(struct rxm_ep *rxm_ep, struct rxm_rma_buf *rx_buf)
 			(struct rxm_buf *)rx_buf);
 }
 
+static inline void *rxm_fs_alloc(void *fs)
+{
+	struct {
+		FREESTACK_HEADER
+	} *freestack = fs;
+
+	return freestack_isempty(freestack) ? NULL : freestack_pop(freestack);
+}
+
+static inline void rxm_fs_free(void *fs, void *entry)
+{
+	struct {
+		FREESTACK_HEADER
+	} *freestack = fs;
+
+	freestack_push(freestack, entry);
+}
+
 #define rxm_entry_pop(queue, entry)					\
 	do {								\
+		if (queue->depot.size) {				\
+			entry = rxm_mag_get(&queue->depot);		\
+			break;						\
+		}							\
 		queue->rxm_ep->res_fastlock_acquire(&queue->lock);	\
 		entry = freestack_isempty(queue->fs) ?			\
 			NULL : freestack_pop(queue->fs);		\
@@ -687,6 +1168,10 @@ rxm_rma_buf_release(struct rxm_ep *rxm_ep, struct rxm_rma_buf *rx_buf)
 
 #define rxm_entry_push(queue, entry)					\
 	do {								\
+		if (queue->depot.size) {				\
+			rxm_mag_put(&queue->depot, entry);		\
+			break;						\
+		}							\
 		queue->rxm_ep->res_fastlock_acquire(&queue->lock);	\
 		freestack_push(queue->fs, entry);			\
 		queue->rxm_ep->res_fastlock_release(&queue->lock);	\
@@ -37,6 +37,27 @@
 #include <ofi_util.h>
 #include "rxm.h"
 
+/* Receive buffers advertised to the peer.  Credit messages are injected,
+ * so the peer isn't flow controlled if there is no room for them */
+static uint32_t rxm_conn_rx_credits(struct rxm_ep *rxm_ep,
+				    struct rxm_conn *rxm_conn)
+{
+	if (rxm_ep->srx_ctx ||
+	    (sizeof(struct rxm_pkt) > rxm_ep->msg_info->tx_attr->inject_size))
+		return 0;
+	return (uint32_t) rxm_conn->rx_posted;
+}
+
+/* Takes the credits the peer advertised in its CM data */
+static void rxm_conn_set_credits(struct rxm_conn *rxm_conn,
+				 struct rxm_cm_data *cm_data)
+{
+	uint32_t credits = ntohl(cm_data->proto.rx_credits);
+
+	rxm_conn->tx_flow_ctrl = (credits != 0);
+	ofi_atomic_set32(&rxm_conn->tx_credits, (int32_t) credits);
+}
+
 static int rxm_msg_ep_open(struct rxm_ep *rxm_ep, struct fi_info *msg_info,
 			   struct rxm_conn *rxm_conn, void *context)
 {
@@ -81,12 +102,25 @@ static int rxm_msg_ep_open(struct rxm_ep *rxm_ep, struct fi_info *msg_info,
 		goto err;
 	}
 
+	memset(&rxm_conn->proto, 0, sizeof(rxm_conn->proto));
+	rxm_conn->proto.limit = MAX(rxm_ep->sar_limit,
+				    rxm_ep->rxm_info->tx_attr->inject_size);
+
 	if (!rxm_ep->srx_ctx) {
-		ret = rxm_ep_prepost_buf(rxm_ep, msg_ep);
+		rxm_conn->rx_posted = 0;
+		ret = rxm_conn_post_rx(rxm_ep, rxm_conn, msg_ep);
 		if (ret)
 			goto err;
 	}
 
+	/* Sends wait for the peer's credits, and the buffers posted so far
+	 * are advertised rather than owed */
+	rxm_conn->tx_flow_ctrl = 0;
+	ofi_atomic_set32(&rxm_conn->tx_credits, 0);
+	ofi_atomic_set32(&rxm_conn->rx_owed, 0);
+	rxm_conn->credit_thresh = rxm_conn_rx_credits(rxm_ep, rxm_conn) ?
+				  RXM_CREDITS_MAX : INT32_MAX;
+
 	rxm_conn->msg_ep = msg_ep;
 	return 0;
 err:
@@ -94,12 +128,29 @@ err:
 	return ret;
 }
 
+/*
+ * Called with the cmap lock held when our connection request is given up
+ * for the peer's, or is to be sent again after being rejected.  The
+ * message the request carried was dropped with it, so it is sent once
+ * connected instead.
+ */
 static void rxm_conn_close(struct util_cmap_handle *handle)
 {
 	struct rxm_conn *rxm_conn = container_of(handle, struct rxm_conn, handle);
+
+	if (rxm_conn->cm_tx_entry) {
+		dlist_insert_head(&rxm_conn->cm_tx_entry->postponed_entry,
+				  &rxm_conn->postponed_tx_list);
+		rxm_conn->cm_tx_entry = NULL;
+	}
+
 	if (!rxm_conn->msg_ep)
 		return;
 
+	/* Left from a request that was rejected before this one */
+	if (rxm_conn->saved_msg_ep && fi_close(&rxm_conn->saved_msg_ep->fid))
+		FI_WARN(&rxm_prov, FI_LOG_EP_CTRL, "Unable to close saved msg_ep\n");
+
 	rxm_conn->saved_msg_ep = rxm_conn->msg_ep;
 	FI_DBG(&rxm_prov, FI_LOG_EP_CTRL,
 	       "Saved MSG EP fid for further deletion in main thread\n");
@@ -109,6 +160,13 @@ static void rxm_conn_close(struct util_cmap_handle *handle)
 static void rxm_conn_free(struct util_cmap_handle *handle)
 {
 	struct rxm_conn *rxm_conn = container_of(handle, struct rxm_conn, handle);
+	struct rxm_ep *rxm_ep = container_of(handle->cmap->ep, struct rxm_ep,
+					     util_ep);
+
+	fastlock_acquire(&handle->cmap->lock);
+	dlist_remove_init(&rxm_conn->close_entry);
+	dlist_remove_init(&rxm_conn->credit_entry);
+	fastlock_release(&handle->cmap->lock);
 
 	/* This handles case when saved_msg_ep wasn't closed */
 	if (rxm_conn->saved_msg_ep) {
@@ -125,10 +183,183 @@ static void rxm_conn_free(struct util_cmap_handle *handle)
 		FI_WARN(&rxm_prov, FI_LOG_EP_CTRL, "Unable to close msg_ep\n");
 	FI_DBG(&rxm_prov, FI_LOG_EP_CTRL, "Closed msg_ep\n");
 	rxm_conn->msg_ep = NULL;
+	rxm_conn_release_rx(rxm_ep, rxm_conn);
 
 	free(container_of(handle, struct rxm_conn, handle));
 }
 
+/*
+ * Messages in flight either way hold receive buffers on one of the sides
+ * by the time a close request is answered, see util_cmap_evict_idle.  Only
+ * RMA isn't seen by the target, so the initiator counts it.
+ *
+ * Caller must hold the cmap lock
+ */
+static int rxm_conn_idle(struct util_cmap_handle *handle)
+{
+	struct rxm_conn *rxm_conn = container_of(handle, struct rxm_conn, handle);
+
+	return dlist_empty(&rxm_conn->postponed_tx_list) &&
+	       dlist_empty(&rxm_conn->sar_rx_msg_list) &&
+	       !rxm_conn->cm_tx_entry && !rxm_conn->rx_held &&
+	       !ofi_atomic_get32(&rxm_conn->rma_pending);
+}
+
+/* Caller must hold the cmap lock */
+void rxm_conn_queue_close(struct rxm_ep *rxm_ep, struct rxm_conn *rxm_conn,
+			  uint8_t type)
+{
+	if (dlist_empty(&rxm_conn->close_entry))
+		dlist_insert_tail(&rxm_conn->close_entry,
+				  &rxm_ep->conn_close_list);
+	rxm_conn->close_type = type;
+}
+
+/* Caller must hold the cmap lock */
+static int rxm_conn_close_req(struct util_cmap_handle *handle)
+{
+	struct rxm_conn *rxm_conn = container_of(handle, struct rxm_conn, handle);
+	struct rxm_ep *rxm_ep = container_of(handle->cmap->ep, struct rxm_ep,
+					     util_ep);
+
+	if (!dlist_empty(&rxm_conn->close_entry))
+		return -FI_EBUSY;
+
+	rxm_conn_queue_close(rxm_ep, rxm_conn, ofi_ctrl_close_req);
+	return 0;
+}
+
+static ssize_t rxm_conn_send_ctrl(struct rxm_conn *rxm_conn, uint8_t type,
+				  int32_t rsvd)
+{
+	struct rxm_pkt pkt;
+
+	if (rxm_conn_get_credit(rxm_conn, rsvd))
+		return -FI_EAGAIN;
+
+	memset(&pkt, 0, sizeof(pkt));
+	pkt.hdr.op		= ofi_op_msg;
+	pkt.hdr.version		= OFI_OP_VERSION;
+	pkt.ctrl_hdr.version	= RXM_CTRL_VERSION;
+	pkt.ctrl_hdr.type	= type;
+	pkt.ctrl_hdr.conn_id	= rxm_conn->handle.remote_key;
+
+	return rxm_conn_msg_inject(rxm_conn, &pkt, sizeof(pkt));
+}
+
+/*
+ * Close messages are queued by the event thread and by handlers of
+ * received ones, and sent on progress.  A close request that can't be sent
+ * is taken as refused.
+ */
+void rxm_conn_progress_close(struct rxm_ep *rxm_ep)
+{
+	struct util_cmap *cmap = rxm_ep->util_ep.cmap;
+	struct rxm_conn *rxm_conn;
+	ssize_t ret;
+
+	fastlock_acquire(&cmap->lock);
+	while (!dlist_empty(&rxm_ep->conn_close_list)) {
+		rxm_conn = container_of(rxm_ep->conn_close_list.next,
+					struct rxm_conn, close_entry);
+		if ((rxm_conn->handle.state == CMAP_SHUTDOWN) ||
+		    !rxm_conn->msg_ep) {
+			dlist_remove_init(&rxm_conn->close_entry);
+			continue;
+		}
+
+		ret = rxm_conn_send_ctrl(rxm_conn, rxm_conn->close_type,
+					 RXM_CREDITS_RSVD);
+		if (ret == -FI_EAGAIN)
+			break;
+		dlist_remove_init(&rxm_conn->close_entry);
+		if (OFI_UNLIKELY(ret)) {
+			FI_WARN(&rxm_prov, FI_LOG_EP_CTRL,
+				"Unable to send close message: %zd\n", ret);
+			if (rxm_conn->close_type == ofi_ctrl_close_req)
+				ofi_cmap_process_close_resp(cmap,
+							    &rxm_conn->handle, 0);
+		}
+	}
+	fastlock_release(&cmap->lock);
+}
+
+/* Caller must hold the cmap lock */
+void rxm_conn_queue_credit(struct rxm_ep *rxm_ep, struct rxm_conn *rxm_conn)
+{
+	if (dlist_empty(&rxm_conn->credit_entry))
+		dlist_insert_tail(&rxm_conn->credit_entry,
+				  &rxm_ep->conn_credit_list);
+}
+
+/*
+ * Sends postponed until the connection was set up take credits like any
+ * other.  Those the peer's initial credits don't cover are sent from
+ * progress as credits come back, and new sends to the peer return
+ * -FI_EAGAIN until then, so that they don't overtake them.
+ *
+ * Caller must hold the cmap lock
+ */
+static int rxm_conn_send_postponed(struct rxm_ep *rxm_ep,
+				   struct rxm_conn *rxm_conn)
+{
+	struct rxm_tx_entry *tx_entry;
+
+	while (!dlist_empty(&rxm_conn->postponed_tx_list)) {
+		tx_entry = container_of(rxm_conn->postponed_tx_list.next,
+					struct rxm_tx_entry, postponed_entry);
+		if (tx_entry->comp_flags & FI_RMA) {
+			dlist_remove(&tx_entry->postponed_entry);
+			rxm_ep_handle_postponed_rma_op(rxm_ep, rxm_conn,
+						       tx_entry);
+			continue;
+		}
+		if (rxm_conn_get_credit(rxm_conn, RXM_CREDITS_RSVD))
+			return -FI_EAGAIN;
+		dlist_remove(&tx_entry->postponed_entry);
+		rxm_ep_handle_postponed_tx_op(rxm_ep, rxm_conn, tx_entry);
+	}
+	return 0;
+}
+
+/*
+ * Connections whose postponed sends wait for credits, or that owe the peer
+ * credits it may be waiting for, see rxm_conn_get_credit.  A credit message
+ * only takes the credits kept for it, which the peer returns along with
+ * the credits it owes once it got a message.
+ */
+void rxm_conn_progress_credits(struct rxm_ep *rxm_ep)
+{
+	struct util_cmap *cmap = rxm_ep->util_ep.cmap;
+	struct rxm_conn *rxm_conn;
+	struct dlist_entry *tmp;
+	ssize_t ret;
+
+	fastlock_acquire(&cmap->lock);
+	dlist_foreach_container_safe(&rxm_ep->conn_credit_list, struct rxm_conn,
+				     rxm_conn, credit_entry, tmp) {
+		if ((rxm_conn->handle.state == CMAP_SHUTDOWN) ||
+		    !rxm_conn->msg_ep) {
+			dlist_remove_init(&rxm_conn->credit_entry);
+			continue;
+		}
+
+		if (rxm_conn_send_postponed(rxm_ep, rxm_conn))
+			continue;
+
+		if (rxm_conn_owes_credits(rxm_conn)) {
+			ret = rxm_conn_send_ctrl(rxm_conn, ofi_ctrl_credit, 0);
+			if (ret == -FI_EAGAIN)
+				continue;
+			if (OFI_UNLIKELY(ret))
+				FI_WARN(&rxm_prov, FI_LOG_EP_CTRL,
+					"Unable to send credits: %zd\n", ret);
+		}
+		dlist_remove_init(&rxm_conn->credit_entry);
+	}
+	fastlock_release(&cmap->lock);
+}
+
 static void rxm_conn_connected_handler(struct util_cmap_handle *handle)
 {
 	struct rxm_conn *rxm_conn = container_of(handle, struct rxm_conn, handle);
@@ -149,6 +380,13 @@ static struct util_cmap_handle *rxm_conn_alloc(void)
 		return NULL;
 
 	dlist_init(&rxm_conn->postponed_tx_list);
+	dlist_init(&rxm_conn->sar_rx_msg_list);
+	ofi_atomic_initialize64(&rxm_conn->sar_tx_id, 0);
+	dlist_init(&rxm_conn->close_entry);
+	ofi_atomic_initialize32(&rxm_conn->rma_pending, 0);
+	dlist_init(&rxm_conn->credit_entry);
+	ofi_atomic_initialize32(&rxm_conn->tx_credits, 0);
+	ofi_atomic_initialize32(&rxm_conn->rx_owed, 0);
 	return &rxm_conn->handle;
 }
 
@@ -193,12 +431,66 @@ err:
 	return -FI_EINVAL;
 }
 
+/*
+ * An eager message that came with a connection request is handed to
+ * progress like a received packet.  It is queued before the request is
+ * accepted, so that it is handled ahead of anything the peer sends once
+ * connected.
+ */
+static int rxm_conn_queue_cm_rx(struct rxm_ep *rxm_ep, struct rxm_conn *rxm_conn,
+				void *data, size_t datalen,
+				struct rxm_rx_buf **rx_buf)
+{
+	struct rxm_pkt *pkt = data;
+
+	if (datalen < sizeof(*pkt) ||
+	    datalen - sizeof(*pkt) != pkt->hdr.size ||
+	    datalen > rxm_ep->eager_pkt_size ||
+	    pkt->ctrl_hdr.type != ofi_ctrl_data) {
+		FI_WARN(&rxm_prov, FI_LOG_EP_CTRL,
+			"Invalid message in CM data\n");
+		return -FI_EINVAL;
+	}
+
+	*rx_buf = rxm_rx_buf_get(rxm_ep);
+	if (OFI_UNLIKELY(!*rx_buf))
+		return -FI_ENOMEM;
+
+	memcpy(&(*rx_buf)->pkt, pkt, datalen);
+	(*rx_buf)->pkt.ctrl_hdr.conn_id = rxm_conn->handle.key;
+	(*rx_buf)->hdr.state = RXM_RX;
+	/* Not posted to any MSG EP, released instead of reposted */
+	(*rx_buf)->hdr.msg_ep = NULL;
+
+	fastlock_acquire(&rxm_ep->util_ep.cmap->lock);
+	dlist_insert_tail(&(*rx_buf)->entry, &rxm_ep->cm_rx_list);
+	fastlock_release(&rxm_ep->util_ep.cmap->lock);
+	return 0;
+}
+
+static void rxm_conn_dequeue_cm_rx(struct rxm_ep *rxm_ep,
+				   struct rxm_rx_buf *rx_buf)
+{
+	struct dlist_entry *entry;
+
+	fastlock_acquire(&rxm_ep->util_ep.cmap->lock);
+	dlist_foreach(&rxm_ep->cm_rx_list, entry) {
+		if (entry == &rx_buf->entry) {
+			dlist_remove(entry);
+			rxm_rx_buf_release(rxm_ep, rx_buf);
+			break;
+		}
+	}
+	fastlock_release(&rxm_ep->util_ep.cmap->lock);
+}
+
 static int
 rxm_msg_process_connreq(struct rxm_ep *rxm_ep, struct fi_info *msg_info,
-			void *data)
+			void *data, size_t datalen)
 {
 	struct rxm_conn *rxm_conn;
 	struct rxm_cm_data *remote_cm_data = data;
+	struct rxm_rx_buf *rx_buf = NULL;
 	struct rxm_cm_data cm_data = {
 		.proto = {
 			.ctrl_version = RXM_CTRL_VERSION,
@@ -231,17 +523,30 @@ rxm_msg_process_connreq(struct rxm_ep *rxm_ep, struct fi_info *msg_info,
 	ret = rxm_msg_ep_open(rxm_ep, msg_info, rxm_conn, handle);
 	if (ret)
 		goto err2;
+	rxm_conn_set_credits(rxm_conn, remote_cm_data);
+
+	if (datalen > sizeof(*remote_cm_data)) {
+		ret = rxm_conn_queue_cm_rx(rxm_ep, rxm_conn, remote_cm_data + 1,
+					   datalen - sizeof(*remote_cm_data),
+					   &rx_buf);
+		if (ret)
+			goto err2;
+	}
 
 	cm_data.conn_id = rxm_conn->handle.key;
 	cm_data.proto.eager_size = htonll(cm_data.proto.eager_size);
+	cm_data.proto.rx_credits = htonl(rxm_conn_rx_credits(rxm_ep, rxm_conn));
 
 	ret = fi_accept(rxm_conn->msg_ep, &cm_data, sizeof(cm_data));
 	if (ret) {
 		FI_WARN(&rxm_prov, FI_LOG_FABRIC,
 				"Unable to accept incoming connection\n");
-		goto err2;
+		goto err3;
 	}
 	return ret;
+err3:
+	if (rx_buf)
+		rxm_conn_dequeue_cm_rx(rxm_ep, rx_buf);
 err2:
 	ofi_cmap_del_handle(&rxm_conn->handle);
 err1:
@@ -269,9 +574,32 @@ static int rxm_conn_handle_notify(struct fi_eq_entry *eq_entry)
 	}
 }
 
+/* Caller must hold the cmap lock */
+static void rxm_conn_complete_cm_tx(struct rxm_ep *rxm_ep,
+				    struct rxm_conn *rxm_conn, int err)
+{
+	struct rxm_tx_entry *tx_entry = rxm_conn->cm_tx_entry;
+
+	if (!tx_entry)
+		return;
+
+	rxm_conn->cm_tx_entry = NULL;
+	rxm_tx_buf_release(rxm_ep, tx_entry->tx_buf);
+	if (err) {
+		rxm_cq_write_error(rxm_ep->util_ep.tx_cq,
+				   rxm_ep->util_ep.tx_cntr,
+				   tx_entry->context, err);
+		rxm_tx_entry_release(&rxm_ep->send_queue, tx_entry);
+	} else if (rxm_finish_send_nobuf(tx_entry)) {
+		FI_WARN(&rxm_prov, FI_LOG_EP_CTRL,
+			"Unable to complete send carried in CM data\n");
+	}
+}
+
 static void rxm_conn_handle_eq_err(struct rxm_ep *rxm_ep, ssize_t rd)
 {
 	struct fi_eq_err_entry err_entry = {0};
+	struct rxm_conn *rxm_conn;
 
 	if (rd != -FI_EAVAIL) {
 		FI_WARN(&rxm_prov, FI_LOG_FABRIC, "Unable to fi_eq_sread\n");
@@ -283,29 +611,34 @@ static void rxm_conn_handle_eq_err(struct rxm_ep *rxm_ep, ssize_t rd)
 		ofi_cmap_process_reject(rxm_ep->util_ep.cmap,
 					err_entry.fid->context);
 	}
+	/* The message carried by a request that failed never reached the
+	 * peer, unless the request is sent again and it is queued to go
+	 * out once connected */
+	if (err_entry.fid && err_entry.fid->fclass == FI_CLASS_EP) {
+		rxm_conn = container_of(err_entry.fid->context,
+					struct rxm_conn, handle);
+		fastlock_acquire(&rxm_ep->util_ep.cmap->lock);
+		rxm_conn_complete_cm_tx(rxm_ep, rxm_conn, -err_entry.err);
+		fastlock_release(&rxm_ep->util_ep.cmap->lock);
+	}
 }
 
 static void rxm_conn_handle_postponed_op(struct rxm_ep *rxm_ep,
 					 struct util_cmap_handle *handle)
 {
-	struct rxm_tx_entry *tx_entry;
 	struct rxm_conn *rxm_conn = container_of(handle, struct rxm_conn, handle);
 
-	while (!dlist_empty(&rxm_conn->postponed_tx_list)) {
-		dlist_pop_front(&rxm_conn->postponed_tx_list, struct rxm_tx_entry,
-				tx_entry, postponed_entry);
-		if (!(tx_entry->comp_flags & FI_RMA))
-			 rxm_ep_handle_postponed_tx_op(rxm_ep, rxm_conn, tx_entry);
-		else
-			rxm_ep_handle_postponed_rma_op(rxm_ep, rxm_conn, tx_entry);
-	}
+	/* The peer got the message along with the connection request */
+	rxm_conn_complete_cm_tx(rxm_ep, rxm_conn, 0);
+
+	if (rxm_conn_send_postponed(rxm_ep, rxm_conn))
+		rxm_conn_queue_credit(rxm_ep, rxm_conn);
 }
 
 static void *rxm_conn_event_handler(void *arg)
 {
 	struct fi_eq_cm_entry *entry;
-	size_t datalen = sizeof(struct rxm_cm_data);
-	size_t len = sizeof(*entry) + datalen;
+	size_t len = sizeof(*entry) + RXM_CM_DATA_MAX;
 	struct rxm_ep *rxm_ep = container_of(arg, struct rxm_ep, util_ep);
 	struct rxm_cm_data *cm_data;
 	uint32_t event;
@@ -333,13 +666,16 @@ static void *rxm_conn_event_handler(void *arg)
 			break;
 		case FI_CONNREQ:
 			FI_DBG(&rxm_prov, FI_LOG_FABRIC, "Got new connection\n");
-			if ((size_t)rd != len) {
+			if ((size_t)rd < sizeof(*entry) +
+					 sizeof(struct rxm_cm_data)) {
 				FI_WARN(&rxm_prov, FI_LOG_FABRIC,
-					"Received size (%zd) not matching "
-					"expected (%zu)\n", rd, len);
+					"Received size (%zd) less than "
+					"expected (%zu)\n", rd, sizeof(*entry) +
+					sizeof(struct rxm_cm_data));
 				goto exit;
 			}
-			rxm_msg_process_connreq(rxm_ep, entry->info, entry->data);
+			rxm_msg_process_connreq(rxm_ep, entry->info, entry->data,
+						rd - sizeof(*entry));
 			fi_freeinfo(entry->info);
 			break;
 		case FI_CONNECTED:
@@ -351,6 +687,12 @@ static void *rxm_conn_event_handler(void *arg)
 						 entry->fid->context,
 						 ((rd - sizeof(*entry)) ?
 						  &cm_data->conn_id : NULL));
+			/* The passive side took the credits from the request */
+			if (rd - sizeof(*entry))
+				rxm_conn_set_credits(container_of(entry->fid->context,
+								  struct rxm_conn,
+								  handle),
+						     cm_data);
 			rxm_conn_handle_postponed_op(rxm_ep, entry->fid->context);
 			fastlock_release(&rxm_ep->util_ep.cmap->lock);
 			break;
@@ -372,21 +714,21 @@ exit:
 }
 
 static int rxm_prepare_cm_data(struct fid_pep *pep, struct util_cmap_handle *handle,
-		struct rxm_cm_data *cm_data)
+		struct rxm_cm_data *cm_data, size_t *cm_data_size)
 {
-	size_t cm_data_size = 0;
 	size_t name_size = sizeof(cm_data->name);
-	size_t opt_size = sizeof(cm_data_size);
+	size_t opt_size = sizeof(*cm_data_size);
 	int ret;
 
+	*cm_data_size = 0;
 	ret = fi_getopt(&pep->fid, FI_OPT_ENDPOINT, FI_OPT_CM_DATA_SIZE,
-			&cm_data_size, &opt_size);
+			cm_data_size, &opt_size);
 	if (ret) {
 		FI_WARN(&rxm_prov, FI_LOG_EP_CTRL, "fi_getopt failed\n");
 		return ret;
 	}
 
-	if (cm_data_size < sizeof(*cm_data)) {
+	if (*cm_data_size < sizeof(*cm_data)) {
 		FI_WARN(&rxm_prov, FI_LOG_EP_CTRL, "MSG EP CM data size too small\n");
 		return -FI_EOTHER;
 	}
@@ -419,6 +761,9 @@ rxm_conn_connect(struct util_ep *util_ep, struct util_cmap_handle *handle,
 			.eager_size = rxm_ep->rxm_info->tx_attr->inject_size,
 		},
 	};
+	struct rxm_tx_entry *tx_entry = rxm_conn->cm_tx_entry;
+	uint8_t cm_buf[RXM_CM_DATA_MAX];
+	size_t cm_data_size, cm_len = sizeof(cm_data), pkt_size;
 
 	free(rxm_ep->msg_info->dest_addr);
 	rxm_ep->msg_info->dest_addrlen = addrlen;
@@ -439,23 +784,42 @@ rxm_conn_connect(struct util_ep *util_ep, struct util_cmap_handle *handle,
 	/* We have to send passive endpoint's address to the server since the
 	 * address from which connection request would be sent would have a
 	 * different port. */
-	ret = rxm_prepare_cm_data(rxm_ep->msg_pep, &rxm_conn->handle, &cm_data);
+	ret = rxm_prepare_cm_data(rxm_ep->msg_pep, &rxm_conn->handle, &cm_data,
+				  &cm_data_size);
 	if (ret)
 		goto err2;
 
 	cm_data.proto.eager_size = htonll(cm_data.proto.eager_size);
+	cm_data.proto.rx_credits = htonl(rxm_conn_rx_credits(rxm_ep, rxm_conn));
+	memcpy(cm_buf, &cm_data, sizeof(cm_data));
+
+	/* Carry the send that triggered the connection if it fits */
+	if (tx_entry) {
+		pkt_size = sizeof(struct rxm_pkt) + tx_entry->tx_buf->pkt.hdr.size;
+		if (cm_len + pkt_size <= MIN(cm_data_size, RXM_CM_DATA_MAX)) {
+			memcpy(cm_buf + cm_len, &tx_entry->tx_buf->pkt, pkt_size);
+			cm_len += pkt_size;
+		} else {
+			rxm_conn->cm_tx_entry = NULL;
+		}
+	}
 
-	ret = fi_connect(rxm_conn->msg_ep, msg_info->dest_addr, &cm_data, sizeof(cm_data));
+	ret = fi_connect(rxm_conn->msg_ep, msg_info->dest_addr, cm_buf, cm_len);
 	if (ret) {
 		FI_WARN(&rxm_prov, FI_LOG_EP_CTRL, "Unable to connect msg_ep\n");
 		goto err2;
 	}
+	if (tx_entry && !rxm_conn->cm_tx_entry)
+		dlist_insert_tail(&tx_entry->postponed_entry,
+				  &rxm_conn->postponed_tx_list);
 	fi_freeinfo(msg_info);
 	return 0;
 err2:
 	fi_close(&rxm_conn->msg_ep->fid);
 	rxm_conn->msg_ep = NULL;
 err1:
+	/* The caller still owns the send */
+	rxm_conn->cm_tx_entry = NULL;
 	fi_freeinfo(msg_info);
 	return ret;
 }
@@ -483,7 +847,7 @@ struct util_cmap *rxm_conn_cmap_alloc(struct rxm_ep *rxm_ep)
 	struct util_cmap_attr attr;
 	struct util_cmap *cmap = NULL;
 	void *name;
-	size_t len;
+	size_t len, idle_time;
 	int ret;
 
 	len = rxm_ep->msg_info->src_addrlen;
@@ -512,6 +876,23 @@ struct util_cmap *rxm_conn_cmap_alloc(struct rxm_ep *rxm_ep)
 	attr.connected_handler	= rxm_conn_connected_handler;
 	attr.event_handler	= rxm_conn_event_handler;
 	attr.signal		= rxm_conn_signal;
+	attr.idle		= rxm_conn_idle;
+	attr.close_req		= rxm_conn_close_req;
+
+	if (fi_param_get_size_t(&rxm_prov, "conn_max", &attr.max_conn))
+		attr.max_conn = 0;
+	if (fi_param_get_size_t(&rxm_prov, "conn_idle_time", &idle_time))
+		idle_time = RXM_CONN_IDLE_TIME;
+	attr.idle_time = idle_time;
+
+	/* Close messages are sent with fi_inject */
+	if (attr.max_conn &&
+	    (sizeof(struct rxm_pkt) > rxm_ep->msg_info->tx_attr->inject_size)) {
+		FI_WARN(&rxm_prov, FI_LOG_EP_CTRL, "MSG provider inject size "
+			"too small to close idle connections, not bounding "
+			"the number of connections\n");
+		attr.max_conn = 0;
+	}
 
 	cmap = ofi_cmap_alloc(&rxm_ep->util_ep, &attr);
 	if (!cmap)
@@ -238,18 +238,24 @@ static inline int rxm_finish_send(struct rxm_tx_entry *tx_entry)
 	return rxm_finish_send_nobuf(tx_entry);
 }
 
-static inline int rxm_finish_sar_segment_send(struct rxm_tx_entry *tx_entry)
+static inline int rxm_finish_sar_segment_send(struct rxm_tx_buf *tx_buf)
 {
-	struct rxm_tx_buf *tx_buf;
+	struct rxm_tx_entry *tx_entry = tx_buf->tx_entry;
 
-	dlist_pop_front(&tx_entry->in_flight_tx_buf_list, struct rxm_tx_buf,
-			tx_buf, in_flight_entry);
+	if (--tx_entry->segs_left) {
+		rxm_ep_sar_tx_next_seg(tx_entry, tx_buf);
+		return FI_SUCCESS;
+	}
 
+	/* All segments of the message have been sent */
 	rxm_tx_buf_release(tx_entry->ep, tx_buf);
-	/* If `segs_left` == 0, all segments of the message have been fully sent */
-	if (!--tx_entry->segs_left)
-		return rxm_finish_send_nobuf(tx_entry);
-	return FI_SUCCESS;
+	if (OFI_UNLIKELY(tx_entry->sar_err)) {
+		rxm_tx_entry_release(&tx_entry->ep->send_queue, tx_entry);
+		return FI_SUCCESS;
+	}
+	rxm_conn_update_bw(tx_entry->conn, tx_entry->total_len,
+			   tx_entry->start, 0);
+	return rxm_finish_send_nobuf(tx_entry);
 }
 
 static inline int rxm_finish_send_lmt_ack(struct rxm_rx_buf *rx_buf)
@@ -257,7 +263,8 @@ static inline int rxm_finish_send_lmt_ack(struct rxm_rx_buf *rx_buf)
 	RXM_LOG_STATE(FI_LOG_CQ, rx_buf->pkt, RXM_LMT_ACK_SENT, RXM_LMT_FINISH);
 	rx_buf->hdr.state = RXM_LMT_FINISH;
 	if (!rx_buf->ep->rxm_mr_local)
-		rxm_ep_msg_mr_closev(rx_buf->mr, rx_buf->recv_entry->rxm_iov.count);
+		rxm_lmt_mr_closev(rx_buf->ep, rx_buf->mr,
+				  rx_buf->recv_entry->rxm_iov.count);
 	return rxm_finish_recv(rx_buf, rx_buf->recv_entry->total_len);
 }
 
@@ -281,9 +288,11 @@ static int rxm_lmt_tx_finish(struct rxm_tx_entry *tx_entry)
 
 	RXM_LOG_STATE_TX(FI_LOG_CQ, tx_entry, RXM_LMT_FINISH);
 	tx_entry->state = RXM_LMT_FINISH;
+	rxm_conn_update_bw(tx_entry->conn, tx_entry->tx_buf->pkt.hdr.size,
+			   tx_entry->start, 1);
 
 	if (!tx_entry->ep->rxm_mr_local)
-		rxm_ep_msg_mr_closev(tx_entry->mr, tx_entry->count);
+		rxm_lmt_mr_closev(tx_entry->ep, tx_entry->mr, tx_entry->count);
 
 	ret = rxm_finish_send(tx_entry);
 	if (ret)
@@ -337,10 +346,10 @@ ssize_t rxm_cq_handle_large_data(struct rxm_rx_buf *rx_buf)
 	rx_buf->index = 0;
 
 	if (!rx_buf->ep->rxm_mr_local) {
-		ret = rxm_ep_msg_mr_regv(rx_buf->ep,
-					 rx_buf->recv_entry->rxm_iov.iov,
-					 rx_buf->recv_entry->rxm_iov.count,
-					 FI_READ, rx_buf->mr);
+		ret = rxm_lmt_mr_regv(rx_buf->ep,
+				      rx_buf->recv_entry->rxm_iov.iov,
+				      rx_buf->recv_entry->rxm_iov.count,
+				      FI_READ, rx_buf->mr);
 		if (OFI_UNLIKELY(ret))
 			return ret;
 
@@ -371,11 +380,129 @@ ssize_t rxm_cq_handle_data(struct rxm_rx_buf *rx_buf)
 	return rxm_finish_recv(rx_buf, done_len);
 }
 
+/*
+ * The first segment of a SAR message stays on its connection's
+ * sar_rx_msg_list until the whole message has arrived.  It tracks the
+ * message, and holds the segments that arrive before it is matched.
+ */
+static int rxm_sar_rx_init(struct rxm_rx_buf *rx_buf)
+{
+	if (!rx_buf->conn) {
+		rx_buf->conn = rxm_key2conn(rx_buf->ep,
+					    rx_buf->pkt.ctrl_hdr.conn_id);
+		if (OFI_UNLIKELY(!rx_buf->conn))
+			return -FI_EOTHER;
+	}
+
+	/* Left from the previous message the buffer received; segments are
+	 * held rather than copied until the first one is matched */
+	rx_buf->recv_entry = NULL;
+	dlist_init(&rx_buf->sar_seg_list);
+	rx_buf->sar_recv_len = 0;
+	rx_buf->sar_discard = 0;
+	dlist_insert_tail(&rx_buf->sar_entry, &rx_buf->conn->sar_rx_msg_list);
+	return FI_SUCCESS;
+}
+
+/* Copies a segment into the receive buffer matched by the first segment */
+static void rxm_sar_rx_seg(struct rxm_rx_buf *first, struct rxm_rx_buf *seg)
+{
+	size_t seg_size = seg->pkt.ctrl_hdr.seg_size;
+	uint64_t offset = (uint64_t)seg->pkt.ctrl_hdr.seg_no * seg_size;
+	size_t len;
+
+	assert(offset < first->pkt.hdr.size);
+	len = MIN(seg_size, first->pkt.hdr.size - offset);
+
+	if (first->recv_entry)
+		first->recv_entry->total_recv_len +=
+			ofi_copy_to_iov(first->recv_entry->rxm_iov.iov,
+					first->recv_entry->rxm_iov.count,
+					offset, seg->pkt.data, len);
+	first->sar_recv_len += len;
+
+	if (seg != first)
+		dlist_insert_tail(&seg->repost_entry,
+				  &seg->ep->repost_ready_list);
+}
+
+static int rxm_sar_rx_check_done(struct rxm_rx_buf *first)
+{
+	if (first->sar_recv_len < first->pkt.hdr.size)
+		return FI_SUCCESS;
+
+	dlist_remove(&first->sar_entry);
+	if (first->sar_discard) {
+		dlist_insert_tail(&first->repost_entry,
+				  &first->ep->repost_ready_list);
+		return FI_SUCCESS;
+	}
+	return rxm_finish_recv(first, first->recv_entry->total_recv_len);
+}
+
+static void rxm_sar_rx_held_segs(struct rxm_rx_buf *first)
+{
+	struct rxm_rx_buf *seg;
+
+	while (!dlist_empty(&first->sar_seg_list)) {
+		dlist_pop_front(&first->sar_seg_list, struct rxm_rx_buf,
+				seg, sar_entry);
+		rxm_sar_rx_seg(first, seg);
+	}
+}
+
+static inline ssize_t rxm_cq_handle_seg_data(struct rxm_rx_buf *rx_buf)
+{
+	rx_buf->recv_entry->total_recv_len = 0;
+	rxm_sar_rx_seg(rx_buf, rx_buf);
+	rxm_sar_rx_held_segs(rx_buf);
+	return rxm_sar_rx_check_done(rx_buf);
+}
+
+void rxm_sar_rx_discard(struct rxm_rx_buf *rx_buf)
+{
+	rx_buf->sar_discard = 1;
+	rxm_sar_rx_seg(rx_buf, rx_buf);
+	rxm_sar_rx_held_segs(rx_buf);
+	(void) rxm_sar_rx_check_done(rx_buf);
+}
+
+static ssize_t rxm_sar_handle_segment(struct rxm_rx_buf *rx_buf)
+{
+	struct rxm_rx_buf *first;
+	struct rxm_conn *conn;
+
+	conn = rxm_key2conn(rx_buf->ep, rx_buf->pkt.ctrl_hdr.conn_id);
+	if (OFI_UNLIKELY(!conn))
+		return -FI_EOTHER;
+
+	dlist_foreach_container(&conn->sar_rx_msg_list, struct rxm_rx_buf,
+				first, sar_entry) {
+		if (first->pkt.ctrl_hdr.msg_id != rx_buf->pkt.ctrl_hdr.msg_id)
+			continue;
+
+		if (!first->recv_entry && !first->sar_discard) {
+			dlist_insert_tail(&rx_buf->sar_entry,
+					  &first->sar_seg_list);
+			return FI_SUCCESS;
+		}
+		rxm_sar_rx_seg(first, rx_buf);
+		return rxm_sar_rx_check_done(first);
+	}
+
+	FI_WARN(&rxm_prov, FI_LOG_CQ, "Unknown SAR msg_id: 0x%" PRIx64 "\n",
+		rx_buf->pkt.ctrl_hdr.msg_id);
+	return -FI_EOTHER;
+}
+
 ssize_t rxm_cq_handle_rx_buf(struct rxm_rx_buf *rx_buf)
 {
-	if (OFI_LIKELY(rx_buf->pkt.ctrl_hdr.type == ofi_ctrl_data)) {
+	switch (rx_buf->pkt.ctrl_hdr.type) {
+	case ofi_ctrl_data:
 		return rxm_cq_handle_data(rx_buf);
-	} else {
+	case ofi_ctrl_seg_data:
+		return rxm_cq_handle_seg_data(rx_buf);
+	default:
 		assert(rx_buf->pkt.ctrl_hdr.type == ofi_ctrl_large_data);
 		return rxm_cq_handle_large_data(rx_buf);
 	}
@@ -384,44 +511,46 @@ ssize_t rxm_cq_handle_rx_buf(struct rxm_rx_buf *rx_buf)
 static inline ssize_t
 rxm_cq_match_rx_buf(struct rxm_rx_buf *rx_buf,
 		    struct rxm_recv_queue *recv_queue,
-		    struct rxm_recv_match_attr *match_attr)
+		    fi_addr_t addr, uint64_t tag)
 {
-	struct dlist_entry *entry;
+	struct rxm_recv_entry *recv_entry;
 
 	rx_buf->ep->res_fastlock_acquire(&recv_queue->lock);
-	entry = dlist_remove_first_match(&recv_queue->recv_list,
-					 recv_queue->match_recv, match_attr);
-	if (!entry) {
+	recv_entry = rxm_recv_entry_match(recv_queue, addr, tag);
+	if (!recv_entry) {
 		RXM_DBG_ADDR_TAG(FI_LOG_CQ, "No matching recv found for "
-				 "incoming msg", match_attr->addr,
-				 match_attr->tag);
+				 "incoming msg", addr, tag);
 		FI_DBG(&rxm_prov, FI_LOG_CQ, "Enqueueing msg to unexpected msg"
 		       "queue\n");
-		rx_buf->unexp_msg.addr = match_attr->addr;
-		rx_buf->unexp_msg.tag = match_attr->tag;
-		dlist_insert_tail(&rx_buf->unexp_msg.entry,
-				  &recv_queue->unexp_msg_list);
+		rx_buf->unexp_msg.addr = addr;
+		rx_buf->unexp_msg.tag = tag;
+		rxm_unexp_msg_insert(recv_queue, rx_buf);
 		rx_buf->ep->res_fastlock_release(&recv_queue->lock);
 		return 0;
 	}
 	rx_buf->ep->res_fastlock_release(&recv_queue->lock);
 
-	rx_buf->recv_entry = container_of(entry, struct rxm_recv_entry, entry);
+	rx_buf->recv_entry = recv_entry;
 	return rxm_cq_handle_rx_buf(rx_buf);
 }
 
 static inline ssize_t rxm_handle_recv_comp(struct rxm_rx_buf *rx_buf)
 {
-	struct rxm_recv_match_attr match_attr = {
-		.addr = FI_ADDR_UNSPEC,
-	};
+	fi_addr_t addr = FI_ADDR_UNSPEC;
+	ssize_t ret;
+
+	if (rx_buf->pkt.ctrl_hdr.type == ofi_ctrl_seg_data) {
+		ret = rxm_sar_rx_init(rx_buf);
+		if (OFI_UNLIKELY(ret))
+			return ret;
+	}
 
 	if (rx_buf->ep->rxm_info->caps & (FI_SOURCE | FI_DIRECTED_RECV)) {
 		rx_buf->conn =
 			rxm_key2conn(rx_buf->ep, rx_buf->pkt.ctrl_hdr.conn_id);
 		if (OFI_UNLIKELY(!rx_buf->conn))
 			return -FI_EOTHER;
-		match_attr.addr = rx_buf->conn->handle.fi_addr;
+		addr = rx_buf->conn->handle.fi_addr;
 
 		if (rx_buf->ep->rxm_info->caps & FI_SOURCE)
 			rx_buf->ep->util_ep.rx_cq->src[
@@ -433,12 +562,11 @@ static inline ssize_t rxm_handle_recv_comp(struct rxm_rx_buf *rx_buf)
 	case ofi_op_msg:
 		FI_DBG(&rxm_prov, FI_LOG_CQ, "Got MSG op\n");
 		return rxm_cq_match_rx_buf(rx_buf, &rx_buf->ep->recv_queue,
-					   &match_attr);
+					   addr, 0);
 	case ofi_op_tagged:
 		FI_DBG(&rxm_prov, FI_LOG_CQ, "Got TAGGED op\n");
-		match_attr.tag = rx_buf->pkt.hdr.tag;
 		return rxm_cq_match_rx_buf(rx_buf, &rx_buf->ep->trecv_queue,
-					   &match_attr);
+					   addr, rx_buf->pkt.hdr.tag);
 	default:
 		FI_WARN(&rxm_prov, FI_LOG_CQ, "Unknown op!\n");
 		assert(0);
@@ -477,14 +605,20 @@ static ssize_t rxm_lmt_send_ack(struct rxm_rx_buf *rx_buf)
 	tx_buf->pkt.ctrl_hdr.conn_id 	= rx_buf->conn->handle.remote_key;
 	tx_buf->pkt.ctrl_hdr.msg_id 	= rx_buf->pkt.ctrl_hdr.msg_id;
 
-	ret = fi_send(rx_buf->conn->msg_ep, &tx_buf->pkt, sizeof(tx_buf->pkt),
-		      tx_buf->hdr.desc, 0, tx_entry);
+	ret = rxm_conn_get_credit(rx_buf->conn, RXM_CREDITS_RSVD);
+	if (OFI_UNLIKELY(ret))
+		goto err2;
+
+	ret = rxm_conn_msg_send(rx_buf->conn, &tx_buf->pkt, sizeof(tx_buf->pkt),
+				tx_buf->hdr.desc, tx_entry);
 	if (OFI_UNLIKELY(ret)) {
-		FI_WARN(&rxm_prov, FI_LOG_CQ, "Unable to send ACK\n");
+		if (ret != -FI_EAGAIN)
+			FI_WARN(&rxm_prov, FI_LOG_CQ, "Unable to send ACK\n");
 		goto err2;
 	}
 	return 0;
 err2:
+	rx_buf->hdr.state = RXM_LMT_READ;
 	rxm_tx_entry_release(&rx_buf->ep->send_queue, tx_entry);
 err1:
 	rxm_tx_buf_release(rx_buf->ep, tx_buf);
@@ -498,8 +632,12 @@ static ssize_t rxm_lmt_send_ack_fast(struct rxm_rx_buf *rx_buf)
 
 	assert(rx_buf->conn);
 
+	if (rxm_conn_get_credit(rx_buf->conn, RXM_CREDITS_RSVD))
+		return -FI_EAGAIN;
+
 	RXM_LOG_STATE(FI_LOG_CQ, rx_buf->pkt, RXM_LMT_READ, RXM_LMT_ACK_SENT);
 
+	memset(&pkt, 0, sizeof(pkt));
 	pkt.hdr.op		= ofi_op_msg;
 	pkt.hdr.version		= OFI_OP_VERSION;
 	pkt.ctrl_hdr.version	= RXM_CTRL_VERSION;
@@ -507,7 +645,7 @@ static ssize_t rxm_lmt_send_ack_fast(struct rxm_rx_buf *rx_buf)
 	pkt.ctrl_hdr.conn_id 	= rx_buf->conn->handle.remote_key;
 	pkt.ctrl_hdr.msg_id 	= rx_buf->pkt.ctrl_hdr.msg_id;
 
-	ret = fi_inject(rx_buf->conn->msg_ep, &pkt, sizeof(pkt), 0);
+	ret = rxm_conn_msg_inject(rx_buf->conn, &pkt, sizeof(pkt));
 	if (OFI_UNLIKELY(ret)) {
 		FI_DBG(&rxm_prov, FI_LOG_EP_DATA,
 		       "fi_inject(ack pkt) for MSG provider failed\n");
@@ -517,9 +655,229 @@ static ssize_t rxm_lmt_send_ack_fast(struct rxm_rx_buf *rx_buf)
 	return rxm_finish_send_lmt_ack(rx_buf);
 }
 
+/* Acks the connection has no credits or the MSG EP no room for are sent
+ * from progress */
+static ssize_t rxm_lmt_ack(struct rxm_rx_buf *rx_buf)
+{
+	ssize_t ret;
+
+	if (sizeof(rx_buf->pkt) > rx_buf->ep->msg_info->tx_attr->inject_size)
+		ret = rxm_lmt_send_ack(rx_buf);
+	else
+		ret = rxm_lmt_send_ack_fast(rx_buf);
+
+	if (ret == -FI_EAGAIN) {
+		dlist_insert_tail(&rx_buf->repost_entry,
+				  &rx_buf->ep->lmt_ack_deferred_list);
+		return 0;
+	}
+	return ret;
+}
+
+/*
+ * Buffers posted to a connection's MSG EP are taken from the domain's pool
+ * and stay on the endpoint's post_rx_list until returned to it.  Past the
+ * pool's watermark buffers are only taken to keep RXM_RX_CREDITS_MIN
+ * posted per connection, so that none of them runs out of credits.
+ */
+static struct rxm_rx_buf *
+rxm_rx_buf_get_posted(struct rxm_ep *rxm_ep, int force)
+{
+	struct rxm_domain *rxm_domain = container_of(rxm_ep->util_ep.domain,
+						     struct rxm_domain,
+						     util_domain);
+	struct rxm_rx_buf *rx_buf = NULL;
+
+	fastlock_acquire(&rxm_domain->rx_pool_lock);
+	if (force || (rxm_domain->rx_pool_used < rxm_domain->rx_pool_max)) {
+		rx_buf = rxm_rx_buf_alloc(rxm_domain);
+		if (rx_buf)
+			dlist_insert_tail(&rx_buf->entry,
+					  &rxm_ep->post_rx_list);
+	}
+	fastlock_release(&rxm_domain->rx_pool_lock);
+
+	if (rx_buf)
+		rx_buf->ep = rxm_ep;
+	return rx_buf;
+}
+
+static void rxm_rx_buf_release_posted(struct rxm_rx_buf *rx_buf)
+{
+	struct rxm_domain *rxm_domain = container_of(rx_buf->ep->util_ep.domain,
+						     struct rxm_domain,
+						     util_domain);
+
+	fastlock_acquire(&rxm_domain->rx_pool_lock);
+	dlist_remove(&rx_buf->entry);
+	rxm_rx_buf_free(rxm_domain, rx_buf);
+	fastlock_release(&rxm_domain->rx_pool_lock);
+}
+
+static inline int rxm_ep_repost_buf(struct rxm_rx_buf *rx_buf)
+{
+	struct rxm_conn *rxm_conn = rx_buf->conn;
+
+	/* Buffer of a message that came with a connection request */
+	if (OFI_UNLIKELY(!rx_buf->hdr.msg_ep)) {
+		rxm_rx_buf_release(rx_buf->ep, rx_buf);
+		return FI_SUCCESS;
+	}
+
+	/* Buffers of a shared receive context aren't tied to a connection.
+	 * Otherwise the buffer goes back to the pool if its connection was
+	 * replenished while it was in use */
+	if (rx_buf->ep->srx_ctx) {
+		rx_buf->conn = NULL;
+	} else if (rxm_conn->rx_posted >= rx_buf->ep->rx_credits) {
+		rxm_rx_buf_release_posted(rx_buf);
+		return FI_SUCCESS;
+	}
+
+	rx_buf->hdr.state = RXM_RX;
+
+	if (fi_recv(rx_buf->hdr.msg_ep, &rx_buf->pkt, rx_buf->ep->eager_pkt_size,
+		    rx_buf->hdr.desc, FI_ADDR_UNSPEC, rx_buf)) {
+		FI_WARN(&rxm_prov, FI_LOG_EP_CTRL, "Unable to repost buf\n");
+		return -FI_EAVAIL;
+	}
+	if (!rx_buf->ep->srx_ctx) {
+		rxm_conn->rx_posted++;
+		ofi_atomic_inc32(&rxm_conn->rx_owed);
+	}
+	return FI_SUCCESS;
+}
+
+int rxm_ep_prepost_buf(struct rxm_ep *rxm_ep, struct fid_ep *msg_ep)
+{
+	struct rxm_rx_buf *rx_buf;
+	int ret;
+	size_t i;
+
+	for (i = 0; i < rxm_ep->msg_info->rx_attr->size; i++) {
+		rx_buf = rxm_rx_buf_get_posted(rxm_ep, 1);
+		if (OFI_UNLIKELY(!rx_buf))
+			return -FI_ENOMEM;
+
+		rx_buf->hdr.msg_ep = msg_ep;
+		ret = rxm_ep_repost_buf(rx_buf);
+		if (ret) {
+			rxm_rx_buf_release_posted(rx_buf);
+			return ret;
+		}
+	}
+	return 0;
+}
+
+/* Posts receive buffers to a connection until it holds its credits */
+int rxm_conn_post_rx(struct rxm_ep *rxm_ep, struct rxm_conn *rxm_conn,
+		     struct fid_ep *msg_ep)
+{
+	struct rxm_rx_buf *rx_buf;
+	int ret;
+
+	while (rxm_conn->rx_posted < rxm_ep->rx_credits) {
+		rx_buf = rxm_rx_buf_get_posted(rxm_ep, rxm_conn->rx_posted <
+						      RXM_RX_CREDITS_MIN);
+		if (!rx_buf)
+			return rxm_conn->rx_posted ? 0 : -FI_ENOMEM;
+
+		rx_buf->hdr.msg_ep = msg_ep;
+		rx_buf->conn = rxm_conn;
+		ret = rxm_ep_repost_buf(rx_buf);
+		if (ret) {
+			rxm_rx_buf_release_posted(rx_buf);
+			return ret;
+		}
+	}
+	return 0;
+}
+
+/* Returns the buffers posted to a connection whose MSG EPs are closed */
+void rxm_conn_release_rx(struct rxm_ep *rxm_ep, struct rxm_conn *rxm_conn)
+{
+	struct rxm_domain *rxm_domain = container_of(rxm_ep->util_ep.domain,
+						     struct rxm_domain,
+						     util_domain);
+	struct rxm_rx_buf *rx_buf;
+	struct dlist_entry *tmp;
+
+	/* Buffers still held by messages are released along with the
+	 * endpoint */
+	if (rxm_ep->srx_ctx || rxm_conn->rx_held)
+		return;
+
+	fastlock_acquire(&rxm_domain->rx_pool_lock);
+	dlist_foreach_container_safe(&rxm_ep->post_rx_list, struct rxm_rx_buf,
+				     rx_buf, entry, tmp) {
+		if (rx_buf->conn != rxm_conn)
+			continue;
+		dlist_remove(&rx_buf->entry);
+		rxm_rx_buf_free(rxm_domain, rx_buf);
+	}
+	fastlock_release(&rxm_domain->rx_pool_lock);
+	rxm_conn->rx_posted = 0;
+}
+
+/* Queues a credit message once the peer may run short of credits */
+static inline void rxm_conn_check_credits(struct rxm_ep *rxm_ep,
+					  struct rxm_conn *rxm_conn)
+{
+	if (OFI_LIKELY(!rxm_conn_owes_credits(rxm_conn)))
+		return;
+
+	fastlock_acquire(&rxm_ep->util_ep.cmap->lock);
+	rxm_conn_queue_credit(rxm_ep, rxm_conn);
+	fastlock_release(&rxm_ep->util_ep.cmap->lock);
+}
+
+/* Credits returned by the peer in the header of a message */
+static inline void rxm_conn_add_credits(struct rxm_rx_buf *rx_buf)
+{
+	struct rxm_conn *rxm_conn = rx_buf->conn;
+
+	if (OFI_LIKELY(!rx_buf->pkt.hdr.rx_index) || !rx_buf->hdr.msg_ep)
+		return;
+
+	if (!rxm_conn) {
+		rxm_conn = rxm_key2conn(rx_buf->ep, rx_buf->pkt.ctrl_hdr.conn_id);
+		if (OFI_UNLIKELY(!rxm_conn))
+			return;
+	}
+	if (rxm_conn->tx_flow_ctrl)
+		ofi_atomic_add32(&rxm_conn->tx_credits,
+				 rx_buf->pkt.hdr.rx_index);
+}
+
+/*
+ * A connection whose buffers are held by unexpected, SAR or rendezvous
+ * messages is replenished from the pool once few are left posted.
+ */
+static inline void rxm_conn_rx_consumed(struct rxm_rx_buf *rx_buf)
+{
+	struct rxm_conn *rxm_conn = rx_buf->conn;
+
+	if (rx_buf->ep->srx_ctx || !rx_buf->hdr.msg_ep)
+		return;
+
+	/* Receiving keeps the connection from being evicted as well */
+	if (OFI_UNLIKELY(rx_buf->ep->util_ep.cmap->attr.max_conn))
+		rxm_conn->handle.last_use = fi_gettime_ms();
+
+	rxm_conn->rx_held++;
+	if (--rxm_conn->rx_posted < MAX(rx_buf->ep->rx_credits / 4 + 1,
+					RXM_RX_CREDITS_MIN))
+		(void) rxm_conn_post_rx(rx_buf->ep, rxm_conn,
+					rx_buf->hdr.msg_ep);
+	/* The peer may be short of credits with fewer buffers posted even if
+	 * none were reposted */
+	rxm_conn_check_credits(rx_buf->ep, rxm_conn);
+}
+
 static int rxm_handle_remote_write(struct rxm_ep *rxm_ep,
 				   struct fi_cq_data_entry *comp)
 {
+	struct rxm_rx_buf *rx_buf;
 	int ret;
 
 	FI_DBG(&rxm_prov, FI_LOG_CQ, "writing remote write completion\n");
@@ -531,10 +889,79 @@ static int rxm_handle_remote_write(struct rxm_ep *rxm_ep,
 		return ret;
 	}
 	rxm_cntr_inc(rxm_ep->util_ep.rem_wr_cntr);
-	if (comp->op_context)
-		dlist_insert_tail(&((struct rxm_rx_buf *)
-					comp->op_context)->repost_entry,
+	if (comp->op_context) {
+		rx_buf = comp->op_context;
+		rxm_conn_rx_consumed(rx_buf);
+		/* The writer took no credit for the buffer, so reposting it
+		 * returns none */
+		if (!rxm_ep->srx_ctx)
+			ofi_atomic_dec32(&rx_buf->conn->rx_owed);
+		dlist_insert_tail(&rx_buf->repost_entry,
 				  &rxm_ep->repost_ready_list);
+	}
+	return 0;
+}
+
+static inline void rxm_cq_repost_rx_buffers(struct rxm_ep *rxm_ep)
+{
+	struct rxm_rx_buf *buf;
+	while (!dlist_empty(&rxm_ep->repost_ready_list)) {
+		dlist_pop_front(&rxm_ep->repost_ready_list, struct rxm_rx_buf,
+				buf, repost_entry);
+		if (rxm_ep->srx_ctx || !buf->hdr.msg_ep) {
+			(void) rxm_ep_repost_buf(buf);
+			continue;
+		}
+		buf->conn->rx_held--;
+		if (!rxm_ep_repost_buf(buf))
+			rxm_conn_check_credits(rxm_ep, buf->conn);
+	}
+}
+
+/*
+ * Close messages of util_cmap_evict_idle.  Buffers consumed by the
+ * messages handled before are reposted first, so that they don't keep the
+ * connection from being found idle.
+ */
+static int rxm_cq_handle_close(struct rxm_rx_buf *rx_buf)
+{
+	struct rxm_ep *rxm_ep = rx_buf->ep;
+	struct util_cmap *cmap = rxm_ep->util_ep.cmap;
+	struct rxm_conn *rxm_conn;
+	uint64_t conn_id = rx_buf->pkt.ctrl_hdr.conn_id;
+	uint8_t type = rx_buf->pkt.ctrl_hdr.type;
+
+	dlist_insert_tail(&rx_buf->repost_entry, &rxm_ep->repost_ready_list);
+	rxm_cq_repost_rx_buffers(rxm_ep);
+
+	rxm_conn = rxm_key2conn(rxm_ep, conn_id);
+	if (OFI_UNLIKELY(!rxm_conn))
+		return 0;
+
+	fastlock_acquire(&cmap->lock);
+	switch (type) {
+	case ofi_ctrl_close_req:
+		/* Both sides asked, ours hasn't been sent yet */
+		if (!dlist_empty(&rxm_conn->close_entry) &&
+		    (rxm_conn->close_type == ofi_ctrl_close_req)) {
+			dlist_remove_init(&rxm_conn->close_entry);
+			ofi_cmap_process_close_resp(cmap, &rxm_conn->handle, 0);
+		}
+		rxm_conn_queue_close(rxm_ep, rxm_conn,
+				     ofi_cmap_process_close_req(cmap,
+							&rxm_conn->handle) ?
+				     ofi_ctrl_close_nack : ofi_ctrl_close_ack);
+		break;
+	case ofi_ctrl_close_ack:
+		if (ofi_cmap_process_close_resp(cmap, &rxm_conn->handle, 1))
+			rxm_conn_queue_close(rxm_ep, rxm_conn,
+					     ofi_ctrl_close_nack);
+		break;
+	default:
+		assert(type == ofi_ctrl_close_nack);
+		ofi_cmap_process_close_resp(cmap, &rxm_conn->handle, 0);
+	}
+	fastlock_release(&cmap->lock);
 	return 0;
 }
 
@@ -554,26 +981,45 @@ static ssize_t rxm_cq_handle_comp(struct rxm_ep *rxm_ep,
 		assert(comp->flags & (FI_SEND | FI_WRITE | FI_READ));
 		if (tx_entry->ep->msg_mr_local && !tx_entry->ep->rxm_mr_local)
 			rxm_ep_msg_mr_closev(tx_entry->mr, tx_entry->count);
+		ofi_atomic_dec32(&tx_entry->conn->rma_pending);
 		return rxm_finish_send_nobuf(tx_entry);
 	case RXM_TX:
 		assert(comp->flags & FI_SEND);
+		if (OFI_UNLIKELY(tx_entry->start))
+			rxm_conn_update_bw(tx_entry->conn,
+					   tx_entry->tx_buf->pkt.hdr.size,
+					   tx_entry->start, 0);
 		return rxm_finish_send(tx_entry);
 	case RXM_SAR_TX:
 		assert(comp->flags & FI_SEND);
-		return rxm_finish_sar_segment_send(tx_entry);
+		return rxm_finish_sar_segment_send(comp->op_context);
 	case RXM_TX_RMA:
 		assert(comp->flags & (FI_WRITE | FI_READ));
 		if (tx_entry->ep->msg_mr_local && !tx_entry->ep->rxm_mr_local)
 			rxm_ep_msg_mr_closev(tx_entry->mr, tx_entry->count);
 		rxm_rma_buf_release(rxm_ep, tx_entry->rma_buf);
+		ofi_atomic_dec32(&tx_entry->conn->rma_pending);
 		return rxm_finish_send_nobuf(tx_entry);
 	case RXM_RX:
 		assert(!(comp->flags & FI_REMOTE_READ));
 		assert((rx_buf->pkt.hdr.version == OFI_OP_VERSION) &&
 		       (rx_buf->pkt.ctrl_hdr.version == RXM_CTRL_VERSION));
+		rxm_conn_rx_consumed(rx_buf);
+		rxm_conn_add_credits(rx_buf);
 
 		if (rx_buf->pkt.ctrl_hdr.type == ofi_ctrl_ack)
 			return rxm_lmt_handle_ack(rx_buf);
+		else if (OFI_UNLIKELY(rx_buf->pkt.ctrl_hdr.type ==
+				      ofi_ctrl_credit)) {
+			dlist_insert_tail(&rx_buf->repost_entry,
+					  &rxm_ep->repost_ready_list);
+			return 0;
+		} else if (OFI_UNLIKELY(rx_buf->pkt.ctrl_hdr.type >=
+				      ofi_ctrl_close_req))
+			return rxm_cq_handle_close(rx_buf);
+		else if ((rx_buf->pkt.ctrl_hdr.type == ofi_ctrl_seg_data) &&
+			 rx_buf->pkt.ctrl_hdr.seg_no)
+			return rxm_sar_handle_segment(rx_buf);
 		else
 			return rxm_handle_recv_comp(rx_buf);
 	case RXM_LMT_TX:
@@ -588,10 +1034,8 @@ static ssize_t rxm_cq_handle_comp(struct rxm_ep *rxm_ep,
 		assert(comp->flags & FI_READ);
 		if (rx_buf->index < rx_buf->rma_iov->count)
 			return rxm_lmt_rma_read(rx_buf);
-		else if (sizeof(rx_buf->pkt) > rxm_ep->msg_info->tx_attr->inject_size)
-			return rxm_lmt_send_ack(rx_buf);
 		else
-			return rxm_lmt_send_ack_fast(rx_buf);
+			return rxm_lmt_ack(rx_buf);
 	case RXM_LMT_ACK_SENT:
 		assert(comp->flags & FI_SEND);
 		rx_buf = tx_entry->context;
@@ -689,6 +1133,9 @@ static void rxm_cq_read_write_error(struct rxm_ep *rxm_ep)
 				util_cntr = tx_entry->ep->util_ep.rd_cntr;
 		}
 		break;
+	case RXM_SAR_TX:
+		rxm_ep_sar_tx_seg_error(err_entry.op_context, -err_entry.err);
+		return;
 	case RXM_LMT_ACK_SENT:
 		tx_entry = (struct rxm_tx_entry *)err_entry.op_context;
 		util_cq = tx_entry->ep->util_ep.rx_cq;
@@ -717,57 +1164,11 @@ static void rxm_cq_read_write_error(struct rxm_ep *rxm_ep)
 	}
 }
 
-static inline int rxm_ep_repost_buf(struct rxm_rx_buf *rx_buf)
-{
-	rx_buf->conn = NULL;
-	rx_buf->hdr.state = RXM_RX;
-
-	if (fi_recv(rx_buf->hdr.msg_ep, &rx_buf->pkt, rx_buf->ep->eager_pkt_size,
-		    rx_buf->hdr.desc, FI_ADDR_UNSPEC, rx_buf)) {
-		FI_WARN(&rxm_prov, FI_LOG_EP_CTRL, "Unable to repost buf\n");
-		return -FI_EAVAIL;
-	}
-	return FI_SUCCESS;
-}
-
-int rxm_ep_prepost_buf(struct rxm_ep *rxm_ep, struct fid_ep *msg_ep)
-{
-	struct rxm_rx_buf *rx_buf;
-	int ret;
-	size_t i;
-
-	for (i = 0; i < rxm_ep->msg_info->rx_attr->size; i++) {
-		rx_buf = rxm_rx_buf_get(rxm_ep);
-		if (OFI_UNLIKELY(!rx_buf))
-			return -FI_ENOMEM;
-
-		rx_buf->hdr.state = RXM_RX;
-		rx_buf->hdr.msg_ep = msg_ep;
-		ret = rxm_ep_repost_buf(rx_buf);
-		if (ret) {
-			rxm_rx_buf_release(rxm_ep, rx_buf);
-			return ret;
-		}
-		dlist_insert_tail(&rx_buf->entry, &rxm_ep->post_rx_list);
-	}
-	return 0;
-}
-
-static inline void rxm_cq_repost_rx_buffers(struct rxm_ep *rxm_ep)
-{
-	struct rxm_rx_buf *buf;
-	while (!dlist_empty(&rxm_ep->repost_ready_list)) {
-		dlist_pop_front(&rxm_ep->repost_ready_list, struct rxm_rx_buf,
-				buf, repost_entry);
-		(void) rxm_ep_repost_buf(buf);
-	}
-}
-
 static int rxm_cq_reprocess_directed_recvs(struct rxm_recv_queue *recv_queue)
 {
 	struct rxm_rx_buf *rx_buf;
-	struct dlist_entry *entry, *tmp_entry;
-	struct rxm_recv_match_attr match_attr;
+	struct rxm_recv_entry *recv_entry;
+	struct dlist_entry *tmp_entry;
 	struct dlist_entry rx_buf_list;
 	struct fi_cq_err_entry err_entry = {0};
 	int ret, count = 0;
@@ -784,19 +1185,17 @@ static int rxm_cq_reprocess_directed_recvs(struct rxm_recv_queue *recv_queue)
 
 		assert(rx_buf->unexp_msg.addr == FI_ADDR_NOTAVAIL);
 
-		match_attr.addr = rx_buf->unexp_msg.addr =
-			rx_buf->conn->handle.fi_addr;
-		match_attr.tag = rx_buf->unexp_msg.tag;
+		rxm_unexp_msg_set_addr(recv_queue, rx_buf,
+				       rx_buf->conn->handle.fi_addr);
 
-		entry = dlist_remove_first_match(&recv_queue->recv_list,
-						 recv_queue->match_recv,
-						 &match_attr);
-		if (!entry)
+		recv_entry = rxm_recv_entry_match(recv_queue,
+						  rx_buf->unexp_msg.addr,
+						  rx_buf->unexp_msg.tag);
+		if (!recv_entry)
 			continue;
 
-		dlist_remove(&rx_buf->unexp_msg.entry);
-		rx_buf->recv_entry = container_of(entry, struct rxm_recv_entry,
-						  entry);
+		rxm_unexp_msg_remove(rx_buf);
+		rx_buf->recv_entry = recv_entry;
 		dlist_insert_tail(&rx_buf->unexp_msg.entry, &rx_buf_list);
 	}
 	recv_queue->rxm_ep->res_fastlock_release(&recv_queue->lock);
@@ -846,6 +1245,47 @@ unlock:
 	return count;
 }
 
+static void rxm_cq_handle_cm_rx(struct rxm_ep *rxm_ep)
+{
+	struct fi_cq_data_entry comp = {
+		.flags = FI_RECV,
+	};
+	struct rxm_rx_buf *rx_buf;
+	ssize_t ret;
+
+	fastlock_acquire(&rxm_ep->util_ep.cmap->lock);
+	while (!dlist_empty(&rxm_ep->cm_rx_list)) {
+		dlist_pop_front(&rxm_ep->cm_rx_list, struct rxm_rx_buf,
+				rx_buf, entry);
+		fastlock_release(&rxm_ep->util_ep.cmap->lock);
+
+		comp.op_context = rx_buf;
+		comp.len = sizeof(rx_buf->pkt) + rx_buf->pkt.hdr.size;
+		ret = rxm_cq_handle_comp(rxm_ep, &comp);
+		if (OFI_UNLIKELY(ret))
+			rxm_cq_write_error_all(rxm_ep, ret);
+
+		fastlock_acquire(&rxm_ep->util_ep.cmap->lock);
+	}
+	fastlock_release(&rxm_ep->util_ep.cmap->lock);
+}
+
+static void rxm_lmt_progress_acks(struct rxm_ep *rxm_ep)
+{
+	struct rxm_rx_buf *rx_buf;
+	struct dlist_entry acks;
+	ssize_t ret;
+
+	dlist_init(&acks);
+	dlist_splice_tail(&acks, &rxm_ep->lmt_ack_deferred_list);
+	while (!dlist_empty(&acks)) {
+		dlist_pop_front(&acks, struct rxm_rx_buf, rx_buf, repost_entry);
+		ret = rxm_lmt_ack(rx_buf);
+		if (OFI_UNLIKELY(ret))
+			rxm_cq_write_error_all(rxm_ep, ret);
+	}
+}
+
 void rxm_ep_progress_one(struct util_ep *util_ep)
 {
 	struct rxm_ep *rxm_ep =
@@ -855,6 +1295,24 @@ void rxm_ep_progress_one(struct util_ep *util_ep)
 
 	rxm_cq_repost_rx_buffers(rxm_ep);
 
+	if (OFI_UNLIKELY(!dlist_empty(&rxm_ep->conn_credit_list)))
+		rxm_conn_progress_credits(rxm_ep);
+
+	if (OFI_UNLIKELY(!dlist_empty(&rxm_ep->cm_rx_list)))
+		rxm_cq_handle_cm_rx(rxm_ep);
+
+	if (OFI_UNLIKELY(!dlist_empty(&rxm_ep->lmt_ack_deferred_list)))
+		rxm_lmt_progress_acks(rxm_ep);
+
+	if (OFI_UNLIKELY(!dlist_empty(&rxm_ep->sar_deferred_list)))
+		rxm_ep_sar_tx_progress(rxm_ep);
+
+	if (OFI_UNLIKELY(ofi_cmap_over_limit(rxm_ep->util_ep.cmap)))
+		ofi_cmap_reap_idle(rxm_ep->util_ep.cmap);
+
+	if (OFI_UNLIKELY(!dlist_empty(&rxm_ep->conn_close_list)))
+		rxm_conn_progress_close(rxm_ep);
+
 	if (OFI_UNLIKELY(rxm_ep->util_ep.cmap->av_updated)) {
 		ret = rxm_cq_reprocess_recv_queues(rxm_ep);
 		if (ret > 0)
@@ -880,45 +1338,73 @@ void rxm_ep_progress_one(struct util_ep *util_ep)
 		rxm_cq_write_error_all(rxm_ep, ret);
 }
 
+/*
+ * Reads MSG CQ completions in arrays to pay the core provider's CQ locking
+ * once per batch.  Receive buffers freed while handling a batch are
+ * reposted together once all of it is handled.
+ */
 void rxm_ep_progress_multi(struct util_ep *util_ep)
 {
 	struct rxm_ep *rxm_ep =
 		container_of(util_ep, struct rxm_ep, util_ep);
-	struct fi_cq_data_entry comp;
-	ssize_t ret;
-	size_t comp_read = 0;
+	struct fi_cq_data_entry comp[RXM_MSG_CQ_READ_BATCH];
+	size_t comp_read = 0, count;
+	ssize_t ret, i;
+	int err = 0;
 
-	rxm_cq_repost_rx_buffers(rxm_ep);
+	if (OFI_UNLIKELY(!dlist_empty(&rxm_ep->cm_rx_list)))
+		rxm_cq_handle_cm_rx(rxm_ep);
+
+	if (OFI_UNLIKELY(!dlist_empty(&rxm_ep->lmt_ack_deferred_list)))
+		rxm_lmt_progress_acks(rxm_ep);
+
+	if (OFI_UNLIKELY(!dlist_empty(&rxm_ep->sar_deferred_list)))
+		rxm_ep_sar_tx_progress(rxm_ep);
+
+	if (OFI_UNLIKELY(ofi_cmap_over_limit(rxm_ep->util_ep.cmap)))
+		ofi_cmap_reap_idle(rxm_ep->util_ep.cmap);
+
+	if (OFI_UNLIKELY(!dlist_empty(&rxm_ep->conn_close_list)))
+		rxm_conn_progress_close(rxm_ep);
 
 	if (OFI_UNLIKELY(rxm_ep->util_ep.cmap->av_updated)) {
 		ret = rxm_cq_reprocess_recv_queues(rxm_ep);
 		if (ret > 0)
-			return;
+			goto repost;
 	}
 
 	do {
-		ret = fi_cq_read(rxm_ep->msg_cq, &comp, 1);
-		if (ret == -FI_EAGAIN)
-			return;
+		count = MIN(rxm_ep->comp_per_progress - comp_read,
+			    RXM_MSG_CQ_READ_BATCH);
+		ret = fi_cq_read(rxm_ep->msg_cq, comp, count);
+		if (ret == -FI_EAGAIN || !ret)
+			break;
 		if (OFI_UNLIKELY(ret < 0)) {
 			if (ret == -FI_EAVAIL)
 				rxm_cq_read_write_error(rxm_ep);
 			else
 				rxm_cq_write_error_all(rxm_ep, ret);
-			return;
+			break;
 		}
-		if (ret) {
+
+		/* Completions already read must all be handled */
+		for (i = 0; i < ret; i++) {
 			// TODO handle errors internally and make this function
 			// return void. we don't have enough info to write a
 			// good error entry to the CQ at this point
-			ret = rxm_cq_handle_comp(rxm_ep, &comp);
-			if (OFI_UNLIKELY(ret)) {
-				rxm_cq_write_error_all(rxm_ep, ret);
-				return;
-			}
-			comp_read++;
+			err = rxm_cq_handle_comp(rxm_ep, &comp[i]);
+			if (OFI_UNLIKELY(err))
+				rxm_cq_write_error_all(rxm_ep, err);
 		}
-	} while (comp_read < rxm_ep->comp_per_progress);
+		comp_read += ret;
+	} while (!err && (size_t) ret == count &&
+		 comp_read < rxm_ep->comp_per_progress);
+
+repost:
+	rxm_cq_repost_rx_buffers(rxm_ep);
+
+	if (OFI_UNLIKELY(!dlist_empty(&rxm_ep->conn_credit_list)))
+		rxm_conn_progress_credits(rxm_ep);
 }
 
 static int rxm_cq_close(struct fid *fid)
@@ -79,6 +79,237 @@ static struct fi_ops_domain rxm_domain_ops = {
 	.query_atomic = fi_no_query_atomic,
 };
 
+/*
+ * Rendezvous buffers are registered with the MSG provider on every large
+ * message unless the app supplies the registrations.  Those registrations
+ * are kept in an MR cache kept coherent by the userfaultfd monitor, so
+ * buffers that are reused skip the registration.  Cached regions are
+ * registered with the access needed by both sides of the protocol.  An
+ * MR registered by the cache carries its cache entry as fid context, which
+ * tells it apart from the direct registrations used for buffers the
+ * monitor cannot track (e.g. file-backed mappings).
+ */
+#define RXM_MR_CACHE_MAX_COUNT	1024
+#define RXM_MR_CACHE_ACCESS	(FI_READ | FI_REMOTE_READ)
+
+static int rxm_mr_cache_add_region(struct ofi_mr_cache *cache,
+				   struct ofi_mr_entry *entry)
+{
+	struct rxm_domain *rxm_domain =
+		container_of(cache, struct rxm_domain, mr_cache);
+
+	return fi_mr_reg(rxm_domain->msg_domain, entry->iov.iov_base,
+			 entry->iov.iov_len, RXM_MR_CACHE_ACCESS, 0, 0, 0,
+			 (struct fid_mr **) entry->data, entry);
+}
+
+static void rxm_mr_cache_delete_region(struct ofi_mr_cache *cache,
+				       struct ofi_mr_entry *entry)
+{
+	struct fid_mr *mr = *(struct fid_mr **) entry->data;
+
+	if (fi_close(&mr->fid))
+		FI_WARN(&rxm_prov, FI_LOG_DOMAIN,
+			"Unable to close cached MSG MR\n");
+}
+
+static void rxm_mr_cache_init(struct rxm_domain *rxm_domain)
+{
+	size_t max_cnt = RXM_MR_CACHE_MAX_COUNT, max_size = 0;
+	int ret;
+
+	fi_param_get_size_t(&rxm_prov, "mr_cache_max_count", &max_cnt);
+	fi_param_get_size_t(&rxm_prov, "mr_cache_max_size", &max_size);
+	if (!max_cnt)
+		return;
+
+	ret = ofi_uffd_init();
+	if (ret) {
+		FI_INFO(&rxm_prov, FI_LOG_DOMAIN, "No memory monitor, "
+			"rendezvous buffers are registered per message\n");
+		return;
+	}
+
+	rxm_domain->mr_cache.max_cached_cnt = max_cnt;
+	rxm_domain->mr_cache.max_cached_size = max_size;
+	rxm_domain->mr_cache.entry_data_size = sizeof(struct fid_mr *);
+	rxm_domain->mr_cache.add_region = rxm_mr_cache_add_region;
+	rxm_domain->mr_cache.delete_region = rxm_mr_cache_delete_region;
+	ret = ofi_mr_cache_init(&rxm_domain->util_domain, uffd_monitor,
+				&rxm_domain->mr_cache);
+	if (ret) {
+		FI_WARN(&rxm_prov, FI_LOG_DOMAIN,
+			"Unable to initialize MR cache\n");
+		ofi_uffd_cleanup();
+		return;
+	}
+
+	fastlock_init(&rxm_domain->mr_cache_lock);
+	rxm_domain->mr_cache_enabled = 1;
+}
+
+static void rxm_mr_cache_cleanup(struct rxm_domain *rxm_domain)
+{
+	if (!rxm_domain->mr_cache_enabled)
+		return;
+
+	ofi_mr_cache_cleanup(&rxm_domain->mr_cache);
+	fastlock_destroy(&rxm_domain->mr_cache_lock);
+	ofi_uffd_cleanup();
+	rxm_domain->mr_cache_enabled = 0;
+}
+
+int rxm_mr_cache_get_stats(struct rxm_domain *rxm_domain,
+			   struct fi_rxm_mr_cache_stats *stats)
+{
+	struct ofi_mr_cache *cache = &rxm_domain->mr_cache;
+
+	if (!rxm_domain->mr_cache_enabled)
+		return -FI_ENODATA;
+
+	fastlock_acquire(&rxm_domain->mr_cache_lock);
+	stats->hits = cache->hit_cnt;
+	stats->misses = cache->search_cnt - cache->hit_cnt;
+	stats->cached_cnt = cache->cached_cnt;
+	stats->cached_size = cache->cached_size;
+	fastlock_release(&rxm_domain->mr_cache_lock);
+	return 0;
+}
+
+void rxm_lmt_mr_closev(struct rxm_ep *rxm_ep, struct fid_mr **mr,
+		       size_t count)
+{
+	struct rxm_domain *rxm_domain =
+		container_of(rxm_ep->util_ep.domain, struct rxm_domain, util_domain);
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		if (!mr[i]->fid.context) {
+			rxm_ep_msg_mr_closev(&mr[i], 1);
+			continue;
+		}
+		fastlock_acquire(&rxm_domain->mr_cache_lock);
+		ofi_mr_cache_delete(&rxm_domain->mr_cache, mr[i]->fid.context);
+		fastlock_release(&rxm_domain->mr_cache_lock);
+	}
+}
+
+int rxm_lmt_mr_regv(struct rxm_ep *rxm_ep, const struct iovec *iov,
+		    size_t count, uint64_t access, struct fid_mr **mr)
+{
+	struct rxm_domain *rxm_domain =
+		container_of(rxm_ep->util_ep.domain, struct rxm_domain, util_domain);
+	struct ofi_mr_entry *entry;
+	struct fi_mr_attr attr = {
+		.iov_count = 1,
+		.access = RXM_MR_CACHE_ACCESS,
+	};
+	size_t i;
+	int ret;
+
+	if (!rxm_domain->mr_cache_enabled)
+		return rxm_ep_msg_mr_regv(rxm_ep, iov, count, access, mr);
+
+	for (i = 0; i < count; i++) {
+		if (iov[i].iov_len) {
+			attr.mr_iov = &iov[i];
+			fastlock_acquire(&rxm_domain->mr_cache_lock);
+			ret = ofi_mr_cache_search(&rxm_domain->mr_cache, &attr,
+						  &entry);
+			fastlock_release(&rxm_domain->mr_cache_lock);
+			if (!ret) {
+				mr[i] = *(struct fid_mr **) entry->data;
+				continue;
+			}
+		}
+
+		ret = fi_mr_reg(rxm_domain->msg_domain, iov[i].iov_base,
+				iov[i].iov_len, access, 0, 0, 0, &mr[i], NULL);
+		if (ret)
+			goto err;
+	}
+	return 0;
+err:
+	rxm_lmt_mr_closev(rxm_ep, mr, i);
+	return ret;
+}
+
+/*
+ * Receive buffers are shared by all endpoints of the domain, which post
+ * rx_credits of them to each of their connections and return those they
+ * no longer need.  Past the pool's watermark a connection is only topped
+ * up to RXM_RX_CREDITS_MIN, which peers wait for credits to send into, so
+ * the receive memory of a domain is bounded by the watermark plus a few
+ * buffers per connection.
+ */
+static int rxm_rx_pool_reg(void *pool_ctx, void *addr, size_t len,
+			   void **context)
+{
+	struct rxm_domain *rxm_domain = pool_ctx;
+	struct rxm_rx_buf *rx_buf;
+	struct fid_mr *mr = NULL;
+	size_t i;
+	int ret;
+
+	if (rxm_domain->msg_mr_local) {
+		ret = fi_mr_reg(rxm_domain->msg_domain, addr, len,
+				FI_SEND | FI_RECV | FI_READ | FI_WRITE,
+				0, 0, 0, &mr, NULL);
+		if (ret)
+			return ret;
+	}
+	*context = mr;
+
+	for (i = 0; i < rxm_domain->rx_pool->chunk_cnt; i++) {
+		rx_buf = (struct rxm_rx_buf *)((char *)addr +
+					       i * rxm_domain->rx_pool->entry_sz);
+		rx_buf->hdr.desc = mr ? fi_mr_desc(mr) : NULL;
+	}
+	return FI_SUCCESS;
+}
+
+static void rxm_rx_pool_close(void *pool_ctx, void *context)
+{
+	if (context && fi_close((struct fid *)context))
+		FI_WARN(&rxm_prov, FI_LOG_DOMAIN,
+			"Unable to close receive buffers MR\n");
+}
+
+static int rxm_rx_pool_init(struct rxm_domain *rxm_domain)
+{
+	int ret;
+
+	if (fi_param_get_size_t(&rxm_prov, "rx_pool_size",
+				&rxm_domain->rx_pool_max))
+		rxm_domain->rx_pool_max = RXM_RX_POOL_SIZE;
+
+	ret = util_buf_pool_create_ex(&rxm_domain->rx_pool,
+				      rxm_info.tx_attr->inject_size +
+				      sizeof(struct rxm_rx_buf), 16, 0,
+				      RXM_RX_CREDITS, rxm_rx_pool_reg,
+				      rxm_rx_pool_close, rxm_domain);
+	if (ret) {
+		FI_WARN(&rxm_prov, FI_LOG_DOMAIN,
+			"Unable to create receive buffer pool\n");
+		return -FI_ENOMEM;
+	}
+	fastlock_init(&rxm_domain->rx_pool_lock);
+	return 0;
+}
+
+static void rxm_rx_pool_cleanup(struct rxm_domain *rxm_domain)
+{
+	if (!rxm_domain->rx_pool)
+		return;
+
+	FI_INFO(&rxm_prov, FI_LOG_DOMAIN, "Receive buffers: %zu at most in "
+		"use (%zu bytes)\n", rxm_domain->rx_pool_peak,
+		rxm_domain->rx_pool_peak * rxm_domain->rx_pool->entry_sz);
+	util_buf_pool_destroy(rxm_domain->rx_pool);
+	fastlock_destroy(&rxm_domain->rx_pool_lock);
+	rxm_domain->rx_pool = NULL;
+}
+
 static int rxm_domain_close(fid_t fid)
 {
 	struct rxm_domain *rxm_domain;
@@ -86,6 +317,19 @@ static int rxm_domain_close(fid_t fid)
 
 	rxm_domain = container_of(fid, struct rxm_domain, util_domain.domain_fid.fid);
 
+	/* The MR cache holds a domain reference of its own */
+	if (ofi_atomic_get32(&rxm_domain->util_domain.ref) >
+	    rxm_domain->mr_cache_enabled)
+		return -FI_EBUSY;
+
+	/*
+	 * Registrations of the cache and of the receive pool are made on the
+	 * MSG domain, so they are released first.  Both cleanups may run
+	 * again if closing the MSG domain fails and the close is retried.
+	 */
+	rxm_mr_cache_cleanup(rxm_domain);
+	rxm_rx_pool_cleanup(rxm_domain);
+
 	ret = fi_close(&rxm_domain->msg_domain->fid);
 	if (ret)
 		return ret;
@@ -221,9 +465,18 @@ int rxm_domain_open(struct fid_fabric *fabric, struct fi_info *info,
 	(*domain)->ops = &rxm_domain_ops;
 
 	rxm_domain->mr_local = ofi_mr_local(msg_info) && !ofi_mr_local(info);
+	rxm_domain->msg_mr_local = ofi_mr_local(msg_info);
+
+	ret = rxm_rx_pool_init(rxm_domain);
+	if (ret)
+		goto err4;
+
+	rxm_mr_cache_init(rxm_domain);
 
 	fi_freeinfo(msg_info);
 	return 0;
+err4:
+	ofi_domain_close(&rxm_domain->util_domain);
 err3:
 	fi_close(&rxm_domain->msg_domain->fid);
 err2:
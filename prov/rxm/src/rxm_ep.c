@@ -39,68 +39,193 @@
 
 const size_t rxm_pkt_size = sizeof(struct rxm_pkt);
 
-static int rxm_match_noop(struct dlist_entry *item, const void *arg)
+static inline struct dlist_entry *
+rxm_hash_bucket(struct rxm_recv_queue *recv_queue, struct dlist_entry *table,
+		fi_addr_t addr, uint64_t tag)
 {
-	OFI_UNUSED(item);
-	OFI_UNUSED(arg);
-	return 1;
+	uint64_t hash;
+
+	if (!recv_queue->directed)
+		addr = FI_ADDR_UNSPEC;
+	hash = (tag ^ (addr * 0x9e3779b97f4a7c15ULL)) * 0x9e3779b97f4a7c15ULL;
+	return &table[(hash ^ (hash >> 32)) & recv_queue->hash_mask];
 }
 
-static int rxm_match_recv_entry(struct dlist_entry *item, const void *arg)
+static inline int rxm_match_recv_addr(struct rxm_recv_queue *recv_queue,
+				      fi_addr_t recv_addr, fi_addr_t addr)
 {
-	struct rxm_recv_match_attr *attr = (struct rxm_recv_match_attr *) arg;
-	struct rxm_recv_entry *recv_entry =
-		container_of(item, struct rxm_recv_entry, entry);
-	return rxm_match_addr(recv_entry->addr, attr->addr);
+	return !recv_queue->directed || rxm_match_addr(recv_addr, addr);
 }
 
-static int rxm_match_recv_entry_tag(struct dlist_entry *item, const void *arg)
+void rxm_recv_entry_insert(struct rxm_recv_queue *recv_queue,
+			   struct rxm_recv_entry *recv_entry)
 {
-	struct rxm_recv_match_attr *attr = (struct rxm_recv_match_attr *)arg;
-	struct rxm_recv_entry *recv_entry =
-		container_of(item, struct rxm_recv_entry, entry);
-	return rxm_match_tag(recv_entry->tag, recv_entry->ignore, attr->tag);
+	struct dlist_entry *list;
+
+	if (recv_entry->ignore)
+		list = &recv_queue->any_tag_list;
+	else if (recv_queue->directed && recv_entry->addr == FI_ADDR_UNSPEC)
+		list = &recv_queue->recv_list;
+	else
+		list = rxm_hash_bucket(recv_queue, recv_queue->recv_hash,
+				       recv_entry->addr, recv_entry->tag);
+
+	recv_entry->seq = recv_queue->seq++;
+	dlist_insert_tail(&recv_entry->entry, list);
 }
 
-static int rxm_match_recv_entry_tag_addr(struct dlist_entry *item, const void *arg)
+static inline void rxm_recv_entry_pick(struct rxm_recv_entry **match,
+				       struct rxm_recv_entry *recv_entry)
 {
-	struct rxm_recv_match_attr *attr = (struct rxm_recv_match_attr *)arg;
-	struct rxm_recv_entry *recv_entry =
-		container_of(item, struct rxm_recv_entry, entry);
-	return rxm_match_addr(recv_entry->addr, attr->addr) &&
-		rxm_match_tag(recv_entry->tag, recv_entry->ignore, attr->tag);
+	if (!*match || recv_entry->seq < (*match)->seq)
+		*match = recv_entry;
 }
 
-static int rxm_match_recv_entry_context(struct dlist_entry *item, const void *context)
+/* Removes and returns the oldest receive matching an incoming message */
+struct rxm_recv_entry *
+rxm_recv_entry_match(struct rxm_recv_queue *recv_queue, fi_addr_t addr,
+		     uint64_t tag)
 {
-	struct rxm_recv_entry *recv_entry =
-		container_of(item, struct rxm_recv_entry, entry);
-	return recv_entry->context == context;
+	struct rxm_recv_entry *recv_entry, *match = NULL;
+	struct dlist_entry *bucket;
+
+	bucket = rxm_hash_bucket(recv_queue, recv_queue->recv_hash, addr, tag);
+	dlist_foreach_container(bucket, struct rxm_recv_entry,
+				recv_entry, entry) {
+		if (recv_entry->tag == tag &&
+		    (!recv_queue->directed || recv_entry->addr == addr)) {
+			match = recv_entry;
+			break;
+		}
+	}
+
+	dlist_foreach_container(&recv_queue->recv_list, struct rxm_recv_entry,
+				recv_entry, entry) {
+		if (match && recv_entry->seq > match->seq)
+			break;
+		if (recv_entry->tag == tag) {
+			rxm_recv_entry_pick(&match, recv_entry);
+			break;
+		}
+	}
+
+	dlist_foreach_container(&recv_queue->any_tag_list,
+				struct rxm_recv_entry, recv_entry, entry) {
+		if (match && recv_entry->seq > match->seq)
+			break;
+		if (rxm_match_tag(recv_entry->tag, recv_entry->ignore, tag) &&
+		    rxm_match_recv_addr(recv_queue, recv_entry->addr, addr)) {
+			rxm_recv_entry_pick(&match, recv_entry);
+			break;
+		}
+	}
+
+	if (match)
+		dlist_remove(&match->entry);
+	return match;
 }
 
-static int rxm_match_unexp_msg(struct dlist_entry *item, const void *arg)
+static struct rxm_recv_entry *
+rxm_recv_list_find_ctx(struct dlist_entry *list, void *context)
 {
-	struct rxm_recv_match_attr *attr = (struct rxm_recv_match_attr *)arg;
-	struct rxm_unexp_msg *unexp_msg =
-		container_of(item, struct rxm_unexp_msg, entry);
-	return rxm_match_addr(attr->addr, unexp_msg->addr);
+	struct rxm_recv_entry *recv_entry;
+
+	dlist_foreach_container(list, struct rxm_recv_entry,
+				recv_entry, entry) {
+		if (recv_entry->context == context)
+			return recv_entry;
+	}
+	return NULL;
 }
 
-static int rxm_match_unexp_msg_tag(struct dlist_entry *item, const void *arg)
+struct rxm_recv_entry *
+rxm_recv_entry_remove_ctx(struct rxm_recv_queue *recv_queue, void *context)
 {
-	struct rxm_recv_match_attr *attr = (struct rxm_recv_match_attr *)arg;
-	struct rxm_unexp_msg *unexp_msg =
-		container_of(item, struct rxm_unexp_msg, entry);
-	return rxm_match_tag(attr->tag, attr->ignore, unexp_msg->tag);
+	struct rxm_recv_entry *recv_entry;
+	size_t i;
+
+	recv_entry = rxm_recv_list_find_ctx(&recv_queue->recv_list, context);
+	if (!recv_entry)
+		recv_entry = rxm_recv_list_find_ctx(&recv_queue->any_tag_list,
+						    context);
+	for (i = 0; !recv_entry && i <= recv_queue->hash_mask; i++)
+		recv_entry = rxm_recv_list_find_ctx(&recv_queue->recv_hash[i],
+						    context);
+
+	if (recv_entry)
+		dlist_remove(&recv_entry->entry);
+	return recv_entry;
+}
+
+/* Keeps unexpected messages of a bucket in arrival order */
+static void rxm_unexp_msg_hash(struct rxm_recv_queue *recv_queue,
+			       struct rxm_unexp_msg *unexp_msg)
+{
+	struct dlist_entry *bucket, *item;
+
+	bucket = rxm_hash_bucket(recv_queue, recv_queue->unexp_hash,
+				 unexp_msg->addr, unexp_msg->tag);
+	for (item = bucket->prev; item != bucket; item = item->prev) {
+		if (container_of(item, struct rxm_unexp_msg,
+				 hash_entry)->seq < unexp_msg->seq)
+			break;
+	}
+	dlist_insert_after(&unexp_msg->hash_entry, item);
+}
+
+void rxm_unexp_msg_insert(struct rxm_recv_queue *recv_queue,
+			  struct rxm_rx_buf *rx_buf)
+{
+	rx_buf->unexp_msg.seq = recv_queue->seq++;
+	dlist_insert_tail(&rx_buf->unexp_msg.entry,
+			  &recv_queue->unexp_msg_list);
+	rxm_unexp_msg_hash(recv_queue, &rx_buf->unexp_msg);
 }
 
-static int rxm_match_unexp_msg_tag_addr(struct dlist_entry *item, const void *arg)
+/* Messages from a source not yet in the AV get their address later */
+void rxm_unexp_msg_set_addr(struct rxm_recv_queue *recv_queue,
+			    struct rxm_rx_buf *rx_buf, fi_addr_t addr)
 {
-	struct rxm_recv_match_attr *attr = (struct rxm_recv_match_attr *)arg;
-	struct rxm_unexp_msg *unexp_msg =
-		container_of(item, struct rxm_unexp_msg, entry);
-	return rxm_match_addr(attr->addr, unexp_msg->addr) &&
-		rxm_match_tag(attr->tag, attr->ignore, unexp_msg->tag);
+	dlist_remove(&rx_buf->unexp_msg.hash_entry);
+	rx_buf->unexp_msg.addr = addr;
+	rxm_unexp_msg_hash(recv_queue, &rx_buf->unexp_msg);
+}
+
+/* Returns the oldest unexpected message matching a posted receive */
+struct rxm_rx_buf *
+rxm_unexp_msg_match(struct rxm_recv_queue *recv_queue, fi_addr_t addr,
+		    uint64_t tag, uint64_t ignore)
+{
+	struct rxm_unexp_msg *unexp_msg;
+	struct dlist_entry *bucket;
+
+	if (dlist_empty(&recv_queue->unexp_msg_list))
+		return NULL;
+
+	if (!ignore && (!recv_queue->directed || addr != FI_ADDR_UNSPEC)) {
+		bucket = rxm_hash_bucket(recv_queue, recv_queue->unexp_hash,
+					 addr, tag);
+		dlist_foreach_container(bucket, struct rxm_unexp_msg,
+					unexp_msg, hash_entry) {
+			if (unexp_msg->tag == tag &&
+			    (!recv_queue->directed || unexp_msg->addr == addr))
+				goto found;
+		}
+		return NULL;
+	}
+
+	dlist_foreach_container(&recv_queue->unexp_msg_list,
+				struct rxm_unexp_msg, unexp_msg, entry) {
+		if (rxm_match_tag(tag, ignore, unexp_msg->tag) &&
+		    rxm_match_recv_addr(recv_queue, addr, unexp_msg->addr))
+			goto found;
+	}
+	return NULL;
+
+found:
+	RXM_DBG_ADDR_TAG(FI_LOG_EP_DATA, "Match for posted recv found in unexp"
+			 " msg list\n", unexp_msg->addr, unexp_msg->tag);
+	return container_of(unexp_msg, struct rxm_rx_buf, unexp_msg);
 }
 
 static inline int
@@ -131,7 +256,6 @@ static int rxm_buf_reg(void *pool_ctx, void *addr, size_t len, void **context)
 	size_t i, entry_sz = pool->pool->entry_sz;
 	int ret;
 	struct rxm_tx_buf *tx_buf;
-	struct rxm_rx_buf *rx_buf;
 	void *mr_desc;
 
 	ret = rxm_mr_buf_reg(pool->rxm_ep, addr, len, context);
@@ -141,41 +265,35 @@ static int rxm_buf_reg(void *pool_ctx, void *addr, size_t len, void **context)
 	mr_desc = (*context != NULL) ? fi_mr_desc((struct fid_mr *)*context) : NULL;
 
 	for (i = 0; i < pool->pool->chunk_cnt; i++) {
-		if (pool->type == RXM_BUF_POOL_RX) {
-			rx_buf = (struct rxm_rx_buf *)((char *)addr + i * entry_sz);
-			rx_buf->ep = pool->rxm_ep;
-			rx_buf->hdr.desc = mr_desc;
-		} else {
-			tx_buf = (struct rxm_tx_buf *)((char *)addr + i * entry_sz);
-			tx_buf->type = pool->type;
-			tx_buf->pkt.ctrl_hdr.version = RXM_CTRL_VERSION;
-			tx_buf->pkt.hdr.version = OFI_OP_VERSION;
-			tx_buf->hdr.desc = mr_desc;
-
-			switch (pool->type) {
-			case RXM_BUF_POOL_TX_MSG:
-			case RXM_BUF_POOL_RMA:
-				tx_buf->pkt.ctrl_hdr.type = ofi_ctrl_data;
-				tx_buf->pkt.hdr.op = ofi_op_msg;
-				break;
-			case RXM_BUF_POOL_TX_TAGGED:
-				tx_buf->pkt.ctrl_hdr.type = ofi_ctrl_data;
-				tx_buf->pkt.hdr.op = ofi_op_tagged;
-				break;
-			case RXM_BUF_POOL_TX_ACK:
-				tx_buf->pkt.ctrl_hdr.type = ofi_ctrl_ack;
-				tx_buf->pkt.hdr.op = ofi_op_msg;
-				break;
-			case RXM_BUF_POOL_TX_LMT:
-				tx_buf->pkt.ctrl_hdr.type = ofi_ctrl_large_data;
-				break;
-			case RXM_BUF_POOL_TX_SAR:
-				tx_buf->pkt.ctrl_hdr.type = ofi_ctrl_seg_data;
-				break;
-			default:
-				assert(0);
-				break;
-			}
+		tx_buf = (struct rxm_tx_buf *)((char *)addr + i * entry_sz);
+		tx_buf->type = pool->type;
+		tx_buf->pkt.ctrl_hdr.version = RXM_CTRL_VERSION;
+		tx_buf->pkt.hdr.version = OFI_OP_VERSION;
+		tx_buf->hdr.desc = mr_desc;
+
+		switch (pool->type) {
+		case RXM_BUF_POOL_TX_MSG:
+		case RXM_BUF_POOL_RMA:
+			tx_buf->pkt.ctrl_hdr.type = ofi_ctrl_data;
+			tx_buf->pkt.hdr.op = ofi_op_msg;
+			break;
+		case RXM_BUF_POOL_TX_TAGGED:
+			tx_buf->pkt.ctrl_hdr.type = ofi_ctrl_data;
+			tx_buf->pkt.hdr.op = ofi_op_tagged;
+			break;
+		case RXM_BUF_POOL_TX_ACK:
+			tx_buf->pkt.ctrl_hdr.type = ofi_ctrl_ack;
+			tx_buf->pkt.hdr.op = ofi_op_msg;
+			break;
+		case RXM_BUF_POOL_TX_LMT:
+			tx_buf->pkt.ctrl_hdr.type = ofi_ctrl_large_data;
+			break;
+		case RXM_BUF_POOL_TX_SAR:
+			tx_buf->pkt.ctrl_hdr.type = ofi_ctrl_seg_data;
+			break;
+		default:
+			assert(0);
+			break;
 		}
 	}
 
@@ -194,6 +312,120 @@ static inline void rxm_buf_close(void *pool_ctx, void *context)
 	}
 }
 
+/* Caller must hold the endpoint's mag_lock */
+static void rxm_mag_set_flush(struct rxm_mag_set *set)
+{
+	struct rxm_mag_depot *depot;
+	struct rxm_mag *mag;
+	size_t i;
+
+	for (i = 0; i < RXM_MAG_MAX; i++) {
+		depot = set->rxm_ep->mag_depots[i];
+		mag = &set->mags[i];
+		if (!depot || !mag->cnt)
+			continue;
+
+		fastlock_acquire(depot->lock);
+		while (mag->cnt)
+			depot->free_obj(depot->pool, mag->objs[--mag->cnt]);
+		fastlock_release(depot->lock);
+	}
+	dlist_remove(&set->entry);
+}
+
+/* Runs when a thread exits, which must not race with closing the
+ * endpoint */
+static void rxm_mag_set_release(void *arg)
+{
+	struct rxm_mag_set *set = arg;
+	struct rxm_ep *rxm_ep = set->rxm_ep;
+
+	fastlock_acquire(&rxm_ep->mag_lock);
+	rxm_mag_set_flush(set);
+	fastlock_release(&rxm_ep->mag_lock);
+	free(set);
+}
+
+struct rxm_mag_set *rxm_mag_set_create(struct rxm_ep *rxm_ep)
+{
+	struct rxm_mag_set *set;
+
+	set = calloc(1, sizeof(*set));
+	if (!set)
+		return NULL;
+
+	set->rxm_ep = rxm_ep;
+	if (pthread_setspecific(rxm_ep->mag_key, set)) {
+		free(set);
+		return NULL;
+	}
+
+	fastlock_acquire(&rxm_ep->mag_lock);
+	dlist_insert_tail(&set->entry, &rxm_ep->mag_set_list);
+	fastlock_release(&rxm_ep->mag_lock);
+	return set;
+}
+
+static void rxm_ep_mag_open(struct rxm_ep *rxm_ep)
+{
+	fastlock_init(&rxm_ep->mag_lock);
+	dlist_init(&rxm_ep->mag_set_list);
+	memset(rxm_ep->mag_depots, 0, sizeof(rxm_ep->mag_depots));
+
+	rxm_ep->mag_key_valid =
+		(rxm_ep->util_ep.domain->threading == FI_THREAD_SAFE) &&
+		!pthread_key_create(&rxm_ep->mag_key, rxm_mag_set_release);
+	if ((rxm_ep->util_ep.domain->threading == FI_THREAD_SAFE) &&
+	    !rxm_ep->mag_key_valid)
+		FI_INFO(&rxm_prov, FI_LOG_EP_CTRL, "Unable to create thread "
+			"key, transmit pools are used without magazines\n");
+}
+
+/* Returns the threads' magazines to the shared pools, which are used
+ * directly from then on */
+static void rxm_ep_mag_close(struct rxm_ep *rxm_ep)
+{
+	struct rxm_mag_set *set;
+	size_t i;
+
+	if (rxm_ep->mag_key_valid) {
+		pthread_key_delete(rxm_ep->mag_key);
+		rxm_ep->mag_key_valid = 0;
+
+		fastlock_acquire(&rxm_ep->mag_lock);
+		while (!dlist_empty(&rxm_ep->mag_set_list)) {
+			set = container_of(rxm_ep->mag_set_list.next,
+					   struct rxm_mag_set, entry);
+			rxm_mag_set_flush(set);
+			free(set);
+		}
+		fastlock_release(&rxm_ep->mag_lock);
+	}
+
+	for (i = 0; i < RXM_MAG_MAX; i++) {
+		if (rxm_ep->mag_depots[i])
+			rxm_ep->mag_depots[i]->size = 0;
+	}
+	fastlock_destroy(&rxm_ep->mag_lock);
+}
+
+static void rxm_mag_depot_init(struct rxm_ep *rxm_ep,
+			       struct rxm_mag_depot *depot, size_t idx,
+			       void *pool, fastlock_t *lock,
+			       rxm_mag_alloc_func alloc_obj,
+			       rxm_mag_free_func free_obj, size_t size)
+{
+	depot->rxm_ep = rxm_ep;
+	depot->pool = pool;
+	depot->lock = lock;
+	depot->alloc_obj = alloc_obj;
+	depot->free_obj = free_obj;
+	depot->idx = idx;
+	depot->size = (rxm_ep->mag_key_valid && (size >= 2)) ?
+		      MIN(size, RXM_MAG_SIZE) : 0;
+	rxm_ep->mag_depots[idx] = depot;
+}
+
 static void rxm_buf_pool_destroy(struct rxm_buf_pool *pool)
 {
 	fastlock_destroy(&pool->lock);
@@ -202,12 +434,18 @@ static void rxm_buf_pool_destroy(struct rxm_buf_pool *pool)
 
 static void rxm_ep_cleanup_post_rx_list(struct rxm_ep *rxm_ep)
 {
+	struct rxm_domain *rxm_domain = container_of(rxm_ep->util_ep.domain,
+						     struct rxm_domain,
+						     util_domain);
 	struct rxm_rx_buf *rx_buf;
+
+	fastlock_acquire(&rxm_domain->rx_pool_lock);
 	while (!dlist_empty(&rxm_ep->post_rx_list)) {
 		dlist_pop_front(&rxm_ep->post_rx_list, struct rxm_rx_buf,
 				rx_buf, entry);
-		rxm_rx_buf_release(rxm_ep, rx_buf);
+		rxm_rx_buf_free(rxm_domain, rx_buf);
 	}
+	fastlock_release(&rxm_domain->rx_pool_lock);
 }
 
 static int rxm_buf_pool_create(struct rxm_ep *rxm_ep,
@@ -226,6 +464,8 @@ static int rxm_buf_pool_create(struct rxm_ep *rxm_ep,
 		return -FI_ENOMEM;
 	}
 	fastlock_init(&pool->lock);
+	rxm_mag_depot_init(rxm_ep, &pool->depot, type, pool->pool, &pool->lock,
+			   rxm_buf_pool_alloc, rxm_buf_pool_free, RXM_MAG_SIZE);
 	return 0;
 }
 
@@ -243,6 +483,9 @@ static int rxm_send_queue_init(struct rxm_ep *rxm_ep, struct rxm_send_queue *sen
 		send_queue->fs->buf[i].ep = rxm_ep;
 
 	fastlock_init(&send_queue->lock);
+	rxm_mag_depot_init(rxm_ep, &send_queue->depot, RXM_MAG_SEND_QUEUE,
+			   send_queue->fs, &send_queue->lock, rxm_fs_alloc,
+			   rxm_fs_free, send_queue->fs->size / RXM_MAG_FS_SHARE);
 	return 0;
 }
 
@@ -257,34 +500,40 @@ static int rxm_recv_queue_init(struct rxm_ep *rxm_ep,  struct rxm_recv_queue *re
 	if (!recv_queue->fs)
 		return -FI_ENOMEM;
 
+	recv_queue->hash_mask = roundup_power_of_two(size) - 1;
+	recv_queue->recv_hash = calloc(recv_queue->hash_mask + 1,
+				       sizeof(*recv_queue->recv_hash));
+	recv_queue->unexp_hash = calloc(recv_queue->hash_mask + 1,
+					sizeof(*recv_queue->unexp_hash));
+	if (!recv_queue->recv_hash || !recv_queue->unexp_hash) {
+		free(recv_queue->recv_hash);
+		free(recv_queue->unexp_hash);
+		rxm_recv_fs_free(recv_queue->fs);
+		recv_queue->fs = NULL;
+		return -FI_ENOMEM;
+	}
+
+	for (i = 0; i <= recv_queue->hash_mask; i++) {
+		dlist_init(&recv_queue->recv_hash[i]);
+		dlist_init(&recv_queue->unexp_hash[i]);
+	}
 	dlist_init(&recv_queue->recv_list);
+	dlist_init(&recv_queue->any_tag_list);
 	dlist_init(&recv_queue->unexp_msg_list);
-	if (type == RXM_RECV_QUEUE_MSG) {
-		if (rxm_ep->rxm_info->caps & FI_DIRECTED_RECV) {
-			recv_queue->match_recv = rxm_match_recv_entry;
-			recv_queue->match_unexp = rxm_match_unexp_msg;
-		} else {
-			recv_queue->match_recv = rxm_match_noop;
-			recv_queue->match_unexp = rxm_match_noop;
-		}
-		for (i = recv_queue->fs->size - 1; i >= 0; i--) {
-			recv_queue->fs->buf[i].comp_flags = FI_MSG | FI_RECV;
-			recv_queue->fs->buf[i].recv_queue = recv_queue;
-		}
-	} else {
-		if (rxm_ep->rxm_info->caps & FI_DIRECTED_RECV) {
-			recv_queue->match_recv = rxm_match_recv_entry_tag_addr;
-			recv_queue->match_unexp = rxm_match_unexp_msg_tag_addr;
-		} else {
-			recv_queue->match_recv = rxm_match_recv_entry_tag;
-			recv_queue->match_unexp = rxm_match_unexp_msg_tag;
-		}
-		for (i = recv_queue->fs->size - 1; i >= 0; i--) {
-			recv_queue->fs->buf[i].comp_flags = FI_TAGGED | FI_RECV;
-			recv_queue->fs->buf[i].recv_queue = recv_queue;
-		}
+	recv_queue->seq = 0;
+	recv_queue->directed = !!(rxm_ep->rxm_info->caps & FI_DIRECTED_RECV);
+
+	for (i = recv_queue->fs->size - 1; i >= 0; i--) {
+		recv_queue->fs->buf[i].comp_flags = (type == RXM_RECV_QUEUE_MSG) ?
+			FI_MSG | FI_RECV : FI_TAGGED | FI_RECV;
+		recv_queue->fs->buf[i].recv_queue = recv_queue;
 	}
 	fastlock_init(&recv_queue->lock);
+	rxm_mag_depot_init(rxm_ep, &recv_queue->depot,
+			   (type == RXM_RECV_QUEUE_MSG) ? RXM_MAG_RECV_QUEUE :
+			   RXM_MAG_TRECV_QUEUE, recv_queue->fs,
+			   &recv_queue->lock, rxm_fs_alloc, rxm_fs_free,
+			   recv_queue->fs->size / RXM_MAG_FS_SHARE);
 	return 0;
 }
 
@@ -310,6 +559,8 @@ static void rxm_recv_queue_close(struct rxm_recv_queue *recv_queue)
 {
 	if (recv_queue->fs)
 		rxm_recv_fs_free(recv_queue->fs);
+	free(recv_queue->recv_hash);
+	free(recv_queue->unexp_hash);
 	fastlock_destroy(&recv_queue->lock);
 	// TODO cleanup recv_list and unexp msg list
 }
@@ -319,16 +570,14 @@ static int rxm_ep_txrx_pool_create(struct rxm_ep *rxm_ep)
 	size_t i;
 	int ret;
 
-	ret = rxm_buf_pool_create(rxm_ep,
-				  rxm_ep->msg_info->rx_attr->size,
-				  rxm_ep->rxm_info->tx_attr->inject_size +
-				  sizeof(struct rxm_rx_buf),
-				  &rxm_ep->buf_pools[RXM_BUF_POOL_RX],
-				  RXM_BUF_POOL_RX);
-	if (ret)
-		return ret;
+	/* Receive buffers come from the domain's pool */
 	dlist_init(&rxm_ep->post_rx_list);
 	dlist_init(&rxm_ep->repost_ready_list);
+	dlist_init(&rxm_ep->sar_deferred_list);
+	dlist_init(&rxm_ep->cm_rx_list);
+	dlist_init(&rxm_ep->conn_close_list);
+	dlist_init(&rxm_ep->conn_credit_list);
+	dlist_init(&rxm_ep->lmt_ack_deferred_list);
 
 	/* Allocates resources for TX pools */
 	for (i = RXM_BUF_POOL_TX_START; i <= RXM_BUF_POOL_TX_END; i++) {
@@ -352,9 +601,8 @@ static int rxm_ep_txrx_pool_create(struct rxm_ep *rxm_ep)
 
 	return FI_SUCCESS;
 err:
-	while (--i >= RXM_BUF_POOL_TX_START)
+	while (i-- > RXM_BUF_POOL_TX_START)
 		rxm_buf_pool_destroy(&rxm_ep->buf_pools[i]);
-	rxm_buf_pool_destroy(&rxm_ep->buf_pools[RXM_BUF_POOL_RX]);
 	return ret;
 }
 
@@ -362,7 +610,7 @@ static void rxm_ep_txrx_pool_destroy(struct rxm_ep *rxm_ep)
 {
 	size_t i;
 
-	for (i = RXM_BUF_POOL_START; i < RXM_BUF_POOL_MAX; i++)
+	for (i = RXM_BUF_POOL_TX_START; i < RXM_BUF_POOL_MAX; i++)
 		rxm_buf_pool_destroy(&rxm_ep->buf_pools[i]);
 }
 
@@ -420,13 +668,15 @@ static int rxm_ep_txrx_res_open(struct rxm_ep *rxm_ep,
 		rxm_ep->res_fastlock_release = ofi_fastlock_release;
 	}
 
+	rxm_ep_mag_open(rxm_ep);
+
 	ret = rxm_ep_txrx_pool_create(rxm_ep);
 	if (ret)
-		return ret;
+		goto err1;
 
 	ret = rxm_ep_txrx_queue_init(rxm_ep);
 	if (ret)
-		goto err;
+		goto err2;
 
 	if (!fi_param_get_size_t(&rxm_prov, "sar_limit", &param)) {
 		if (param < rxm_info.tx_attr->inject_size)
@@ -441,14 +691,45 @@ static int rxm_ep_txrx_res_open(struct rxm_ep *rxm_ep,
 		rxm_ep->sar_limit = RXM_SAR_LIMIT;
 	}
 
+	/* The rendezvous threshold of a connection starts at the SAR limit,
+	 * or at the inject size when SAR is disabled, and stays within
+	 * [proto_limit_min, proto_limit_max] */
+	if (!rxm_ep->sar_limit)
+		rxm_ep->proto_limit_max = rxm_ep->rxm_info->tx_attr->inject_size;
+	else if (!fi_param_get_size_t(&rxm_prov, "proto_limit_max", &param))
+		rxm_ep->proto_limit_max = MAX(param, rxm_ep->sar_limit);
+	else
+		rxm_ep->proto_limit_max = MAX(RXM_PROTO_LIMIT_MAX,
+					      rxm_ep->sar_limit);
+
+	/* Messages that fit in a buffer are always sent eagerly */
+	if (fi_param_get_size_t(&rxm_prov, "proto_limit_min", &param))
+		param = 0;
+	rxm_ep->proto_limit_min =
+		MIN(MAX(param, rxm_ep->rxm_info->tx_attr->inject_size),
+		    rxm_ep->proto_limit_max);
+
+	if (!fi_param_get_size_t(&rxm_prov, "sar_window", &param) &&
+	    param && (param <= RXM_SAR_WINDOW_MAX))
+		rxm_ep->sar_window = param;
+	else
+		rxm_ep->sar_window = RXM_SAR_WINDOW;
+
+	rxm_ep->sar_seg_size = MIN(rxm_ep->rxm_info->tx_attr->inject_size,
+				   UINT16_MAX);
 	return FI_SUCCESS;
-err:
+err2:
+	rxm_ep_mag_close(rxm_ep);
 	rxm_ep_txrx_pool_destroy(rxm_ep);
 	return ret;
+err1:
+	rxm_ep_mag_close(rxm_ep);
+	return ret;
 }
 
 static void rxm_ep_txrx_res_close(struct rxm_ep *rxm_ep)
 {
+	rxm_ep_mag_close(rxm_ep);
 	rxm_ep_txrx_queue_close(rxm_ep);
 
 	rxm_ep_cleanup_post_rx_list(rxm_ep);
@@ -489,15 +770,11 @@ static int rxm_ep_cancel_recv(struct rxm_ep *rxm_ep,
 {
 	struct fi_cq_err_entry err_entry;
 	struct rxm_recv_entry *recv_entry;
-	struct dlist_entry *entry;
 
 	rxm_ep->res_fastlock_acquire(&recv_queue->lock);
-	entry = dlist_remove_first_match(&recv_queue->recv_list,
-					 rxm_match_recv_entry_context,
-					 context);
+	recv_entry = rxm_recv_entry_remove_ctx(recv_queue, context);
 	rxm_ep->res_fastlock_release(&recv_queue->lock);
-	if (entry) {
-		recv_entry = container_of(entry, struct rxm_recv_entry, entry);
+	if (recv_entry) {
 		memset(&err_entry, 0, sizeof(err_entry));
 		err_entry.op_context = recv_entry->context;
 		err_entry.flags |= recv_entry->comp_flags;
@@ -526,18 +803,69 @@ static ssize_t rxm_ep_cancel(fid_t fid_ep, void *context)
 	return 0;
 }
 
+static int rxm_ep_get_proto_limits(struct rxm_ep *rxm_ep,
+				   struct fi_rxm_proto_limits *limits)
+{
+	struct util_cmap *cmap = rxm_ep->util_ep.cmap;
+	struct util_cmap_handle *handle;
+	size_t inject_size = rxm_ep->rxm_info->tx_attr->inject_size;
+	size_t limit = MAX(rxm_ep->sar_limit, inject_size);
+
+	if (limits->addr != FI_ADDR_UNSPEC) {
+		if (!cmap || (limits->addr >= cmap->av->count))
+			return -FI_EINVAL;
+
+		fastlock_acquire(&cmap->lock);
+		handle = ofi_cmap_lookup_handle(cmap, limits->addr);
+		if (handle && (handle->state == CMAP_CONNECTED))
+			limit = container_of(handle, struct rxm_conn,
+					     handle)->proto.limit;
+		fastlock_release(&cmap->lock);
+	}
+
+	/* The threshold never drops below the buffer size */
+	limits->eager_limit = inject_size;
+	limits->sar_limit = limit;
+	return FI_SUCCESS;
+}
+
 static int rxm_ep_getopt(fid_t fid, int level, int optname, void *optval,
 			 size_t *optlen)
 {
 	struct rxm_ep *rxm_ep =
 		container_of(fid, struct rxm_ep, util_ep.ep_fid);
+	int ret;
 
-	if ((level != FI_OPT_ENDPOINT) || (optname != FI_OPT_MIN_MULTI_RECV))
+	if (level != FI_OPT_ENDPOINT)
 		return -FI_ENOPROTOOPT;
 
-	*(size_t *)optval = rxm_ep->min_multi_recv_size;
-	*optlen = sizeof(size_t);
-
+	switch (optname) {
+	case FI_OPT_MIN_MULTI_RECV:
+		*(size_t *)optval = rxm_ep->min_multi_recv_size;
+		*optlen = sizeof(size_t);
+		break;
+	case FI_OPT_RXM_PROTO_LIMITS:
+		if (*optlen < sizeof(struct fi_rxm_proto_limits))
+			return -FI_ETOOSMALL;
+		ret = rxm_ep_get_proto_limits(rxm_ep, optval);
+		if (ret)
+			return ret;
+		*optlen = sizeof(struct fi_rxm_proto_limits);
+		break;
+	case FI_OPT_RXM_MR_CACHE_STATS:
+		if (*optlen < sizeof(struct fi_rxm_mr_cache_stats))
+			return -FI_ETOOSMALL;
+		ret = rxm_mr_cache_get_stats(container_of(rxm_ep->util_ep.domain,
+							  struct rxm_domain,
+							  util_domain),
+					     optval);
+		if (ret)
+			return ret;
+		*optlen = sizeof(struct fi_rxm_mr_cache_stats);
+		break;
+	default:
+		return -FI_ENOPROTOOPT;
+	}
 	return FI_SUCCESS;
 }
 
@@ -572,8 +900,11 @@ static int rxm_ep_discard_recv(struct rxm_ep *rxm_ep, struct rxm_rx_buf *rx_buf,
 	RXM_DBG_ADDR_TAG(FI_LOG_EP_DATA, "Discarding message",
 			 rx_buf->unexp_msg.addr, rx_buf->unexp_msg.tag);
 
-	dlist_insert_tail(&rx_buf->repost_entry,
-			  &rx_buf->ep->repost_ready_list);
+	if (rx_buf->pkt.ctrl_hdr.type == ofi_ctrl_seg_data)
+		rxm_sar_rx_discard(rx_buf);
+	else
+		dlist_insert_tail(&rx_buf->repost_entry,
+				  &rx_buf->ep->repost_ready_list);
 	return ofi_cq_write(rxm_ep->util_ep.rx_cq, context, FI_TAGGED | FI_RECV,
 			    0, NULL, rx_buf->pkt.hdr.data, rx_buf->pkt.hdr.tag);
 }
@@ -590,7 +921,7 @@ static int rxm_ep_peek_recv(struct rxm_ep *rxm_ep, fi_addr_t addr, uint64_t tag,
 
 	rxm_ep->res_fastlock_acquire(&recv_queue->lock);
 
-	rx_buf = rxm_check_unexp_msg_list(recv_queue, addr, tag, ignore);
+	rx_buf = rxm_unexp_msg_match(recv_queue, addr, tag, ignore);
 	if (!rx_buf) {
 		rxm_ep->res_fastlock_release(&recv_queue->lock);
 		FI_DBG(&rxm_prov, FI_LOG_EP_DATA, "Message not found\n");
@@ -601,7 +932,7 @@ static int rxm_ep_peek_recv(struct rxm_ep *rxm_ep, fi_addr_t addr, uint64_t tag,
 	FI_DBG(&rxm_prov, FI_LOG_EP_DATA, "Message found\n");
 
 	if (flags & FI_DISCARD) {
-		dlist_remove(&rx_buf->unexp_msg.entry);
+		rxm_unexp_msg_remove(rx_buf);
 		rxm_ep->res_fastlock_release(&recv_queue->lock);
 		return rxm_ep_discard_recv(rxm_ep, rx_buf, context);
 	}
@@ -609,7 +940,7 @@ static int rxm_ep_peek_recv(struct rxm_ep *rxm_ep, fi_addr_t addr, uint64_t tag,
 	if (flags & FI_CLAIM) {
 		FI_DBG(&rxm_prov, FI_LOG_EP_DATA, "Marking message for Claim\n");
 		((struct fi_context *)context)->internal[0] = rx_buf;
-		dlist_remove(&rx_buf->unexp_msg.entry);
+		rxm_unexp_msg_remove(rx_buf);
 	}
 	rxm_ep->res_fastlock_release(&recv_queue->lock);
 
@@ -812,6 +1143,7 @@ rxm_ep_format_tx_entry(struct rxm_ep *rxm_ep, void *context, uint8_t count,
 	(*tx_entry)->flags = flags;
 	(*tx_entry)->tx_buf = tx_buf;
 	(*tx_entry)->comp_flags = comp_flags | FI_SEND;
+	(*tx_entry)->start = 0;
 
 	return FI_SUCCESS;
 }
@@ -841,19 +1173,27 @@ err:
 	return ret;
 }
 
+/* Postponed sends are made from progress with the credit taken, rsvd is
+ * RXM_CREDIT_TAKEN, see rxm_conn_get_credit */
 static inline ssize_t
 rxm_ep_normal_send(struct rxm_ep *rxm_ep, struct rxm_conn *rxm_conn,
-		   struct rxm_tx_entry *tx_entry, size_t pkt_size)
+		   struct rxm_tx_entry *tx_entry, size_t pkt_size, int32_t rsvd)
 {
+	ssize_t ret;
+
 	FI_DBG(&rxm_prov, FI_LOG_EP_DATA, "Posting send with length: %" PRIu64
 	       " tag: 0x%" PRIx64 "\n", tx_entry->tx_buf->pkt.hdr.size,
 	       tx_entry->tx_buf->pkt.hdr.tag);
-	ssize_t ret = fi_send(rxm_conn->msg_ep, &tx_entry->tx_buf->pkt, pkt_size,
-			      tx_entry->tx_buf->hdr.desc, 0, tx_entry);
+	ret = rxm_conn_get_credit(rxm_conn, rsvd);
+	if (OFI_LIKELY(!ret))
+		ret = rxm_conn_msg_send(rxm_conn, &tx_entry->tx_buf->pkt,
+					pkt_size, tx_entry->tx_buf->hdr.desc,
+					tx_entry);
 	if (OFI_UNLIKELY(ret)) {
-		if (ret == -FI_EAGAIN)
+		/* Progress would take the cmap lock postponed sends hold */
+		if (ret == -FI_EAGAIN && rsvd != RXM_CREDIT_TAKEN)
 			rxm_ep_progress_multi(&rxm_ep->util_ep);
-		else
+		else if (ret != -FI_EAGAIN)
 			FI_WARN(&rxm_prov, FI_LOG_EP_DATA,
 				"fi_send for MSG provider failed\n");
 		rxm_tx_buf_release(rxm_ep, tx_entry->tx_buf);
@@ -883,9 +1223,11 @@ rxm_ep_alloc_lmt_tx_res(struct rxm_ep *rxm_ep, struct rxm_conn *rxm_conn,
 	tx_buf->pkt.hdr.op = op;
 	tx_buf->pkt.ctrl_hdr.msg_id = rxm_txe_fs_index(rxm_ep->send_queue.fs,
 						       (*tx_entry));
+	(*tx_entry)->conn = rxm_conn;
+	(*tx_entry)->start = fi_gettime_us();
 	if (!rxm_ep->rxm_mr_local) {
-		ret = rxm_ep_msg_mr_regv(rxm_ep, iov, (*tx_entry)->count,
-					 FI_REMOTE_READ, (*tx_entry)->mr);
+		ret = rxm_lmt_mr_regv(rxm_ep, iov, (*tx_entry)->count,
+				      FI_REMOTE_READ, (*tx_entry)->mr);
 		if (ret)
 			goto err;
 		mr_iov = (*tx_entry)->mr;
@@ -904,10 +1246,14 @@ err:
 
 static inline ssize_t
 rxm_ep_lmt_tx_send(struct rxm_ep *rxm_ep, struct rxm_conn *rxm_conn,
-		   struct rxm_tx_entry *tx_entry, size_t pkt_size)
+		   struct rxm_tx_entry *tx_entry, size_t pkt_size, int32_t rsvd)
 {
 	ssize_t ret;
 
+	ret = rxm_conn_get_credit(rxm_conn, rsvd);
+	if (OFI_UNLIKELY(ret))
+		goto err;
+
 	RXM_LOG_STATE(FI_LOG_EP_DATA, tx_entry->tx_buf->pkt,
 		      RXM_TX, RXM_LMT_TX);
 	if (pkt_size <= rxm_ep->msg_info->tx_attr->inject_size) {
@@ -915,11 +1261,14 @@ rxm_ep_lmt_tx_send(struct rxm_ep *rxm_ep, struct rxm_conn *rxm_conn,
 			      RXM_LMT_TX, RXM_LMT_ACK_WAIT);
 		tx_entry->state = RXM_LMT_ACK_WAIT;
 
-		ret = fi_inject(rxm_conn->msg_ep, &tx_entry->tx_buf->pkt, pkt_size, 0);
+		ret = rxm_conn_msg_inject(rxm_conn, &tx_entry->tx_buf->pkt,
+					  pkt_size);
 	} else {
 		tx_entry->state = RXM_LMT_TX;
 
-		ret = rxm_ep_normal_send(rxm_ep, rxm_conn, tx_entry, pkt_size);
+		ret = rxm_conn_msg_send(rxm_conn, &tx_entry->tx_buf->pkt,
+					pkt_size, tx_entry->tx_buf->hdr.desc,
+					tx_entry);
 	}
 	if (OFI_UNLIKELY(ret))
 		goto err;
@@ -928,7 +1277,7 @@ err:
 	FI_DBG(&rxm_prov, FI_LOG_EP_DATA,
 	       "Transmit for MSG provider failed\n");
 	if (!rxm_ep->rxm_mr_local)
-		rxm_ep_msg_mr_closev(tx_entry->mr, tx_entry->count);
+		rxm_lmt_mr_closev(rxm_ep, tx_entry->mr, tx_entry->count);
 	rxm_tx_buf_release(rxm_ep, tx_entry->tx_buf);
 	rxm_tx_entry_release(&rxm_ep->send_queue, tx_entry);
 	return ret;
@@ -936,11 +1285,17 @@ err:
 
 static inline ssize_t
 rxm_ep_inject_send(struct rxm_ep *rxm_ep, struct rxm_conn *rxm_conn,
-		   struct rxm_tx_buf *tx_buf, size_t pkt_size)
+		   struct rxm_tx_buf *tx_buf, size_t pkt_size, int32_t rsvd)
 {
+	ssize_t ret;
+
 	FI_DBG(&rxm_prov, FI_LOG_EP_DATA, "Posting inject with length: %" PRIu64
 	       " tag: 0x%" PRIx64 "\n", tx_buf->pkt.hdr.size, tx_buf->pkt.hdr.tag);
-	ssize_t ret = fi_inject(rxm_conn->msg_ep, &tx_buf->pkt, pkt_size, 0);
+	if (OFI_UNLIKELY(rxm_conn_get_credit(rxm_conn, rsvd))) {
+		rxm_tx_buf_release(rxm_ep, tx_buf);
+		return -FI_EAGAIN;
+	}
+	ret = rxm_conn_msg_inject(rxm_conn, &tx_buf->pkt, pkt_size);
 	if (OFI_UNLIKELY(ret)) {
 		FI_DBG(&rxm_prov, FI_LOG_EP_DATA,
 		       "fi_inject for MSG provider failed\n");
@@ -953,6 +1308,337 @@ rxm_ep_inject_send(struct rxm_ep *rxm_ep, struct rxm_conn *rxm_conn,
 	return ret;
 }
 
+/*
+ * Tiny messages are formatted on the stack and injected straight from there,
+ * which saves taking a transmit buffer from the pool and releasing it.
+ */
+static inline ssize_t
+rxm_ep_inject_inline(struct rxm_ep *rxm_ep, struct rxm_conn *rxm_conn,
+		     const void *buf, size_t len, uint64_t data,
+		     uint64_t flags, uint64_t tag, uint8_t op)
+{
+	uint64_t pkt_buf[(sizeof(struct rxm_pkt) + RXM_INJECT_INLINE_SIZE +
+			  sizeof(uint64_t) - 1) / sizeof(uint64_t)];
+	struct rxm_pkt *pkt = (struct rxm_pkt *)pkt_buf;
+	ssize_t ret;
+
+	assert(len <= RXM_INJECT_INLINE_SIZE);
+
+	if (OFI_UNLIKELY(rxm_conn_get_credit(rxm_conn, RXM_CREDITS_RSVD)))
+		return -FI_EAGAIN;
+
+	memset(pkt, 0, sizeof(*pkt));
+	pkt->ctrl_hdr.version = RXM_CTRL_VERSION;
+	pkt->ctrl_hdr.type = ofi_ctrl_data;
+	pkt->ctrl_hdr.conn_id = rxm_conn->handle.remote_key;
+	pkt->hdr.version = OFI_OP_VERSION;
+	pkt->hdr.op = op;
+	pkt->hdr.size = len;
+	pkt->hdr.tag = tag;
+	if (flags & FI_REMOTE_CQ_DATA) {
+		pkt->hdr.flags = FI_REMOTE_CQ_DATA;
+		pkt->hdr.data = data;
+	}
+	memcpy(pkt->data, buf, len);
+
+	FI_DBG(&rxm_prov, FI_LOG_EP_DATA, "Posting inline inject with length: "
+	       "%zu tag: 0x%" PRIx64 "\n", len, tag);
+	ret = rxm_conn_msg_inject(rxm_conn, pkt, rxm_pkt_size + len);
+	if (OFI_UNLIKELY(ret)) {
+		FI_DBG(&rxm_prov, FI_LOG_EP_DATA,
+		       "fi_inject for MSG provider failed\n");
+		rxm_cntr_incerr(rxm_ep->util_ep.tx_cntr);
+	} else {
+		rxm_cntr_inc(rxm_ep->util_ep.tx_cntr);
+	}
+	return ret;
+}
+
+static void rxm_proto_adjust(struct rxm_ep *rxm_ep,
+			     struct rxm_proto_limit *proto)
+{
+	size_t limit = proto->limit;
+	uint64_t copy_bw, lmt_bw;
+
+	/* Wait for a full probe run's worth of samples on either side */
+	if (proto->copy_cnt < RXM_PROTO_PROBE_LEN ||
+	    proto->lmt_cnt < RXM_PROTO_PROBE_LEN)
+		return;
+
+	copy_bw = proto->copy_bytes / MAX(proto->copy_usec, 1);
+	lmt_bw = proto->lmt_bytes / MAX(proto->lmt_usec, 1);
+
+	/* Only move when one side is ahead by more than 1/8 */
+	if (lmt_bw > copy_bw + copy_bw / 8)
+		limit = MAX(limit / 2, rxm_ep->proto_limit_min);
+	else if (copy_bw > lmt_bw + lmt_bw / 8)
+		limit = MIN(limit * 2, rxm_ep->proto_limit_max);
+
+	if (limit == proto->limit) {
+		/* Let older samples fade */
+		proto->copy_bytes /= 2;
+		proto->copy_usec /= 2;
+		proto->copy_cnt /= 2;
+		proto->lmt_bytes /= 2;
+		proto->lmt_usec /= 2;
+		proto->lmt_cnt /= 2;
+		return;
+	}
+
+	FI_DBG(&rxm_prov, FI_LOG_EP_DATA, "Rendezvous threshold %zu -> %zu "
+	       "(copy: %" PRIu64 " rendezvous: %" PRIu64 " bytes/us)\n",
+	       proto->limit, limit, copy_bw, lmt_bw);
+	proto->limit = limit;
+	proto->copy_bytes = 0;
+	proto->copy_usec = 0;
+	proto->copy_cnt = 0;
+	proto->lmt_bytes = 0;
+	proto->lmt_usec = 0;
+	proto->lmt_cnt = 0;
+}
+
+/* Messages sent with FI_INJECT are never sent by rendezvous */
+static inline int
+rxm_ep_use_lmt(struct rxm_ep *rxm_ep, struct rxm_conn *rxm_conn, size_t len,
+	       uint64_t flags)
+{
+	struct rxm_proto_limit *proto = &rxm_conn->proto;
+	uint64_t cnt;
+
+	if (OFI_LIKELY(!rxm_proto_near_limit(proto, len)))
+		return (len > proto->limit) && !(flags & FI_INJECT);
+	if (flags & FI_INJECT)
+		return 0;
+
+	cnt = ++proto->msg_cnt % RXM_PROTO_PROBE_INTERVAL;
+	if (OFI_UNLIKELY(cnt == RXM_PROTO_PROBE_INTERVAL -
+				RXM_PROTO_PROBE_LEN)) {
+		fastlock_acquire(&rxm_ep->util_ep.cmap->lock);
+		rxm_proto_adjust(rxm_ep, proto);
+		fastlock_release(&rxm_ep->util_ep.cmap->lock);
+	}
+	/* Probe the other side with a run of sends, as a single one only
+	 * waits behind the stream of the other; eager sends never use
+	 * rendezvous */
+	if (OFI_UNLIKELY(cnt >= RXM_PROTO_PROBE_INTERVAL - RXM_PROTO_PROBE_LEN) &&
+	    len > rxm_ep->rxm_info->tx_attr->inject_size)
+		return len <= proto->limit;
+	return len > proto->limit;
+}
+
+/*
+ * SAR (Segmentation And Reassembly) sends a message as a series of eager
+ * sized segments.  Every segment carries the full op header, the index of
+ * the segment in ctrl_hdr::seg_no and the segment size in seg_size, so the
+ * receiver matches the first segment and copies the others straight into
+ * the matched receive buffer.  Segments are told apart from those of other
+ * messages by a msg_id that is unique on the connection, as the first
+ * segment may sit unexpected at the receiver long after the send completed.
+ * Up to sar_window segments of a message are in flight at a time, and each
+ * completed segment buffer is refilled with the next segment.
+ *
+ * Only the first segment takes part in matching, so it is posted before
+ * the send returns.  Later segments the MSG EP has no room or the
+ * connection no credits for are queued on sar_deferred_list and sent from
+ * progress.
+ */
+static inline size_t rxm_ep_sar_seg_len(struct rxm_tx_entry *tx_entry,
+					size_t seg_no)
+{
+	size_t seg_size = tx_entry->ep->sar_seg_size;
+
+	return MIN(seg_size, tx_entry->total_len - seg_no * seg_size);
+}
+
+static inline ssize_t rxm_ep_sar_tx_post(struct rxm_tx_buf *tx_buf)
+{
+	struct rxm_tx_entry *tx_entry = tx_buf->tx_entry;
+
+	if (rxm_conn_get_credit(tx_entry->conn, RXM_CREDITS_RSVD))
+		return -FI_EAGAIN;
+
+	return rxm_conn_msg_send(tx_entry->conn, &tx_buf->pkt, rxm_pkt_size +
+				 rxm_ep_sar_seg_len(tx_entry,
+						    tx_buf->pkt.ctrl_hdr.seg_no),
+				 tx_buf->hdr.desc, tx_buf);
+}
+
+static inline void rxm_ep_sar_tx_fill(struct rxm_tx_entry *tx_entry,
+				      struct rxm_tx_buf *tx_buf)
+{
+	size_t seg_no = tx_entry->next_seg++;
+
+	tx_buf->pkt.ctrl_hdr.seg_no = (uint32_t)seg_no;
+	ofi_copy_from_iov(tx_buf->pkt.data,
+			  rxm_ep_sar_seg_len(tx_entry, seg_no),
+			  tx_entry->rxm_iov.iov, tx_entry->rxm_iov.count,
+			  seg_no * tx_entry->ep->sar_seg_size);
+}
+
+static void rxm_ep_sar_tx_defer(struct rxm_ep *rxm_ep,
+				struct rxm_tx_buf *tx_buf)
+{
+	rxm_ep->res_fastlock_acquire(&rxm_ep->send_queue.lock);
+	dlist_insert_tail(&tx_buf->deferred_entry, &rxm_ep->sar_deferred_list);
+	rxm_ep->res_fastlock_release(&rxm_ep->send_queue.lock);
+}
+
+void rxm_ep_sar_tx_seg_error(struct rxm_tx_buf *tx_buf, int err)
+{
+	struct rxm_tx_entry *tx_entry = tx_buf->tx_entry;
+
+	FI_WARN(&rxm_prov, FI_LOG_EP_DATA,
+		"Unable to send SAR segment %" PRIu32 "\n",
+		tx_buf->pkt.ctrl_hdr.seg_no);
+	rxm_tx_buf_release(tx_entry->ep, tx_buf);
+
+	if (!tx_entry->sar_err) {
+		tx_entry->sar_err = err;
+		/* Segments that were never posted won't complete */
+		tx_entry->segs_left -= tx_entry->segs - tx_entry->next_seg;
+		tx_entry->next_seg = tx_entry->segs;
+		rxm_cq_write_error(tx_entry->ep->util_ep.tx_cq,
+				   tx_entry->ep->util_ep.tx_cntr,
+				   tx_entry->context, err);
+	}
+	if (!--tx_entry->segs_left)
+		rxm_tx_entry_release(&tx_entry->ep->send_queue, tx_entry);
+}
+
+/* Called on send completion of a segment that isn't the last to complete */
+void rxm_ep_sar_tx_next_seg(struct rxm_tx_entry *tx_entry,
+			    struct rxm_tx_buf *tx_buf)
+{
+	ssize_t ret;
+
+	if (tx_entry->next_seg == tx_entry->segs) {
+		rxm_tx_buf_release(tx_entry->ep, tx_buf);
+		return;
+	}
+
+	rxm_ep_sar_tx_fill(tx_entry, tx_buf);
+	ret = rxm_ep_sar_tx_post(tx_buf);
+	if (ret == -FI_EAGAIN)
+		rxm_ep_sar_tx_defer(tx_entry->ep, tx_buf);
+	else if (OFI_UNLIKELY(ret))
+		rxm_ep_sar_tx_seg_error(tx_buf, (int)ret);
+}
+
+/* Segments of a connection out of credits don't hold up those of others.
+ * They may be sent out of order as the receiver places them by seg_no */
+void rxm_ep_sar_tx_progress(struct rxm_ep *rxm_ep)
+{
+	struct rxm_tx_buf *tx_buf;
+	struct dlist_entry *tmp;
+	ssize_t ret;
+
+	rxm_ep->res_fastlock_acquire(&rxm_ep->send_queue.lock);
+	dlist_foreach_container_safe(&rxm_ep->sar_deferred_list,
+				     struct rxm_tx_buf, tx_buf,
+				     deferred_entry, tmp) {
+		ret = rxm_ep_sar_tx_post(tx_buf);
+		if (ret == -FI_EAGAIN)
+			continue;
+		dlist_remove(&tx_buf->deferred_entry);
+		if (OFI_UNLIKELY(ret)) {
+			rxm_ep->res_fastlock_release(&rxm_ep->send_queue.lock);
+			rxm_ep_sar_tx_seg_error(tx_buf, (int)ret);
+			rxm_ep->res_fastlock_acquire(&rxm_ep->send_queue.lock);
+		}
+	}
+	rxm_ep->res_fastlock_release(&rxm_ep->send_queue.lock);
+}
+
+static ssize_t
+rxm_ep_sar_tx_send(struct rxm_ep *rxm_ep, struct rxm_conn *rxm_conn,
+		   void *context, uint8_t count, const struct iovec *iov,
+		   size_t data_len, uint64_t data, uint64_t flags, uint64_t tag,
+		   uint64_t comp_flags, uint8_t op)
+{
+	struct rxm_tx_entry *tx_entry;
+	struct rxm_tx_buf *tx_buf[RXM_SAR_WINDOW_MAX];
+	size_t segs, window, i;
+	uint64_t msg_id;
+	ssize_t ret;
+
+	segs = (data_len + rxm_ep->sar_seg_size - 1) / rxm_ep->sar_seg_size;
+	window = MIN(segs, rxm_ep->sar_window);
+
+	for (i = 0; i < window; i++) {
+		tx_buf[i] = rxm_tx_buf_get(rxm_ep, RXM_BUF_POOL_TX_SAR);
+		if (!tx_buf[i])
+			break;
+	}
+	window = i;
+	if (OFI_UNLIKELY(!window)) {
+		FI_WARN(&rxm_prov, FI_LOG_EP_DATA, "TX queue full!\n");
+		return -FI_EAGAIN;
+	}
+
+	ret = rxm_ep_format_tx_entry(rxm_ep, context, count, flags, comp_flags,
+				     NULL, &tx_entry);
+	if (OFI_UNLIKELY(ret))
+		goto err;
+
+	tx_entry->state = RXM_SAR_TX;
+	tx_entry->conn = rxm_conn;
+	tx_entry->start = fi_gettime_us();
+	tx_entry->segs = segs;
+	tx_entry->segs_left = segs;
+	tx_entry->next_seg = 0;
+	tx_entry->total_len = data_len;
+	tx_entry->sar_err = 0;
+	tx_entry->rxm_iov.count = count;
+	memcpy(tx_entry->rxm_iov.iov, iov, sizeof(*iov) * count);
+
+	msg_id = ofi_atomic_inc64(&rxm_conn->sar_tx_id);
+	for (i = 0; i < window; i++) {
+		tx_buf[i]->tx_entry = tx_entry;
+		tx_buf[i]->hdr.state = RXM_SAR_TX;
+		tx_buf[i]->pkt.ctrl_hdr.conn_id = rxm_conn->handle.remote_key;
+		tx_buf[i]->pkt.ctrl_hdr.msg_id = msg_id;
+		tx_buf[i]->pkt.ctrl_hdr.seg_size =
+			(uint16_t) rxm_ep->sar_seg_size;
+		tx_buf[i]->pkt.hdr.op = op;
+		tx_buf[i]->pkt.hdr.size = data_len;
+		tx_buf[i]->pkt.hdr.tag = tag;
+		if (flags & FI_REMOTE_CQ_DATA) {
+			tx_buf[i]->pkt.hdr.flags = FI_REMOTE_CQ_DATA;
+			tx_buf[i]->pkt.hdr.data = data;
+		}
+	}
+
+	rxm_ep_sar_tx_fill(tx_entry, tx_buf[0]);
+	ret = rxm_ep_sar_tx_post(tx_buf[0]);
+	if (OFI_UNLIKELY(ret)) {
+		if (ret == -FI_EAGAIN)
+			rxm_ep_progress_multi(&rxm_ep->util_ep);
+		else
+			FI_WARN(&rxm_prov, FI_LOG_EP_DATA,
+				"fi_send for MSG provider failed\n");
+		rxm_tx_entry_release(&rxm_ep->send_queue, tx_entry);
+		goto err;
+	}
+
+	for (i = 1; i < window; i++) {
+		if (OFI_UNLIKELY(tx_entry->sar_err)) {
+			rxm_tx_buf_release(rxm_ep, tx_buf[i]);
+			continue;
+		}
+		rxm_ep_sar_tx_fill(tx_entry, tx_buf[i]);
+		ret = rxm_ep_sar_tx_post(tx_buf[i]);
+		if (ret == -FI_EAGAIN)
+			rxm_ep_sar_tx_defer(rxm_ep, tx_buf[i]);
+		else if (OFI_UNLIKELY(ret))
+			rxm_ep_sar_tx_seg_error(tx_buf[i], (int)ret);
+	}
+	return FI_SUCCESS;
+err:
+	for (i = 0; i < window; i++)
+		rxm_tx_buf_release(rxm_ep, tx_buf[i]);
+	return ret;
+}
+
 void rxm_ep_handle_postponed_tx_op(struct rxm_ep *rxm_ep,
 				   struct rxm_conn *rxm_conn,
 				   struct rxm_tx_entry *tx_entry)
@@ -967,8 +1653,8 @@ void rxm_ep_handle_postponed_tx_op(struct rxm_ep *rxm_ep,
 
 	if ((tx_size <= rxm_ep->msg_info->tx_attr->inject_size) &&
 	    (tx_entry->flags & FI_INJECT) && !(tx_entry->flags & FI_COMPLETION))  {
-		(void) rxm_ep_inject_send(rxm_ep, rxm_conn,
-					  tx_entry->tx_buf, tx_size);
+		(void) rxm_ep_inject_send(rxm_ep, rxm_conn, tx_entry->tx_buf,
+					  tx_size, RXM_CREDIT_TAKEN);
 		/* Release TX entry for futher reuse */
 		rxm_tx_entry_release(&rxm_ep->send_queue, tx_entry);
 	} else if (tx_entry->tx_buf->pkt.hdr.size >
@@ -977,7 +1663,8 @@ void rxm_ep_handle_postponed_tx_op(struct rxm_ep *rxm_ep,
 			(struct rxm_rma_iov *)&tx_entry->tx_buf->pkt.data;
 		ret = rxm_ep_lmt_tx_send(rxm_ep, rxm_conn, tx_entry,
 					 rxm_pkt_size + sizeof(*rma_iov) +
-					 sizeof(*rma_iov->iov) * tx_entry->count);
+					 sizeof(*rma_iov->iov) * tx_entry->count,
+					 RXM_CREDIT_TAKEN);
 		if (OFI_UNLIKELY(ret)) {
 			FI_WARN(&rxm_prov, FI_LOG_EP_DATA,
 				"Unable to perform deferred large send operation\n");
@@ -986,7 +1673,8 @@ void rxm_ep_handle_postponed_tx_op(struct rxm_ep *rxm_ep,
 					   tx_entry->context, (int)ret);
 		}
 	} else {
-		ret = rxm_ep_normal_send(rxm_ep, rxm_conn, tx_entry, tx_size);
+		ret = rxm_ep_normal_send(rxm_ep, rxm_conn, tx_entry, tx_size,
+					 RXM_CREDIT_TAKEN);
 		if (OFI_UNLIKELY(ret)) {
 			FI_WARN(&rxm_prov, FI_LOG_EP_DATA,
 				"Unable to perform deferred send operation\n");
@@ -1032,6 +1720,45 @@ rxm_ep_postpone_send(struct rxm_ep *rxm_ep, struct rxm_conn *rxm_conn,
 	return FI_SUCCESS;
 }
 
+/*
+ * An eager send to a peer that is not connected yet triggers the
+ * connection and is carried in the connection request's CM data when it
+ * fits, so the peer gets it without waiting for connection setup.  It is
+ * completed once the connection is accepted.  Otherwise it is postponed
+ * like any other send.
+ *
+ * Caller must hold `cmap::lock`.
+ */
+static inline ssize_t
+rxm_ep_cm_eager_send(struct rxm_ep *rxm_ep, struct rxm_conn *rxm_conn,
+		     fi_addr_t dest_addr, void *context, uint8_t count,
+		     const struct iovec *iov, size_t len, uint64_t data,
+		     uint64_t flags, uint64_t tag, uint64_t comp_flags,
+		     struct rxm_buf_pool *pool)
+{
+	struct rxm_tx_entry *tx_entry;
+	struct rxm_tx_buf *tx_buf;
+	ssize_t ret;
+
+	ret = rxm_ep_format_tx_res(rxm_ep, rxm_conn, context, count, len, data,
+				   flags, tag, comp_flags, &tx_buf, &tx_entry,
+				   pool);
+	if (OFI_UNLIKELY(ret))
+		return ret;
+	ofi_copy_from_iov(tx_buf->pkt.data, tx_buf->pkt.hdr.size, iov, count, 0);
+	tx_entry->state = RXM_TX;
+
+	rxm_conn->cm_tx_entry = tx_entry;
+	ret = ofi_cmap_handle_connect(rxm_ep->util_ep.cmap, dest_addr,
+				      &rxm_conn->handle);
+	if (OFI_LIKELY(ret == -FI_EAGAIN))
+		return FI_SUCCESS;
+
+	rxm_tx_buf_release(rxm_ep, tx_buf);
+	rxm_tx_entry_release(&rxm_ep->send_queue, tx_entry);
+	return ret;
+}
+
 static inline ssize_t
 rxm_ep_inject_common(struct rxm_ep *rxm_ep, const void *buf, size_t len,
 		     fi_addr_t dest_addr, uint64_t data, uint64_t flags,
@@ -1052,6 +1779,17 @@ rxm_ep_inject_common(struct rxm_ep *rxm_ep, const void *buf, size_t len,
 			.iov_base = (void *)buf,
 			.iov_len = len,
 		};
+		/* Retried by the app once the close request is answered */
+		if (rxm_conn->handle.state == CMAP_CLOSING) {
+			ret = -FI_EAGAIN;
+			goto cmap_err;
+		}
+		if (rxm_conn->handle.state == CMAP_IDLE) {
+			ret = rxm_ep_cm_eager_send(rxm_ep, rxm_conn, dest_addr,
+						   NULL, 1, &iov, len, data,
+						   flags, tag, comp_flags, pool);
+			goto cmap_err;
+		}
 		ret = rxm_ep_handle_unconnected(rxm_ep, &rxm_conn->handle, dest_addr);
 		if (!ret)
 			goto inject_continue;
@@ -1065,18 +1803,28 @@ cmap_err:
 		return ret;
 	}
 inject_continue:
+	/* Sends postponed until connected wait for credits, this one may not
+	 * overtake them */
+	if (OFI_UNLIKELY(!dlist_empty(&rxm_conn->postponed_tx_list))) {
+		ret = -FI_EAGAIN;
+		goto cmap_err;
+	}
 	fastlock_release(&rxm_ep->util_ep.cmap->lock);
 
-	assert(dlist_empty(&rxm_conn->postponed_tx_list));
-
 	if (pkt_size <= rxm_ep->msg_info->tx_attr->inject_size) {
+		if (len <= RXM_INJECT_INLINE_SIZE)
+			return rxm_ep_inject_inline(rxm_ep, rxm_conn, buf, len,
+						    data, flags, tag,
+						    (comp_flags & FI_TAGGED) ?
+						    ofi_op_tagged : ofi_op_msg);
 		ret = rxm_ep_format_tx_res_lightweight(rxm_ep, rxm_conn, len,
 						       data, flags, tag,
 						       &tx_buf, pool);
 		if (OFI_UNLIKELY(ret))
 	    		return ret;
 		memcpy(tx_buf->pkt.data, buf, tx_buf->pkt.hdr.size);
-		return rxm_ep_inject_send(rxm_ep, rxm_conn, tx_buf, pkt_size);
+		return rxm_ep_inject_send(rxm_ep, rxm_conn, tx_buf, pkt_size,
+					  RXM_CREDITS_RSVD);
 	} else {
 		struct rxm_tx_entry *tx_entry;
 
@@ -1090,7 +1838,8 @@ inject_continue:
 			return ret;
 		memcpy(tx_buf->pkt.data, buf, tx_buf->pkt.hdr.size);
 		tx_entry->state = RXM_TX;
-		return rxm_ep_normal_send(rxm_ep, rxm_conn, tx_entry, pkt_size);
+		return rxm_ep_normal_send(rxm_ep, rxm_conn, tx_entry, pkt_size,
+					  RXM_CREDITS_RSVD);
 	}
 }
 
@@ -1112,6 +1861,18 @@ rxm_ep_send_common(struct rxm_ep *rxm_ep, const struct iovec *iov, void **desc,
 	fastlock_acquire(&rxm_ep->util_ep.cmap->lock);
 	rxm_conn = rxm_acquire_conn(rxm_ep, dest_addr);
 	if (OFI_UNLIKELY(rxm_conn->handle.state != CMAP_CONNECTED)) {
+		if (rxm_conn->handle.state == CMAP_CLOSING) {
+			ret = -FI_EAGAIN;
+			goto cmap_err;
+		}
+		if (rxm_conn->handle.state == CMAP_IDLE &&
+		    data_len <= rxm_ep->rxm_info->tx_attr->inject_size) {
+			ret = rxm_ep_cm_eager_send(rxm_ep, rxm_conn, dest_addr,
+						   context, (uint8_t)count, iov,
+						   data_len, data, flags, tag,
+						   comp_flags, pool);
+			goto cmap_err;
+		}
 		ret = rxm_ep_handle_unconnected(rxm_ep, &rxm_conn->handle, dest_addr);
 		if (!ret)
 			goto send_continue;
@@ -1129,23 +1890,32 @@ cmap_err:
 		return ret;
 	}
 send_continue:
+	if (OFI_UNLIKELY(!dlist_empty(&rxm_conn->postponed_tx_list))) {
+		ret = -FI_EAGAIN;
+		goto cmap_err;
+	}
 	fastlock_release(&rxm_ep->util_ep.cmap->lock);
 
-	assert(dlist_empty(&rxm_conn->postponed_tx_list));
+	if (OFI_UNLIKELY((data_len > rxm_ep->rxm_info->tx_attr->inject_size) &&
+			 (flags & FI_INJECT))) {
+		FI_WARN(&rxm_prov, FI_LOG_EP_DATA,
+			"inject size supported: %zu, msg size: %zu\n",
+			rxm_tx_attr.inject_size, data_len);
+		return -FI_EMSGSIZE;
+	}
 
-	if (data_len > rxm_ep->rxm_info->tx_attr->inject_size) {
-		if (OFI_UNLIKELY(flags & FI_INJECT)) {
-			FI_WARN(&rxm_prov, FI_LOG_EP_DATA,
-				"inject size supported: %zu, msg size: %zu\n",
-				rxm_tx_attr.inject_size, data_len);
-			return -FI_EMSGSIZE;
-		}
+	if (rxm_ep_use_lmt(rxm_ep, rxm_conn, data_len, flags)) {
 		ret = rxm_ep_alloc_lmt_tx_res(rxm_ep, rxm_conn, context, (uint8_t)count,
 					      iov, desc, data_len, data, flags, tag,
 					      comp_flags, op, &tx_entry);
 		if (OFI_UNLIKELY(ret < 0))
 			return ret;			
-		return rxm_ep_lmt_tx_send(rxm_ep, rxm_conn, tx_entry, rxm_pkt_size + ret);
+		return rxm_ep_lmt_tx_send(rxm_ep, rxm_conn, tx_entry,
+					  rxm_pkt_size + ret, RXM_CREDITS_RSVD);
+	} else if (data_len > rxm_ep->rxm_info->tx_attr->inject_size) {
+		return rxm_ep_sar_tx_send(rxm_ep, rxm_conn, context,
+					  (uint8_t)count, iov, data_len,
+					  data, flags, tag, comp_flags, op);
 	} else {
 		size_t total_len = rxm_pkt_size + data_len;
 
@@ -1158,7 +1928,8 @@ send_continue:
 
 		if ((flags & FI_INJECT) && !(flags & FI_COMPLETION) &&
 		    (total_len <= rxm_ep->msg_info->tx_attr->inject_size))
-			return rxm_ep_inject_send(rxm_ep, rxm_conn, tx_buf, total_len);
+			return rxm_ep_inject_send(rxm_ep, rxm_conn, tx_buf,
+						  total_len, RXM_CREDITS_RSVD);
 
 		ret = rxm_ep_format_tx_entry(rxm_ep, context, (uint8_t)count,
 					     flags, comp_flags, tx_buf, &tx_entry);
@@ -1167,7 +1938,12 @@ send_continue:
 			return ret;
 		}
 		tx_entry->state = RXM_TX;
-		return rxm_ep_normal_send(rxm_ep, rxm_conn, tx_entry, total_len);
+		if (OFI_UNLIKELY(rxm_proto_near_limit(&rxm_conn->proto, data_len))) {
+			tx_entry->conn = rxm_conn;
+			tx_entry->start = fi_gettime_us();
+		}
+		return rxm_ep_normal_send(rxm_ep, rxm_conn, tx_entry, total_len,
+					  RXM_CREDITS_RSVD);
 	}
 }
 
@@ -1465,8 +2241,13 @@ static int rxm_ep_close(struct fid *fid)
 	}
 	OFI_UNUSED(tmp_list_entry); /* to avoid "set, but not used" warning*/
 
-	if (rxm_ep->util_ep.cmap)
+	if (rxm_ep->util_ep.cmap) {
+		FI_INFO(&rxm_prov, FI_LOG_EP_CTRL, "Connections: %" PRIu64
+			" evicted, %" PRIu64 " re-established\n",
+			rxm_ep->util_ep.cmap->evict_cnt,
+			rxm_ep->util_ep.cmap->reconnect_cnt);
 		ofi_cmap_free(rxm_ep->util_ep.cmap);
+	}
 
 	ret = rxm_listener_close(rxm_ep);
 	if (ret)
@@ -1785,6 +2566,12 @@ static int rxm_ep_msg_res_open(struct util_domain *util_domain,
 	rxm_ep->eager_pkt_size =
 		rxm_ep->rxm_info->tx_attr->inject_size + sizeof(struct rxm_pkt);
 
+	if (fi_param_get_size_t(&rxm_prov, "rx_credits", &rxm_ep->rx_credits) ||
+	    !rxm_ep->rx_credits)
+		rxm_ep->rx_credits = RXM_RX_CREDITS;
+	rxm_ep->rx_credits = MIN(MAX(rxm_ep->rx_credits, RXM_RX_CREDITS_MIN),
+				 rxm_ep->msg_info->rx_attr->size);
+
 	dlist_init(&rxm_ep->msg_cq_fd_ref_list);
 
 	if (fi_param_get_bool(&rxm_prov, "use_srx", &use_srx))
@@ -270,13 +270,63 @@ RXM_INI
 	fi_param_define(&rxm_prov, "comp_per_progress", FI_PARAM_INT,
 			"Defines the maximum number of MSG provider CQ entries "
 			"(default: 1) that would be read per progress "
-			"(RxM CQ read).");
+			"(RxM CQ read). Entries are read in batches when "
+			"this is greater than 1.");
 
 	fi_param_define(&rxm_prov, "sar_limit", FI_PARAM_SIZE_T,
 			"Set this environment variable to control the RxM SAR "
 			"(Segmentation And Reassembly) protocol. "
 			"Messages of size greater than this (default: 256 Kb) "
-			"would be transmitted via rendezvous protocol.");
+			"would be transmitted via rendezvous protocol. This is "
+			"where the rendezvous threshold of a connection starts "
+			"from before it adapts to the measured bandwidth of "
+			"either protocol.");
+
+	fi_param_define(&rxm_prov, "proto_limit_min", FI_PARAM_SIZE_T,
+			"Defines the lowest rendezvous threshold a connection "
+			"may adapt to (default and minimum: the buffer size). "
+			"Messages up to the threshold are copied through "
+			"transmit buffers.");
+
+	fi_param_define(&rxm_prov, "proto_limit_max", FI_PARAM_SIZE_T,
+			"Defines the highest rendezvous threshold a connection "
+			"may adapt to (default: 4 Mb).");
+
+	fi_param_define(&rxm_prov, "sar_window", FI_PARAM_SIZE_T,
+			"Defines the maximum number of segments of a SAR "
+			"message that are in flight at a time (default: 8, "
+			"max: 64).");
+
+	fi_param_define(&rxm_prov, "mr_cache_max_count", FI_PARAM_SIZE_T,
+			"Defines the maximum number of registrations of "
+			"rendezvous buffers that are kept cached (default: "
+			"1024). Setting this to 0 disables the cache.");
+
+	fi_param_define(&rxm_prov, "mr_cache_max_size", FI_PARAM_SIZE_T,
+			"Defines the maximum total size in bytes of cached "
+			"registrations of rendezvous buffers (default: no "
+			"limit).");
+
+	fi_param_define(&rxm_prov, "rx_credits", FI_PARAM_SIZE_T,
+			"Defines the number of receive buffers kept posted to "
+			"each connection, which the peer may send as many "
+			"messages into (default: 64, minimum: 4).");
+
+	fi_param_define(&rxm_prov, "rx_pool_size", FI_PARAM_SIZE_T,
+			"Defines the number of receive buffers in use by a "
+			"domain above which connections are no longer "
+			"replenished (default: 4096).");
+
+	fi_param_define(&rxm_prov, "conn_max", FI_PARAM_SIZE_T,
+			"Defines the number of connections of an endpoint above "
+			"which idle connections are closed, least recently used "
+			"first, and re-established on next use (default: 0, no "
+			"limit).");
+
+	fi_param_define(&rxm_prov, "conn_idle_time", FI_PARAM_SIZE_T,
+			"Defines the time in milliseconds a connection has to "
+			"be unused before it can be closed to stay within "
+			"FI_OFI_RXM_CONN_MAX (default: 1000).");
 
 	fi_param_define(&rxm_prov, "use_srx", FI_PARAM_BOOL,
 			"Set this enivronment variable to control the RxM "
@@ -189,6 +189,8 @@ void rxm_ep_handle_postponed_rma_op(struct rxm_ep *rxm_ep,
 	       "Perform deferred RMA operation (len - %zd) for %p conn\n",
 	       tx_entry->rma_buf->pkt.hdr.size, rxm_conn);
 
+	tx_entry->conn = rxm_conn;
+	ofi_atomic_inc32(&rxm_conn->rma_pending);
 	if (tx_entry->comp_flags & FI_WRITE) {
 		uint64_t flags = ((tx_entry->flags & FI_INJECT) ?
 				  ((tx_entry->flags & ~FI_INJECT) |
@@ -197,6 +199,7 @@ void rxm_ep_handle_postponed_rma_op(struct rxm_ep *rxm_ep,
 				  &tx_entry->rma_buf->msg,
 				  flags);
 		if (OFI_UNLIKELY(ret)) {
+			ofi_atomic_dec32(&rxm_conn->rma_pending);
 			rxm_cq_write_error(rxm_ep->util_ep.tx_cq,
 					   rxm_ep->util_ep.wr_cntr,
 					   tx_entry->context, (int)ret);
@@ -208,6 +211,7 @@ void rxm_ep_handle_postponed_rma_op(struct rxm_ep *rxm_ep,
 				 &tx_entry->rma_buf->msg,
 				 tx_entry->flags);
 		if (OFI_UNLIKELY(ret)) {
+			ofi_atomic_dec32(&rxm_conn->rma_pending);
 			rxm_cq_write_error(rxm_ep->util_ep.tx_cq,
 					   rxm_ep->util_ep.rd_cntr,
 					   tx_entry->context, (int)ret);
@@ -307,6 +311,10 @@ rxm_ep_rma_common(struct rxm_ep *rxm_ep, const struct fi_msg_rma *msg, uint64_t
 	fastlock_acquire(&rxm_ep->util_ep.cmap->lock);
 	rxm_conn = rxm_acquire_conn(rxm_ep, msg->addr);
 	if (OFI_UNLIKELY(rxm_conn->handle.state != CMAP_CONNECTED)) {
+		if (rxm_conn->handle.state == CMAP_CLOSING) {
+			ret = -FI_EAGAIN;
+			goto cmap_err;
+		}
 		ret = rxm_ep_handle_unconnected(rxm_ep, &rxm_conn->handle, msg->addr);
 		if (!ret)
 			goto rma_continue;
@@ -337,9 +345,12 @@ rma_continue:
 		goto err;
 	msg_rma.desc = mr_desc;
 
+	tx_entry->conn = rxm_conn;
+	ofi_atomic_inc32(&rxm_conn->rma_pending);
 	ret = rma_msg(rxm_conn->msg_ep, &msg_rma, flags);
 	if (OFI_LIKELY(!ret))
 		return ret;
+	ofi_atomic_dec32(&rxm_conn->rma_pending);
 
 	if ((rxm_ep->msg_mr_local) && (!rxm_ep->rxm_mr_local))
 		rxm_ep_msg_mr_closev(tx_entry->mr, tx_entry->count);
@@ -423,6 +434,10 @@ rxm_ep_rma_inject(struct rxm_ep *rxm_ep, const struct fi_msg_rma *msg, uint64_t
 	fastlock_acquire(&rxm_ep->util_ep.cmap->lock);
 	rxm_conn = rxm_acquire_conn(rxm_ep, msg->addr);
 	if (OFI_UNLIKELY(rxm_conn->handle.state != CMAP_CONNECTED)) {
+		if (rxm_conn->handle.state == CMAP_CLOSING) {
+			ret = -FI_EAGAIN;
+			goto cmap_err;
+		}
 		ret = rxm_ep_handle_unconnected(rxm_ep, &rxm_conn->handle, msg->addr);
 		if (!ret)
 			goto rma_inject_continue;
@@ -463,8 +478,11 @@ rma_inject_continue:
 	if (OFI_UNLIKELY(ret))
 		return ret;
 	flags = (flags & ~FI_INJECT) | FI_COMPLETION;
+	tx_entry->conn = rxm_conn;
+	ofi_atomic_inc32(&rxm_conn->rma_pending);
 	ret = fi_writemsg(rxm_conn->msg_ep, &rma_buf->msg, flags);
 	if (OFI_UNLIKELY(ret)) {
+		ofi_atomic_dec32(&rxm_conn->rma_pending);
 		if (ret == -FI_EAGAIN)
 			rxm_ep_progress_multi(&rxm_ep->util_ep);
 		goto err;
@@ -71,6 +71,18 @@ extern struct fi_provider smr_prov;
 extern struct fi_info smr_info;
 extern struct util_prov smr_util_prov;
 
+struct smr_env {
+	int	disable_cma;
+	int	lazy_map;
+	int	max_mapped;
+	int	progress_batch;
+	int	cma_threads;
+	size_t	cma_stripe_size;
+	int	huge_pages;
+};
+
+extern struct smr_env smr_env;
+
 int smr_fabric(struct fi_fabric_attr *attr, struct fid_fabric **fabric,
 		void *context);
 
@@ -103,6 +115,7 @@ struct smr_ep_entry {
 	uint32_t		iov_count;
 	uint32_t		flags;
 	uint64_t		err;
+	uint64_t		seq;
 };
 
 struct smr_ep;
@@ -132,18 +145,62 @@ static inline int smr_match_tag(uint64_t tag, uint64_t ignore, uint64_t match_ta
 
 struct smr_unexp_msg {
 	struct dlist_entry entry;
+	struct dlist_entry tag_entry;
 	struct smr_cmd cmd;
 };
 
+/*
+ * Local state of one side of a SAR transfer.  The side that copies into
+ * the bounce buffers fills, the other side drains.  Sends and writes are
+ * filled by the initiator; reads are filled by the target.
+ */
+struct smr_sar_entry {
+	struct dlist_entry	entry;
+	struct smr_cmd		cmd;
+	struct smr_region	*peer_smr;
+	struct smr_sar_msg	*sar_msg;
+	struct smr_resp		*resp;
+	void			*context;
+	struct iovec		iov[SMR_IOV_LIMIT];
+	size_t			iov_count;
+	size_t			bytes_done;
+	size_t			total_len;
+	int			next;
+	int			fill;
+	int			err;
+};
+
 DECLARE_FREESTACK(struct smr_ep_entry, smr_recv_fs);
 DECLARE_FREESTACK(struct smr_unexp_msg, smr_unexp_fs);
 DECLARE_FREESTACK(struct smr_cmd, smr_pend_fs);
+DECLARE_FREESTACK(struct smr_sar_entry, smr_sar_fs);
 
+/*
+ * Tagged queues hash their entries by tag so a message or receive with an
+ * exact tag only scans the entries that share its bucket.  Posted receives
+ * with ignore bits stay on the queue's list, and a sequence number taken
+ * at post time decides between the oldest exact and the oldest wildcard
+ * match.  Unexpected messages are on both the list, in arrival order for
+ * wildcard receives, and their tag bucket.  Queues without tag lists keep
+ * every entry on the list.
+ */
 struct smr_queue {
 	struct dlist_entry list;
+	struct dlist_entry *tag_lists;
+	uint64_t tag_mask;
+	uint64_t seq;
+	size_t count;
 	dlist_func_t *match_func;
 };
 
+void smr_queue_insert(struct smr_queue *queue, struct smr_ep_entry *entry);
+void smr_queue_reinsert(struct smr_queue *queue, struct smr_ep_entry *entry);
+struct smr_ep_entry *smr_queue_match(struct smr_queue *queue,
+				     struct smr_match_attr *attr);
+void smr_unexp_insert(struct smr_queue *queue, struct smr_unexp_msg *unexp);
+struct smr_unexp_msg *smr_unexp_match(struct smr_queue *queue,
+				      struct smr_match_attr *attr);
+
 struct smr_fabric {
 	struct util_fabric	util_fabric;
 	int			dom_idx;
@@ -187,6 +244,16 @@ struct smr_ep {
 	struct smr_unexp_fs	*unexp_fs;
 	struct smr_pend_fs	*pend_fs;
 	struct smr_queue	unexp_queue;
+	struct smr_sar_fs	*tx_sar_fs; /* protected by tx_cq lock */
+	struct dlist_entry	tx_sar_list;
+	struct smr_sar_fs	*rx_sar_fs; /* protected by rx_cq lock */
+	struct dlist_entry	rx_sar_list;
+
+	/* forwards doorbell rings to CQs with a wait object */
+	int			wait_active;
+	int			wait_stop;
+	pthread_t		wait_thread;
+	struct fd_signal	signal;
 };
 
 #define smr_ep_rx_flags(smr_ep) ((smr_ep)->util_ep.rx_op_flags)
@@ -198,10 +265,48 @@ int smr_endpoint(struct fid_domain *domain, struct fi_info *info,
 int smr_cq_open(struct fid_domain *domain, struct fi_cq_attr *attr,
 		struct fid_cq **cq_fid, void *context);
 
+/*
+ * smr_verify_peer maps the peer if needed and holds it mapped until the
+ * matching smr_release_peer.
+ */
 int smr_verify_peer(struct smr_ep *ep, int peer_id);
 
+static inline void smr_release_peer(struct smr_ep *ep, int peer_id)
+{
+	smr_map_release(ep->region->map, peer_id);
+}
+
+/* Takes another reference on a peer the caller already holds */
+static inline void smr_hold_peer(struct smr_ep *ep, int peer_id)
+{
+	(void) smr_map_try_acquire(ep->region->map, peer_id);
+}
+
+/*
+ * Pending commands hold their peer until the response is processed, and
+ * carry our index for it rather than the peer's index for us.
+ */
+static inline void smr_hold_pend(struct smr_ep *ep, struct smr_cmd *pend,
+				 int peer_id)
+{
+	pend->msg.hdr.addr = peer_id;
+	smr_hold_peer(ep, peer_id);
+}
+
+int smr_cma_enabled(struct smr_ep *ep, int peer_id);
+void smr_cma_publish(struct smr_ep *ep, int peer_id);
+int smr_peer_cma_enabled(struct smr_ep *ep, int peer_id);
+
+#define SMR_CMA_MAX_THREADS	64
+
+ssize_t smr_cma_copy(pid_t pid, const struct iovec *local, size_t local_cnt,
+		     const struct iovec *remote, size_t remote_cnt,
+		     int is_write);
+void smr_cma_fini(void);
+
 void smr_post_pend_resp(struct smr_cmd *cmd, struct smr_cmd *pend,
 			struct smr_resp *resp);
+void smr_cancel_resp(struct smr_ep *ep, int64_t pos);
 void smr_generic_format(struct smr_cmd *cmd, fi_addr_t peer_id,
 		uint32_t op, uint64_t tag, uint8_t datatype, uint8_t atomic_op,
 		uint64_t data, uint64_t op_flags);
@@ -217,22 +322,35 @@ void smr_format_iov(struct smr_cmd *cmd, fi_addr_t peer_id,
 		uint32_t op, uint64_t tag, uint64_t data, uint64_t op_flags,
 		void *context, struct smr_region *smr, struct smr_resp *resp,
 		struct smr_cmd *pend);
+void smr_init_sar_entry(struct smr_sar_entry *sar, struct smr_cmd *cmd,
+		struct smr_region *peer_smr, struct smr_sar_msg *sar_msg,
+		struct smr_resp *resp, const struct iovec *iov, size_t count,
+		int fill);
+void smr_format_sar(struct smr_cmd *cmd, fi_addr_t peer_id,
+		const struct iovec *iov, size_t count, size_t total_len,
+		uint32_t op, uint64_t tag, uint64_t data, uint64_t op_flags,
+		void *context, struct smr_region *smr, struct smr_resp *resp,
+		struct smr_cmd *pend, struct smr_region *peer_smr,
+		struct smr_sar_msg *sar_msg, struct smr_sar_entry *sar);
 
 int smr_tx_comp(struct smr_ep *ep, void *context, uint64_t flags, uint64_t err);
-int smr_tx_comp_signal(struct smr_ep *ep, void *context, uint64_t flags,
-		       uint64_t err);
 int smr_rx_comp(struct smr_ep *ep, void *context, uint64_t flags, size_t len,
 		void *buf, void *addr, uint64_t tag, uint64_t data,
 		uint64_t err);
 int smr_rx_src_comp(struct smr_ep *ep, void *context, uint64_t flags,
 		    size_t len, void *buf, void *addr, uint64_t tag,
 		    uint64_t data, uint64_t err);
-int smr_rx_comp_signal(struct smr_ep *ep, void *context, uint64_t flags,
-		       size_t len, void *buf, void *addr, uint64_t tag,
-		       uint64_t data, uint64_t err);
-int smr_rx_src_comp_signal(struct smr_ep *ep, void *context, uint64_t flags,
-			   size_t len, void *buf, void *addr, uint64_t tag,
-			   uint64_t data, uint64_t err);
+
+/*
+ * Completions are written without waking the CQ.  Callers signal the CQ
+ * once after writing one or more completions, so a progress batch costs
+ * a single wakeup.
+ */
+static inline void smr_cq_signal(struct util_cq *cq)
+{
+	if (cq->wait)
+		cq->wait->signal(cq->wait);
+}
 
 uint64_t smr_tx_comp_flags(uint32_t op);
 uint64_t smr_rx_comp_flags(uint32_t op, uint16_t op_flags);
@@ -240,5 +358,7 @@ uint64_t smr_mr_reg_flags(uint32_t op, uint16_t atomic_op);
 
 void smr_ep_progress(struct util_ep *util_ep);
 int smr_progress_unexp(struct smr_ep *ep, struct smr_ep_entry *entry);
+int smr_progress_sar(struct smr_sar_entry *sar);
+int smr_sar_ready(struct smr_sar_entry *sar);
 
 #endif
@@ -160,24 +160,25 @@ static int smr_fetch_result(struct smr_ep *ep, struct smr_region *peer_smr,
 }
 
 static void smr_post_fetch_resp(struct smr_ep *ep, struct smr_cmd *cmd,
+				int peer_id, int64_t resp_pos,
 				const struct iovec *result_iov, size_t count)
 {
 	struct smr_cmd *pend;
 	struct smr_resp *resp;
 
-	assert(!ofi_cirque_isfull(smr_resp_queue(ep->region)));
-	resp = ofi_cirque_tail(smr_resp_queue(ep->region));
+	resp = smr_resp_queue_slot(smr_resp_queue(ep->region), resp_pos);
 
 	cmd->msg.hdr.data = (uint64_t) ((char **) resp -
 			    (char **) ep->region);
 
 	pend = freestack_pop(ep->pend_fs);
 	smr_post_pend_resp(cmd, pend, resp);
+	smr_hold_pend(ep, pend, peer_id);
 	memcpy(pend->msg.data.iov, result_iov,
 	       sizeof(*result_iov) * count);
 	pend->msg.data.iov_count = count;
 
-	ofi_cirque_commit(smr_resp_queue(ep->region));
+	smr_resp_queue_publish(smr_resp_queue(ep->region), resp_pos);
 }
 
 static ssize_t smr_generic_atomic(struct fid_ep *ep_fid,
@@ -192,11 +193,12 @@ static ssize_t smr_generic_atomic(struct fid_ep *ep_fid,
 	struct smr_ep *ep;
 	struct smr_domain *domain;
 	struct smr_region *peer_smr;
-	struct smr_inject_buf *tx_buf;
+	struct smr_inject_buf *tx_buf = NULL;
 	struct smr_cmd *cmd;
 	struct iovec iov[SMR_IOV_LIMIT];
 	struct iovec compare_iov[SMR_IOV_LIMIT];
 	struct iovec result_iov[SMR_IOV_LIMIT];
+	int64_t pos, resp_pos = -1;
 	int peer_id, err = 0;
 	uint16_t flags = 0;
 	ssize_t ret = 0;
@@ -216,11 +218,6 @@ static ssize_t smr_generic_atomic(struct fid_ep *ep_fid,
 		return ret;
 
 	peer_smr = smr_peer_region(ep->region, peer_id);
-	fastlock_acquire(&peer_smr->lock);
-	if (peer_smr->cmd_cnt < 2) {
-		ret = -FI_EAGAIN;
-		goto unlock_region;
-	}
 
 	fastlock_acquire(&ep->util_ep.tx_cq->cq_lock);
 	if (ofi_cirque_isfull(ep->util_ep.tx_cq->cirq)) {
@@ -228,7 +225,6 @@ static ssize_t smr_generic_atomic(struct fid_ep *ep_fid,
 		goto unlock_cq;
 	}
 
-	cmd = ofi_cirque_tail(smr_cmd_queue(peer_smr));
 	msg_len = total_len = ofi_datatype_size(datatype) *
 			      ofi_total_ioc_cnt(ioc, count);
 	
@@ -243,7 +239,7 @@ static ssize_t smr_generic_atomic(struct fid_ep *ep_fid,
 		assert(result_ioc);
 		smr_ioc_to_iov(result_ioc, result_iov, result_count,
 			       ofi_datatype_size(datatype));
-		if (!domain->fast_rma)
+		if (!domain->fast_rma || !smr_cma_enabled(ep, peer_id))
 			flags |= SMR_RMA_REQ;
 		/* fall through */
 	case ofi_op_atomic:
@@ -258,34 +254,55 @@ static ssize_t smr_generic_atomic(struct fid_ep *ep_fid,
 		break;
 	}
 
-	if (total_len <= SMR_MSG_DATA_LEN && !(flags & SMR_RMA_REQ)) {
+	if (total_len > SMR_INJECT_SIZE) {
+		FI_WARN(&smr_prov, FI_LOG_EP_CTRL,
+			"message too large\n");
+		ret = -FI_EINVAL;
+		goto unlock_cq;
+	} else if (total_len > SMR_MSG_DATA_LEN || flags & SMR_RMA_REQ) {
+		tx_buf = smr_freestack_pop(smr_inject_pool(peer_smr));
+		if (!tx_buf) {
+			ret = -FI_EAGAIN;
+			goto unlock_cq;
+		}
+	}
+
+	if (flags & SMR_RMA_REQ) {
+		ret = smr_resp_queue_reserve(smr_resp_queue(ep->region), 1,
+					     &resp_pos);
+		if (ret)
+			goto free_buf;
+	}
+
+	ret = smr_cmd_queue_reserve(smr_cmd_queue(peer_smr), 2, &pos);
+	if (ret) {
+		if (flags & SMR_RMA_REQ)
+			smr_cancel_resp(ep, resp_pos);
+		goto free_buf;
+	}
+	cmd = smr_cmd_queue_slot(smr_cmd_queue(peer_smr), pos);
+
+	if (!tx_buf) {
 		smr_format_inline_atomic(cmd, smr_peer_addr(ep->region)[peer_id].addr,
 					 iov, count, compare_iov, compare_count,
 					 op, datatype, atomic_op);
-	} else if (total_len <= SMR_INJECT_SIZE) {
-		tx_buf = smr_freestack_pop(smr_inject_pool(peer_smr));
+	} else {
 		smr_format_inject_atomic(cmd, smr_peer_addr(ep->region)[peer_id].addr,
 					 iov, count, result_iov, result_count,
 					 compare_iov, compare_count, op, datatype,
 					 atomic_op, peer_smr, tx_buf);
-	} else {
-		FI_WARN(&smr_prov, FI_LOG_EP_CTRL,
-			"message too large\n");
-		ret = -FI_EINVAL;
-		goto unlock_cq;
 	}
 	cmd->msg.hdr.op_flags |= flags;
 
-	ofi_cirque_commit(smr_cmd_queue(peer_smr));
-	peer_smr->cmd_cnt--;
+	if (flags & SMR_RMA_REQ)
+		smr_post_fetch_resp(ep, cmd, peer_id, resp_pos,
+				    (const struct iovec *) result_iov,
+				    result_count);
 
-	if (op != ofi_op_atomic) {
-		if (flags & SMR_RMA_REQ) {
-			smr_post_fetch_resp(ep, cmd,
-				(const struct iovec *) result_iov,
-				result_count);
-			goto format_rma;
-		}
+	smr_format_rma_ioc(smr_cmd_queue_slot(smr_cmd_queue(peer_smr), pos + 1),
+			   rma_ioc, rma_count);
+
+	if (op != ofi_op_atomic && !(flags & SMR_RMA_REQ)) {
 		err = smr_fetch_result(ep, peer_smr, result_iov, result_count,
 				       rma_ioc, rma_count, datatype, msg_len);
 		if (err)
@@ -293,21 +310,27 @@ static ssize_t smr_generic_atomic(struct fid_ep *ep_fid,
 				"unable to fetch results");
 	}
 
+	smr_cmd_queue_publish(smr_cmd_queue(peer_smr), pos + 1);
+	smr_cmd_queue_publish(smr_cmd_queue(peer_smr), pos);
+	smr_signal(peer_smr);
+
+	if (flags & SMR_RMA_REQ)
+		goto unlock_cq;
+
 	ret = ep->tx_comp(ep, context, smr_tx_comp_flags(op), err);
 	if (ret) {
 		FI_WARN(&smr_prov, FI_LOG_EP_CTRL,
 			"unable to process tx completion\n");
 	}
+	smr_cq_signal(ep->util_ep.tx_cq);
+	goto unlock_cq;
 
-format_rma:
-	cmd = ofi_cirque_tail(smr_cmd_queue(peer_smr));
-	smr_format_rma_ioc(cmd, rma_ioc, rma_count);
-	ofi_cirque_commit(smr_cmd_queue(peer_smr));
-	peer_smr->cmd_cnt--;
+free_buf:
+	if (tx_buf)
+		smr_freestack_push(smr_inject_pool(peer_smr), tx_buf);
 unlock_cq:
 	fastlock_release(&ep->util_ep.tx_cq->cq_lock);
-unlock_region:
-	fastlock_release(&peer_smr->lock);
+	smr_release_peer(ep, peer_id);
 	return ret;
 }
 
@@ -363,10 +386,11 @@ static ssize_t smr_atomic_inject(struct fid_ep *ep_fid, const void *buf,
 {
 	struct smr_ep *ep;
 	struct smr_region *peer_smr;
-	struct smr_inject_buf *tx_buf;
+	struct smr_inject_buf *tx_buf = NULL;
 	struct smr_cmd *cmd;
 	struct iovec iov;
 	struct fi_rma_ioc rma_ioc;
+	int64_t pos;
 	int peer_id;
 	ssize_t ret = 0;
 	size_t total_len;
@@ -381,13 +405,6 @@ static ssize_t smr_atomic_inject(struct fid_ep *ep_fid, const void *buf,
 		return ret;
 
 	peer_smr = smr_peer_region(ep->region, peer_id);
-	fastlock_acquire(&peer_smr->lock);
-	if (peer_smr->cmd_cnt < 2) {
-		ret = -FI_EAGAIN;
-		goto unlock_region;
-	}
-
-	cmd = ofi_cirque_tail(smr_cmd_queue(peer_smr));
 	total_len = count * ofi_datatype_size(datatype);
 	
 	iov.iov_base = (void *) buf;
@@ -397,26 +414,40 @@ static ssize_t smr_atomic_inject(struct fid_ep *ep_fid, const void *buf,
 	rma_ioc.count = count;
 	rma_ioc.key = key;
 
+	if (total_len > SMR_MSG_DATA_LEN) {
+		tx_buf = smr_freestack_pop(smr_inject_pool(peer_smr));
+		if (!tx_buf) {
+			ret = -FI_EAGAIN;
+			goto out;
+		}
+	}
+
+	ret = smr_cmd_queue_reserve(smr_cmd_queue(peer_smr), 2, &pos);
+	if (ret) {
+		if (tx_buf)
+			smr_freestack_push(smr_inject_pool(peer_smr), tx_buf);
+		goto out;
+	}
+	cmd = smr_cmd_queue_slot(smr_cmd_queue(peer_smr), pos);
+
 	if (total_len <= SMR_MSG_DATA_LEN) {
 		smr_format_inline_atomic(cmd, smr_peer_addr(ep->region)[peer_id].addr,
 					 &iov, 1, NULL, 0, ofi_op_atomic,
 					 datatype, op);
-	} else if (total_len <= SMR_INJECT_SIZE) {
-		tx_buf = smr_freestack_pop(smr_inject_pool(peer_smr));
+	} else {
 		smr_format_inject_atomic(cmd, smr_peer_addr(ep->region)[peer_id].addr,
 					 &iov, 1, NULL, 0, NULL, 0, ofi_op_atomic,
 					 datatype, op, peer_smr, tx_buf);
 	}
 
-	ofi_cirque_commit(smr_cmd_queue(peer_smr));
-	peer_smr->cmd_cnt--;
-	cmd = ofi_cirque_tail(smr_cmd_queue(peer_smr));
-	smr_format_rma_ioc(cmd, &rma_ioc, 1);
-	ofi_cirque_commit(smr_cmd_queue(peer_smr));
-	peer_smr->cmd_cnt--;
+	smr_format_rma_ioc(smr_cmd_queue_slot(smr_cmd_queue(peer_smr), pos + 1),
+			   &rma_ioc, 1);
+	smr_cmd_queue_publish(smr_cmd_queue(peer_smr), pos + 1);
+	smr_cmd_queue_publish(smr_cmd_queue(peer_smr), pos);
+	smr_signal(peer_smr);
 
-unlock_region:
-	fastlock_release(&peer_smr->lock);
+out:
+	smr_release_peer(ep, peer_id);
 	return ret;
 }
 
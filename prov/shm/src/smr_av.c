@@ -89,6 +89,8 @@ static int smr_av_insert(struct fid_av *av_fid, const void *addr, size_t count,
 
 		if (fi_addr)
 			fi_addr[i] = (ret == 0) ? index : FI_ADDR_NOTAVAIL;
+		if (ret)
+			continue;
 
 		dlist_foreach(&util_av->ep_list, av_entry) {
 			util_ep = container_of(av_entry, struct util_ep, av_entry);
@@ -143,17 +145,21 @@ static int smr_av_lookup(struct fid_av *av, fi_addr_t fi_addr, void *addr,
 {
 	struct util_av *util_av;
 	struct smr_av *smr_av;
-	struct smr_region *peer_smr;
+	struct smr_peer *peer;
 	int peer_id = (int)fi_addr;
 
 	util_av = container_of(av, struct util_av, av_fid);
 	smr_av = container_of(util_av, struct smr_av, util_av);
-	peer_smr = smr_map_get(smr_av->smr_map, peer_id);
 
-	if (!peer_smr)
+	/* Peers may not be mapped yet, so report the name from the map */
+	if (!smr_map_valid(smr_av->smr_map, peer_id))
 		return -FI_ADDR_NOTAVAIL;
 
-	strncpy((char *)addr, smr_name(peer_smr), *addrlen);
+	peer = smr_map_peer(smr_av->smr_map, peer_id);
+	if (!peer->peer.name[0])
+		return -FI_ADDR_NOTAVAIL;
+
+	strncpy((char *)addr, peer->peer.name, *addrlen);
 	((char *) addr)[*addrlen] = '\0';
 	*addrlen = sizeof(struct smr_addr);
 	return 0;
@@ -214,10 +220,6 @@ int smr_av_open(struct fid_domain *domain, struct fi_av_attr *attr,
 	util_attr.addrlen = sizeof(int);
 	util_attr.overhead = 0;
 	util_attr.flags = 0;
-	if (attr->count > SMR_MAX_PEERS) {
-		ret = -FI_ENOSYS;
-		goto out;
-	}
 
 	ret = ofi_av_init(util_domain, attr, &util_attr, &smr_av->util_av, context);
 	if (ret)
@@ -227,7 +229,9 @@ int smr_av_open(struct fid_domain *domain, struct fi_av_attr *attr,
 	(*av)->fid.ops = &smr_av_fi_ops;
 	(*av)->ops = &smr_av_ops;
 
-	ret = smr_map_create(&smr_prov, SMR_MAX_PEERS, &smr_av->smr_map);
+	ret = smr_map_create(&smr_prov, smr_av->util_av.count,
+			     smr_env.lazy_map ? SMR_MAP_LAZY : 0,
+			     smr_env.max_mapped, &smr_av->smr_map);
 	if (ret)
 		goto close;
 
@@ -0,0 +1,287 @@
+/*
+ * Copyright (c) 2013-2018 Intel Corporation. All rights reserved
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <sys/uio.h>
+
+#include "ofi_iov.h"
+#include "smr.h"
+
+/*
+ * CMA copies of at least two stripes are split into one slice per copy
+ * thread.  The caller queues all slices but the first, copies the first
+ * itself, and then helps drain the queue until every slice of its copy
+ * is done, so the copy stays synchronous and completions are only written
+ * once all slices have finished.
+ *
+ * The pool is started by the first striped copy and the helpers inherit
+ * the CPU affinity of the thread that starts it, which keeps them on the
+ * NUMA node the receiving process is bound to.
+ */
+#define SMR_CMA_ALIGN	4096
+
+struct smr_cma_copy {
+	pid_t			pid;
+	int			write;
+	ofi_atomic32_t		pending;
+	ofi_atomic32_t		err;
+	ofi_atomic64_t		bytes;
+};
+
+struct smr_cma_slice {
+	struct dlist_entry	entry;
+	struct smr_cma_copy	*copy;
+	struct iovec		local[SMR_IOV_LIMIT];
+	size_t			local_cnt;
+	struct iovec		remote[SMR_IOV_LIMIT];
+	size_t			remote_cnt;
+};
+
+enum {
+	SMR_CMA_POOL_IDLE,
+	SMR_CMA_POOL_RUNNING,
+	SMR_CMA_POOL_FAILED,
+};
+
+static struct {
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	struct dlist_entry	queue;
+	pthread_t		*threads;
+	int			num_threads;
+	int			state;
+	int			stop;
+} smr_cma_pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+static void smr_cma_run(struct smr_cma_slice *slice)
+{
+	struct smr_cma_copy *copy = slice->copy;
+	ssize_t ret;
+
+	if (copy->write) {
+		ret = process_vm_writev(copy->pid, slice->local,
+					slice->local_cnt, slice->remote,
+					slice->remote_cnt, 0);
+	} else {
+		ret = process_vm_readv(copy->pid, slice->local,
+				       slice->local_cnt, slice->remote,
+				       slice->remote_cnt, 0);
+	}
+
+	if (ret < 0)
+		ofi_atomic_cas_bool32(&copy->err, 0, errno);
+	else
+		ofi_atomic_add64(&copy->bytes, ret);
+
+	/* The copy may go away as soon as its last slice is done */
+	ofi_atomic_dec32(&copy->pending);
+}
+
+static struct smr_cma_slice *smr_cma_pop(void)
+{
+	struct smr_cma_slice *slice;
+
+	if (dlist_empty(&smr_cma_pool.queue))
+		return NULL;
+
+	dlist_pop_front(&smr_cma_pool.queue, struct smr_cma_slice,
+			slice, entry);
+	return slice;
+}
+
+static void *smr_cma_thread(void *arg)
+{
+	struct smr_cma_slice *slice;
+
+	pthread_mutex_lock(&smr_cma_pool.lock);
+	while (!smr_cma_pool.stop) {
+		slice = smr_cma_pop();
+		if (!slice) {
+			pthread_cond_wait(&smr_cma_pool.cond,
+					  &smr_cma_pool.lock);
+			continue;
+		}
+
+		pthread_mutex_unlock(&smr_cma_pool.lock);
+		smr_cma_run(slice);
+		pthread_mutex_lock(&smr_cma_pool.lock);
+	}
+	pthread_mutex_unlock(&smr_cma_pool.lock);
+	return NULL;
+}
+
+/* Called with the pool lock held */
+static int smr_cma_start(void)
+{
+	int i, ret = 0;
+
+	if (smr_cma_pool.state != SMR_CMA_POOL_IDLE)
+		return smr_cma_pool.state == SMR_CMA_POOL_RUNNING ?
+			0 : -FI_ENOSYS;
+
+	smr_cma_pool.state = SMR_CMA_POOL_FAILED;
+	dlist_init(&smr_cma_pool.queue);
+	smr_cma_pool.threads = calloc(smr_env.cma_threads,
+				      sizeof(*smr_cma_pool.threads));
+	if (!smr_cma_pool.threads)
+		return -FI_ENOMEM;
+
+	for (i = 0; i < smr_env.cma_threads; i++) {
+		ret = pthread_create(&smr_cma_pool.threads[i], NULL,
+				     smr_cma_thread, NULL);
+		if (ret) {
+			FI_WARN(&smr_prov, FI_LOG_EP_CTRL,
+				"unable to start CMA copy thread\n");
+			break;
+		}
+	}
+
+	smr_cma_pool.num_threads = i;
+	if (!i) {
+		free(smr_cma_pool.threads);
+		smr_cma_pool.threads = NULL;
+		return -ret;
+	}
+
+	smr_cma_pool.state = SMR_CMA_POOL_RUNNING;
+	return 0;
+}
+
+void smr_cma_fini(void)
+{
+	int i;
+
+	pthread_mutex_lock(&smr_cma_pool.lock);
+	smr_cma_pool.stop = 1;
+	pthread_cond_broadcast(&smr_cma_pool.cond);
+	pthread_mutex_unlock(&smr_cma_pool.lock);
+
+	for (i = 0; i < smr_cma_pool.num_threads; i++)
+		pthread_join(smr_cma_pool.threads[i], NULL);
+
+	free(smr_cma_pool.threads);
+	smr_cma_pool.threads = NULL;
+	smr_cma_pool.num_threads = 0;
+	smr_cma_pool.state = SMR_CMA_POOL_IDLE;
+	smr_cma_pool.stop = 0;
+}
+
+static size_t smr_cma_slice_iov(const struct iovec *iov, size_t iov_count,
+				size_t offset, size_t len, struct iovec *slice)
+{
+	size_t count = iov_count;
+
+	memcpy(slice, iov, sizeof(*iov) * iov_count);
+	ofi_consume_iov(slice, &count, offset);
+	(void) ofi_truncate_iov(slice, &count, len);
+	return count;
+}
+
+/*
+ * Same semantics as process_vm_readv/process_vm_writev: returns the
+ * number of bytes copied, or -1 with errno set.
+ */
+ssize_t smr_cma_copy(pid_t pid, const struct iovec *local, size_t local_cnt,
+		     const struct iovec *remote, size_t remote_cnt, int is_write)
+{
+	struct smr_cma_slice slice[SMR_CMA_MAX_THREADS + 1], *queued;
+	struct smr_cma_copy copy;
+	size_t len, slice_len, offset;
+	int i, n, ret;
+
+	len = MIN(ofi_total_iov_len(local, local_cnt),
+		  ofi_total_iov_len(remote, remote_cnt));
+	n = smr_env.cma_stripe_size ? len / smr_env.cma_stripe_size : 0;
+	n = MIN(n, smr_env.cma_threads + 1);
+	if (n < 2)
+		goto direct;
+
+	pthread_mutex_lock(&smr_cma_pool.lock);
+	ret = smr_cma_start();
+	pthread_mutex_unlock(&smr_cma_pool.lock);
+	if (ret)
+		goto direct;
+
+	slice_len = fi_get_aligned_sz((len + n - 1) / n, SMR_CMA_ALIGN);
+	n = (len + slice_len - 1) / slice_len;
+
+	copy.pid = pid;
+	copy.write = is_write;
+	ofi_atomic_initialize32(&copy.pending, n);
+	ofi_atomic_initialize32(&copy.err, 0);
+	ofi_atomic_initialize64(&copy.bytes, 0);
+
+	for (i = 0, offset = 0; i < n; i++, offset += slice_len) {
+		slice[i].copy = &copy;
+		slice[i].local_cnt = smr_cma_slice_iov(local, local_cnt, offset,
+					MIN(slice_len, len - offset),
+					slice[i].local);
+		slice[i].remote_cnt = smr_cma_slice_iov(remote, remote_cnt,
+					offset, MIN(slice_len, len - offset),
+					slice[i].remote);
+	}
+
+	pthread_mutex_lock(&smr_cma_pool.lock);
+	for (i = 1; i < n; i++)
+		dlist_insert_tail(&slice[i].entry, &smr_cma_pool.queue);
+	pthread_cond_broadcast(&smr_cma_pool.cond);
+	pthread_mutex_unlock(&smr_cma_pool.lock);
+
+	smr_cma_run(&slice[0]);
+
+	/* Copy queued slices ourselves rather than wait on busy helpers */
+	while (ofi_atomic_get32(&copy.pending)) {
+		pthread_mutex_lock(&smr_cma_pool.lock);
+		queued = smr_cma_pop();
+		pthread_mutex_unlock(&smr_cma_pool.lock);
+		if (queued)
+			smr_cma_run(queued);
+		else
+			sched_yield();
+	}
+
+	if (ofi_atomic_get32(&copy.err)) {
+		errno = ofi_atomic_get32(&copy.err);
+		return -1;
+	}
+	return (ssize_t) ofi_atomic_get64(&copy.bytes);
+
+direct:
+	return is_write ?
+		process_vm_writev(pid, local, local_cnt, remote, remote_cnt, 0) :
+		process_vm_readv(pid, local, local_cnt, remote, remote_cnt, 0);
+}
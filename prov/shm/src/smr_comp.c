@@ -65,18 +65,6 @@ int smr_tx_comp(struct smr_ep *ep, void *context, uint64_t flags, uint64_t err)
 	return 0;
 }
 
-int smr_tx_comp_signal(struct smr_ep *ep, void *context, uint64_t flags,
-		       uint64_t err)
-{
-	int ret;
-
-	ret = smr_tx_comp(ep, context, flags, err);
-	if (ret)
-		return ret;
-	ep->util_ep.tx_cq->wait->signal(ep->util_ep.tx_cq->wait);
-	return 0;
-}
-
 int smr_rx_comp(struct smr_ep *ep, void *context, uint64_t flags, size_t len,
 		void *buf, void *addr, uint64_t tag, uint64_t data,
 		uint64_t err)
@@ -117,33 +105,6 @@ int smr_rx_src_comp(struct smr_ep *ep, void *context, uint64_t flags,
 	return smr_rx_comp(ep, context, flags, len, buf, addr, tag, data, err);
 }
 
-int smr_rx_comp_signal(struct smr_ep *ep, void *context, uint64_t flags,
-		       size_t len, void *buf, void *addr, uint64_t tag,
-		       uint64_t data, uint64_t err)
-{
-	int ret;
-
-	ret = smr_rx_comp(ep, context, flags, len, buf, addr, tag, data, err);
-	if (ret)
-		return ret;
-	ep->util_ep.rx_cq->wait->signal(ep->util_ep.rx_cq->wait);
-	return 0;
-}
-
-int smr_rx_src_comp_signal(struct smr_ep *ep, void *context, uint64_t flags,
-			   size_t len, void *buf, void *addr, uint64_t tag,
-			   uint64_t data, uint64_t err)
-{
-	int ret;
-
-	ret = smr_rx_src_comp(ep, context, flags, len, buf, addr, tag, data, err);
-	if (ret)
-		return ret;
-	ep->util_ep.rx_cq->wait->signal(ep->util_ep.rx_cq->wait);
-	return 0;
-
-}
-
 static const uint64_t smr_tx_flags[] = {
 	[ofi_op_msg] = FI_SEND,
 	[ofi_op_tagged] = FI_SEND | FI_TAGGED,
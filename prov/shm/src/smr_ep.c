@@ -32,6 +32,7 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/uio.h>
 
 #include "ofi_iov.h"
@@ -124,23 +125,39 @@ static int smr_match_recv_ctx(struct dlist_entry *item, const void *args)
 	return pending_recv->context == args;
 }
 
+static struct smr_ep_entry *smr_queue_remove_ctx(struct smr_queue *queue,
+						 void *context)
+{
+	struct dlist_entry *item;
+	size_t i;
+
+	item = dlist_remove_first_match(&queue->list, smr_match_recv_ctx,
+					context);
+	for (i = 0; !item && queue->tag_lists && i <= queue->tag_mask; i++)
+		item = dlist_remove_first_match(&queue->tag_lists[i],
+						smr_match_recv_ctx, context);
+	if (!item)
+		return NULL;
+
+	queue->count--;
+	return container_of(item, struct smr_ep_entry, entry);
+}
+
 static int smr_ep_cancel_recv(struct smr_ep *ep, struct smr_queue *queue,
 			      void *context)
 {
 	struct smr_ep_entry *recv_entry;
-	struct dlist_entry *entry;
 	int ret = 0;
 
 	fastlock_acquire(&ep->util_ep.rx_cq->cq_lock);
-	entry = dlist_remove_first_match(&queue->list, smr_match_recv_ctx,
-					 context);
-	if (entry) {
-		recv_entry = container_of(entry, struct smr_ep_entry, entry);
+	recv_entry = smr_queue_remove_ctx(queue, context);
+	if (recv_entry) {
 		ret = ep->rx_comp(ep, (void *) recv_entry->context,
 				  recv_entry->flags | FI_RECV, 0,
 				  NULL, (void *) recv_entry->addr,
 				  recv_entry->tag, 0, FI_ECANCELED);
 		freestack_push(ep->recv_fs, recv_entry);
+		smr_cq_signal(ep->util_ep.rx_cq);
 		ret = ret ? ret : 1;
 	}
 
@@ -178,12 +195,90 @@ int smr_verify_peer(struct smr_ep *ep, int peer_id)
 {
 	int ret;
 
-	if (ep->region->map->peers[peer_id].peer.addr != FI_ADDR_UNSPEC)
+	ret = smr_map_acquire(&smr_prov, ep->region->map, peer_id);
+	if (ret)
+		return (ret == -ENOENT) ? -FI_EAGAIN : ret;
+
+	/*
+	 * Lazily mapped peers do not learn our index when they insert us, so
+	 * look for ourselves in their table until they have.
+	 */
+	if ((ep->region->map->flags & SMR_MAP_LAZY) &&
+	    smr_peer_addr(ep->region)[peer_id].addr == FI_ADDR_UNSPEC)
+		smr_map_to_endpoint(ep->region, peer_id);
+
+	/* Let the peer know early whether it can copy from us */
+	if (smr_peer_cma(ep->region)[peer_id] == SMR_CMA_CAP_NA)
+		smr_cma_publish(ep, peer_id);
+
+	return 0;
+}
+
+/*
+ * Whether we can reach the peer's address space with
+ * process_vm_readv/writev, as needed when we make the copy ourselves.
+ * Probe each peer once by reading its pid out of its own address space;
+ * ptrace scope or seccomp may block CMA in one direction only.
+ */
+int smr_cma_enabled(struct smr_ep *ep, int peer_id)
+{
+	struct smr_peer *peer;
+	struct iovec local, remote;
+	int remote_pid = 0;
+	ssize_t ret;
+
+	if (smr_env.disable_cma)
 		return 0;
 
-	ret = smr_map_to_region(&smr_prov, &ep->region->map->peers[peer_id]);
+	peer = smr_map_peer(ep->region->map, peer_id);
+	if (peer->cma_cap != SMR_CMA_CAP_NA)
+		return peer->cma_cap == SMR_CMA_CAP_ON;
+
+	local.iov_base = &remote_pid;
+	local.iov_len = sizeof(remote_pid);
+	remote.iov_base = (char *) peer->region->base_addr +
+			  offsetof(struct smr_region, pid);
+	remote.iov_len = sizeof(remote_pid);
+
+	ret = process_vm_readv(peer->region->pid, &local, 1, &remote, 1, 0);
+	if (ret == sizeof(remote_pid) && remote_pid == peer->region->pid) {
+		peer->cma_cap = SMR_CMA_CAP_ON;
+	} else {
+		FI_INFO(&smr_prov, FI_LOG_EP_CTRL,
+			"CMA unavailable for peer %s, using SAR\n",
+			peer->peer.name);
+		peer->cma_cap = SMR_CMA_CAP_OFF;
+	}
 
-	return (ret == -ENOENT) ? -FI_EAGAIN : ret;
+	return peer->cma_cap == SMR_CMA_CAP_ON;
+}
+
+/* Publish in our region whether we can copy to and from the peer */
+void smr_cma_publish(struct smr_ep *ep, int peer_id)
+{
+	smr_peer_cma(ep->region)[peer_id] = smr_cma_enabled(ep, peer_id) ?
+					    SMR_CMA_CAP_ON : SMR_CMA_CAP_OFF;
+}
+
+/*
+ * Transfers above the inject size are copied by the receiving peer, so
+ * use what the peer published about us rather than our own probe.  Until
+ * the peer has probed us, large transfers go through its SAR buffers.
+ */
+int smr_peer_cma_enabled(struct smr_ep *ep, int peer_id)
+{
+	struct smr_region *peer_smr;
+	fi_addr_t index;
+
+	if (smr_env.disable_cma)
+		return 0;
+
+	index = smr_peer_addr(ep->region)[peer_id].addr;
+	if (index == FI_ADDR_UNSPEC)
+		return 0;
+
+	peer_smr = smr_peer_region(ep->region, peer_id);
+	return smr_peer_cma(peer_smr)[index] == SMR_CMA_CAP_ON;
 }
 
 static int smr_match_msg(struct dlist_entry *item, const void *args)
@@ -216,11 +311,120 @@ static int smr_match_unexp(struct dlist_entry *item, const void *args)
 			     attr->tag);
 }
 
-static void smr_init_queue(struct smr_queue *queue,
-			   dlist_func_t *match_func)
+static int smr_init_queue(struct smr_queue *queue,
+			  dlist_func_t *match_func, size_t tag_count)
 {
+	size_t i;
+
 	dlist_init(&queue->list);
 	queue->match_func = match_func;
+	queue->seq = 0;
+	queue->count = 0;
+	queue->tag_lists = NULL;
+	if (!tag_count)
+		return 0;
+
+	tag_count = roundup_power_of_two(tag_count);
+	queue->tag_lists = calloc(tag_count, sizeof(*queue->tag_lists));
+	if (!queue->tag_lists)
+		return -FI_ENOMEM;
+
+	for (i = 0; i < tag_count; i++)
+		dlist_init(&queue->tag_lists[i]);
+	queue->tag_mask = tag_count - 1;
+	return 0;
+}
+
+static inline struct dlist_entry *
+smr_tag_list(struct smr_queue *queue, uint64_t tag)
+{
+	tag *= 0x9e3779b97f4a7c15ULL;
+	return &queue->tag_lists[(tag ^ (tag >> 32)) & queue->tag_mask];
+}
+
+static inline struct dlist_entry *
+smr_queue_list(struct smr_queue *queue, struct smr_ep_entry *entry)
+{
+	return (queue->tag_lists && !entry->ignore) ?
+		smr_tag_list(queue, entry->tag) : &queue->list;
+}
+
+void smr_queue_insert(struct smr_queue *queue, struct smr_ep_entry *entry)
+{
+	entry->seq = queue->seq++;
+	dlist_insert_tail(&entry->entry, smr_queue_list(queue, entry));
+	queue->count++;
+}
+
+/* Puts back a multi-recv buffer ahead of later receives */
+void smr_queue_reinsert(struct smr_queue *queue, struct smr_ep_entry *entry)
+{
+	dlist_insert_head(&entry->entry, smr_queue_list(queue, entry));
+	queue->count++;
+}
+
+struct smr_ep_entry *smr_queue_match(struct smr_queue *queue,
+				     struct smr_match_attr *attr)
+{
+	struct smr_ep_entry *exact = NULL, *wild = NULL;
+	struct dlist_entry *item;
+
+	if (queue->tag_lists) {
+		item = dlist_find_first_match(smr_tag_list(queue, attr->tag),
+					      queue->match_func, attr);
+		if (item)
+			exact = container_of(item, struct smr_ep_entry, entry);
+	}
+
+	item = dlist_find_first_match(&queue->list, queue->match_func, attr);
+	if (item)
+		wild = container_of(item, struct smr_ep_entry, entry);
+
+	if (!wild || (exact && exact->seq < wild->seq))
+		wild = exact;
+	if (wild) {
+		dlist_remove(&wild->entry);
+		queue->count--;
+	}
+	return wild;
+}
+
+void smr_unexp_insert(struct smr_queue *queue, struct smr_unexp_msg *unexp)
+{
+	dlist_insert_tail(&unexp->entry, &queue->list);
+	dlist_insert_tail(&unexp->tag_entry,
+			  smr_tag_list(queue, unexp->cmd.msg.hdr.tag));
+	queue->count++;
+}
+
+struct smr_unexp_msg *smr_unexp_match(struct smr_queue *queue,
+				      struct smr_match_attr *attr)
+{
+	struct smr_unexp_msg *unexp;
+	struct dlist_entry *item;
+
+	if (attr->ignore) {
+		item = dlist_find_first_match(&queue->list, queue->match_func,
+					      attr);
+		if (!item)
+			return NULL;
+		unexp = container_of(item, struct smr_unexp_msg, entry);
+		goto found;
+	}
+
+	dlist_foreach_container(smr_tag_list(queue, attr->tag),
+				struct smr_unexp_msg, unexp, tag_entry) {
+		if (unexp->cmd.msg.hdr.tag == attr->tag &&
+		    smr_match_addr(unexp->cmd.msg.hdr.addr, attr->addr))
+			goto found;
+	}
+	return NULL;
+
+found:
+	dlist_remove(&unexp->entry);
+	dlist_remove(&unexp->tag_entry);
+	queue->count--;
+	return unexp;
 }
 
 void smr_post_pend_resp(struct smr_cmd *cmd, struct smr_cmd *pend,
@@ -231,6 +435,17 @@ void smr_post_pend_resp(struct smr_cmd *cmd, struct smr_cmd *pend,
 	resp->status = FI_EBUSY;
 }
 
+/* Returns a reserved response slot that will never be written by a peer */
+void smr_cancel_resp(struct smr_ep *ep, int64_t pos)
+{
+	struct smr_resp *resp;
+
+	resp = smr_resp_queue_slot(smr_resp_queue(ep->region), pos);
+	resp->msg_id = 0;
+	resp->status = 0;
+	smr_resp_queue_publish(smr_resp_queue(ep->region), pos);
+}
+
 void smr_generic_format(struct smr_cmd *cmd, fi_addr_t peer_id,
 			uint32_t op, uint64_t tag, uint8_t datatype,
 			uint8_t atomic_op, uint64_t data,
@@ -292,12 +507,200 @@ void smr_format_iov(struct smr_cmd *cmd, fi_addr_t peer_id,
 	smr_post_pend_resp(cmd, pend_cmd, resp);
 }
 
+void smr_init_sar_entry(struct smr_sar_entry *sar, struct smr_cmd *cmd,
+			struct smr_region *peer_smr, struct smr_sar_msg *sar_msg,
+			struct smr_resp *resp, const struct iovec *iov,
+			size_t count, int fill)
+{
+	sar->cmd = *cmd;
+	sar->peer_smr = peer_smr;
+	sar->sar_msg = sar_msg;
+	sar->resp = resp;
+	memcpy(sar->iov, iov, sizeof(*iov) * count);
+	sar->iov_count = count;
+	sar->bytes_done = 0;
+	sar->total_len = 0;
+	sar->next = 0;
+	sar->fill = fill;
+	sar->err = 0;
+}
+
+void smr_format_sar(struct smr_cmd *cmd, fi_addr_t peer_id,
+		    const struct iovec *iov, size_t count, size_t total_len,
+		    uint32_t op, uint64_t tag, uint64_t data, uint64_t op_flags,
+		    void *context, struct smr_region *smr, struct smr_resp *resp,
+		    struct smr_cmd *pend_cmd, struct smr_region *peer_smr,
+		    struct smr_sar_msg *sar_msg, struct smr_sar_entry *sar)
+{
+	int i;
+
+	smr_generic_format(cmd, peer_id, op, tag, 0, 0, data, op_flags);
+	cmd->msg.hdr.op_src = smr_src_sar;
+	cmd->msg.hdr.src_data = (uint64_t) ((char **) resp - (char **) smr);
+	cmd->msg.hdr.size = total_len;
+	cmd->msg.hdr.msg_id = (uint64_t) (uintptr_t) context;
+	cmd->msg.data.sar = (uint64_t) ((char **) sar_msg - (char **) peer_smr);
+
+	/* The freestack link overwrites the first chunk while on the pool */
+	for (i = 0; i < SMR_SAR_CHUNKS; i++)
+		ofi_atomic_initialize32(&sar_msg->chunk[i].status, SMR_SAR_FREE);
+
+	smr_init_sar_entry(sar, cmd, peer_smr, sar_msg, resp, iov, count,
+			   op != ofi_op_read_req);
+	sar->context = context;
+
+	smr_post_pend_resp(cmd, pend_cmd, resp);
+}
+
+static int smr_sar_list_ready(struct dlist_entry *list)
+{
+	struct smr_sar_entry *sar;
+
+	dlist_foreach_container(list, struct smr_sar_entry, sar, entry) {
+		if (smr_sar_ready(sar))
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Peers cannot signal the fds in our CQ wait sets, so a thread sleeps on
+ * the region doorbell and forwards each ring to an fd added to those wait
+ * sets.  The wait set calls smr_wait_try right before it blocks, which
+ * arms the doorbell and checks whether anything arrived in the meantime.
+ */
+static int smr_wait_try(void *arg)
+{
+	struct smr_ep *ep = arg;
+	struct smr_resp *resp;
+	int ret;
+
+	fd_signal_reset(&ep->signal);
+	ofi_atomic_set32(&ep->region->waiting, 1);
+	ofi_atomic_fence();
+
+	if (smr_cmd_queue_head(smr_cmd_queue(ep->region)))
+		return -FI_EAGAIN;
+
+	resp = smr_resp_queue_head(smr_resp_queue(ep->region));
+	if (resp && resp->status != FI_EBUSY)
+		return -FI_EAGAIN;
+
+	/*
+	 * SAR chunks may have moved without a ring while we were not armed.
+	 * The lists are owned by the progress paths under the CQ locks, which
+	 * are taken one at a time since both CQs may be the same.
+	 */
+	fastlock_acquire(&ep->util_ep.tx_cq->cq_lock);
+	ret = smr_sar_list_ready(&ep->tx_sar_list);
+	fastlock_release(&ep->util_ep.tx_cq->cq_lock);
+	if (ret)
+		return -FI_EAGAIN;
+
+	fastlock_acquire(&ep->util_ep.rx_cq->cq_lock);
+	ret = smr_sar_list_ready(&ep->rx_sar_list);
+	fastlock_release(&ep->util_ep.rx_cq->cq_lock);
+
+	return ret ? -FI_EAGAIN : FI_SUCCESS;
+}
+
+static void *smr_wait_thread(void *arg)
+{
+	struct smr_ep *ep = arg;
+	int seq, cur;
+
+	seq = ofi_atomic_get32(&ep->region->doorbell);
+	while (!ep->wait_stop) {
+		ofi_futex_wait(smr_doorbell(ep->region), seq, -1);
+		cur = ofi_atomic_get32(&ep->region->doorbell);
+		if (cur != seq) {
+			seq = cur;
+			fd_signal_set(&ep->signal);
+		}
+	}
+	return NULL;
+}
+
+static void smr_ep_del_wait(struct smr_ep *ep)
+{
+	if (ep->util_ep.tx_cq->wait)
+		ofi_wait_fd_del(ep->util_ep.tx_cq->wait,
+				ep->signal.fd[FI_READ_FD]);
+	if (ep->util_ep.rx_cq->wait)
+		ofi_wait_fd_del(ep->util_ep.rx_cq->wait,
+				ep->signal.fd[FI_READ_FD]);
+}
+
+static int smr_ep_start_wait(struct smr_ep *ep)
+{
+	int ret;
+
+	ret = fd_signal_init(&ep->signal);
+	if (ret)
+		return ret;
+
+	if (ep->util_ep.tx_cq->wait) {
+		ret = ofi_wait_fd_add(ep->util_ep.tx_cq->wait,
+				      ep->signal.fd[FI_READ_FD], smr_wait_try,
+				      ep, &ep->util_ep.ep_fid.fid);
+		if (ret)
+			goto err1;
+	}
+
+	if (ep->util_ep.rx_cq->wait) {
+		ret = ofi_wait_fd_add(ep->util_ep.rx_cq->wait,
+				      ep->signal.fd[FI_READ_FD], smr_wait_try,
+				      ep, &ep->util_ep.ep_fid.fid);
+		if (ret)
+			goto err2;
+	}
+
+	ep->wait_stop = 0;
+	ret = pthread_create(&ep->wait_thread, NULL, smr_wait_thread, ep);
+	if (ret) {
+		FI_WARN(&smr_prov, FI_LOG_EP_CTRL,
+			"unable to create wait thread\n");
+		ret = -ret;
+		goto err3;
+	}
+
+	ep->wait_active = 1;
+	return 0;
+
+err3:
+	if (ep->util_ep.rx_cq->wait)
+		ofi_wait_fd_del(ep->util_ep.rx_cq->wait,
+				ep->signal.fd[FI_READ_FD]);
+err2:
+	if (ep->util_ep.tx_cq->wait)
+		ofi_wait_fd_del(ep->util_ep.tx_cq->wait,
+				ep->signal.fd[FI_READ_FD]);
+err1:
+	fd_signal_free(&ep->signal);
+	return ret;
+}
+
+static void smr_ep_stop_wait(struct smr_ep *ep)
+{
+	ep->wait_stop = 1;
+	ofi_atomic_inc32(&ep->region->doorbell);
+	ofi_futex_wake(smr_doorbell(ep->region), INT_MAX);
+	pthread_join(ep->wait_thread, NULL);
+
+	smr_ep_del_wait(ep);
+	fd_signal_free(&ep->signal);
+	ep->wait_active = 0;
+}
+
 static int smr_ep_close(struct fid *fid)
 {
 	struct smr_ep *ep;
 
 	ep = container_of(fid, struct smr_ep, util_ep.ep_fid.fid);
 
+	if (ep->wait_active)
+		smr_ep_stop_wait(ep);
+
 	ofi_endpoint_close(&ep->util_ep);
 
 	if (ep->region)
@@ -306,6 +709,10 @@ static int smr_ep_close(struct fid *fid)
 	smr_recv_fs_free(ep->recv_fs);
 	smr_unexp_fs_free(ep->unexp_fs);
 	smr_pend_fs_free(ep->pend_fs);
+	smr_sar_fs_free(ep->tx_sar_fs);
+	smr_sar_fs_free(ep->rx_sar_fs);
+	free(ep->trecv_queue.tag_lists);
+	free(ep->unexp_queue.tag_lists);
 	free(ep);
 	return 0;
 }
@@ -330,21 +737,14 @@ static int smr_ep_bind_cq(struct smr_ep *ep, struct util_cq *cq, uint64_t flags)
 	if (flags & FI_TRANSMIT) {
 		ep->util_ep.tx_cq = cq;
 		ofi_atomic_inc32(&cq->ref);
-		ep->tx_comp = cq->wait ? smr_tx_comp_signal : smr_tx_comp;
+		ep->tx_comp = smr_tx_comp;
 	}
 
 	if (flags & FI_RECV) {
 		ep->util_ep.rx_cq = cq;
 		ofi_atomic_inc32(&cq->ref);
-
-		if (cq->wait) {
-			ep->rx_comp = (cq->domain->info_domain_caps & FI_SOURCE) ?
-				      smr_rx_src_comp_signal :
-				      smr_rx_comp_signal;
-		} else {
-			ep->rx_comp = (cq->domain->info_domain_caps & FI_SOURCE) ?
-				      smr_rx_src_comp : smr_rx_comp;
-		}
+		ep->rx_comp = (cq->domain->info_domain_caps & FI_SOURCE) ?
+			      smr_rx_src_comp : smr_rx_comp;
 	}
 
 	ret = fid_list_insert(&cq->ep_list,
@@ -406,10 +806,20 @@ static int smr_ep_ctrl(struct fid *fid, int command, void *arg)
 		attr.name = ep->name;
 		attr.rx_count = ep->rx_size;
 		attr.tx_count = ep->tx_size;
+		attr.huge_pages = smr_env.huge_pages;
 		ret = smr_create(&smr_prov, av->smr_map, &attr, &ep->region);
 		if (ret)
 			return ret;
 		smr_exchange_all_peers(ep->region);
+
+		if (ep->util_ep.tx_cq->wait || ep->util_ep.rx_cq->wait) {
+			ret = smr_ep_start_wait(ep);
+			if (ret) {
+				smr_free(ep->region);
+				munmap(ep->region, ep->region->total_size);
+				ep->region = NULL;
+			}
+		}
 		break;
 	default:
 		return -FI_ENOSYS;
@@ -479,9 +889,19 @@ int smr_endpoint(struct fid_domain *domain, struct fi_info *info,
 	ep->recv_fs = smr_recv_fs_create(info->rx_attr->size);
 	ep->unexp_fs = smr_unexp_fs_create(info->rx_attr->size);
 	ep->pend_fs = smr_pend_fs_create(info->tx_attr->size);
-	smr_init_queue(&ep->recv_queue, smr_match_msg);
-	smr_init_queue(&ep->trecv_queue, smr_match_tagged);
-	smr_init_queue(&ep->unexp_queue, smr_match_unexp);
+	ep->tx_sar_fs = smr_sar_fs_create(info->tx_attr->size);
+	ep->rx_sar_fs = smr_sar_fs_create(SMR_SAR_COUNT);
+	dlist_init(&ep->tx_sar_list);
+	dlist_init(&ep->rx_sar_list);
+	smr_init_queue(&ep->recv_queue, smr_match_msg, 0);
+	ret = smr_init_queue(&ep->trecv_queue, smr_match_tagged,
+			     info->rx_attr->size);
+	if (ret)
+		goto err3;
+	ret = smr_init_queue(&ep->unexp_queue, smr_match_unexp,
+			     info->rx_attr->size);
+	if (ret)
+		goto err3;
 
 	ep->min_multi_recv_size = SMR_INJECT_SIZE;
 
@@ -496,6 +916,14 @@ int smr_endpoint(struct fid_domain *domain, struct fi_info *info,
 	*ep_fid = &ep->util_ep.ep_fid;
 	return 0;
 
+err3:
+	free(ep->trecv_queue.tag_lists);
+	smr_recv_fs_free(ep->recv_fs);
+	smr_unexp_fs_free(ep->unexp_fs);
+	smr_pend_fs_free(ep->pend_fs);
+	smr_sar_fs_free(ep->tx_sar_fs);
+	smr_sar_fs_free(ep->rx_sar_fs);
+	ofi_endpoint_close(&ep->util_ep);
 err1:
 	free((void *)ep->name);
 err2:
@@ -35,6 +35,15 @@
 #include <ofi_prov.h>
 #include "smr.h"
 
+struct smr_env smr_env = {
+	.disable_cma = 0,
+	.lazy_map = 0,
+	.max_mapped = 0,
+	.progress_batch = 32,
+	.cma_threads = 0,
+	.cma_stripe_size = 1 << 20,
+	.huge_pages = 0,
+};
 
 static void smr_resolve_addr(const char *node, const char *service,
 			     char **addr, size_t *addrlen)
@@ -106,7 +115,7 @@ static int smr_getinfo(uint32_t version, const char *node, const char *service,
 
 static void smr_fini(void)
 {
-	/* yawn */
+	smr_cma_fini();
 }
 
 struct fi_provider smr_prov = {
@@ -124,7 +133,62 @@ struct util_prov smr_util_prov = {
 	.flags = 0
 };
 
+static void smr_init_env(void)
+{
+	fi_param_get_bool(&smr_prov, "disable_cma", &smr_env.disable_cma);
+	fi_param_get_bool(&smr_prov, "lazy_map", &smr_env.lazy_map);
+	fi_param_get_int(&smr_prov, "max_mapped", &smr_env.max_mapped);
+	if (smr_env.max_mapped < 0)
+		smr_env.max_mapped = 0;
+	fi_param_get_int(&smr_prov, "progress_batch", &smr_env.progress_batch);
+	if (smr_env.progress_batch < 1)
+		smr_env.progress_batch = 1;
+	fi_param_get_int(&smr_prov, "cma_threads", &smr_env.cma_threads);
+	smr_env.cma_threads = MAX(0, MIN(smr_env.cma_threads,
+					 SMR_CMA_MAX_THREADS));
+	fi_param_get_size_t(&smr_prov, "cma_stripe_size",
+			    &smr_env.cma_stripe_size);
+	fi_param_get_bool(&smr_prov, "huge_pages", &smr_env.huge_pages);
+}
+
 SHM_INI
 {
+	fi_param_define(&smr_prov, "disable_cma", FI_PARAM_BOOL,
+			"Disable use of CMA (Cross Memory Attach) for large "
+			"transfers. Messages larger than the inject size are "
+			"then copied through shared bounce buffers (SAR). By "
+			"default CMA is used whenever a peer can be accessed "
+			"with process_vm_readv (default: no).");
+	fi_param_define(&smr_prov, "lazy_map", FI_PARAM_BOOL,
+			"Map a peer's shared memory region the first time it "
+			"is used instead of when it is inserted into the AV. "
+			"Reduces startup cost and address space use for large "
+			"jobs (default: no).");
+	fi_param_define(&smr_prov, "max_mapped", FI_PARAM_INT,
+			"Maximum number of peer regions an AV keeps mapped. "
+			"Past this, idle peers are unmapped in least recently "
+			"used order and mapped again on their next use. Best "
+			"combined with lazy_map (default: 0, unlimited).");
+	fi_param_define(&smr_prov, "progress_batch", FI_PARAM_INT,
+			"Maximum number of commands and responses handled by "
+			"a single progress call. Larger batches amortize "
+			"locking and CQ wakeups, smaller ones bound the time "
+			"spent in progress (default: 32).");
+	fi_param_define(&smr_prov, "cma_threads", FI_PARAM_INT,
+			"Number of helper threads that copy slices of large "
+			"CMA transfers in parallel with the progressing "
+			"thread (default: 0, disabled).");
+	fi_param_define(&smr_prov, "cma_stripe_size", FI_PARAM_SIZE_T,
+			"Minimum number of bytes each thread copies when a "
+			"CMA transfer is striped. Transfers smaller than two "
+			"stripes are copied by a single thread "
+			"(default: 1048576).");
+	fi_param_define(&smr_prov, "huge_pages", FI_PARAM_BOOL,
+			"Back endpoint regions with huge pages from a "
+			"writable hugetlbfs mount, falling back to normal "
+			"pages if none is mounted or no huge pages are free "
+			"(default: no).");
+
+	smr_init_env();
 	return &smr_prov;
 }
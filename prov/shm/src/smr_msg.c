@@ -70,6 +70,8 @@ static ssize_t smr_generic_recvmsg(struct smr_ep *ep, const struct iovec *iov,
 
 	if (flags & FI_TAGGED) {
 		ret = smr_progress_unexp(ep, entry);
+		if (!ret)
+			smr_cq_signal(ep->util_ep.rx_cq);
 		if (!ret || ret == -FI_EAGAIN)
 			goto out;
 		recv_queue = &ep->trecv_queue;
@@ -77,7 +79,7 @@ static ssize_t smr_generic_recvmsg(struct smr_ep *ep, const struct iovec *iov,
 		recv_queue = &ep->recv_queue;
 	}
 
-	dlist_insert_tail(&entry->entry, &recv_queue->list);
+	smr_queue_insert(recv_queue, entry);
 
 	ret = 0;
 out:
@@ -128,9 +130,12 @@ static ssize_t smr_generic_sendmsg(struct smr_ep *ep, const struct iovec *iov,
 				   uint64_t op_flags)
 {
 	struct smr_region *peer_smr;
-	struct smr_inject_buf *tx_buf;
+	struct smr_inject_buf *tx_buf = NULL;
+	struct smr_sar_msg *sar_msg = NULL;
+	struct smr_sar_entry *sar;
 	struct smr_resp *resp;
 	struct smr_cmd *cmd, *pend;
+	int64_t pos, resp_pos = -1;
 	int peer_id;
 	ssize_t ret = 0;
 	size_t total_len;
@@ -144,11 +149,6 @@ static ssize_t smr_generic_sendmsg(struct smr_ep *ep, const struct iovec *iov,
 		return ret;
 
 	peer_smr = smr_peer_region(ep->region, peer_id);
-	fastlock_acquire(&peer_smr->lock);
-	if (!peer_smr->cmd_cnt) {
-		ret = -FI_EAGAIN;
-		goto unlock_region;
-	}
 
 	fastlock_acquire(&ep->util_ep.tx_cq->cq_lock);
 	if (ofi_cirque_isfull(ep->util_ep.tx_cq->cirq)) {
@@ -158,40 +158,91 @@ static ssize_t smr_generic_sendmsg(struct smr_ep *ep, const struct iovec *iov,
 
 	total_len = ofi_total_iov_len(iov, iov_count);
 
-	cmd = ofi_cirque_tail(smr_cmd_queue(peer_smr));
+	if (total_len > SMR_INJECT_SIZE) {
+		if (!smr_peer_cma_enabled(ep, peer_id)) {
+			sar_msg = smr_freestack_pop(smr_sar_pool(peer_smr));
+			if (!sar_msg) {
+				ret = -FI_EAGAIN;
+				goto unlock_cq;
+			}
+		}
+		ret = smr_resp_queue_reserve(smr_resp_queue(ep->region), 1,
+					     &resp_pos);
+		if (ret)
+			goto free_sar;
+	} else if (total_len > SMR_MSG_DATA_LEN) {
+		tx_buf = smr_freestack_pop(smr_inject_pool(peer_smr));
+		if (!tx_buf) {
+			ret = -FI_EAGAIN;
+			goto unlock_cq;
+		}
+	}
+
+	ret = smr_cmd_queue_reserve(smr_cmd_queue(peer_smr), 1, &pos);
+	if (ret) {
+		if (resp_pos >= 0)
+			smr_cancel_resp(ep, resp_pos);
+		else if (tx_buf)
+			smr_freestack_push(smr_inject_pool(peer_smr), tx_buf);
+		goto free_sar;
+	}
+	cmd = smr_cmd_queue_slot(smr_cmd_queue(peer_smr), pos);
 
 	if (total_len <= SMR_MSG_DATA_LEN) {
 		smr_format_inline(cmd, smr_peer_addr(ep->region)[peer_id].addr, iov,
 				  iov_count, op, tag, data, op_flags);
 	} else if (total_len <= SMR_INJECT_SIZE) {
-		tx_buf = smr_freestack_pop(smr_inject_pool(peer_smr));
 		smr_format_inject(cmd, smr_peer_addr(ep->region)[peer_id].addr,
 				  iov, iov_count, op, tag, data, op_flags,
 				  peer_smr, tx_buf);
-	} else {
-		assert(!ofi_cirque_isfull(smr_resp_queue(ep->region)));
-		resp = ofi_cirque_tail(smr_resp_queue(ep->region));
+	} else if (!sar_msg) {
+		resp = smr_resp_queue_slot(smr_resp_queue(ep->region), resp_pos);
 		pend = freestack_pop(ep->pend_fs);
 		smr_format_iov(cmd, smr_peer_addr(ep->region)[peer_id].addr, iov,
 			       iov_count, total_len, op, tag, data, op_flags,
 			       context, ep->region, resp, pend);
-		ofi_cirque_commit(smr_resp_queue(ep->region));
-		goto commit;
+		smr_hold_pend(ep, pend, peer_id);
+		smr_resp_queue_publish(smr_resp_queue(ep->region), resp_pos);
+		smr_cmd_queue_publish(smr_cmd_queue(peer_smr), pos);
+		smr_signal(peer_smr);
+		goto unlock_cq;
+	} else {
+		resp = smr_resp_queue_slot(smr_resp_queue(ep->region), resp_pos);
+		pend = freestack_pop(ep->pend_fs);
+		sar = freestack_pop(ep->tx_sar_fs);
+		smr_format_sar(cmd, smr_peer_addr(ep->region)[peer_id].addr, iov,
+			       iov_count, total_len, op, tag, data, op_flags,
+			       context, ep->region, resp, pend, peer_smr,
+			       sar_msg, sar);
+		smr_hold_pend(ep, pend, peer_id);
+		smr_resp_queue_publish(smr_resp_queue(ep->region), resp_pos);
+		smr_cmd_queue_publish(smr_cmd_queue(peer_smr), pos);
+		smr_signal(peer_smr);
+
+		/* Start filling while the peer picks up the command */
+		if (smr_progress_sar(sar))
+			freestack_push(ep->tx_sar_fs, sar);
+		else
+			dlist_insert_tail(&sar->entry, &ep->tx_sar_list);
+		goto unlock_cq;
 	}
+	smr_cmd_queue_publish(smr_cmd_queue(peer_smr), pos);
+	smr_signal(peer_smr);
+
 	ret = ep->tx_comp(ep, context, smr_tx_comp_flags(op), 0);
 	if (ret) {
 		FI_WARN(&smr_prov, FI_LOG_EP_CTRL,
 			"unable to process tx completion\n");
-		goto unlock_cq;
 	}
+	smr_cq_signal(ep->util_ep.tx_cq);
+	goto unlock_cq;
 
-commit:
-	ofi_cirque_commit(smr_cmd_queue(peer_smr));
-	peer_smr->cmd_cnt--;
+free_sar:
+	if (sar_msg)
+		smr_freestack_push(smr_sar_pool(peer_smr), sar_msg);
 unlock_cq:
 	fastlock_release(&ep->util_ep.tx_cq->cq_lock);
-unlock_region:
-	fastlock_release(&peer_smr->lock);
+	smr_release_peer(ep, peer_id);
 	return ret;
 }
 
@@ -240,8 +291,9 @@ static ssize_t smr_generic_inject(struct fid_ep *ep_fid, const void *buf,
 {
 	struct smr_ep *ep;
 	struct smr_region *peer_smr;
-	struct smr_inject_buf *tx_buf;
+	struct smr_inject_buf *tx_buf = NULL;
 	struct smr_cmd *cmd;
+	int64_t pos;
 	int peer_id;
 	ssize_t ret = 0;
 	struct iovec msg_iov;
@@ -259,29 +311,35 @@ static ssize_t smr_generic_inject(struct fid_ep *ep_fid, const void *buf,
 		return ret;
 
 	peer_smr = smr_peer_region(ep->region, peer_id);
-	fastlock_acquire(&peer_smr->lock);
-	if (!peer_smr->cmd_cnt) {
-		ret = -FI_EAGAIN;
-		goto unlock;
+	if (len > SMR_MSG_DATA_LEN) {
+		tx_buf = smr_freestack_pop(smr_inject_pool(peer_smr));
+		if (!tx_buf) {
+			ret = -FI_EAGAIN;
+			goto out;
+		}
 	}
 
-	cmd = ofi_cirque_tail(smr_cmd_queue(peer_smr));
+	ret = smr_cmd_queue_reserve(smr_cmd_queue(peer_smr), 1, &pos);
+	if (ret) {
+		if (tx_buf)
+			smr_freestack_push(smr_inject_pool(peer_smr), tx_buf);
+		goto out;
+	}
+	cmd = smr_cmd_queue_slot(smr_cmd_queue(peer_smr), pos);
 
 	if (len <= SMR_MSG_DATA_LEN) {
 		smr_format_inline(cmd, smr_peer_addr(ep->region)[peer_id].addr,
 				  &msg_iov, 1, op, tag, data, op_flags);
 	} else {
-		tx_buf = smr_freestack_pop(smr_inject_pool(peer_smr));
 		smr_format_inject(cmd, smr_peer_addr(ep->region)[peer_id].addr,
 				  &msg_iov, 1, op, tag, data, op_flags,
 				  peer_smr, tx_buf);
 	}
 
-	peer_smr->cmd_cnt--;
-	ofi_cirque_commit(smr_cmd_queue(peer_smr));
-unlock:
-	fastlock_release(&peer_smr->lock);
-
+	smr_cmd_queue_publish(smr_cmd_queue(peer_smr), pos);
+	smr_signal(peer_smr);
+out:
+	smr_release_peer(ep, peer_id);
 	return ret;
 }
 
@@ -37,8 +37,28 @@
 #include "ofi_iov.h"
 #include "smr.h"
 
-static int smr_progress_fetch(struct smr_ep *ep, struct smr_cmd *pending,
-			      uint64_t *ret)
+/*
+ * Commands that are answered through the sender's region need it mapped
+ * while they are processed.
+ */
+static int smr_cmd_uses_peer(struct smr_cmd *cmd)
+{
+	switch (cmd->msg.hdr.op) {
+	case ofi_op_write_rsp:
+	case ofi_op_read_rsp:
+		return 0;
+	case ofi_op_atomic:
+	case ofi_op_atomic_fetch:
+	case ofi_op_atomic_compare:
+		return cmd->msg.hdr.op_flags & SMR_RMA_REQ;
+	default:
+		return cmd->msg.hdr.op_src == smr_src_iov ||
+		       cmd->msg.hdr.op_src == smr_src_sar;
+	}
+}
+
+static void smr_progress_fetch(struct smr_ep *ep, struct smr_cmd *pending,
+			       uint64_t *ret)
 {
 	struct smr_region *peer_smr;
 	size_t inj_offset, size;
@@ -46,8 +66,6 @@ static int smr_progress_fetch(struct smr_ep *ep, struct smr_cmd *pending,
 	uint8_t *src;
 
 	peer_smr = smr_peer_region(ep->region, pending->msg.hdr.addr);
-	if (fastlock_tryacquire(&peer_smr->lock))
-		return -FI_EAGAIN;
 
 	inj_offset = (size_t) pending->msg.hdr.src_data;
 	tx_buf = (struct smr_inject_buf *) ((char **) peer_smr +
@@ -70,29 +88,198 @@ static int smr_progress_fetch(struct smr_ep *ep, struct smr_cmd *pending,
 
 out:
 	smr_freestack_push(smr_inject_pool(peer_smr), tx_buf);
-	peer_smr->cmd_cnt++;
-	fastlock_release(&peer_smr->lock);
-	return 0;
+}
+
+/*
+ * Moves as many chunks as the other side allows.  Returns 1 once the whole
+ * transfer has passed through the bounce buffers or the filling side
+ * aborted it.
+ */
+int smr_sar_ready(struct smr_sar_entry *sar)
+{
+	int status;
+
+	if (sar->bytes_done >= sar->cmd.msg.hdr.size)
+		return 1;
+
+	status = ofi_atomic_get32(&sar->sar_msg->chunk[sar->next].status);
+	return sar->fill ? status == SMR_SAR_FREE : status != SMR_SAR_FREE;
+}
+
+int smr_progress_sar(struct smr_sar_entry *sar)
+{
+	struct smr_sar_chunk *chunk;
+	size_t len, start = sar->bytes_done;
+	int status;
+
+	while (sar->bytes_done < sar->cmd.msg.hdr.size) {
+		chunk = &sar->sar_msg->chunk[sar->next];
+		status = ofi_atomic_get32(&chunk->status);
+		len = MIN(SMR_SAR_CHUNK_SIZE,
+			  sar->cmd.msg.hdr.size - sar->bytes_done);
+
+		if (sar->fill) {
+			if (status != SMR_SAR_FREE)
+				break;
+			if (sar->err) {
+				*(int *) chunk->buf = sar->err;
+				ofi_atomic_set32(&chunk->status, SMR_SAR_ERROR);
+				smr_signal(sar->peer_smr);
+				return 1;
+			}
+			sar->total_len += ofi_copy_from_iov(chunk->buf, len,
+						sar->iov, sar->iov_count,
+						sar->bytes_done);
+			ofi_atomic_set32(&chunk->status, SMR_SAR_READY);
+		} else {
+			if (status == SMR_SAR_FREE)
+				break;
+			if (status == SMR_SAR_ERROR) {
+				sar->err = *(int *) chunk->buf;
+				ofi_atomic_set32(&chunk->status, SMR_SAR_FREE);
+				return 1;
+			}
+			sar->total_len += ofi_copy_to_iov(sar->iov,
+						sar->iov_count, sar->bytes_done,
+						chunk->buf, len);
+			ofi_atomic_set32(&chunk->status, SMR_SAR_FREE);
+		}
+		sar->bytes_done += len;
+		sar->next = (sar->next + 1) % SMR_SAR_CHUNKS;
+	}
+
+	/* The other side may be asleep waiting for these chunks */
+	if (sar->bytes_done != start)
+		smr_signal(sar->peer_smr);
+
+	if (sar->bytes_done < sar->cmd.msg.hdr.size)
+		return 0;
+
+	if (!sar->err && sar->total_len != sar->cmd.msg.hdr.size) {
+		FI_WARN(&smr_prov, FI_LOG_EP_CTRL,
+			"partial SAR transfer occurred\n");
+		sar->err = FI_EIO;
+	}
+	return 1;
+}
+
+static void smr_progress_sar_start(struct smr_ep *ep, struct smr_cmd *cmd,
+				   struct iovec *iov, size_t iov_count,
+				   void *context, int err)
+{
+	struct smr_region *peer_smr;
+	struct smr_sar_entry *sar;
+
+	peer_smr = smr_peer_region(ep->region, cmd->msg.hdr.addr);
+	smr_hold_peer(ep, cmd->msg.hdr.addr);
+
+	/* Every receive side entry holds one sar msg from our own pool */
+	assert(!freestack_isempty(ep->rx_sar_fs));
+	sar = freestack_pop(ep->rx_sar_fs);
+	smr_init_sar_entry(sar, cmd, peer_smr,
+			   (struct smr_sar_msg *) ((char **) ep->region +
+			   (size_t) cmd->msg.data.sar),
+			   (struct smr_resp *) ((char **) peer_smr +
+			   (size_t) cmd->msg.hdr.src_data),
+			   iov, iov_count, cmd->msg.hdr.op == ofi_op_read_req);
+	sar->context = context;
+	sar->err = err;
+
+	dlist_insert_tail(&sar->entry, &ep->rx_sar_list);
+}
+
+static void smr_progress_tx_sar(struct smr_ep *ep)
+{
+	struct smr_sar_entry *sar;
+	struct dlist_entry *tmp;
+
+	dlist_foreach_container_safe(&ep->tx_sar_list, struct smr_sar_entry,
+				     sar, entry, tmp) {
+		if (!smr_progress_sar(sar))
+			continue;
+
+		/* Reads are drained last by the initiator */
+		if (!sar->fill) {
+			smr_freestack_push(smr_sar_pool(sar->peer_smr),
+					   sar->sar_msg);
+			sar->resp->status = sar->err;
+		}
+		dlist_remove(&sar->entry);
+		freestack_push(ep->tx_sar_fs, sar);
+	}
+}
+
+static void smr_progress_rx_sar(struct smr_ep *ep)
+{
+	struct smr_sar_entry *sar;
+	struct dlist_entry *tmp;
+	int ret;
+
+	dlist_foreach_container_safe(&ep->rx_sar_list, struct smr_sar_entry,
+				     sar, entry, tmp) {
+		if (ofi_cirque_isfull(ep->util_ep.rx_cq->cirq))
+			break;
+
+		if (!smr_progress_sar(sar))
+			continue;
+
+		dlist_remove(&sar->entry);
+		if (sar->fill) {
+			smr_release_peer(ep, sar->cmd.msg.hdr.addr);
+			freestack_push(ep->rx_sar_fs, sar);
+			continue;
+		}
+
+		if (sar->cmd.msg.hdr.op != ofi_op_write ||
+		    sar->cmd.msg.hdr.op_flags & SMR_REMOTE_CQ_DATA) {
+			ret = ep->rx_comp(ep, sar->context,
+					  smr_rx_comp_flags(sar->cmd.msg.hdr.op,
+					  sar->cmd.msg.hdr.op_flags),
+					  sar->total_len, sar->iov_count ?
+					  sar->iov[0].iov_base : NULL,
+					  &sar->cmd.msg.hdr.addr,
+					  sar->cmd.msg.hdr.tag,
+					  sar->cmd.msg.hdr.data, -sar->err);
+			if (ret) {
+				FI_WARN(&smr_prov, FI_LOG_EP_CTRL,
+					"unable to process rx completion\n");
+			}
+		}
+
+		smr_freestack_push(smr_sar_pool(ep->region), sar->sar_msg);
+		//Status must be set last (signals peer: op done, valid resp entry)
+		sar->resp->status = sar->err;
+		smr_signal(sar->peer_smr);
+		smr_release_peer(ep, sar->cmd.msg.hdr.addr);
+		freestack_push(ep->rx_sar_fs, sar);
+	}
 }
 
 static void smr_progress_resp(struct smr_ep *ep)
 {
+	struct util_cq *cq = ep->util_ep.tx_cq;
 	struct smr_resp *resp;
 	struct smr_cmd *pending;
-	int ret;
-
-	fastlock_acquire(&ep->region->lock);
-	fastlock_acquire(&ep->util_ep.tx_cq->cq_lock);
-	while (!ofi_cirque_isempty(smr_resp_queue(ep->region)) &&
-	       !ofi_cirque_isfull(ep->util_ep.tx_cq->cirq)) {
-		resp = ofi_cirque_head(smr_resp_queue(ep->region));
-		if (resp->status == FI_EBUSY)
+	size_t wcnt;
+	int i, ret;
+
+	fastlock_acquire(&cq->cq_lock);
+	wcnt = cq->cirq->wcnt;
+	smr_progress_tx_sar(ep);
+	for (i = 0; i < smr_env.progress_batch &&
+		    !ofi_cirque_isfull(cq->cirq); i++) {
+		resp = smr_resp_queue_head(smr_resp_queue(ep->region));
+		if (!resp || resp->status == FI_EBUSY)
 			break;
 
 		pending = (struct smr_cmd *) resp->msg_id;
-		if (pending->msg.hdr.op_flags & SMR_RMA_REQ &&
-			smr_progress_fetch(ep, pending, &resp->status))
-				break;
+		if (!pending) {
+			smr_resp_queue_discard(smr_resp_queue(ep->region));
+			continue;
+		}
+
+		if (pending->msg.hdr.op_flags & SMR_RMA_REQ)
+			smr_progress_fetch(ep, pending, &resp->status);
 
 		ret = ep->tx_comp(ep, (void *) (uintptr_t) pending->msg.hdr.msg_id,
 				  smr_tx_comp_flags(pending->msg.hdr.op),
@@ -102,11 +289,14 @@ static void smr_progress_resp(struct smr_ep *ep)
 				"unable to process tx completion\n");
 			break;
 		}
+		smr_release_peer(ep, pending->msg.hdr.addr);
 		freestack_push(ep->pend_fs, pending);
-		ofi_cirque_discard(smr_resp_queue(ep->region));
+		smr_resp_queue_discard(smr_resp_queue(ep->region));
 	}
-	fastlock_release(&ep->util_ep.tx_cq->cq_lock);
-	fastlock_release(&ep->region->lock);
+
+	if (cq->cirq->wcnt != wcnt)
+		smr_cq_signal(cq);
+	fastlock_release(&cq->cq_lock);
 }
 
 static int smr_progress_inline(struct smr_cmd *cmd, struct iovec *iov,
@@ -166,15 +356,9 @@ static int smr_progress_iov(struct smr_cmd *cmd, struct iovec *iov,
 		goto out;
 	}
 
-	if (cmd->msg.hdr.op == ofi_op_read_req) {
-		ret = process_vm_writev(peer_smr->pid, iov, iov_count,
-					cmd->msg.data.iov,
-					cmd->msg.data.iov_count, 0);
-	} else {
-		ret = process_vm_readv(peer_smr->pid, iov, iov_count,
-				       cmd->msg.data.iov,
-				       cmd->msg.data.iov_count, 0);
-	}
+	ret = smr_cma_copy(peer_smr->pid, iov, iov_count, cmd->msg.data.iov,
+			   cmd->msg.data.iov_count,
+			   cmd->msg.hdr.op == ofi_op_read_req);
 
 	if (ret != cmd->msg.hdr.size) {
 		if (ret < 0) {
@@ -194,6 +378,7 @@ static int smr_progress_iov(struct smr_cmd *cmd, struct iovec *iov,
 out:
 	//Status must be set last (signals peer: op done, valid resp entry)
 	resp->status = ret;
+	smr_signal(peer_smr);
 
 	return -ret;
 }
@@ -217,7 +402,7 @@ static int smr_progress_multi_recv(struct smr_ep *ep, struct smr_queue *queue,
 	entry->iov[0].iov_len = left;
 	entry->iov[0].iov_base = new_base;
 
-	dlist_insert_head(&entry->entry, &queue->list);
+	smr_queue_reinsert(queue, entry);
 
 	return 0;
 }
@@ -324,7 +509,6 @@ static int smr_progress_cmd_msg(struct smr_ep *ep, struct smr_cmd *cmd)
 {
 	struct smr_queue *recv_queue;
 	struct smr_match_attr match_attr;
-	struct dlist_entry *dlist_entry;
 	struct smr_ep_entry *entry;
 	struct smr_unexp_msg *unexp;
 	fi_addr_t addr;
@@ -340,7 +524,7 @@ static int smr_progress_cmd_msg(struct smr_ep *ep, struct smr_cmd *cmd)
 	recv_queue = (cmd->msg.hdr.op == ofi_op_tagged) ?
 		      &ep->trecv_queue : &ep->recv_queue;
 
-	if (dlist_empty(&recv_queue->list)) {
+	if (!recv_queue->count) {
 		FI_WARN(&smr_prov, FI_LOG_EP_CTRL,
 			"no recv entry available\n");
 		return -FI_ENOMSG;
@@ -349,19 +533,18 @@ static int smr_progress_cmd_msg(struct smr_ep *ep, struct smr_cmd *cmd)
 	match_attr.addr = cmd->msg.hdr.addr;
 	match_attr.tag = cmd->msg.hdr.tag;
 
-	dlist_entry = dlist_remove_first_match(&recv_queue->list,
-					       recv_queue->match_func,
-					       &match_attr);
-	if (!dlist_entry) {
+	entry = smr_queue_match(recv_queue, &match_attr);
+	if (!entry) {
 		if (freestack_isempty(ep->unexp_fs))
 			return -FI_EAGAIN;
 		unexp = freestack_pop(ep->unexp_fs);
 		memcpy(&unexp->cmd, cmd, sizeof(*cmd));
-		ofi_cirque_discard(smr_cmd_queue(ep->region));
-		dlist_insert_tail(&unexp->entry, &ep->unexp_queue.list);
+		if (smr_cmd_uses_peer(cmd))
+			smr_hold_peer(ep, cmd->msg.hdr.addr);
+		smr_cmd_queue_discard(smr_cmd_queue(ep->region));
+		smr_unexp_insert(&ep->unexp_queue, unexp);
 		return ret;
 	}
-	entry = container_of(dlist_entry, struct smr_ep_entry, entry);
 
 	switch (cmd->msg.hdr.op_src) {
 	case smr_src_inline:
@@ -376,6 +559,14 @@ static int smr_progress_cmd_msg(struct smr_ep *ep, struct smr_cmd *cmd)
 		err = smr_progress_iov(cmd, entry->iov, entry->iov_count,
 				       &total_len, ep, 0);
 		break;
+	case smr_src_sar:
+		/* Completed once the data has been drained */
+		smr_progress_sar_start(ep, cmd, entry->iov, entry->iov_count,
+				       entry->context, 0);
+		total_len = MIN(cmd->msg.hdr.size,
+				ofi_total_iov_len(entry->iov, entry->iov_count));
+		smr_cmd_queue_discard(smr_cmd_queue(ep->region));
+		goto release;
 	default:
 		FI_WARN(&smr_prov, FI_LOG_EP_CTRL,
 			"unidentified operation type\n");
@@ -389,9 +580,9 @@ static int smr_progress_cmd_msg(struct smr_ep *ep, struct smr_cmd *cmd)
 		FI_WARN(&smr_prov, FI_LOG_EP_CTRL,
 			"unable to process rx completion\n");
 	}
-	ofi_cirque_discard(smr_cmd_queue(ep->region));
-	ep->region->cmd_cnt++;
+	smr_cmd_queue_discard(smr_cmd_queue(ep->region));
 
+release:
 	if (entry->flags & FI_MULTI_RECV) {
 		ret = smr_progress_multi_recv(ep, recv_queue, entry, total_len);
 		return ret;
@@ -421,9 +612,8 @@ static int smr_progress_cmd_rma(struct smr_ep *ep, struct smr_cmd *cmd)
 		return -FI_ENOSPC;
 	}
 
-	ofi_cirque_discard(smr_cmd_queue(ep->region));
-	ep->region->cmd_cnt++;
-	rma_cmd = ofi_cirque_head(smr_cmd_queue(ep->region));
+	rma_cmd = smr_cmd_queue_peek(smr_cmd_queue(ep->region), 1);
+	assert(rma_cmd);
 
 	for (iov_count = 0; iov_count < rma_cmd->rma.rma_count; iov_count++) {
 		ret = ofi_mr_verify(&domain->util_domain.mr_map,
@@ -437,10 +627,16 @@ static int smr_progress_cmd_rma(struct smr_ep *ep, struct smr_cmd *cmd)
 		iov[iov_count].iov_base = (void *) rma_cmd->rma.rma_iov[iov_count].addr;
 		iov[iov_count].iov_len = rma_cmd->rma.rma_iov[iov_count].len;
 	}
-	ofi_cirque_discard(smr_cmd_queue(ep->region));
-	ep->region->cmd_cnt++;
+
+	/* The initiator is blocked on the bounce buffers, so fail through them */
+	if (cmd->msg.hdr.op_src == smr_src_sar) {
+		smr_progress_sar_start(ep, cmd, iov, ret ? 0 : iov_count,
+				       (void *) cmd->msg.hdr.msg_id, -ret);
+		ret = 0;
+		goto out;
+	}
 	if (ret)
-		return ret;
+		goto out;
 
 	switch (cmd->msg.hdr.op_src) {
 	case smr_src_inline:
@@ -469,6 +665,9 @@ static int smr_progress_cmd_rma(struct smr_ep *ep, struct smr_cmd *cmd)
 		}
 	}
 
+out:
+	smr_cmd_queue_discard(smr_cmd_queue(ep->region));
+	smr_cmd_queue_discard(smr_cmd_queue(ep->region));
 	return ret;
 }
 
@@ -486,9 +685,8 @@ static int smr_progress_cmd_atomic(struct smr_ep *ep, struct smr_cmd *cmd)
 	domain = container_of(ep->util_ep.domain, struct smr_domain,
 			      util_domain);
 
-	ofi_cirque_discard(smr_cmd_queue(ep->region));
-	ep->region->cmd_cnt++;
-	rma_cmd = ofi_cirque_head(smr_cmd_queue(ep->region));
+	rma_cmd = smr_cmd_queue_peek(smr_cmd_queue(ep->region), 1);
+	assert(rma_cmd);
 
 	for (ioc_count = 0; ioc_count < rma_cmd->rma.rma_count; ioc_count++) {
 		ret = ofi_mr_verify(&domain->util_domain.mr_map,
@@ -504,11 +702,8 @@ static int smr_progress_cmd_atomic(struct smr_ep *ep, struct smr_cmd *cmd)
 		ioc[ioc_count].addr = (void *) rma_cmd->rma.rma_ioc[ioc_count].addr;
 		ioc[ioc_count].count = rma_cmd->rma.rma_ioc[ioc_count].count;
 	}
-	ofi_cirque_discard(smr_cmd_queue(ep->region));
-	if (ret) {
-		ep->region->cmd_cnt++;
-		return ret;
-	}
+	if (ret)
+		goto out;
 
 	switch (cmd->msg.hdr.op_src) {
 	case smr_src_inline:
@@ -522,32 +717,60 @@ static int smr_progress_cmd_atomic(struct smr_ep *ep, struct smr_cmd *cmd)
 			"unidentified operation type\n");
 		err = -FI_EINVAL;
 	}
-	if (!(cmd->msg.hdr.op_flags & SMR_RMA_REQ)) {
-		ep->region->cmd_cnt++;
-	} else {
+	if (cmd->msg.hdr.op_flags & SMR_RMA_REQ) {
 		peer_smr = smr_peer_region(ep->region, cmd->msg.hdr.addr);
 		resp = (struct smr_resp *) ((char **) peer_smr +
 			    (size_t) cmd->msg.hdr.data);
 		resp->status = -err;
+		smr_signal(peer_smr);
 	}
 
 	if (err)
 		FI_WARN(&smr_prov, FI_LOG_EP_CTRL,
 			"error processing atomic op\n");
+	ret = err;
 
-	return err; 
+out:
+	smr_cmd_queue_discard(smr_cmd_queue(ep->region));
+	smr_cmd_queue_discard(smr_cmd_queue(ep->region));
+	return ret;
 }
 
+/*
+ * Commands are drained in batches of at most progress_batch, so one call
+ * cannot starve the response queue or other endpoints sharing the CQ.
+ * Completions for the whole batch are written under a single acquisition
+ * of the CQ lock and the CQ is woken once at the end.
+ */
 static void smr_progress_cmd(struct smr_ep *ep)
 {
+	struct util_cq *cq = ep->util_ep.rx_cq;
 	struct smr_cmd *cmd;
-	int ret = 0;
+	size_t wcnt;
+	int i, peer_id, ret = 0;
 
-	fastlock_acquire(&ep->region->lock);
-	fastlock_acquire(&ep->util_ep.rx_cq->cq_lock);
+	fastlock_acquire(&cq->cq_lock);
+	wcnt = cq->cirq->wcnt;
 
-	while (!ofi_cirque_isempty(smr_cmd_queue(ep->region))) {
-		cmd = ofi_cirque_head(smr_cmd_queue(ep->region));
+	for (i = 0; i < smr_env.progress_batch; i++) {
+		cmd = smr_cmd_queue_head(smr_cmd_queue(ep->region));
+		if (!cmd)
+			break;
+
+		/* The slot may be reused once the command is discarded */
+		peer_id = smr_cmd_uses_peer(cmd) ? (int) cmd->msg.hdr.addr : -1;
+		if (peer_id >= 0) {
+			ret = smr_map_acquire(&smr_prov, ep->region->map,
+					      peer_id);
+			if (ret) {
+				FI_WARN(&smr_prov, FI_LOG_EP_CTRL,
+					"unable to map peer\n");
+				break;
+			}
+			if (smr_peer_cma(ep->region)[peer_id] ==
+			    SMR_CMA_CAP_NA)
+				smr_cma_publish(ep, peer_id);
+		}
 
 		switch (cmd->msg.hdr.op) {
 		case ofi_op_msg:
@@ -560,8 +783,7 @@ static void smr_progress_cmd(struct smr_ep *ep)
 			break;
 		case ofi_op_write_rsp:
 		case ofi_op_read_rsp:
-			ofi_cirque_discard(smr_cmd_queue(ep->region));
-			ep->region->cmd_cnt++;
+			smr_cmd_queue_discard(smr_cmd_queue(ep->region));
 			break;
 		case ofi_op_atomic:
 		case ofi_op_atomic_fetch:
@@ -574,6 +796,9 @@ static void smr_progress_cmd(struct smr_ep *ep)
 			ret = -FI_EINVAL;
 		}
 
+		if (peer_id >= 0)
+			smr_release_peer(ep, peer_id);
+
 		if (ret) {
 			if (ret != -FI_EAGAIN) {
 				FI_WARN(&smr_prov, FI_LOG_EP_CTRL,
@@ -582,8 +807,11 @@ static void smr_progress_cmd(struct smr_ep *ep)
 			break;
 		}
 	}
-	fastlock_release(&ep->util_ep.rx_cq->cq_lock);
-	fastlock_release(&ep->region->lock);
+	smr_progress_rx_sar(ep);
+
+	if (cq->cirq->wcnt != wcnt)
+		smr_cq_signal(cq);
+	fastlock_release(&cq->cq_lock);
 }
 
 void smr_ep_progress(struct util_ep *util_ep)
@@ -600,7 +828,6 @@ int smr_progress_unexp(struct smr_ep *ep, struct smr_ep_entry *entry)
 {
 	struct smr_match_attr match_attr;
 	struct smr_unexp_msg *unexp_msg;
-	struct dlist_entry *dlist_entry;
 	size_t total_len = 0;
 	int ret = 0;
 
@@ -614,14 +841,10 @@ int smr_progress_unexp(struct smr_ep *ep, struct smr_ep_entry *entry)
 	match_attr.addr = entry->addr;
 	match_attr.ignore = entry->ignore;
 	match_attr.tag = entry->tag;
-	dlist_entry = dlist_remove_first_match(&ep->unexp_queue.list,
-					       ep->unexp_queue.match_func,
-					       &match_attr);
-	if (!dlist_entry)
+	unexp_msg = smr_unexp_match(&ep->unexp_queue, &match_attr);
+	if (!unexp_msg)
 		return -FI_ENOMSG;
 
-	unexp_msg = container_of(dlist_entry, struct smr_unexp_msg, entry);
-
 	switch (unexp_msg->cmd.msg.hdr.op_src) {
 	case smr_src_inline:
 		entry->err = smr_progress_inline(&unexp_msg->cmd, entry->iov,
@@ -637,6 +860,12 @@ int smr_progress_unexp(struct smr_ep *ep, struct smr_ep_entry *entry)
 					      entry->iov_count, &total_len,
 					      ep, 0);
 		break;
+	case smr_src_sar:
+		smr_progress_sar_start(ep, &unexp_msg->cmd, entry->iov,
+				       entry->iov_count, entry->context, 0);
+		total_len = MIN(unexp_msg->cmd.msg.hdr.size,
+				ofi_total_iov_len(entry->iov, entry->iov_count));
+		goto release;
 	default:
 		FI_WARN(&smr_prov, FI_LOG_EP_CTRL,
 			"unidentified operation type\n");
@@ -652,7 +881,9 @@ int smr_progress_unexp(struct smr_ep *ep, struct smr_ep_entry *entry)
 			"unable to process rx completion\n");
 	}
 
-	ep->region->cmd_cnt++;
+release:
+	if (smr_cmd_uses_peer(&unexp_msg->cmd))
+		smr_release_peer(ep, unexp_msg->cmd.msg.hdr.addr);
 	freestack_push(ep->unexp_fs, unexp_msg);
 
 	if (entry->flags & FI_MULTI_RECV) {
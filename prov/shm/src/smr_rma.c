@@ -69,13 +69,13 @@ ssize_t smr_rma_fast(struct smr_region *peer_smr, struct smr_cmd *cmd,
 
 	total_len = ofi_total_iov_len(iov, iov_count);
 
-	if (op == ofi_op_write) {
-		ret = process_vm_writev(peer_smr->pid, iov, iov_count,
-					rma_iovec, rma_count, 0);
-	} else {
-		ret = process_vm_readv(peer_smr->pid, iov, iov_count,
-				       rma_iovec, rma_count, 0);
-	}
+	ret = smr_cma_copy(peer_smr->pid, iov, iov_count, rma_iovec,
+			   rma_count, op == ofi_op_write);
+
+	/* The command slot is already reserved, so always format it */
+	smr_format_rma_resp(cmd, peer_id, rma_iov, rma_count, total_len,
+			    (op == ofi_op_write) ? ofi_op_write_rsp :
+			    ofi_op_read_rsp);
 
 	if (ret != total_len) {
 		if (ret < 0) {
@@ -90,10 +90,6 @@ ssize_t smr_rma_fast(struct smr_region *peer_smr, struct smr_cmd *cmd,
 		return ret;
 	}
 
-	smr_format_rma_resp(cmd, peer_id, rma_iov, rma_count, total_len,
-			    (op == ofi_op_write) ? ofi_op_write_rsp :
-			    ofi_op_read_rsp);
-
 	return 0;
 }
 
@@ -104,10 +100,13 @@ ssize_t smr_generic_rma(struct smr_ep *ep, const struct iovec *iov,
 {
 	struct smr_domain *domain;
 	struct smr_region *peer_smr;
-	struct smr_inject_buf *tx_buf;
+	struct smr_inject_buf *tx_buf = NULL;
+	struct smr_sar_msg *sar_msg = NULL;
+	struct smr_sar_entry *sar = NULL;
 	struct smr_resp *resp;
 	struct smr_cmd *cmd, *pend;
-	int peer_id, cmds, err = 0, comp = 1;
+	int64_t pos, resp_pos = -1;
+	int peer_id, cmds, cma, err = 0, comp = 1;
 	ssize_t ret = 0;
 	size_t total_len;
 
@@ -121,15 +120,11 @@ ssize_t smr_generic_rma(struct smr_ep *ep, const struct iovec *iov,
 	if (ret)
 		return ret;
 
+	cma = smr_cma_enabled(ep, peer_id);
 	cmds = 1 + !(domain->fast_rma && !(op_flags & FI_REMOTE_CQ_DATA) &&
-		     rma_count == 1);
+		     rma_count == 1 && cma);
 
 	peer_smr = smr_peer_region(ep->region, peer_id);
-	fastlock_acquire(&peer_smr->lock);
-	if (peer_smr->cmd_cnt < cmds) {
-		ret = -FI_EAGAIN;
-		goto unlock_region;
-	}
 
 	fastlock_acquire(&ep->util_ep.tx_cq->cq_lock);
 	if (ofi_cirque_isfull(ep->util_ep.tx_cq->cirq)) {
@@ -137,57 +132,112 @@ ssize_t smr_generic_rma(struct smr_ep *ep, const struct iovec *iov,
 		goto unlock_cq;
 	}
 
-	cmd = ofi_cirque_tail(smr_cmd_queue(peer_smr));
-
 	if (cmds == 1) {
+		ret = smr_cmd_queue_reserve(smr_cmd_queue(peer_smr), 1, &pos);
+		if (ret)
+			goto unlock_cq;
+		cmd = smr_cmd_queue_slot(smr_cmd_queue(peer_smr), pos);
 		err = smr_rma_fast(peer_smr, cmd, iov, iov_count, rma_iov,
 				   rma_count, desc, peer_id, context, op);
-		goto commit_comp;
+		smr_cmd_queue_publish(smr_cmd_queue(peer_smr), pos);
+		smr_signal(peer_smr);
+		goto comp;
 	}
 
 	total_len = ofi_total_iov_len(iov, iov_count);
 
+	if (total_len > SMR_INJECT_SIZE || op != ofi_op_write) {
+		if (!smr_peer_cma_enabled(ep, peer_id)) {
+			sar_msg = smr_freestack_pop(smr_sar_pool(peer_smr));
+			if (!sar_msg) {
+				ret = -FI_EAGAIN;
+				goto unlock_cq;
+			}
+		}
+		ret = smr_resp_queue_reserve(smr_resp_queue(ep->region), 1,
+					     &resp_pos);
+		if (ret)
+			goto free_sar;
+	} else if (total_len > SMR_MSG_DATA_LEN) {
+		tx_buf = smr_freestack_pop(smr_inject_pool(peer_smr));
+		if (!tx_buf) {
+			ret = -FI_EAGAIN;
+			goto unlock_cq;
+		}
+	}
+
+	ret = smr_cmd_queue_reserve(smr_cmd_queue(peer_smr), 2, &pos);
+	if (ret) {
+		if (resp_pos >= 0)
+			smr_cancel_resp(ep, resp_pos);
+		else if (tx_buf)
+			smr_freestack_push(smr_inject_pool(peer_smr), tx_buf);
+		goto free_sar;
+	}
+	cmd = smr_cmd_queue_slot(smr_cmd_queue(peer_smr), pos);
+
 	if (total_len <= SMR_MSG_DATA_LEN && op == ofi_op_write) {
 		smr_format_inline(cmd, smr_peer_addr(ep->region)[peer_id].addr,
 				  iov, iov_count, op, 0, data, op_flags);
 	} else if (total_len <= SMR_INJECT_SIZE && op == ofi_op_write) {
-		tx_buf = smr_freestack_pop(smr_inject_pool(peer_smr));
 		smr_format_inject(cmd, smr_peer_addr(ep->region)[peer_id].addr,
 				  iov, iov_count, op, 0, data, op_flags,
 				  peer_smr, tx_buf);
-	} else {
-		assert(!ofi_cirque_isfull(smr_resp_queue(ep->region)));
-		resp = ofi_cirque_tail(smr_resp_queue(ep->region));
+	} else if (!sar_msg) {
+		resp = smr_resp_queue_slot(smr_resp_queue(ep->region), resp_pos);
 		pend = freestack_pop(ep->pend_fs);
 		smr_format_iov(cmd, smr_peer_addr(ep->region)[peer_id].addr,
 			       iov, iov_count, total_len, op, 0, data,
 			       op_flags, context, ep->region, resp, pend);
-		ofi_cirque_commit(smr_resp_queue(ep->region));
+		smr_hold_pend(ep, pend, peer_id);
+		smr_resp_queue_publish(smr_resp_queue(ep->region), resp_pos);
+		comp = 0;
+	} else {
+		resp = smr_resp_queue_slot(smr_resp_queue(ep->region), resp_pos);
+		pend = freestack_pop(ep->pend_fs);
+		sar = freestack_pop(ep->tx_sar_fs);
+		smr_format_sar(cmd, smr_peer_addr(ep->region)[peer_id].addr,
+			       iov, iov_count, total_len, op, 0, data,
+			       op_flags, context, ep->region, resp, pend,
+			       peer_smr, sar_msg, sar);
+		smr_hold_pend(ep, pend, peer_id);
+		smr_resp_queue_publish(smr_resp_queue(ep->region), resp_pos);
 		comp = 0;
 	}
 
-	ofi_cirque_commit(smr_cmd_queue(peer_smr));
-	peer_smr->cmd_cnt--;
-	cmd = ofi_cirque_tail(smr_cmd_queue(peer_smr));
-	smr_format_rma_iov(cmd, rma_iov, rma_count);
+	smr_format_rma_iov(smr_cmd_queue_slot(smr_cmd_queue(peer_smr), pos + 1),
+			   rma_iov, rma_count);
 
-commit_comp:
-	ofi_cirque_commit(smr_cmd_queue(peer_smr));
-	peer_smr->cmd_cnt--;
+	/* The consumer reads both commands once the first is visible */
+	smr_cmd_queue_publish(smr_cmd_queue(peer_smr), pos + 1);
+	smr_cmd_queue_publish(smr_cmd_queue(peer_smr), pos);
+	smr_signal(peer_smr);
+
+	if (sar) {
+		if (smr_progress_sar(sar))
+			freestack_push(ep->tx_sar_fs, sar);
+		else
+			dlist_insert_tail(&sar->entry, &ep->tx_sar_list);
+	}
 
 	if (!comp)
 		goto unlock_cq;
 
+comp:
 	ret = ep->tx_comp(ep, context, smr_tx_comp_flags(op), err);
 	if (ret) {
 		FI_WARN(&smr_prov, FI_LOG_EP_CTRL,
 			"unable to process tx completion\n");
 	}
+	smr_cq_signal(ep->util_ep.tx_cq);
+	goto unlock_cq;
 
+free_sar:
+	if (sar_msg)
+		smr_freestack_push(smr_sar_pool(peer_smr), sar_msg);
 unlock_cq:
 	fastlock_release(&ep->util_ep.tx_cq->cq_lock);
-unlock_region:
-	fastlock_release(&peer_smr->lock);
+	smr_release_peer(ep, peer_id);
 	return ret;
 }
 
@@ -301,10 +351,11 @@ ssize_t smr_generic_rma_inject(struct fid_ep *ep_fid, const void *buf,
 	struct smr_ep *ep;
 	struct smr_domain *domain;
 	struct smr_region *peer_smr;
-	struct smr_inject_buf *tx_buf;
+	struct smr_inject_buf *tx_buf = NULL;
 	struct smr_cmd *cmd;
 	struct iovec iov;
 	struct fi_rma_iov rma_iov;
+	int64_t pos;
 	int peer_id, cmds;
 	ssize_t ret = 0;
 
@@ -317,14 +368,10 @@ ssize_t smr_generic_rma_inject(struct fid_ep *ep_fid, const void *buf,
 	if (ret)
 		return ret;
 
-	cmds = 1 + !(domain->fast_rma && !(flags & FI_REMOTE_CQ_DATA));
+	cmds = 1 + !(domain->fast_rma && !(flags & FI_REMOTE_CQ_DATA) &&
+		     smr_cma_enabled(ep, peer_id));
 
 	peer_smr = smr_peer_region(ep->region, peer_id);
-	fastlock_acquire(&peer_smr->lock);
-	if (peer_smr->cmd_cnt < cmds) {
-		ret = -FI_EAGAIN;
-		goto unlock_region;
-	}
 
 	iov.iov_base = (void *) buf;
 	iov.iov_len = len;
@@ -332,7 +379,21 @@ ssize_t smr_generic_rma_inject(struct fid_ep *ep_fid, const void *buf,
 	rma_iov.len = len;
 	rma_iov.key = key;
 
-	cmd = ofi_cirque_tail(smr_cmd_queue(peer_smr));
+	if (cmds == 2 && len > SMR_MSG_DATA_LEN) {
+		tx_buf = smr_freestack_pop(smr_inject_pool(peer_smr));
+		if (!tx_buf) {
+			ret = -FI_EAGAIN;
+			goto out;
+		}
+	}
+
+	ret = smr_cmd_queue_reserve(smr_cmd_queue(peer_smr), cmds, &pos);
+	if (ret) {
+		if (tx_buf)
+			smr_freestack_push(smr_inject_pool(peer_smr), tx_buf);
+		goto out;
+	}
+	cmd = smr_cmd_queue_slot(smr_cmd_queue(peer_smr), pos);
 
 	if (cmds == 1) {
 		ret = smr_rma_fast(peer_smr, cmd, &iov, 1, &rma_iov, 1, NULL,
@@ -344,22 +405,20 @@ ssize_t smr_generic_rma_inject(struct fid_ep *ep_fid, const void *buf,
 		smr_format_inline(cmd, smr_peer_addr(ep->region)[peer_id].addr,
 				  &iov, 1, ofi_op_write, 0, data, flags);
 	} else {
-		tx_buf = smr_freestack_pop(smr_inject_pool(peer_smr));
 		smr_format_inject(cmd, smr_peer_addr(ep->region)[peer_id].addr,
 				  &iov, 1, ofi_op_write, 0, data,
 				  flags, peer_smr, tx_buf);
 	}
 
-	ofi_cirque_commit(smr_cmd_queue(peer_smr));
-	peer_smr->cmd_cnt--;
-	cmd = ofi_cirque_tail(smr_cmd_queue(peer_smr));
-	smr_format_rma_iov(cmd, &rma_iov, 1);
+	smr_format_rma_iov(smr_cmd_queue_slot(smr_cmd_queue(peer_smr), pos + 1),
+			   &rma_iov, 1);
+	smr_cmd_queue_publish(smr_cmd_queue(peer_smr), pos + 1);
 
 commit:
-	ofi_cirque_commit(smr_cmd_queue(peer_smr));
-	peer_smr->cmd_cnt--;
-unlock_region:
-	fastlock_release(&peer_smr->lock);
+	smr_cmd_queue_publish(smr_cmd_queue(peer_smr), pos);
+	smr_signal(peer_smr);
+out:
+	smr_release_peer(ep, peer_id);
 	return ret;
 }
 
@@ -62,6 +62,13 @@
 #ifndef _TCP_H_
 #define _TCP_H_
 
+#if defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY)
+#include <linux/errqueue.h>
+#define TCPX_HAVE_ZEROCOPY 1
+#else
+#define TCPX_HAVE_ZEROCOPY 0
+#endif
+
 #define TCPX_MAJOR_VERSION 0
 #define TCPX_MINOR_VERSION 1
 
@@ -74,10 +81,26 @@
 #define TCPX_MAX_CM_DATA_SIZE	(1<<8)
 #define TCPX_IOV_LIMIT		(4)
 #define TCPX_MAX_INJECT_SZ	(64)
+/* Socket data received ahead of the current message is staged here */
+#define TCPX_RX_STAGE_SIZE	(1 << 14)
+/* Queued transmits are written with up to this many iovs at a time */
+#define TCPX_TX_IOV_MAX		(256)
+/* Socket events collected by a CQ per progress call */
+#define TCPX_CQ_EVENTS_MAX	(64)
+
+/*
+ * Message header version of the compact format, in which RMA descriptors
+ * follow the op header only for RMA requests.  It is advertised in the
+ * conn_data of the CM messages.  Connections to peers that don't
+ * advertise it send the full struct tcpx_msg_hdr, with version
+ * OFI_CTRL_VERSION.
+ */
+#define TCPX_HDR_VERSION	3
 
 extern struct fi_provider	tcpx_prov;
 extern struct util_prov		tcpx_util_prov;
 extern struct fi_info		tcpx_info;
+extern size_t			tcpx_zerocopy_size;
 struct tcpx_fabric;
 struct tcpx_domain;
 struct tcpx_xfer_entry;
@@ -110,7 +133,9 @@ int tcpx_conn_mgr_init(struct tcpx_fabric *tcpx_fabric);
 void tcpx_conn_mgr_close(struct tcpx_fabric *tcpx_fabric);
 int tcpx_recv_msg_data(struct tcpx_xfer_entry *recv_entry);
 int tcpx_send_msg(struct tcpx_xfer_entry *tx_entry);
-int tcpx_recv_hdr(SOCKET sock, struct tcpx_rx_detect *rx_detect);
+ssize_t tcpx_send_queued(struct tcpx_ep *ep);
+int tcpx_recv_zerocopy(struct tcpx_ep *ep);
+int tcpx_recv_hdr(struct tcpx_ep *ep);
 
 struct tcpx_xfer_entry *tcpx_xfer_entry_alloc(struct tcpx_cq *cq);
 void tcpx_xfer_entry_release(struct tcpx_cq *tcpx_cq,
@@ -120,6 +145,8 @@ void tcpx_ep_progress(struct tcpx_ep *ep);
 int tcpx_ep_shutdown_report(struct tcpx_ep *ep, fid_t fid);
 int tcpx_progress_ep_add(struct tcpx_ep *ep);
 void tcpx_progress_ep_del(struct tcpx_ep *ep);
+void tcpx_progress_ep_ready(struct tcpx_ep *ep);
+void tcpx_cq_progress(struct util_cq *util_cq);
 void process_tx_entry(struct tcpx_xfer_entry *tx_entry);
 typedef void (*tcpx_ep_progress_func_t)(struct tcpx_ep *ep);
 
@@ -143,6 +170,7 @@ enum poll_fd_type {
 	CONNECT_SOCK,
 	PASSIVE_SOCK,
 	ACCEPT_SOCK,
+	CONNREQ_SOCK,
 };
 
 enum poll_fd_state {
@@ -176,6 +204,7 @@ struct poll_fd_mgr {
 struct tcpx_conn_handle {
 	struct fid		handle;
 	SOCKET			conn_fd;
+	uint8_t			hdr_version;
 };
 
 struct tcpx_pep {
@@ -204,11 +233,35 @@ struct tcpx_msg_hdr {
 	};
 };
 
+/* Length of hdr on the wire, with its RMA descriptors in host order */
+static inline size_t tcpx_hdr_len(uint8_t version,
+				  const struct tcpx_msg_hdr *hdr)
+{
+	if (version != TCPX_HDR_VERSION)
+		return sizeof(*hdr);
+
+	switch (hdr->hdr.op) {
+	case ofi_op_read_req:
+	case ofi_op_write:
+		return offsetof(struct tcpx_msg_hdr, rma_iov) +
+		       hdr->rma_iov_cnt * sizeof(hdr->rma_iov[0]);
+	default:
+		return sizeof(hdr->hdr);
+	}
+}
+
 struct tcpx_rx_detect {
 	struct tcpx_msg_hdr	hdr;
 	uint64_t		done_len;
 };
 
+/* Registration of an endpoint with the progress engine of one of its CQs */
+struct tcpx_ready_entry {
+	struct dlist_entry	entry;
+	struct tcpx_ep		*ep;
+	struct tcpx_cq		*cq;
+};
+
 struct tcpx_rma_list {
 	struct dlist_entry	list;
 	uint64_t		msg_id_tracker;
@@ -219,11 +272,40 @@ struct tcpx_ep {
 	SOCKET			conn_fd;
 	struct tcpx_rx_detect	rx_detect;
 	struct tcpx_xfer_entry	*cur_rx_entry;
+	struct ofi_ringbuf	rx_stage;
+	/* Socket reads and writes, messages received and sent, logged on close */
+	uint64_t		rx_read_cnt;
+	uint64_t		rx_msg_cnt;
+	uint64_t		tx_write_cnt;
+	uint64_t		tx_msg_cnt;
 	struct dlist_entry	ep_entry;
 	struct dlist_entry	rx_queue;
 	struct dlist_entry	tx_queue;
+	/*
+	 * Transmits of at least zerocopy_size bytes are sent with
+	 * MSG_ZEROCOPY, 0 if disabled.  Each such send gets the next
+	 * notification id from the kernel.  Transmits that were written
+	 * while some ids are not notified yet wait in zc_queue, in order,
+	 * until those ids are notified.
+	 */
+	size_t			zerocopy_size;
+	struct dlist_entry	zc_queue;
+	uint32_t		zc_sent;
+	uint32_t		zc_done;
 	struct tcpx_rma_list	rma_list;
 	enum tcpx_cm_state	cm_state;
+	uint8_t			hdr_version;
+	/*
+	 * Set when the last socket read or write would have blocked, or
+	 * a message waits for a receive to be posted.  Endpoints that are
+	 * blocked both ways are left alone until a socket event.
+	 */
+	uint8_t			rx_blocked;
+	uint8_t			tx_blocked;
+	/* POLLOUT is requested, see tcpx_ep_events() */
+	uint8_t			pollout;
+	struct tcpx_ready_entry	rx_ready;
+	struct tcpx_ready_entry	tx_ready;
 	/* lock for protecting tx/rx queues,rma list,cm_state*/
 	fastlock_t		lock;
 	tcpx_ep_progress_func_t progress_func;
@@ -249,6 +331,7 @@ struct tcpx_xfer_entry {
 	uint64_t		flags;
 	void			*context;
 	uint64_t		done_len;
+	uint32_t		zc_id;
 };
 
 struct tcpx_domain {
@@ -258,6 +341,14 @@ struct tcpx_domain {
 struct tcpx_cq {
 	struct util_cq		util_cq;
 	struct util_buf_pool	*xfer_entry_pool;
+	/*
+	 * Sockets of the connected endpoints are registered edge-triggered,
+	 * and progress only visits the endpoints on the ready list: those
+	 * with a socket event, or with work left that no event will signal.
+	 */
+	fi_epoll_t		epoll_fd;
+	struct dlist_entry	ready_list;
+	fastlock_t		ready_lock;
 };
 
 #endif //_TCP_H_
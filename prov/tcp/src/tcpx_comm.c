@@ -37,15 +37,56 @@
 #include <ofi_iov.h>
 #include "tcpx.h"
 
+static int tcpx_use_zerocopy(struct tcpx_xfer_entry *tx_entry)
+{
+	return tx_entry->ep->zerocopy_size &&
+	       ntohll(tx_entry->msg_hdr.hdr.size) >=
+	       tx_entry->ep->zerocopy_size;
+}
+
+/*
+ * Returns the number of bytes written, or -errno.  A zerocopy send that
+ * the kernel can't pin more pages for is copied instead.
+ */
+static ssize_t tcpx_sendv(struct tcpx_ep *ep, struct iovec *iov,
+			  size_t iov_cnt, int zerocopy)
+{
+	ssize_t bytes_sent;
+#if TCPX_HAVE_ZEROCOPY
+	struct msghdr msg = {0};
+
+	if (zerocopy) {
+		msg.msg_iov = iov;
+		msg.msg_iovlen = iov_cnt;
+		bytes_sent = sendmsg(ep->conn_fd, &msg, MSG_ZEROCOPY);
+		ep->tx_write_cnt++;
+		if (bytes_sent >= 0) {
+			ep->tx_blocked = 0;
+			ep->zc_sent++;
+			return bytes_sent;
+		}
+
+		if (errno != ENOBUFS) {
+			ep->tx_blocked = OFI_SOCK_TRY_SND_RCV_AGAIN(errno);
+			return -errno;
+		}
+	}
+#endif
+	bytes_sent = ofi_writev_socket(ep->conn_fd, iov, iov_cnt);
+	ep->tx_write_cnt++;
+	ep->tx_blocked = (bytes_sent < 0) && OFI_SOCK_TRY_SND_RCV_AGAIN(errno);
+	return (bytes_sent < 0) ? -errno : bytes_sent;
+}
+
 int tcpx_send_msg(struct tcpx_xfer_entry *tx_entry)
 {
 	ssize_t bytes_sent;
 
-	bytes_sent = ofi_writev_socket(tx_entry->ep->conn_fd,
-				       tx_entry->msg_data.iov,
-				       tx_entry->msg_data.iov_cnt);
+	bytes_sent = tcpx_sendv(tx_entry->ep, tx_entry->msg_data.iov,
+				tx_entry->msg_data.iov_cnt,
+				tcpx_use_zerocopy(tx_entry));
 	if (bytes_sent < 0)
-		return -errno;
+		return (int) bytes_sent;
 
 	tx_entry->done_len += bytes_sent;
 	if (tx_entry->done_len < ntohll(tx_entry->msg_hdr.hdr.size)) {
@@ -57,32 +98,213 @@ int tcpx_send_msg(struct tcpx_xfer_entry *tx_entry)
 	return FI_SUCCESS;
 }
 
-int tcpx_recv_hdr(SOCKET sock, struct tcpx_rx_detect *rx_detect)
+/*
+ * Writes the remaining data of as many queued transmits as fit in
+ * TCPX_TX_IOV_MAX iovs with a single call.  Returns the number of bytes
+ * written, which the caller accounts to the entries in queue order.
+ */
+ssize_t tcpx_send_queued(struct tcpx_ep *ep)
+{
+	struct iovec iov[TCPX_TX_IOV_MAX];
+	struct tcpx_xfer_entry *tx_entry;
+	struct dlist_entry *entry;
+	size_t iov_cnt = 0;
+	int zerocopy = 0;
+
+	dlist_foreach(&ep->tx_queue, entry) {
+		tx_entry = container_of(entry, struct tcpx_xfer_entry, entry);
+		if (iov_cnt + tx_entry->msg_data.iov_cnt > TCPX_TX_IOV_MAX)
+			break;
+
+		memcpy(&iov[iov_cnt], tx_entry->msg_data.iov,
+		       sizeof(*iov) * tx_entry->msg_data.iov_cnt);
+		iov_cnt += tx_entry->msg_data.iov_cnt;
+		zerocopy |= tcpx_use_zerocopy(tx_entry);
+	}
+
+	return tcpx_sendv(ep, iov, iov_cnt, zerocopy);
+}
+
+/*
+ * Reads the zerocopy notifications queued on the socket's error queue.
+ * Each covers a range of ids, which are notified in order for TCP.  Once
+ * the kernel reports having copied the data anyway, as it does over
+ * loopback, later sends are copied by us without deferring completions.
+ */
+int tcpx_recv_zerocopy(struct tcpx_ep *ep)
+{
+#if TCPX_HAVE_ZEROCOPY
+	char control[CMSG_SPACE(sizeof(struct sock_extended_err))];
+	struct sock_extended_err *serr;
+	struct msghdr msg = {0};
+	struct cmsghdr *cmsg;
+
+	for (;;) {
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(ep->conn_fd, &msg, MSG_ERRQUEUE) < 0)
+			return -errno;
+
+		cmsg = CMSG_FIRSTHDR(&msg);
+		if (!cmsg)
+			continue;
+
+		serr = (struct sock_extended_err *) CMSG_DATA(cmsg);
+		if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY || serr->ee_errno)
+			continue;
+
+		ep->zc_done += serr->ee_data - serr->ee_info + 1;
+		if ((serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) &&
+		    ep->zerocopy_size) {
+			FI_INFO(&tcpx_prov, FI_LOG_EP_DATA,
+				"zerocopy sends copied by the kernel\n");
+			ep->zerocopy_size = 0;
+		}
+	}
+#else
+	return -FI_ENOSYS;
+#endif
+}
+
+/*
+ * Reads up to len bytes into iov, and whatever else the socket has ready
+ * into the staging buffer, with a single call.  The staging buffer must be
+ * empty, so that staged data is always contiguous.  Returns the number of
+ * bytes read into iov, which has room for one more entry.
+ */
+static ssize_t tcpx_readv_staged(struct tcpx_ep *ep, struct iovec *iov,
+				 size_t iov_cnt, size_t len)
 {
-	void *rem_buf;
-	size_t rem_len;
+	struct ofi_ringbuf *rb = &ep->rx_stage;
 	ssize_t bytes_recvd;
 
-	rem_buf = (uint8_t *) &rx_detect->hdr + rx_detect->done_len;
-	rem_len = sizeof(rx_detect->hdr) - rx_detect->done_len;
+	assert(ofi_rbempty(rb));
+	ofi_rbreset(rb);
+	iov[iov_cnt].iov_base = rb->buf;
+	iov[iov_cnt].iov_len = rb->size;
 
-	bytes_recvd = ofi_recv_socket(sock, rem_buf, rem_len, 0);
+	bytes_recvd = ofi_readv_socket(ep->conn_fd, iov, iov_cnt + 1);
+	ep->rx_read_cnt++;
+	ep->rx_blocked = (bytes_recvd < 0) && OFI_SOCK_TRY_SND_RCV_AGAIN(errno);
 	if (bytes_recvd <= 0)
 		return (bytes_recvd)? -errno: -FI_ENOTCONN;
 
-	rx_detect->done_len += bytes_recvd;
-	return (rem_len == bytes_recvd)? FI_SUCCESS : -FI_EAGAIN;
+	if ((size_t) bytes_recvd <= len)
+		return bytes_recvd;
+
+	rb->wcnt = rb->wpos = bytes_recvd - len;
+	return len;
+}
+
+/* Copies up to len staged bytes to iov, returns the number copied */
+static size_t tcpx_copy_staged(struct tcpx_ep *ep, const struct iovec *iov,
+			       size_t iov_cnt, size_t len)
+{
+	struct ofi_ringbuf *rb = &ep->rx_stage;
+
+	len = MIN(len, ofi_rbused(rb));
+	if (!len)
+		return 0;
+
+	ofi_copy_to_iov(iov, iov_cnt, 0,
+			(uint8_t *) rb->buf + (rb->rcnt & rb->size_mask), len);
+	ofi_rbdiscard(rb, len);
+	return len;
+}
+
+/*
+ * Returns how much of the header to receive, which with the compact format
+ * depends on the part received so far.
+ */
+static ssize_t tcpx_rx_hdr_len(struct tcpx_ep *ep)
+{
+	struct tcpx_rx_detect *rx_detect = &ep->rx_detect;
+	struct tcpx_msg_hdr *hdr = &rx_detect->hdr;
+
+	if (ep->hdr_version != TCPX_HDR_VERSION)
+		return sizeof(*hdr);
+
+	if (rx_detect->done_len < sizeof(hdr->hdr))
+		return sizeof(hdr->hdr);
+
+	if (hdr->hdr.version != TCPX_HDR_VERSION)
+		return -FI_EIO;
+
+	if (hdr->hdr.op != ofi_op_read_req && hdr->hdr.op != ofi_op_write)
+		return sizeof(hdr->hdr);
+
+	if (rx_detect->done_len < offsetof(struct tcpx_msg_hdr, rma_iov))
+		return offsetof(struct tcpx_msg_hdr, rma_iov);
+
+	if (hdr->rma_iov_cnt > TCPX_IOV_LIMIT)
+		return -FI_EIO;
+
+	return tcpx_hdr_len(TCPX_HDR_VERSION, hdr);
+}
+
+int tcpx_recv_hdr(struct tcpx_ep *ep)
+{
+	struct tcpx_rx_detect *rx_detect = &ep->rx_detect;
+	struct iovec iov[2];
+	ssize_t bytes_recvd, hdr_len;
+	size_t copied;
+
+	while ((hdr_len = tcpx_rx_hdr_len(ep)) > (ssize_t) rx_detect->done_len) {
+		iov[0].iov_base = (uint8_t *) &rx_detect->hdr +
+				  rx_detect->done_len;
+		iov[0].iov_len = hdr_len - rx_detect->done_len;
+
+		copied = tcpx_copy_staged(ep, iov, 1, iov[0].iov_len);
+		bytes_recvd = copied;
+		if (copied < iov[0].iov_len) {
+			iov[0].iov_base = (uint8_t *) iov[0].iov_base + copied;
+			iov[0].iov_len -= copied;
+			rx_detect->done_len += copied;
+
+			bytes_recvd = tcpx_readv_staged(ep, iov, 1,
+							iov[0].iov_len);
+			if (bytes_recvd < 0)
+				return (int) bytes_recvd;
+		}
+
+		rx_detect->done_len += bytes_recvd;
+		if (rx_detect->done_len < (size_t) hdr_len)
+			return -FI_EAGAIN;
+	}
+	return (hdr_len < 0) ? (int) hdr_len : FI_SUCCESS;
 }
 
 int tcpx_recv_msg_data(struct tcpx_xfer_entry *rx_entry)
 {
+	struct iovec iov[TCPX_IOV_LIMIT + 2];
+	size_t iov_cnt, rem_len, copied;
 	ssize_t bytes_recvd;
 
-	bytes_recvd = ofi_readv_socket(rx_entry->ep->conn_fd,
-				       rx_entry->msg_data.iov,
-				       rx_entry->msg_data.iov_cnt);
-	if (bytes_recvd <= 0)
-		return (bytes_recvd)? -errno: -FI_ENOTCONN;
+	rem_len = ntohll(rx_entry->msg_hdr.hdr.size) - rx_entry->done_len;
+	if (!rem_len)
+		return FI_SUCCESS;
+
+	/* Data already staged, then straight into the receive buffer */
+	copied = tcpx_copy_staged(rx_entry->ep, rx_entry->msg_data.iov,
+				  rx_entry->msg_data.iov_cnt, rem_len);
+	bytes_recvd = copied;
+	if (copied < rem_len) {
+		if (copied)
+			ofi_consume_iov(rx_entry->msg_data.iov,
+					&rx_entry->msg_data.iov_cnt, copied);
+		rx_entry->done_len += copied;
+		rem_len -= copied;
+
+		iov_cnt = rx_entry->msg_data.iov_cnt;
+		memcpy(iov, rx_entry->msg_data.iov, sizeof(*iov) * iov_cnt);
+		if (ofi_truncate_iov(iov, &iov_cnt, rem_len))
+			return -FI_ETRUNC;
+
+		bytes_recvd = tcpx_readv_staged(rx_entry->ep, iov, iov_cnt,
+						rem_len);
+		if (bytes_recvd < 0)
+			return (int) bytes_recvd;
+	}
 
 	rx_entry->done_len += bytes_recvd;
 	if (rx_entry->done_len < ntohll(rx_entry->msg_hdr.hdr.size)) {
@@ -114,9 +114,11 @@ static int poll_fds_add_item(struct poll_fd_mgr *poll_mgr,
 
 	if (poll_mgr->nfds >= poll_mgr->max_nfds) {
 		ret = poll_fd_resize(poll_mgr, poll_mgr->max_nfds << 1);
-		FI_WARN(&tcpx_prov, FI_LOG_EP_CTRL,
-			"memory allocation failed\n");
-		return ret;
+		if (ret) {
+			FI_WARN(&tcpx_prov, FI_LOG_EP_CTRL,
+				"memory allocation failed\n");
+			return ret;
+		}
 	}
 
 	poll_mgr->poll_info[poll_mgr->nfds] = *poll_info;
@@ -148,6 +150,44 @@ static int poll_fds_add_item(struct poll_fd_mgr *poll_mgr,
 	return 0;
 }
 
+/* Accepted sockets are polled until their connection request arrives, so
+ * that a peer we are connecting to at the same time is not waited on */
+static int poll_fds_add_connreq(struct poll_fd_mgr *poll_mgr, fid_t fid,
+				SOCKET sock)
+{
+	int ret;
+
+	if (poll_mgr->nfds >= poll_mgr->max_nfds) {
+		ret = poll_fd_resize(poll_mgr, poll_mgr->max_nfds << 1);
+		if (ret)
+			return ret;
+	}
+
+	memset(&poll_mgr->poll_info[poll_mgr->nfds], 0,
+	       sizeof(poll_mgr->poll_info[poll_mgr->nfds]));
+	poll_mgr->poll_info[poll_mgr->nfds].fid = fid;
+	poll_mgr->poll_info[poll_mgr->nfds].type = CONNREQ_SOCK;
+	poll_mgr->poll_fds[poll_mgr->nfds].fd = sock;
+	poll_mgr->poll_fds[poll_mgr->nfds].events = POLLIN;
+	poll_mgr->poll_fds[poll_mgr->nfds].revents = 0;
+	poll_mgr->nfds++;
+	return 0;
+}
+
+static void poll_fds_del_connreqs(struct poll_fd_mgr *poll_mgr, fid_t fid)
+{
+	int i;
+
+	for (i = poll_mgr->nfds - 1; i > 0; i--) {
+		if (poll_mgr->poll_info[i].type != CONNREQ_SOCK ||
+		    poll_mgr->poll_info[i].fid != fid)
+			continue;
+
+		ofi_close_socket(poll_mgr->poll_fds[i].fd);
+		poll_fds_swap_del_last(poll_mgr, i);
+	}
+}
+
 static int handle_poll_list(struct poll_fd_mgr *poll_mgr)
 {
 	struct poll_fd_info *poll_item;
@@ -167,6 +207,8 @@ static int handle_poll_list(struct poll_fd_mgr *poll_mgr)
 			}
 
 			poll_fds_swap_del_last(poll_mgr, id);
+			if (poll_item->fid->fclass == FI_CLASS_PEP)
+				poll_fds_del_connreqs(poll_mgr, poll_item->fid);
 			poll_item->flags |= POLL_MGR_ACK;
 		} else {
 			assert(poll_fds_find_dup(poll_mgr, poll_item) < 0);
@@ -214,7 +256,8 @@ static int rx_cm_data(SOCKET fd, struct ofi_ctrl_hdr *hdr,
 	return FI_SUCCESS;
 }
 
-static int tx_cm_data(SOCKET fd, uint8_t type, struct poll_fd_info *poll_info)
+static int tx_cm_data(SOCKET fd, uint8_t type, struct poll_fd_info *poll_info,
+		      uint8_t hdr_version)
 {
 	struct ofi_ctrl_hdr hdr;
 	ssize_t ret;
@@ -223,6 +266,7 @@ static int tx_cm_data(SOCKET fd, uint8_t type, struct poll_fd_info *poll_info)
 	hdr.version = OFI_CTRL_VERSION;
 	hdr.type = type;
 	hdr.seg_size = htons((uint16_t) poll_info->cm_data_sz);
+	hdr.conn_data = htonll(hdr_version);
 
 	ret = ofi_send_socket(fd, &hdr, sizeof(hdr), MSG_NOSIGNAL);
 	if (ret != sizeof(hdr))
@@ -237,6 +281,13 @@ static int tx_cm_data(SOCKET fd, uint8_t type, struct poll_fd_info *poll_info)
 	return FI_SUCCESS;
 }
 
+/* Peers that predate the compact message header leave conn_data zeroed */
+static uint8_t rx_hdr_version(struct ofi_ctrl_hdr *hdr)
+{
+	return (ntohll(hdr->conn_data) >= TCPX_HDR_VERSION) ?
+		TCPX_HDR_VERSION : OFI_CTRL_VERSION;
+}
+
 static int send_conn_req(struct poll_fd_mgr *poll_mgr,
 			 struct poll_fd_info *poll_info,
 			 struct tcpx_ep *ep,
@@ -245,7 +296,8 @@ static int send_conn_req(struct poll_fd_mgr *poll_mgr,
 	socklen_t len;
 	int status, ret = FI_SUCCESS;
 
-	assert(poll_mgr->poll_fds[index].revents == POLLOUT);
+	assert(poll_mgr->poll_fds[index].revents &
+	       (POLLOUT | POLLERR | POLLHUP));
 
 	len = sizeof(status);
 	ret = getsockopt(ep->conn_fd, SOL_SOCKET, SO_ERROR, (char *) &status, &len);
@@ -254,7 +306,8 @@ static int send_conn_req(struct poll_fd_mgr *poll_mgr,
 		return (ret < 0)? -errno : status;
 	}
 
-	ret = tx_cm_data(ep->conn_fd, ofi_ctrl_connreq, poll_info);
+	ret = tx_cm_data(ep->conn_fd, ofi_ctrl_connreq, poll_info,
+			 TCPX_HDR_VERSION);
 	return ret;
 }
 
@@ -292,7 +345,8 @@ static int proc_conn_resp(struct poll_fd_mgr *poll_mgr,
 	ssize_t len;
 	int ret = FI_SUCCESS;
 
-	assert(poll_mgr->poll_fds[index].revents == POLLIN);
+	assert(poll_mgr->poll_fds[index].revents &
+	       (POLLIN | POLLERR | POLLHUP));
 	ret = rx_cm_data(ep->conn_fd, &conn_resp, ofi_ctrl_connresp, poll_info);
 	if (ret)
 		return ret;
@@ -306,6 +360,7 @@ static int proc_conn_resp(struct poll_fd_mgr *poll_mgr,
 	cm_entry->fid = poll_info->fid;
 	memcpy(cm_entry->data, poll_info->cm_data, poll_info->cm_data_sz);
 
+	ep->hdr_version = rx_hdr_version(&conn_resp);
 	ret = tcpx_ep_msg_xfer_enable(ep);
 	if (ret)
 		goto err;
@@ -371,15 +426,10 @@ err:
 static void handle_connreq(struct poll_fd_mgr *poll_mgr,
 			   struct poll_fd_info *poll_info)
 {
-	struct tcpx_conn_handle *handle;
 	struct tcpx_pep *pep;
-	struct fi_eq_cm_entry *cm_entry;
-	struct ofi_ctrl_hdr conn_req;
 	SOCKET sock;
-	int ret;
 
 	assert(poll_info->fid->fclass == FI_CLASS_PEP);
-	FI_DBG(&tcpx_prov, FI_LOG_EP_CTRL, "Received Connreq\n");
 	pep = container_of(poll_info->fid, struct tcpx_pep, util_pep.pep_fid.fid);
 
 	sock = accept(pep->sock, NULL, 0);
@@ -388,6 +438,28 @@ static void handle_connreq(struct poll_fd_mgr *poll_mgr,
 			ofi_sockerr());
 		return;
 	}
+
+	/* May move the poll arrays along with poll_info */
+	if (poll_fds_add_connreq(poll_mgr, &pep->util_pep.pep_fid.fid, sock)) {
+		FI_WARN(&tcpx_prov, FI_LOG_EP_CTRL,
+			"Failed to add fd to event polling\n");
+		ofi_close_socket(sock);
+	}
+}
+
+static void handle_connreq_data(struct poll_fd_mgr *poll_mgr, int index)
+{
+	struct poll_fd_info *poll_info = &poll_mgr->poll_info[index];
+	SOCKET sock = poll_mgr->poll_fds[index].fd;
+	struct tcpx_conn_handle *handle;
+	struct tcpx_pep *pep;
+	struct fi_eq_cm_entry *cm_entry;
+	struct ofi_ctrl_hdr conn_req;
+	int ret;
+
+	FI_DBG(&tcpx_prov, FI_LOG_EP_CTRL, "Received Connreq\n");
+	pep = container_of(poll_info->fid, struct tcpx_pep, util_pep.pep_fid.fid);
+
 	ret = rx_cm_data(sock, &conn_req, ofi_ctrl_connreq, poll_info);
 	if (ret) {
 		FI_WARN(&tcpx_prov, FI_LOG_EP_CTRL, "cm data recv failed \n");
@@ -403,6 +475,7 @@ static void handle_connreq(struct poll_fd_mgr *poll_mgr,
 		goto err2;
 
 	handle->conn_fd = sock;
+	handle->hdr_version = rx_hdr_version(&conn_req);
 	cm_entry->fid = poll_info->fid;
 	cm_entry->info = fi_dupinfo(&pep->info);
 	if (!cm_entry->info)
@@ -441,7 +514,8 @@ static void handle_accept_conn(struct poll_fd_mgr *poll_mgr,
 	assert(poll_info->fid->fclass == FI_CLASS_EP);
 	ep = container_of(poll_info->fid, struct tcpx_ep, util_ep.ep_fid.fid);
 
-	ret = tx_cm_data(ep->conn_fd, ofi_ctrl_connresp, poll_info);
+	ret = tx_cm_data(ep->conn_fd, ofi_ctrl_connresp, poll_info,
+			 ep->hdr_version);
 	if (ret)
 		goto err;
 
@@ -493,6 +567,10 @@ static void handle_fd_events(struct poll_fd_mgr *poll_mgr)
 			handle_accept_conn(poll_mgr, &poll_mgr->poll_info[i]);
 			poll_fds_swap_del_last(poll_mgr, i);
 			break;
+		case CONNREQ_SOCK:
+			handle_connreq_data(poll_mgr, i);
+			poll_fds_swap_del_last(poll_mgr, i);
+			break;
 		default:
 			FI_WARN(&tcpx_prov, FI_LOG_EP_CTRL,
 				"should never end up here\n");
@@ -48,6 +48,8 @@ static int tcpx_cq_close(struct fid *fid)
 	if (ret)
 		return ret;
 
+	fi_epoll_close(tcpx_cq->epoll_fd);
+	fastlock_destroy(&tcpx_cq->ready_lock);
 	free(tcpx_cq);
 	return 0;
 }
@@ -169,15 +171,25 @@ int tcpx_cq_open(struct fid_domain *domain, struct fi_cq_attr *attr,
 	if (ret)
 		goto free_cq;
 
-	ret = ofi_cq_init(&tcpx_prov, domain, attr, &tcpx_cq->util_cq,
-			   &ofi_cq_progress, context);
+	ret = fi_epoll_create(&tcpx_cq->epoll_fd);
 	if (ret)
 		goto destroy_pool;
 
+	dlist_init(&tcpx_cq->ready_list);
+	fastlock_init(&tcpx_cq->ready_lock);
+
+	ret = ofi_cq_init(&tcpx_prov, domain, attr, &tcpx_cq->util_cq,
+			   &tcpx_cq_progress, context);
+	if (ret)
+		goto close_epoll;
+
 	*cq_fid = &tcpx_cq->util_cq.cq_fid;
 	(*cq_fid)->fid.ops = &tcpx_cq_fi_ops;
 	return 0;
 
+close_epoll:
+	fastlock_destroy(&tcpx_cq->ready_lock);
+	fi_epoll_close(tcpx_cq->epoll_fd);
 destroy_pool:
 	util_buf_pool_destroy(tcpx_cq->xfer_entry_pool);
 free_cq:
@@ -79,6 +79,8 @@ static ssize_t tcpx_recvmsg(struct fid_ep *ep, const struct fi_msg *msg,
 
 	fastlock_acquire(&tcpx_ep->lock);
 	dlist_insert_tail(&recv_entry->entry, &tcpx_ep->rx_queue);
+	tcpx_ep->rx_blocked = 0;
+	tcpx_progress_ep_ready(tcpx_ep);
 	fastlock_release(&tcpx_ep->lock);
 	return FI_SUCCESS;
 }
@@ -137,13 +139,15 @@ static ssize_t tcpx_sendmsg(struct fid_ep *ep, const struct fi_msg *msg,
 
 	assert(!(flags & FI_INJECT) || (data_len <= TCPX_MAX_INJECT_SZ));
 
-	tx_entry->msg_hdr.hdr.version = OFI_CTRL_VERSION;
+	tx_entry->msg_hdr.hdr.version = tcpx_ep->hdr_version;
 	tx_entry->msg_hdr.hdr.op = ofi_op_msg;
 	tx_entry->msg_hdr.hdr.op_data = TCPX_OP_MSG_SEND;
-	tx_entry->msg_hdr.hdr.size = htonll(data_len + sizeof(tx_entry->msg_hdr));
 
 	tx_entry->msg_data.iov[0].iov_base = (void *) &tx_entry->msg_hdr;
-	tx_entry->msg_data.iov[0].iov_len = sizeof(tx_entry->msg_hdr);
+	tx_entry->msg_data.iov[0].iov_len =
+		tcpx_hdr_len(tcpx_ep->hdr_version, &tx_entry->msg_hdr);
+	tx_entry->msg_hdr.hdr.size =
+		htonll(data_len + tx_entry->msg_data.iov[0].iov_len);
 	tx_entry->msg_data.iov_cnt = msg->iov_count + 1;
 
 	if (flags & FI_INJECT) {
@@ -179,6 +183,7 @@ static ssize_t tcpx_sendmsg(struct fid_ep *ep, const struct fi_msg *msg,
 	} else {
 		dlist_insert_tail(&tx_entry->entry, &tcpx_ep->tx_queue);
 	}
+	tcpx_progress_ep_ready(tcpx_ep);
 	fastlock_release(&tcpx_ep->lock);
 	return FI_SUCCESS;
 }
@@ -283,6 +288,24 @@ static struct fi_ops_msg tcpx_msg_ops = {
 	.injectdata = tcpx_injectdata,
 };
 
+static void tcpx_ep_init_zerocopy(struct tcpx_ep *ep)
+{
+#if TCPX_HAVE_ZEROCOPY
+	int optval = 1;
+
+	if (!tcpx_zerocopy_size)
+		return;
+
+	if (setsockopt(ep->conn_fd, SOL_SOCKET, SO_ZEROCOPY, (char *) &optval,
+		       sizeof(optval))) {
+		FI_WARN(&tcpx_prov, FI_LOG_EP_CTRL,
+			"setsockopt zerocopy failed, sends will be copied\n");
+		return;
+	}
+	ep->zerocopy_size = tcpx_zerocopy_size;
+#endif
+}
+
 static int tcpx_setup_socket(SOCKET sock)
 {
 	int ret, optval = 1;
@@ -481,8 +504,9 @@ static void tcpx_ep_tx_rx_queues_release(struct tcpx_ep *ep)
 	struct tcpx_cq *tcpx_cq;
 
 	fastlock_acquire(&ep->lock);
-	while (!dlist_empty(&ep->tx_queue)) {
-		entry = ep->tx_queue.next;
+	dlist_splice_tail(&ep->zc_queue, &ep->tx_queue);
+	while (!dlist_empty(&ep->zc_queue)) {
+		entry = ep->zc_queue.next;
 		xfer_entry = container_of(entry, struct tcpx_xfer_entry, entry);
 		dlist_remove(entry);
 		tcpx_cq = container_of(xfer_entry->ep->util_ep.tx_cq,
@@ -506,9 +530,20 @@ static int tcpx_ep_close(struct fid *fid)
 	struct tcpx_ep *ep = container_of(fid, struct tcpx_ep,
 					  util_ep.ep_fid.fid);
 
+	FI_INFO(&tcpx_prov, FI_LOG_EP_DATA, "%" PRIu64 " messages received "
+		"with %" PRIu64 " socket reads\n", ep->rx_msg_cnt,
+		ep->rx_read_cnt);
+	FI_INFO(&tcpx_prov, FI_LOG_EP_DATA, "%" PRIu64 " messages sent "
+		"with %" PRIu64 " socket writes\n", ep->tx_msg_cnt,
+		ep->tx_write_cnt);
+	if (ep->zc_sent)
+		FI_INFO(&tcpx_prov, FI_LOG_EP_DATA, "%" PRIu32 " zerocopy "
+			"sends\n", ep->zc_sent);
+
 	tcpx_ep_tx_rx_queues_release(ep);
 	tcpx_progress_ep_del(ep);
 	ofi_close_socket(ep->conn_fd);
+	ofi_rbfree(&ep->rx_stage);
 	fastlock_destroy(&ep->lock);
 	ofi_endpoint_close(&ep->util_ep);
 
@@ -646,6 +681,7 @@ int tcpx_endpoint(struct fid_domain *domain, struct fi_info *info,
 			}
 		} else {
 			ep->conn_fd = handle->conn_fd;
+			ep->hdr_version = handle->hdr_version;
 			free(handle);
 
 			ret = tcpx_setup_socket(ep->conn_fd);
@@ -671,14 +707,22 @@ int tcpx_endpoint(struct fid_domain *domain, struct fi_info *info,
 			goto err3;
 	}
 
+	tcpx_ep_init_zerocopy(ep);
 	ep->cm_state = TCPX_EP_CONNECTING;
 	ep->progress_func = tcpx_empty_progress;
-	ret = fastlock_init(&ep->lock);
+	ret = ofi_rbinit(&ep->rx_stage, TCPX_RX_STAGE_SIZE);
 	if (ret)
 		goto err3;
 
+	ret = fastlock_init(&ep->lock);
+	if (ret)
+		goto err4;
+
 	dlist_init(&ep->rx_queue);
 	dlist_init(&ep->tx_queue);
+	dlist_init(&ep->zc_queue);
+	dlist_init(&ep->rx_ready.entry);
+	dlist_init(&ep->tx_ready.entry);
 	dlist_init(&ep->rma_list.list);
 	ep->rma_list.msg_id_tracker = 0;
 
@@ -690,6 +734,8 @@ int tcpx_endpoint(struct fid_domain *domain, struct fi_info *info,
 	(*ep_fid)->rma = &tcpx_rma_ops;
 
 	return 0;
+err4:
+	ofi_rbfree(&ep->rx_stage);
 err3:
 	ofi_close_socket(ep->conn_fd);
 err2:
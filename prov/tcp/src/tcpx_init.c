@@ -40,6 +40,8 @@
 #include <net/if.h>
 #include <ofi_util.h>
 
+size_t tcpx_zerocopy_size;
+
 /* TODO: merge with sock_get_list_of_addr() - sock_fabric.c */
 #if HAVE_GETIFADDRS
 static void tcpx_getinfo_ifs(struct fi_info **info)
@@ -149,5 +151,12 @@ struct fi_provider tcpx_prov = {
 
 TCP_INI
 {
+	fi_param_define(&tcpx_prov, "zerocopy_size", FI_PARAM_SIZE_T,
+			"Transfers of at least this many bytes are "
+			"sent with MSG_ZEROCOPY, where supported, and completed "
+			"once the kernel no longer references their buffers "
+			"(default: 0, disabled)");
+	fi_param_get_size_t(&tcpx_prov, "zerocopy_size", &tcpx_zerocopy_size);
+
 	return &tcpx_prov;
 }
@@ -61,24 +61,13 @@ int tcpx_ep_shutdown_report(struct tcpx_ep *ep, fid_t fid)
 	return FI_SUCCESS;
 }
 
-void process_tx_entry(struct tcpx_xfer_entry *tx_entry)
+static void tcpx_tx_entry_complete(struct tcpx_xfer_entry *tx_entry, int ret)
 {
 	struct tcpx_cq *tcpx_cq;
-	int ret;
-
-	ret = tcpx_send_msg(tx_entry);
-	if (OFI_SOCK_TRY_SND_RCV_AGAIN(-ret))
-		return;
 
 	if (!ret)
-		goto done;
-
-	FI_WARN(&tcpx_prov, FI_LOG_DOMAIN, "msg send failed\n");
+		tx_entry->ep->tx_msg_cnt++;
 
-	if (ret == -FI_ENOTCONN)
-		tcpx_ep_shutdown_report(tx_entry->ep,
-					&tx_entry->ep->util_ep.ep_fid.fid);
-done:
 	tcpx_cq_report_completion(tx_entry->ep->util_ep.tx_cq,
 				  tx_entry, ret);
 	dlist_remove(&tx_entry->entry);
@@ -87,6 +76,48 @@ done:
 	tcpx_xfer_entry_release(tcpx_cq, tx_entry);
 }
 
+/*
+ * The buffers of zerocopy sends, including the entry's header, are in
+ * use by the kernel until their ids are notified.  Transmits completing
+ * meanwhile wait for those ids too, so completions stay in order.
+ */
+static void tcpx_tx_entry_done(struct tcpx_xfer_entry *tx_entry, int ret)
+{
+	struct tcpx_ep *ep = tx_entry->ep;
+
+	if (!ret && ep->zc_sent != ep->zc_done) {
+		tx_entry->zc_id = ep->zc_sent;
+		dlist_remove(&tx_entry->entry);
+		dlist_insert_tail(&tx_entry->entry, &ep->zc_queue);
+		return;
+	}
+	tcpx_tx_entry_complete(tx_entry, ret);
+}
+
+static void tcpx_tx_entry_fail(struct tcpx_xfer_entry *tx_entry, int ret)
+{
+	FI_WARN(&tcpx_prov, FI_LOG_DOMAIN, "msg send failed\n");
+
+	if (ret == -FI_ENOTCONN)
+		tcpx_ep_shutdown_report(tx_entry->ep,
+					&tx_entry->ep->util_ep.ep_fid.fid);
+	tcpx_tx_entry_done(tx_entry, ret);
+}
+
+void process_tx_entry(struct tcpx_xfer_entry *tx_entry)
+{
+	int ret;
+
+	ret = tcpx_send_msg(tx_entry);
+	if (OFI_SOCK_TRY_SND_RCV_AGAIN(-ret))
+		return;
+
+	if (ret)
+		tcpx_tx_entry_fail(tx_entry, ret);
+	else
+		tcpx_tx_entry_done(tx_entry, ret);
+}
+
 static void process_rx_entry(struct tcpx_xfer_entry *rx_entry)
 {
 	struct tcpx_cq *tcpx_cq;
@@ -182,8 +213,13 @@ static void tcpx_prepare_rx_remote_read_resp(struct tcpx_xfer_entry *resp_entry)
 {
 	int i;
 
+	resp_entry->msg_hdr.hdr.version = resp_entry->ep->hdr_version;
+	resp_entry->msg_hdr.hdr.op = ofi_op_read_rsp;
+	resp_entry->msg_hdr.hdr.op_data = TCPX_OP_REMOTE_READ_RSP;
+
 	resp_entry->msg_data.iov[0].iov_base = (void *) &resp_entry->msg_hdr;
-	resp_entry->msg_data.iov[0].iov_len = sizeof(resp_entry->msg_hdr);
+	resp_entry->msg_data.iov[0].iov_len =
+		tcpx_hdr_len(resp_entry->ep->hdr_version, &resp_entry->msg_hdr);
 	resp_entry->msg_data.iov_cnt = 1 + resp_entry->msg_hdr.rma_iov_cnt;
 
 	resp_entry->msg_hdr.hdr.size = resp_entry->msg_data.iov[0].iov_len;
@@ -196,9 +232,6 @@ static void tcpx_prepare_rx_remote_read_resp(struct tcpx_xfer_entry *resp_entry)
 			resp_entry->msg_data.iov[i+1].iov_len;
 	}
 
-	resp_entry->msg_hdr.hdr.version = OFI_CTRL_VERSION;
-	resp_entry->msg_hdr.hdr.op = ofi_op_read_rsp;
-	resp_entry->msg_hdr.hdr.op_data = TCPX_OP_REMOTE_READ_RSP;
 	resp_entry->msg_hdr.hdr.size =
 		htonll(resp_entry->msg_hdr.hdr.size);
 
@@ -249,6 +282,7 @@ static int tcpx_get_rx_entry(struct tcpx_rx_detect *rx_detect,
 	struct dlist_entry *entry;
 	struct tcpx_ep *tcpx_ep;
 	struct tcpx_cq *tcpx_cq;
+	uint64_t hdr_len = rx_detect->done_len;
 	int ret;
 
 	tcpx_ep = container_of(rx_detect, struct tcpx_ep, rx_detect);
@@ -257,8 +291,10 @@ static int tcpx_get_rx_entry(struct tcpx_rx_detect *rx_detect,
 
 	switch (rx_detect->hdr.hdr.op) {
 	case ofi_op_msg:
-		if (dlist_empty(&tcpx_ep->rx_queue))
+		if (dlist_empty(&tcpx_ep->rx_queue)) {
+			tcpx_ep->rx_blocked = 1;
 			return -FI_EAGAIN;
+		}
 
 		entry = tcpx_ep->rx_queue.next;
 		rx_entry = container_of(entry, struct tcpx_xfer_entry,
@@ -266,15 +302,15 @@ static int tcpx_get_rx_entry(struct tcpx_rx_detect *rx_detect,
 
 		rx_entry->msg_hdr = rx_detect->hdr;
 		rx_entry->msg_hdr.hdr.op_data = TCPX_OP_MSG_RECV;
-		rx_entry->done_len = sizeof(rx_detect->hdr);
+		rx_entry->done_len = hdr_len;
 
 		if (ntohl(rx_detect->hdr.hdr.flags) & OFI_REMOTE_CQ_DATA)
 			rx_entry->flags |= FI_REMOTE_CQ_DATA;
 
 		ret = ofi_truncate_iov(rx_entry->msg_data.iov,
 				       &rx_entry->msg_data.iov_cnt,
-				       (ntohll(rx_entry->msg_hdr.hdr.size) -
-					sizeof(rx_entry->msg_hdr)));
+				       ntohll(rx_entry->msg_hdr.hdr.size) -
+				       hdr_len);
 		if (ret) {
 			FI_WARN(&tcpx_prov, FI_LOG_DOMAIN,
 				"posted rx buffer size is not big enough\n");
@@ -294,7 +330,7 @@ static int tcpx_get_rx_entry(struct tcpx_rx_detect *rx_detect,
 		rx_entry->msg_hdr.hdr.op_data =	TCPX_OP_REMOTE_READ_REQ;
 		rx_entry->ep = tcpx_ep;
 		rx_entry->flags = TCPX_NO_COMPLETION;
-		rx_entry->done_len = sizeof(rx_detect->hdr);
+		rx_entry->done_len = hdr_len;
 
 		ret = tcpx_validate_rx_rma_data(rx_entry, FI_REMOTE_READ);
 		if (ret) {
@@ -320,7 +356,7 @@ static int tcpx_get_rx_entry(struct tcpx_rx_detect *rx_detect,
 		rx_entry->msg_hdr = rx_detect->hdr;
 		rx_entry->msg_hdr.hdr.op_data = TCPX_OP_REMOTE_WRITE;
 		rx_entry->ep = tcpx_ep;
-		rx_entry->done_len = sizeof(rx_detect->hdr);
+		rx_entry->done_len = hdr_len;
 
 		ret = tcpx_validate_rx_rma_data(rx_entry, FI_REMOTE_WRITE);
 		if (ret) {
@@ -347,7 +383,7 @@ static int tcpx_get_rx_entry(struct tcpx_rx_detect *rx_detect,
 
 		rx_entry->msg_hdr = rx_detect->hdr;
 		rx_entry->msg_hdr.hdr.op_data = TCPX_OP_READ;
-		rx_entry->done_len = sizeof(rx_detect->hdr);
+		rx_entry->done_len = hdr_len;
 		break;
 	default:
 		FI_WARN(&tcpx_prov, FI_LOG_DOMAIN,
@@ -355,70 +391,126 @@ static int tcpx_get_rx_entry(struct tcpx_rx_detect *rx_detect,
 		return -FI_EINVAL;
 	}
 	rx_detect->done_len = 0;
+	tcpx_ep->rx_msg_cnt++;
 	*new_rx_entry = rx_entry;
 	return FI_SUCCESS;
 }
 
+/*
+ * Messages that were read ahead into the staging buffer don't make the
+ * socket readable, so keep going until it is drained or we're stuck.
+ */
 static void tcpx_process_rx_msg(struct tcpx_ep *ep)
 {
 	int ret;
 
-	if (!ep->cur_rx_entry) {
-		ret = tcpx_recv_hdr(ep->conn_fd, &ep->rx_detect);
-		if (OFI_SOCK_TRY_SND_RCV_AGAIN(-ret))
-			return;
+	do {
+		if (!ep->cur_rx_entry) {
+			ret = tcpx_recv_hdr(ep);
+			if (OFI_SOCK_TRY_SND_RCV_AGAIN(-ret))
+				return;
 
-		if (ret)
-			goto err;
+			if (ret)
+				goto err;
 
-		if (tcpx_get_rx_entry(&ep->rx_detect,
-					 &ep->cur_rx_entry))
-			return;
-	}
+			if (tcpx_get_rx_entry(&ep->rx_detect,
+						 &ep->cur_rx_entry))
+				return;
+		}
 
-	switch(ep->cur_rx_entry->msg_hdr.hdr.op_data){
-	case TCPX_OP_MSG_RECV:
-		process_rx_entry(ep->cur_rx_entry);
-		break;
-	case TCPX_OP_REMOTE_WRITE:
-		process_rx_remote_write_entry(ep->cur_rx_entry);
-		break;
-	case TCPX_OP_READ:
-		process_rx_read_entry(ep->cur_rx_entry);
-		break;
- 	case TCPX_OP_REMOTE_READ_REQ:
-		tcpx_prepare_rx_remote_read_resp(ep->cur_rx_entry);
-		ep->cur_rx_entry = NULL;
-		break;
-	default:
-		FI_WARN(&tcpx_prov, FI_LOG_DOMAIN,
-			"invalid op type\n");
-		return;
-	}
+		switch(ep->cur_rx_entry->msg_hdr.hdr.op_data){
+		case TCPX_OP_MSG_RECV:
+			process_rx_entry(ep->cur_rx_entry);
+			break;
+		case TCPX_OP_REMOTE_WRITE:
+			process_rx_remote_write_entry(ep->cur_rx_entry);
+			break;
+		case TCPX_OP_READ:
+			process_rx_read_entry(ep->cur_rx_entry);
+			break;
+		case TCPX_OP_REMOTE_READ_REQ:
+			tcpx_prepare_rx_remote_read_resp(ep->cur_rx_entry);
+			ep->cur_rx_entry = NULL;
+			break;
+		default:
+			FI_WARN(&tcpx_prov, FI_LOG_DOMAIN,
+				"invalid op type\n");
+			return;
+		}
+	} while (!ep->cur_rx_entry && !ofi_rbempty(&ep->rx_stage));
 	return;
 err:
 	if (ret == -FI_ENOTCONN)
 		tcpx_ep_shutdown_report(ep, &ep->util_ep.ep_fid.fid);
 }
 
+/*
+ * Queued transmits are written together, and the entries sent in full
+ * are completed in queue order.  A partially sent entry keeps what is
+ * left of it at the head of the queue.
+ */
 static void process_tx_queue(struct tcpx_ep *ep)
 {
 	struct tcpx_xfer_entry *tx_entry;
-	struct dlist_entry *entry;
+	ssize_t bytes_sent;
+	uint64_t rem_len;
 
 	if (dlist_empty(&ep->tx_queue))
 		return;
 
-	entry = ep->tx_queue.next;
-	tx_entry = container_of(entry, struct tcpx_xfer_entry,
-				entry);
-	process_tx_entry(tx_entry);
+	bytes_sent = tcpx_send_queued(ep);
+	if (bytes_sent < 0) {
+		if (OFI_SOCK_TRY_SND_RCV_AGAIN(-bytes_sent))
+			return;
+
+		tx_entry = container_of(ep->tx_queue.next,
+					struct tcpx_xfer_entry, entry);
+		tcpx_tx_entry_fail(tx_entry, (int) bytes_sent);
+		return;
+	}
+
+	while (bytes_sent && !dlist_empty(&ep->tx_queue)) {
+		tx_entry = container_of(ep->tx_queue.next,
+					struct tcpx_xfer_entry, entry);
+		rem_len = ntohll(tx_entry->msg_hdr.hdr.size) -
+			  tx_entry->done_len;
+		if ((uint64_t) bytes_sent < rem_len) {
+			tx_entry->done_len += bytes_sent;
+			ofi_consume_iov(tx_entry->msg_data.iov,
+					&tx_entry->msg_data.iov_cnt,
+					bytes_sent);
+			break;
+		}
+
+		tx_entry->done_len += rem_len;
+		bytes_sent -= rem_len;
+		tcpx_tx_entry_done(tx_entry, FI_SUCCESS);
+	}
+}
+
+static void process_zerocopy(struct tcpx_ep *ep)
+{
+	struct tcpx_xfer_entry *tx_entry;
+
+	if (dlist_empty(&ep->zc_queue))
+		return;
+
+	tcpx_recv_zerocopy(ep);
+	while (!dlist_empty(&ep->zc_queue)) {
+		tx_entry = container_of(ep->zc_queue.next,
+					struct tcpx_xfer_entry, entry);
+		if ((int32_t) (ep->zc_done - tx_entry->zc_id) < 0)
+			break;
+
+		tcpx_tx_entry_complete(tx_entry, FI_SUCCESS);
+	}
 }
 
 void tcpx_ep_progress(struct tcpx_ep *ep)
 {
 	tcpx_process_rx_msg(ep);
 	process_tx_queue(ep);
+	process_zerocopy(ep);
 }
 
 void tcpx_progress(struct util_ep *util_ep)
@@ -432,6 +524,172 @@ void tcpx_progress(struct util_ep *util_ep)
 	return;
 }
 
+static int tcpx_ep_has_work(struct tcpx_ep *ep)
+{
+	if (ep->cm_state != TCPX_EP_CONNECTED)
+		return 0;
+
+	return !ep->rx_blocked ||
+	       (!ep->tx_blocked && !dlist_empty(&ep->tx_queue));
+}
+
+/*
+ * Sockets are watched edge-triggered for both directions.  Without
+ * edge-triggered events an idle socket is always writable, so output is
+ * then only watched while a transmit is blocked on the socket.
+ */
+static uint32_t tcpx_ep_events(struct tcpx_ep *ep)
+{
+	if (FI_EPOLL_ET)
+		return FI_EPOLL_IN | FI_EPOLL_OUT | FI_EPOLL_ET;
+
+	return ep->pollout ? FI_EPOLL_IN | FI_EPOLL_OUT : FI_EPOLL_IN;
+}
+
+static void tcpx_ready_mod(struct tcpx_ready_entry *ready, uint32_t events)
+{
+	if (!ready->cq)
+		return;
+
+	fastlock_acquire(&ready->cq->ready_lock);
+	fi_epoll_mod(ready->cq->epoll_fd, ready->ep->conn_fd, events, ready);
+	fastlock_release(&ready->cq->ready_lock);
+}
+
+static void tcpx_ep_update_events(struct tcpx_ep *ep)
+{
+	uint8_t pollout;
+
+	if (FI_EPOLL_ET)
+		return;
+
+	pollout = ep->tx_blocked && !dlist_empty(&ep->tx_queue);
+	if (pollout == ep->pollout)
+		return;
+
+	ep->pollout = pollout;
+	tcpx_ready_mod(&ep->rx_ready, tcpx_ep_events(ep));
+	tcpx_ready_mod(&ep->tx_ready, tcpx_ep_events(ep));
+}
+
+static void tcpx_ready_insert(struct tcpx_ready_entry *ready)
+{
+	if (!ready->cq)
+		return;
+
+	fastlock_acquire(&ready->cq->ready_lock);
+	if (dlist_empty(&ready->entry))
+		dlist_insert_tail(&ready->entry, &ready->cq->ready_list);
+	fastlock_release(&ready->cq->ready_lock);
+}
+
+/*
+ * Called with the endpoint lock held, after posting work that no socket
+ * event may signal.
+ */
+void tcpx_progress_ep_ready(struct tcpx_ep *ep)
+{
+	tcpx_ep_update_events(ep);
+	if (!tcpx_ep_has_work(ep))
+		return;
+
+	tcpx_ready_insert(&ep->rx_ready);
+	tcpx_ready_insert(&ep->tx_ready);
+}
+
+/*
+ * Endpoints are visited once per call: those with work left after their
+ * progress are queued for the next one.  Holding the ep list lock keeps
+ * endpoints from being closed under us, as with ofi_cq_progress.
+ */
+void tcpx_cq_progress(struct util_cq *util_cq)
+{
+	struct tcpx_cq *cq = container_of(util_cq, struct tcpx_cq, util_cq);
+	void *contexts[TCPX_CQ_EVENTS_MAX];
+	struct tcpx_ready_entry *ready;
+	struct dlist_entry ready_list;
+	struct tcpx_ep *ep;
+	int i, ret;
+
+	dlist_init(&ready_list);
+	util_cq->cq_fastlock_acquire(&util_cq->ep_list_lock);
+	fastlock_acquire(&cq->ready_lock);
+	ret = fi_epoll_wait(cq->epoll_fd, contexts, TCPX_CQ_EVENTS_MAX, 0);
+	for (i = 0; i < ret; i++) {
+		ready = contexts[i];
+		if (dlist_empty(&ready->entry))
+			dlist_insert_tail(&ready->entry, &cq->ready_list);
+	}
+	dlist_splice_tail(&ready_list, &cq->ready_list);
+	fastlock_release(&cq->ready_lock);
+
+	for (;;) {
+		fastlock_acquire(&cq->ready_lock);
+		if (dlist_empty(&ready_list)) {
+			fastlock_release(&cq->ready_lock);
+			break;
+		}
+		ready = container_of(ready_list.next, struct tcpx_ready_entry,
+				     entry);
+		dlist_remove_init(&ready->entry);
+		fastlock_release(&cq->ready_lock);
+
+		ep = ready->ep;
+		fastlock_acquire(&ep->lock);
+		ep->progress_func(ep);
+		tcpx_progress_ep_ready(ep);
+		fastlock_release(&ep->lock);
+	}
+	util_cq->cq_fastlock_release(&util_cq->ep_list_lock);
+}
+
+static int tcpx_ready_add(struct util_cq *util_cq,
+			  struct tcpx_ready_entry *ready, struct tcpx_ep *ep)
+{
+	struct tcpx_cq *cq = container_of(util_cq, struct tcpx_cq, util_cq);
+	int ret;
+
+	ready->ep = ep;
+	fastlock_acquire(&cq->ready_lock);
+	ret = fi_epoll_add(cq->epoll_fd, ep->conn_fd, tcpx_ep_events(ep),
+			   ready);
+	if (!ret) {
+		ready->cq = cq;
+		dlist_insert_tail(&ready->entry, &cq->ready_list);
+	}
+	fastlock_release(&cq->ready_lock);
+	return ret;
+}
+
+static void tcpx_ready_remove(struct tcpx_ready_entry *ready)
+{
+	struct tcpx_cq *cq = ready->cq;
+
+	if (!cq)
+		return;
+
+	fastlock_acquire(&cq->ready_lock);
+	fi_epoll_del(cq->epoll_fd, ready->ep->conn_fd);
+	dlist_remove_init(&ready->entry);
+	ready->cq = NULL;
+	fastlock_release(&cq->ready_lock);
+}
+
+/*
+ * Taking the ep list lock, without the endpoint lock held, waits for
+ * any progress call of the CQ that may be visiting the endpoint.
+ */
+static void tcpx_ready_del(struct util_cq *util_cq,
+			   struct tcpx_ready_entry *ready)
+{
+	if (!util_cq)
+		return;
+
+	util_cq->cq_fastlock_acquire(&util_cq->ep_list_lock);
+	tcpx_ready_remove(ready);
+	util_cq->cq_fastlock_release(&util_cq->ep_list_lock);
+}
+
 static int tcpx_try_func(void *util_ep)
 {
 	/* nothing to do here. When endpoints
@@ -439,18 +697,45 @@ static int tcpx_try_func(void *util_ep)
 	return FI_SUCCESS;
 }
 
+/* Called with the endpoint lock held */
 int tcpx_progress_ep_add(struct tcpx_ep *ep)
 {
-	if (!ep->util_ep.rx_cq->wait)
+	struct util_cq *rx_cq = ep->util_ep.rx_cq;
+	struct util_cq *tx_cq = ep->util_ep.tx_cq;
+	int ret;
+
+	if (rx_cq) {
+		ret = tcpx_ready_add(rx_cq, &ep->rx_ready, ep);
+		if (ret)
+			return ret;
+	}
+
+	if (tx_cq && tx_cq != rx_cq) {
+		ret = tcpx_ready_add(tx_cq, &ep->tx_ready, ep);
+		if (ret)
+			goto err;
+	}
+
+	if (!rx_cq || !rx_cq->wait)
 		return FI_SUCCESS;
 
-	return ofi_wait_fd_add(ep->util_ep.rx_cq->wait,
-			       ep->conn_fd, tcpx_try_func,
-			       (void *)&ep->util_ep, NULL);
+	ret = ofi_wait_fd_add(rx_cq->wait, ep->conn_fd, tcpx_try_func,
+			      (void *)&ep->util_ep, NULL);
+	if (ret)
+		goto err;
+
+	return FI_SUCCESS;
+err:
+	tcpx_ready_remove(&ep->tx_ready);
+	tcpx_ready_remove(&ep->rx_ready);
+	return ret;
 }
 
 void tcpx_progress_ep_del(struct tcpx_ep *ep)
 {
+	tcpx_ready_del(ep->util_ep.rx_cq, &ep->rx_ready);
+	tcpx_ready_del(ep->util_ep.tx_cq, &ep->tx_ready);
+
 	fastlock_acquire(&ep->lock);
 	if (ep->cm_state == TCPX_EP_CONNECTING) {
 		goto out;
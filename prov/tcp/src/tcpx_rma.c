@@ -53,10 +53,9 @@ static void tcpx_rma_read_send_entry_fill(struct tcpx_xfer_entry *send_entry,
 					  struct tcpx_ep *tcpx_ep,
 					  const struct fi_msg_rma *msg)
 {
-	send_entry->msg_hdr.hdr.version = OFI_CTRL_VERSION;
+	send_entry->msg_hdr.hdr.version = tcpx_ep->hdr_version;
 	send_entry->msg_hdr.hdr.op = ofi_op_read_req;
 	send_entry->msg_hdr.hdr.op_data = TCPX_OP_READ;
-	send_entry->msg_hdr.hdr.size = htonll(sizeof(send_entry->msg_hdr));
 
 	memcpy(send_entry->msg_hdr.rma_iov, msg->rma_iov,
 	       msg->rma_iov_count * sizeof(msg->rma_iov[0]));
@@ -64,8 +63,11 @@ static void tcpx_rma_read_send_entry_fill(struct tcpx_xfer_entry *send_entry,
 	send_entry->msg_hdr.rma_iov_cnt = msg->rma_iov_count;
 
 	send_entry->msg_data.iov[0].iov_base = (void *) &send_entry->msg_hdr;
-	send_entry->msg_data.iov[0].iov_len = sizeof(send_entry->msg_hdr);
+	send_entry->msg_data.iov[0].iov_len =
+		tcpx_hdr_len(tcpx_ep->hdr_version, &send_entry->msg_hdr);
 	send_entry->msg_data.iov_cnt = 1;
+	send_entry->msg_hdr.hdr.size =
+		htonll(send_entry->msg_data.iov[0].iov_len);
 
 	send_entry->flags |= TCPX_NO_COMPLETION;
 	send_entry->msg_hdr.hdr.flags = htonl(send_entry->msg_hdr.hdr.flags);
@@ -133,6 +135,7 @@ static ssize_t tcpx_rma_readmsg(struct fid_ep *ep, const struct fi_msg_rma *msg,
 		htonll(tcpx_ep->rma_list.msg_id_tracker++);
 	dlist_insert_tail(&recv_entry->entry, &tcpx_ep->rma_list.list);
 	dlist_insert_tail(&send_entry->entry, &tcpx_ep->tx_queue);
+	tcpx_progress_ep_ready(tcpx_ep);
 	fastlock_release(&tcpx_ep->lock);
 	return FI_SUCCESS;
 }
@@ -209,17 +212,19 @@ static ssize_t tcpx_rma_writemsg(struct fid_ep *ep, const struct fi_msg_rma *msg
 
 	assert(!(flags & FI_INJECT) || (data_len <= TCPX_MAX_INJECT_SZ));
 
-	send_entry->msg_hdr.hdr.version = OFI_CTRL_VERSION;
+	send_entry->msg_hdr.hdr.version = tcpx_ep->hdr_version;
 	send_entry->msg_hdr.hdr.op = ofi_op_write;
 	send_entry->msg_hdr.hdr.op_data = TCPX_OP_WRITE;
-	send_entry->msg_hdr.hdr.size = htonll(data_len + sizeof(send_entry->msg_hdr));
 
 	memcpy(send_entry->msg_hdr.rma_iov, msg->rma_iov,
 	       msg->rma_iov_count * sizeof(msg->rma_iov[0]));
 	send_entry->msg_hdr.rma_iov_cnt = msg->rma_iov_count;
 
 	send_entry->msg_data.iov[0].iov_base = (void *) &send_entry->msg_hdr;
-	send_entry->msg_data.iov[0].iov_len = sizeof(send_entry->msg_hdr);
+	send_entry->msg_data.iov[0].iov_len =
+		tcpx_hdr_len(tcpx_ep->hdr_version, &send_entry->msg_hdr);
+	send_entry->msg_hdr.hdr.size =
+		htonll(data_len + send_entry->msg_data.iov[0].iov_len);
 	send_entry->msg_data.iov_cnt = msg->iov_count + 1;
 
 	if (flags & FI_INJECT) {
@@ -254,6 +259,7 @@ static ssize_t tcpx_rma_writemsg(struct fid_ep *ep, const struct fi_msg_rma *msg
 	} else {
 		dlist_insert_tail(&send_entry->entry, &tcpx_ep->tx_queue);
 	}
+	tcpx_progress_ep_ready(tcpx_ep);
 	fastlock_release(&tcpx_ep->lock);
 	return FI_SUCCESS;
 }
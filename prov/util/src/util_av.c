@@ -1215,6 +1215,10 @@ static void util_cmap_init_handle(struct util_cmap_handle *handle,
 	util_cmap_set_key(handle);
 	handle->fi_addr = fi_addr;
 	handle->peer = peer;
+	dlist_init(&handle->lru_entry);
+	handle->last_use = 0;
+	handle->reconnect = 0;
+	handle->connect_retry = 0;
 }
 
 static int util_cmap_match_peer(struct dlist_entry *entry, const void *addr)
@@ -1240,6 +1244,10 @@ static int util_cmap_del_handle(struct util_cmap_handle *handle)
 	} else {
 		cmap->handles_av[handle->fi_addr] = 0;
 	}
+	if (!dlist_empty(&handle->lru_entry)) {
+		dlist_remove_init(&handle->lru_entry);
+		cmap->conn_cnt--;
+	}
 	util_cmap_clear_key(handle);
 
 	handle->state = CMAP_SHUTDOWN;
@@ -1256,6 +1264,158 @@ static int util_cmap_del_handle(struct util_cmap_handle *handle)
 	return 0;
 }
 
+/* Caller must hold cmap->lock */
+static int util_cmap_reset_handle(struct util_cmap_handle *handle)
+{
+	struct util_cmap *cmap = handle->cmap;
+	fi_addr_t fi_addr = handle->peer ? FI_ADDR_NOTAVAIL : handle->fi_addr;
+	int ret;
+
+	ret = util_cmap_del_handle(handle);
+	if (ret || fi_addr == FI_ADDR_NOTAVAIL)
+		return ret;
+
+	/* Addresses in the AV get a new handle so that their connection is
+	 * re-established on next use */
+	ret = util_cmap_alloc_handle(cmap, fi_addr, CMAP_IDLE, &handle);
+	if (ret)
+		return ret;
+	handle->reconnect = 1;
+	return 0;
+}
+
+/*
+ * Closing a connection that the peer is still using could drop data in
+ * flight, so an idle handle is only evicted with the peer's agreement:
+ *
+ * - The evicting side stops starting new transfers (CMAP_CLOSING) and asks
+ *   the peer with close_req.
+ * - The peer agrees only if the connection is idle on its side too. It then
+ *   moves to CMAP_CLOSING as well, so its answer is the last message it
+ *   sends on the connection, see ofi_cmap_process_close_req.
+ * - Everything the peer sent before its answer has arrived with it. If the
+ *   connection is still idle, the evicting side closes it and the peer
+ *   resets its handle on the shutdown event, see ofi_cmap_process_close_resp.
+ *
+ * A refusal by either side returns both handles to CMAP_CONNECTED, and
+ * eviction is tried again on the next handle.  Handles that were skipped
+ * are retried by ofi_cmap_reap_idle.
+ *
+ * Caller must hold cmap->lock
+ */
+static void util_cmap_evict_idle(struct util_cmap *cmap)
+{
+	struct util_cmap_handle *handle;
+	struct dlist_entry *entry, *tmp;
+	uint64_t now = fi_gettime_ms();
+
+	cmap->reap_time = now + OFI_CMAP_REAP_INTERVAL;
+	dlist_foreach_safe(&cmap->lru_list, entry, tmp) {
+		if (cmap->conn_cnt <= cmap->attr.max_conn)
+			break;
+
+		handle = container_of(entry, struct util_cmap_handle,
+				      lru_entry);
+		if (now - handle->last_use < cmap->attr.idle_time)
+			continue;
+		if (handle->state == CMAP_CONNECTED_NOTIFY)
+			ofi_cmap_process_conn_notify(cmap, handle);
+		if ((handle->state != CMAP_CONNECTED) ||
+		    (cmap->attr.idle && !cmap->attr.idle(handle)))
+			continue;
+
+		FI_DBG(cmap->av->prov, FI_LOG_EP_CTRL,
+		       "Requesting close of idle connection handle: %p\n",
+		       handle);
+		if (cmap->attr.close_req(handle))
+			continue;
+		dlist_remove_init(&handle->lru_entry);
+		cmap->conn_cnt--;
+		handle->state = CMAP_CLOSING;
+	}
+}
+
+/* Caller must hold cmap->lock */
+static void util_cmap_resume_handle(struct util_cmap_handle *handle)
+{
+	struct util_cmap *cmap = handle->cmap;
+
+	FI_DBG(cmap->av->prov, FI_LOG_EP_CTRL,
+	       "Keeping connection handle: %p\n", handle);
+	handle->state = CMAP_CONNECTED;
+	if (!cmap->attr.max_conn)
+		return;
+
+	dlist_insert_tail(&handle->lru_entry, &cmap->lru_list);
+	handle->last_use = fi_gettime_ms();
+	if (++cmap->conn_cnt > cmap->attr.max_conn)
+		util_cmap_evict_idle(cmap);
+}
+
+/*
+ * Eviction only closes connections that have been idle for idle_time, so
+ * the number of connections may stay above max_conn after a new one is
+ * established.  Providers call this from progress while
+ * ofi_cmap_over_limit() to evict the connections that became idle since.
+ */
+void ofi_cmap_reap_idle(struct util_cmap *cmap)
+{
+	fastlock_acquire(&cmap->lock);
+	if (ofi_cmap_over_limit(cmap) && fi_gettime_ms() >= cmap->reap_time)
+		util_cmap_evict_idle(cmap);
+	fastlock_release(&cmap->lock);
+}
+
+/* Caller must hold cmap->lock */
+int ofi_cmap_process_close_req(struct util_cmap *cmap,
+			       struct util_cmap_handle *handle)
+{
+	FI_DBG(cmap->av->prov, FI_LOG_EP_CTRL,
+	       "Processing close request for handle: %p\n", handle);
+	if (handle->state == CMAP_CONNECTED_NOTIFY)
+		ofi_cmap_process_conn_notify(cmap, handle);
+
+	if (handle->state != CMAP_CONNECTED ||
+	    (cmap->attr.idle && !cmap->attr.idle(handle)))
+		return -FI_EBUSY;
+
+	if (!dlist_empty(&handle->lru_entry)) {
+		dlist_remove_init(&handle->lru_entry);
+		cmap->conn_cnt--;
+	}
+	handle->state = CMAP_CLOSING;
+	return 0;
+}
+
+/* Returns -FI_EBUSY if the peer agreed to close but the connection is no
+ * longer idle, in which case the caller has to tell the peer to keep it.
+ *
+ * Caller must hold cmap->lock */
+int ofi_cmap_process_close_resp(struct util_cmap *cmap,
+				struct util_cmap_handle *handle, int accepted)
+{
+	FI_DBG(cmap->av->prov, FI_LOG_EP_CTRL, "Processing close %s for "
+	       "handle: %p\n", accepted ? "accept" : "refusal", handle);
+	if (!accepted) {
+		if (handle->state == CMAP_CLOSING)
+			util_cmap_resume_handle(handle);
+		return 0;
+	}
+
+	if (handle->state != CMAP_CLOSING)
+		return handle->state == CMAP_SHUTDOWN ? 0 : -FI_EBUSY;
+
+	if (cmap->attr.idle && !cmap->attr.idle(handle)) {
+		util_cmap_resume_handle(handle);
+		return -FI_EBUSY;
+	}
+
+	FI_DBG(cmap->av->prov, FI_LOG_EP_CTRL,
+	       "Evicting idle connection handle: %p\n", handle);
+	cmap->evict_cnt++;
+	return util_cmap_reset_handle(handle);
+}
+
 void ofi_cmap_del_handle(struct util_cmap_handle *handle)
 {
 	struct util_cmap *cmap = handle->cmap;
@@ -1387,7 +1547,11 @@ void ofi_cmap_process_shutdown(struct util_cmap *cmap,
 			"Invalid handle on shutdown event\n");
 	} else if (handle->state != CMAP_SHUTDOWN) {
 		FI_DBG(cmap->av->prov, FI_LOG_EP_CTRL, "Got remote shutdown\n");
-		util_cmap_del_handle(handle);
+		/* Bounded cmaps reconnect on next use, as after an eviction */
+		if (cmap->attr.max_conn || handle->state == CMAP_CLOSING)
+			util_cmap_reset_handle(handle);
+		else
+			util_cmap_del_handle(handle);
 	} else {
 		FI_DBG(cmap->av->prov, FI_LOG_EP_CTRL, "Got local shutdown\n");
 	}
@@ -1414,6 +1578,39 @@ void ofi_cmap_process_connect(struct util_cmap *cmap,
 	handle->state = CMAP_CONNECTED_NOTIFY;
 	if (remote_key)
 		handle->remote_key = *remote_key;
+
+	if (handle->reconnect) {
+		cmap->reconnect_cnt++;
+		handle->reconnect = 0;
+	}
+
+	if (!cmap->attr.max_conn || !dlist_empty(&handle->lru_entry))
+		return;
+
+	dlist_insert_tail(&handle->lru_entry, &cmap->lru_list);
+	handle->last_use = fi_gettime_ms();
+	if (++cmap->conn_cnt > cmap->attr.max_conn)
+		util_cmap_evict_idle(cmap);
+}
+
+/*
+ * A peer that connects to us at the same time rejects our request if its
+ * name is higher than ours, and accepts its own request instead, see
+ * ofi_cmap_process_connreq.  Its request may arrive after the reject, so
+ * ours is sent again a few times before the peer is taken to refuse the
+ * connection, which would drop everything queued on the handle.
+ *
+ * Caller must hold cmap->lock
+ */
+static int util_cmap_may_retry(struct util_cmap_handle *handle)
+{
+	struct util_cmap *cmap = handle->cmap;
+
+	return !handle->peer &&
+	       handle->connect_retry < OFI_CMAP_CONNECT_RETRY &&
+	       ofi_addr_cmp(cmap->av->prov,
+			    ofi_av_get_addr(cmap->av, handle->fi_addr),
+			    cmap->attr.name) > 0;
 }
 
 void ofi_cmap_process_reject(struct util_cmap *cmap,
@@ -1426,11 +1623,22 @@ void ofi_cmap_process_reject(struct util_cmap *cmap,
 	case CMAP_CONNREQ_RECV:
 	case CMAP_CONNECTED:
 	case CMAP_CONNECTED_NOTIFY:
+	case CMAP_CLOSING:
 		/* Handle is being re-used for incoming connection request */
 		FI_DBG(cmap->av->prov, FI_LOG_EP_CTRL,
 			"Connection handle is being re-used. Ignoring reject\n");
 		break;
 	case CMAP_CONNREQ_SENT:
+		if (util_cmap_may_retry(handle)) {
+			FI_DBG(cmap->av->prov, FI_LOG_EP_CTRL,
+				"Retrying connection request\n");
+			handle->connect_retry++;
+			cmap->attr.close(handle);
+			handle->state = CMAP_IDLE;
+			/* Deletes the handle if the request can't be sent */
+			ofi_cmap_handle_connect(cmap, handle->fi_addr, handle);
+			break;
+		}
 		FI_DBG(cmap->av->prov, FI_LOG_EP_CTRL,
 			"Deleting connection handle\n");
 		util_cmap_del_handle(handle);
@@ -1485,6 +1693,7 @@ int ofi_cmap_process_connreq(struct util_cmap *cmap, void *addr,
 	switch (handle->state) {
 	case CMAP_CONNECTED_NOTIFY:
 	case CMAP_CONNECTED:
+	case CMAP_CLOSING:
 		FI_DBG(cmap->av->prov, FI_LOG_EP_CTRL,
 			"Connection already present.\n");
 		ret = -FI_EALREADY;
@@ -1553,6 +1762,7 @@ int ofi_cmap_handle_connect(struct util_cmap *cmap, fi_addr_t fi_addr,
 	case CMAP_CONNREQ_SENT:
 	case CMAP_CONNREQ_RECV:
 	case CMAP_ACCEPT:
+	case CMAP_CLOSING:
 	case CMAP_SHUTDOWN:
 		ret = -FI_EAGAIN;
 		break;
@@ -1655,6 +1865,7 @@ struct util_cmap *ofi_cmap_alloc(struct util_ep *ep,
 	ofi_key_idx_init(&cmap->key_idx, UTIL_CMAP_IDX_BITS);
 
 	dlist_init(&cmap->peer_list);
+	dlist_init(&cmap->lru_list);
 	fastlock_init(&cmap->lock);
 
 	if (pthread_create(&cmap->event_handler_thread, 0,
@@ -33,6 +33,13 @@
 
 #include <ofi_mr.h>
 
+#ifdef HAVE_UFFD_UNMAP
+#include <poll.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/userfaultfd.h>
+#endif
 
 void ofi_monitor_init(struct ofi_mem_monitor *monitor)
 {
@@ -106,11 +113,26 @@ void ofi_monitor_unsubscribe(struct ofi_subscription *subscription)
 					       subscription->len,
 					       subscription);
 	fastlock_acquire(&subscription->nq->lock);
-	dlist_init(&subscription->entry);
+	/* A pending event must not outlive the subscription */
+	dlist_remove_init(&subscription->entry);
 	subscription->nq->refcnt--;
 	fastlock_release(&subscription->nq->lock);
 }
 
+static void util_monitor_queue_event(struct ofi_subscription *subscription)
+{
+	FI_DBG(&core_prov, FI_LOG_MR,
+	       "found event, context=%p, addr=%p, len=%"PRIu64" nq=%p\n",
+	       subscription, subscription->addr,
+	       subscription->len, subscription->nq);
+
+	fastlock_acquire(&subscription->nq->lock);
+	if (dlist_empty(&subscription->entry))
+		dlist_insert_tail(&subscription->entry,
+				   &subscription->nq->list);
+	fastlock_release(&subscription->nq->lock);
+}
+
 static void util_monitor_read_events(struct ofi_mem_monitor *monitor)
 {
 	struct ofi_subscription *subscription;
@@ -123,16 +145,7 @@ static void util_monitor_read_events(struct ofi_mem_monitor *monitor)
 			break;
 		}
 
-		FI_DBG(&core_prov, FI_LOG_MR,
-		       "found event, context=%p, addr=%p, len=%"PRIu64" nq=%p\n",
-		       subscription, subscription->addr,
-		       subscription->len, subscription->nq);
-
-		fastlock_acquire(&subscription->nq->lock);
-		if (dlist_empty(&subscription->entry))
-			dlist_insert_tail(&subscription->entry,
-					   &subscription->nq->list);
-		fastlock_release(&subscription->nq->lock);
+		util_monitor_queue_event(subscription);
 	} while (1);
 }
 
@@ -155,3 +168,256 @@ struct ofi_subscription *ofi_monitor_get_event(struct ofi_notification_queue *nq
 
 	return subscription;
 }
+
+
+#ifdef HAVE_UFFD_UNMAP
+
+/*
+ * Subscribed ranges are registered with a single userfaultfd in write
+ * protect mode, which only arms event delivery: nothing is ever write
+ * protected, so no faults reach the handler.  Without write protect
+ * support, or for mappings it does not cover (such as hugetlbfs on older
+ * kernels), subscribing fails and the caller registers per message.
+ *
+ * The kernel holds munmap/madvise callers until their event is read, so
+ * a dedicated thread reads events and queues every overlapping
+ * subscription.  It does so under the monitor lock, which get_event takes
+ * to make sure an unmap that has returned is visible to the caches.
+ * A range is unregistered on unsubscribe unless its pages are shared with
+ * another subscription; the kernel drops it along with the mapping.
+ */
+static struct {
+	struct ofi_mem_monitor	monitor;
+	pthread_mutex_t		init_lock;
+	pthread_mutex_t		lock;
+	struct dlist_entry	list;
+	pthread_t		thread;
+	int			fd;
+	int			refcnt;
+	size_t			page_size;
+} util_uffd = {
+	.init_lock = PTHREAD_MUTEX_INITIALIZER,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.fd = -1,
+};
+
+struct ofi_mem_monitor *uffd_monitor = &util_uffd.monitor;
+
+static void util_uffd_page_range(void *addr, size_t len,
+				 struct uffdio_range *range)
+{
+	range->start = (uintptr_t) addr & ~(util_uffd.page_size - 1);
+	range->len = fi_get_aligned_sz((uintptr_t) addr + len - range->start,
+				       util_uffd.page_size);
+}
+
+static void util_uffd_notify(void *addr, size_t len)
+{
+	struct ofi_subscription *subscription;
+
+	dlist_foreach_container(&util_uffd.list, struct ofi_subscription,
+				subscription, mon_entry) {
+		if ((char *) subscription->addr + subscription->len <=
+		    (char *) addr ||
+		    (char *) subscription->addr >= (char *) addr + len)
+			continue;
+		util_monitor_queue_event(subscription);
+	}
+}
+
+static void util_uffd_handle(struct uffd_msg *msg)
+{
+	switch (msg->event) {
+	case UFFD_EVENT_REMOVE:
+	case UFFD_EVENT_UNMAP:
+		util_uffd_notify((void *) (uintptr_t) msg->arg.remove.start,
+				 msg->arg.remove.end - msg->arg.remove.start);
+		break;
+	case UFFD_EVENT_REMAP:
+		util_uffd_notify((void *) (uintptr_t) msg->arg.remap.from,
+				 msg->arg.remap.len);
+		break;
+	default:
+		FI_WARN(&core_prov, FI_LOG_MR,
+			"unexpected userfaultfd event %d\n", msg->event);
+		break;
+	}
+}
+
+static void *util_uffd_thread(void *arg)
+{
+	struct pollfd fds;
+	struct uffd_msg msg;
+	int ret;
+
+	fds.fd = util_uffd.fd;
+	fds.events = POLLIN;
+	for (;;) {
+		ret = poll(&fds, 1, -1);
+		if (ret < 0 && errno != EINTR)
+			break;
+
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		pthread_mutex_lock(&util_uffd.lock);
+		while (read(util_uffd.fd, &msg, sizeof msg) == sizeof msg)
+			util_uffd_handle(&msg);
+		pthread_mutex_unlock(&util_uffd.lock);
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+	}
+
+	FI_WARN(&core_prov, FI_LOG_MR,
+		"userfaultfd handler exiting (%s)\n", strerror(errno));
+	return NULL;
+}
+
+static int util_uffd_subscribe(struct ofi_mem_monitor *monitor, void *addr,
+			       size_t len, struct ofi_subscription *subscription)
+{
+	struct uffdio_register reg;
+	int ret = 0;
+
+#ifdef UFFDIO_REGISTER_MODE_WP
+	reg.mode = UFFDIO_REGISTER_MODE_WP;
+#else
+	return -FI_ENOSYS;
+#endif
+	util_uffd_page_range(addr, len, &reg.range);
+
+	/* Serialized with unsubscribe unregistering shared pages */
+	pthread_mutex_lock(&util_uffd.lock);
+	if (ioctl(util_uffd.fd, UFFDIO_REGISTER, &reg))
+		ret = -errno;
+	else
+		dlist_insert_tail(&subscription->mon_entry, &util_uffd.list);
+	pthread_mutex_unlock(&util_uffd.lock);
+	return ret;
+}
+
+static int util_uffd_shared(struct uffdio_range *range)
+{
+	struct ofi_subscription *subscription;
+	struct uffdio_range other;
+
+	dlist_foreach_container(&util_uffd.list, struct ofi_subscription,
+				subscription, mon_entry) {
+		util_uffd_page_range(subscription->addr, subscription->len,
+				     &other);
+		if (other.start < range->start + range->len &&
+		    range->start < other.start + other.len)
+			return 1;
+	}
+	return 0;
+}
+
+static void util_uffd_unsubscribe(struct ofi_mem_monitor *monitor,
+				  void *addr, size_t len,
+				  struct ofi_subscription *subscription)
+{
+	struct uffdio_range range;
+
+	util_uffd_page_range(addr, len, &range);
+
+	pthread_mutex_lock(&util_uffd.lock);
+	dlist_remove(&subscription->mon_entry);
+	/* Fails harmlessly if the range was unmapped in the meantime */
+	if (!util_uffd_shared(&range))
+		(void) ioctl(util_uffd.fd, UFFDIO_UNREGISTER, &range);
+	pthread_mutex_unlock(&util_uffd.lock);
+}
+
+static struct ofi_subscription *
+util_uffd_get_event(struct ofi_mem_monitor *monitor)
+{
+	/* Events are queued by the handler; wait out one in progress */
+	pthread_mutex_lock(&util_uffd.lock);
+	pthread_mutex_unlock(&util_uffd.lock);
+	return NULL;
+}
+
+int ofi_uffd_init(void)
+{
+	struct uffdio_api api;
+	int ret = 0;
+
+	pthread_mutex_lock(&util_uffd.init_lock);
+	if (util_uffd.refcnt++)
+		goto out;
+
+	util_uffd.fd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+	if (util_uffd.fd < 0) {
+		ret = -errno;
+		goto err;
+	}
+
+	api.api = UFFD_API;
+	api.features = UFFD_FEATURE_EVENT_UNMAP | UFFD_FEATURE_EVENT_REMOVE |
+		       UFFD_FEATURE_EVENT_REMAP;
+	if (ioctl(util_uffd.fd, UFFDIO_API, &api)) {
+		ret = -errno;
+		goto err_close;
+	}
+
+#ifdef UFFDIO_REGISTER_MODE_WP
+	if (!(api.features & UFFD_FEATURE_PAGEFAULT_FLAG_WP))
+#endif
+	{
+		ret = -FI_ENOSYS;
+		goto err_close;
+	}
+
+	util_uffd.page_size = sysconf(_SC_PAGESIZE);
+	dlist_init(&util_uffd.list);
+	ofi_monitor_init(&util_uffd.monitor);
+	util_uffd.monitor.subscribe = util_uffd_subscribe;
+	util_uffd.monitor.unsubscribe = util_uffd_unsubscribe;
+	util_uffd.monitor.get_event = util_uffd_get_event;
+
+	ret = pthread_create(&util_uffd.thread, NULL, util_uffd_thread, NULL);
+	if (ret) {
+		ret = -ret;
+		goto err_close;
+	}
+out:
+	pthread_mutex_unlock(&util_uffd.init_lock);
+	return 0;
+
+err_close:
+	close(util_uffd.fd);
+	util_uffd.fd = -1;
+err:
+	FI_INFO(&core_prov, FI_LOG_MR,
+		"userfaultfd monitor unavailable: %s\n", fi_strerror(-ret));
+	util_uffd.refcnt--;
+	pthread_mutex_unlock(&util_uffd.init_lock);
+	return ret;
+}
+
+void ofi_uffd_cleanup(void)
+{
+	pthread_mutex_lock(&util_uffd.init_lock);
+	assert(util_uffd.refcnt > 0);
+	if (--util_uffd.refcnt == 0) {
+		pthread_cancel(util_uffd.thread);
+		pthread_join(util_uffd.thread, NULL);
+		ofi_monitor_cleanup(&util_uffd.monitor);
+		assert(dlist_empty(&util_uffd.list));
+		close(util_uffd.fd);
+		util_uffd.fd = -1;
+	}
+	pthread_mutex_unlock(&util_uffd.init_lock);
+}
+
+#else /* HAVE_UFFD_UNMAP */
+
+struct ofi_mem_monitor *uffd_monitor = NULL;
+
+int ofi_uffd_init(void)
+{
+	return -FI_ENOSYS;
+}
+
+void ofi_uffd_cleanup(void)
+{
+}
+
+#endif /* HAVE_UFFD_UNMAP */
@@ -34,14 +34,23 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 
 #include <ofi_shm.h>
 
+#ifndef MAP_POPULATE
+#define MAP_POPULATE 0
+#endif
+
+/* The header must not spill into the doorbell line that peers write */
+_Static_assert(offsetof(struct smr_region, doorbell) == SMR_HDR_SIZE,
+	       "smr_region header does not fit in SMR_HDR_SIZE");
 
 static void smr_peer_addr_init(struct smr_addr *peer)
 {
@@ -49,26 +58,125 @@ static void smr_peer_addr_init(struct smr_addr *peer)
 	peer->addr = FI_ADDR_UNSPEC;
 }
 
-/* TODO: Determine if aligning SMR data helps performance */
+/* Path of a region's file on the local hugetlbfs mount */
+static int smr_huge_path(const char *name, char *path, size_t *page_size)
+{
+	char dir[PATH_MAX];
+	int ret;
+
+	ret = ofi_hugepage_dir(dir, sizeof(dir), page_size);
+	if (ret)
+		return ret;
+
+	if (name[0] == '/')
+		name++;
+	if (snprintf(path, PATH_MAX, "%s/%s", dir, name) >= PATH_MAX)
+		return -FI_ETOOSMALL;
+	return 0;
+}
+
+/*
+ * Huge pages are reserved when the file is mapped, so running out of them
+ * fails here rather than with a SIGBUS on first touch.
+ */
+static void *smr_map_huge(const struct fi_provider *prov, const char *name,
+			  size_t *size, size_t *page_size)
+{
+	char path[PATH_MAX];
+	size_t huge_size, map_size;
+	void *addr;
+	int fd, ret;
+
+	ret = smr_huge_path(name, path, &huge_size);
+	if (ret) {
+		FI_INFO(prov, FI_LOG_EP_CTRL,
+			"no usable hugetlbfs mount: %s\n", fi_strerror(-ret));
+		return MAP_FAILED;
+	}
+
+	fd = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+	if (fd < 0) {
+		ret = errno;
+		goto err1;
+	}
+
+	map_size = fi_get_aligned_sz(*size, huge_size);
+	if (ftruncate(fd, map_size)) {
+		ret = errno;
+		goto err2;
+	}
+
+	addr = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, fd, 0);
+	if (addr == MAP_FAILED) {
+		ret = errno;
+		goto err2;
+	}
+
+	close(fd);
+	*size = map_size;
+	*page_size = huge_size;
+	return addr;
+
+err2:
+	close(fd);
+	unlink(path);
+err1:
+	FI_INFO(prov, FI_LOG_EP_CTRL, "unable to use huge pages for %s: %s\n",
+		path, strerror(ret));
+	return MAP_FAILED;
+}
+
 int smr_create(const struct fi_provider *prov, struct smr_map *map,
 	       const struct smr_attr *attr, struct smr_region **smr)
 {
 	size_t total_size, cmd_queue_offset, peer_addr_offset;
 	size_t resp_queue_offset, inject_pool_offset, name_offset;
-	int fd, ret, i;
+	size_t sar_pool_offset, peer_cma_offset, rx_count, tx_count, page_size;
+	int fd, ret, i, node;
+	uint16_t flags = 0;
 	void *mapped_addr;
 
-	cmd_queue_offset = sizeof(**smr);
-	resp_queue_offset = cmd_queue_offset + sizeof(struct smr_cmd_queue) +
-			sizeof(struct smr_cmd) * attr->rx_count;
-	inject_pool_offset = resp_queue_offset + sizeof(struct smr_resp_queue) +
-			sizeof(struct smr_resp) * attr->tx_count;
-	peer_addr_offset = inject_pool_offset + sizeof(struct smr_inject_pool) +
-			sizeof(struct smr_inject_buf) * attr->rx_count;
-	name_offset = peer_addr_offset + sizeof(struct smr_addr) * SMR_MAX_PEERS;
+	/* Queues and pools index with a mask */
+	rx_count = roundup_power_of_two(attr->rx_count);
+	tx_count = roundup_power_of_two(attr->tx_count);
+
+	cmd_queue_offset = fi_get_aligned_sz(sizeof(**smr),
+					     OFI_CACHE_LINE_SIZE);
+	resp_queue_offset = fi_get_aligned_sz(cmd_queue_offset +
+			sizeof(struct smr_cmd_queue) +
+			sizeof(struct smr_cmd_queue_entry) * rx_count,
+			OFI_CACHE_LINE_SIZE);
+	inject_pool_offset = fi_get_aligned_sz(resp_queue_offset +
+			sizeof(struct smr_resp_queue) +
+			sizeof(struct smr_resp_queue_entry) * tx_count,
+			OFI_CACHE_LINE_SIZE);
+	sar_pool_offset = fi_get_aligned_sz(inject_pool_offset +
+			sizeof(struct smr_inject_pool) +
+			sizeof(struct smr_inject_buf) * rx_count,
+			OFI_CACHE_LINE_SIZE);
+	peer_addr_offset = fi_get_aligned_sz(sar_pool_offset +
+			sizeof(struct smr_sar_pool) +
+			sizeof(struct smr_sar_msg) * SMR_SAR_COUNT,
+			OFI_CACHE_LINE_SIZE);
+	peer_cma_offset = fi_get_aligned_sz(peer_addr_offset +
+			sizeof(struct smr_addr) * map->num_peers,
+			OFI_CACHE_LINE_SIZE);
+	name_offset = fi_get_aligned_sz(peer_cma_offset + map->num_peers,
+			OFI_CACHE_LINE_SIZE);
 	total_size = name_offset + strlen(attr->name) + 1;
 	total_size = roundup_power_of_two(total_size);
 
+	if (attr->huge_pages) {
+		mapped_addr = smr_map_huge(prov, attr->name, &total_size,
+					   &page_size);
+		if (mapped_addr != MAP_FAILED) {
+			flags = SMR_FLAG_HUGEPAGE;
+			goto init;
+		}
+	}
+
+	page_size = ofi_sysconf(_SC_PAGESIZE);
 	fd = shm_open(attr->name, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
 	if (fd < 0) {
 		FI_WARN(prov, FI_LOG_EP_CTRL, "shm_open error\n");
@@ -81,8 +189,13 @@ int smr_create(const struct fi_provider *prov, struct smr_map *map,
 		goto err2;
 	}
 
+	/*
+	 * Fault the whole region in from the owner so that first touch places
+	 * it on the owner's NUMA node rather than on that of the first peer
+	 * to write into it.
+	 */
 	mapped_addr = mmap(NULL, total_size, PROT_READ | PROT_WRITE,
-			   MAP_SHARED, fd, 0);
+			   MAP_SHARED | MAP_POPULATE, fd, 0);
 	if (mapped_addr == MAP_FAILED) {
 		FI_WARN(prov, FI_LOG_EP_CTRL, "mmap error\n");
 		goto err2;
@@ -91,31 +204,44 @@ int smr_create(const struct fi_provider *prov, struct smr_map *map,
 	/* TODO: If we unlink here, can other processes open the region? */
 	close(fd);
 
+init:
+	node = ofi_mem_node(mapped_addr);
+	FI_INFO(prov, FI_LOG_EP_CTRL,
+		"region %s: %zu bytes, %zu byte pages, NUMA node %d\n",
+		attr->name, total_size, page_size, node < 0 ? -1 : node);
+
 	*smr = mapped_addr;
-	fastlock_init(&(*smr)->lock);
-	fastlock_acquire(&(*smr)->lock);
 
 	(*smr)->map = map;
+	(*smr)->base_addr = *smr;
 	(*smr)->version = SMR_VERSION;
-	(*smr)->flags = SMR_FLAG_ATOMIC | SMR_FLAG_DEBUG;
-	(*smr)->pid = getpid();
+	(*smr)->flags = SMR_FLAG_ATOMIC | SMR_FLAG_DEBUG | flags;
 
 	(*smr)->total_size = total_size;
+	(*smr)->num_peers = map->num_peers;
+	ofi_atomic_initialize32(&(*smr)->doorbell, 0);
+	ofi_atomic_initialize32(&(*smr)->waiting, 0);
 	(*smr)->cmd_queue_offset = cmd_queue_offset;
 	(*smr)->resp_queue_offset = resp_queue_offset;
 	(*smr)->inject_pool_offset = inject_pool_offset;
+	(*smr)->sar_pool_offset = sar_pool_offset;
 	(*smr)->peer_addr_offset = peer_addr_offset;
+	(*smr)->peer_cma_offset = peer_cma_offset;
 	(*smr)->name_offset = name_offset;
-	(*smr)->cmd_cnt = attr->rx_count;
 
-	smr_cmd_queue_init(smr_cmd_queue(*smr), attr->rx_count);
-	smr_resp_queue_init(smr_resp_queue(*smr), attr->tx_count);
-	smr_inject_pool_init(smr_inject_pool(*smr), attr->rx_count);
-	for (i = 0; i < SMR_MAX_PEERS; i++)
+	smr_cmd_queue_init(smr_cmd_queue(*smr), rx_count);
+	smr_resp_queue_init(smr_resp_queue(*smr), tx_count);
+	smr_inject_pool_init(smr_inject_pool(*smr), rx_count);
+	smr_sar_pool_init(smr_sar_pool(*smr), SMR_SAR_COUNT);
+	for (i = 0; i < map->num_peers; i++) {
 		smr_peer_addr_init(&smr_peer_addr(*smr)[i]);
+		smr_peer_cma(*smr)[i] = SMR_CMA_CAP_NA;
+	}
 
 	strncpy((char *) smr_name(*smr), attr->name, total_size - name_offset);
-	fastlock_release(&(*smr)->lock);
+
+	/* Peers treat a region with a valid pid as initialized */
+	(*smr)->pid = getpid();
 
 	return 0;
 
@@ -128,41 +254,110 @@ err1:
 
 void smr_free(struct smr_region *smr)
 {
-	shm_unlink(smr_name(smr));
+	char path[PATH_MAX];
+	size_t page_size;
+
+	if (!(smr->flags & SMR_FLAG_HUGEPAGE))
+		shm_unlink(smr_name(smr));
+	else if (!smr_huge_path(smr_name(smr), path, &page_size))
+		unlink(path);
 }
 
 int smr_map_create(const struct fi_provider *prov, int peer_count,
-		   struct smr_map **map)
+		   int flags, int max_mapped, struct smr_map **map)
 {
-	int i;
-
 	(*map) = calloc(1, sizeof(struct smr_map));
-	if (!*map) {
-		FI_WARN(prov, FI_LOG_DOMAIN, "failed to create SHM region group\n");
-		return -FI_ENOMEM;
-	}
+	if (!*map)
+		goto err1;
 
-	for (i = 0; i < peer_count; i++)
-		smr_peer_addr_init(&(*map)->peers[i].peer);
+	(*map)->num_peers = peer_count;
+	(*map)->flags = flags;
+	(*map)->max_mapped = max_mapped;
+	ofi_atomic_initialize64(&(*map)->clock, 0);
+	dlist_init(&(*map)->mapped_list);
+	(*map)->peers = calloc((peer_count + SMR_PEER_CHUNK_SIZE - 1) >>
+			       SMR_PEER_CHUNK_SHIFT, sizeof(*(*map)->peers));
+	if (!(*map)->peers)
+		goto err2;
 
 	fastlock_init(&(*map)->lock);
 
 	return 0;
+
+err2:
+	free(*map);
+err1:
+	FI_WARN(prov, FI_LOG_DOMAIN, "failed to create SHM region group\n");
+	return -FI_ENOMEM;
+}
+
+static int smr_map_reserve(struct smr_map *map, int id)
+{
+	struct smr_peer *chunk;
+	int i;
+
+	if (map->peers[id >> SMR_PEER_CHUNK_SHIFT])
+		return 0;
+
+	chunk = calloc(SMR_PEER_CHUNK_SIZE, sizeof(*chunk));
+	if (!chunk)
+		return -FI_ENOMEM;
+
+	for (i = 0; i < SMR_PEER_CHUNK_SIZE; i++) {
+		smr_peer_addr_init(&chunk[i].peer);
+		ofi_atomic_initialize32(&chunk[i].ref, 0);
+	}
+
+	map->peers[id >> SMR_PEER_CHUNK_SHIFT] = chunk;
+	return 0;
+}
+
+static int smr_open_peer(const char *name)
+{
+	char path[PATH_MAX];
+	size_t page_size;
+	int fd;
+
+	fd = shm_open(name, O_RDWR, S_IRUSR | S_IWUSR);
+	if (fd >= 0 || errno != ENOENT)
+		return fd;
+
+	/* The peer may have put its region on huge pages */
+	if (smr_huge_path(name, path, &page_size)) {
+		errno = ENOENT;
+		return -1;
+	}
+	return open(path, O_RDWR);
 }
 
 int smr_map_to_region(const struct fi_provider *prov, struct smr_peer *peer_buf)
 {
 	struct smr_region *peer;
-	size_t size;
+	struct stat st;
 	int fd, ret = 0;
 
-	fd = shm_open(peer_buf->peer.name, O_RDWR, S_IRUSR | S_IWUSR);
+	fd = smr_open_peer(peer_buf->peer.name);
 	if (fd < 0) {
 		FI_WARN(prov, FI_LOG_AV, "shm_open error\n");
 		return -errno;
 	}
 
-	peer = mmap(NULL, sizeof(*peer), PROT_READ | PROT_WRITE,
+	/*
+	 * Map the whole file at once: hugetlbfs mappings cannot be partially
+	 * unmapped, so the header cannot be mapped on its own first.
+	 */
+	if (fstat(fd, &st)) {
+		ret = -errno;
+		goto out;
+	}
+
+	if (st.st_size < sizeof(*peer)) {
+		FI_WARN(prov, FI_LOG_AV, "peer not initialized\n");
+		ret = -FI_EAGAIN;
+		goto out;
+	}
+
+	peer = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
 		    MAP_SHARED, fd, 0);
 	if (peer == MAP_FAILED) {
 		FI_WARN(prov, FI_LOG_AV, "mmap error\n");
@@ -172,15 +367,20 @@ int smr_map_to_region(const struct fi_provider *prov, struct smr_peer *peer_buf)
 
 	if (!peer->pid) {
 		FI_WARN(prov, FI_LOG_AV, "peer not initialized\n");
-		munmap(peer, sizeof(*peer));
+		munmap(peer, st.st_size);
 		ret = -FI_EAGAIN;
 		goto out;
 	}
 
-	size = peer->total_size;
-	munmap(peer, sizeof(*peer));
+	if (peer->version != SMR_VERSION) {
+		FI_WARN(prov, FI_LOG_AV, "peer %s has region version %d, "
+			"expected %d\n", peer_buf->peer.name, peer->version,
+			SMR_VERSION);
+		munmap(peer, st.st_size);
+		ret = -FI_EINVAL;
+		goto out;
+	}
 
-	peer = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
 	peer_buf->region = peer;
 
 out:
@@ -194,25 +394,29 @@ void smr_map_to_endpoint(struct smr_region *region, int index)
 	struct smr_addr *local_peers, *peer_peers;
 	int peer_index;
 
+	if (!smr_map_valid(region->map, index))
+		return;
+
 	local_peers = smr_peer_addr(region);
 
 	strncpy(smr_peer_addr(region)[index].name,
-		region->map->peers[index].peer.name, SMR_NAME_SIZE);
-	if (region->map->peers[index].peer.addr == FI_ADDR_UNSPEC)
+		smr_map_peer(region->map, index)->peer.name, SMR_NAME_SIZE);
+	if (smr_map_try_acquire(region->map, index))
 		return;
 
 	peer_smr = smr_peer_region(region, index);
 	peer_peers = smr_peer_addr(peer_smr);
 
-	for (peer_index = 0; peer_index < SMR_MAX_PEERS; peer_index++) {
+	for (peer_index = 0; peer_index < peer_smr->num_peers; peer_index++) {
 		if (!strncmp(smr_name(region),
 		    peer_peers[peer_index].name, SMR_NAME_SIZE))
 			break;
 	}
-	if (peer_index != SMR_MAX_PEERS) {
+	if (peer_index != peer_smr->num_peers) {
 		peer_peers[peer_index].addr = index;
 		local_peers[index].addr = peer_index;
 	}
+	smr_map_release(region->map, index);
 }
 
 void smr_unmap_from_endpoint(struct smr_region *region, int index)
@@ -221,37 +425,128 @@ void smr_unmap_from_endpoint(struct smr_region *region, int index)
 	struct smr_addr *local_peers, *peer_peers;
 	int peer_index;
 
+	if (!smr_map_valid(region->map, index))
+		return;
+
 	local_peers = smr_peer_addr(region);
 
 	memset(local_peers[index].name, 0, SMR_NAME_SIZE);
-	peer_index = region->map->peers[index].peer.addr;
-	if (peer_index == FI_ADDR_UNSPEC)
+	smr_peer_cma(region)[index] = SMR_CMA_CAP_NA;
+	if (smr_map_try_acquire(region->map, index))
 		return;
 
+	peer_index = smr_map_peer(region->map, index)->peer.addr;
 	peer_smr = smr_peer_region(region, index);
 	peer_peers = smr_peer_addr(peer_smr);
 
 	peer_peers[peer_index].addr = FI_ADDR_UNSPEC;
+	smr_map_release(region->map, index);
 }
 
 void smr_exchange_all_peers(struct smr_region *region)
 {
 	int i;
-	for (i = 0; i < SMR_MAX_PEERS; i++)
+	for (i = 0; i < region->map->num_peers; i++)
 		smr_map_to_endpoint(region, i);
 }
 
+static void smr_map_unmap(struct smr_map *map, struct smr_peer *peer)
+{
+	munmap(peer->region, peer->region->total_size);
+	peer->region = NULL;
+	peer->peer.addr = FI_ADDR_UNSPEC;
+	dlist_remove(&peer->entry);
+	map->num_mapped--;
+}
+
+/* Unmaps the least recently used peer that nobody holds a reference on */
+static void smr_map_evict(struct smr_map *map)
+{
+	struct smr_peer *peer, *lru = NULL;
+
+	dlist_foreach_container(&map->mapped_list, struct smr_peer,
+				peer, entry) {
+		if (ofi_atomic_get32(&peer->ref))
+			continue;
+		if (!lru || peer->last_use < lru->last_use)
+			lru = peer;
+	}
+
+	/* Fails if the peer was picked up since it was checked */
+	if (!lru || !ofi_atomic_cas_bool32(&lru->ref, 0, SMR_PEER_EVICTING))
+		return;
+
+	smr_map_unmap(map, lru);
+	ofi_atomic_sub32(&lru->ref, SMR_PEER_EVICTING);
+}
+
+/* Must be called with the map lock held */
+static int smr_map_region(const struct fi_provider *prov,
+			  struct smr_map *map, int id)
+{
+	struct smr_peer *peer;
+	int ret;
+
+	if (map->max_mapped && map->num_mapped >= map->max_mapped)
+		smr_map_evict(map);
+
+	peer = smr_map_peer(map, id);
+	ret = smr_map_to_region(prov, peer);
+	if (ret)
+		return ret;
+
+	peer->peer.addr = id;
+	peer->last_use = ofi_atomic_inc64(&map->clock);
+	dlist_insert_tail(&peer->entry, &map->mapped_list);
+	map->num_mapped++;
+	return 0;
+}
+
+int smr_map_acquire(const struct fi_provider *prov, struct smr_map *map,
+		    int id)
+{
+	int ret = 0;
+
+	if (!smr_map_valid(map, id))
+		return -FI_EINVAL;
+
+	if (!smr_map_try_acquire(map, id))
+		return 0;
+
+	fastlock_acquire(&map->lock);
+	if (!smr_map_peer(map, id)->region) {
+		ret = smr_map_region(prov, map, id);
+		if (ret)
+			goto unlock;
+	}
+	if (map->max_mapped)
+		ofi_atomic_inc32(&smr_map_peer(map, id)->ref);
+unlock:
+	fastlock_release(&map->lock);
+	return ret;
+}
+
 int smr_map_add(const struct fi_provider *prov, struct smr_map *map,
 		const char *name, int id)
 {
+	struct smr_peer *peer;
 	int ret = 0;
 
+	if (id < 0 || id >= map->num_peers)
+		return -FI_EINVAL;
+
 	fastlock_acquire(&map->lock);
-	strncpy(map->peers[id].peer.name, name, SMR_NAME_SIZE);
-	map->peers[id].peer.name[SMR_NAME_SIZE - 1] = '\0';
-	ret = smr_map_to_region(prov, &map->peers[id]);
-	if (!ret)
-		map->peers[id].peer.addr = id;
+	ret = smr_map_reserve(map, id);
+	if (ret)
+		goto unlock;
+
+	peer = smr_map_peer(map, id);
+	strncpy(peer->peer.name, name, SMR_NAME_SIZE);
+	peer->peer.name[SMR_NAME_SIZE - 1] = '\0';
+	peer->cma_cap = SMR_CMA_CAP_NA;
+	if (!(map->flags & SMR_MAP_LAZY) && !peer->region)
+		ret = smr_map_region(prov, map, id);
+unlock:
 	fastlock_release(&map->lock);
 
 	return ret == -ENOENT ? 0 : ret;
@@ -259,28 +554,37 @@ int smr_map_add(const struct fi_provider *prov, struct smr_map *map,
 
 void smr_map_del(struct smr_map *map, int id)
 {
-	if (id >= SMR_MAX_PEERS || id < 0 ||
-	    map->peers[id].peer.addr == FI_ADDR_UNSPEC)
+	struct smr_peer *peer;
+
+	if (!smr_map_valid(map, id))
 		return;
 
-	munmap(map->peers[id].region, map->peers[id].region->total_size);
-	map->peers[id].peer.addr = FI_ADDR_UNSPEC;
+	fastlock_acquire(&map->lock);
+	peer = smr_map_peer(map, id);
+	if (peer->region)
+		smr_map_unmap(map, peer);
+	smr_peer_addr_init(&peer->peer);
+	fastlock_release(&map->lock);
 }
 
 void smr_map_free(struct smr_map *map)
 {
 	int i;
 
-	for (i = 0; i < SMR_MAX_PEERS; i++)
+	for (i = 0; i < map->num_peers; i++)
 		smr_map_del(map, i);
 
+	for (i = 0; i < map->num_peers; i += SMR_PEER_CHUNK_SIZE)
+		free(map->peers[i >> SMR_PEER_CHUNK_SHIFT]);
+
+	free(map->peers);
 	free(map);
 }
 
 struct smr_region *smr_map_get(struct smr_map *map, int id)
 {
-	if (id < 0 || id >= SMR_MAX_PEERS)
+	if (!smr_map_valid(map, id))
 		return NULL;
 
-	return map->peers[id].region;
+	return smr_map_peer(map, id)->region;
 }
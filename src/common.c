@@ -650,13 +650,27 @@ int fi_epoll_add(struct fi_epoll *ep, int fd, uint32_t events, void *context)
 	return 0;
 }
 
+int fi_epoll_mod(struct fi_epoll *ep, int fd, uint32_t events, void *context)
+{
+	int i;
+
+	for (i = 0; i < ep->nfds; i++) {
+		if (ep->fds[i].fd == fd) {
+			ep->fds[i].events = events;
+			ep->context[i] = context;
+			return 0;
+		}
+	}
+	return -FI_EINVAL;
+}
+
 int fi_epoll_del(struct fi_epoll *ep, int fd)
 {
 	int i;
 
 	for (i = 0; i < ep->nfds; i++) {
 		if (ep->fds[i].fd == fd) {
-			ep->fds[i].fd = ep->fds[ep->nfds - 1].fd;
+			ep->fds[i] = ep->fds[ep->nfds - 1];
 			ep->context[i] = ep->context[--ep->nfds];
       			return 0;
 		}
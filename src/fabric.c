@@ -449,6 +449,7 @@ libdl_done:
 			ofi_register_provider(RXD_INIT, NULL);
 	}
 
+	ofi_register_provider(TCP_INIT, NULL);
 	ofi_register_provider(UDP_INIT, NULL);
 	ofi_register_provider(SOCKETS_INIT, NULL);
 
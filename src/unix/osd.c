@@ -47,6 +47,12 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#ifdef __linux__
+#include <mntent.h>
+#include <sys/syscall.h>
+#include <sys/vfs.h>
+#include <linux/mempolicy.h>
+#endif
 
 #include "ofi.h"
 #include "ofi_osd.h"
@@ -266,3 +272,61 @@ int ofi_set_thread_affinity(const char *s)
 	return -FI_ENOSYS;
 #endif
 }
+
+/*
+ * Finds a hugetlbfs mount that files can be created in and returns its
+ * path and huge page size.
+ */
+int ofi_hugepage_dir(char *dir, size_t len, size_t *page_size)
+{
+#ifdef __linux__
+	struct mntent *mnt;
+	struct statfs fs;
+	FILE *mounts;
+	int ret = -FI_ENOENT;
+
+	mounts = setmntent("/proc/mounts", "r");
+	if (!mounts)
+		return -errno;
+
+	while ((mnt = getmntent(mounts))) {
+		if (strcmp(mnt->mnt_type, "hugetlbfs") ||
+		    access(mnt->mnt_dir, W_OK) || statfs(mnt->mnt_dir, &fs))
+			continue;
+
+		if (strlen(mnt->mnt_dir) >= len) {
+			ret = -FI_ETOOSMALL;
+			continue;
+		}
+
+		strcpy(dir, mnt->mnt_dir);
+		*page_size = fs.f_bsize;
+		ret = 0;
+		break;
+	}
+
+	endmntent(mounts);
+	return ret;
+#else
+	OFI_UNUSED(dir);
+	OFI_UNUSED(len);
+	OFI_UNUSED(page_size);
+	return -FI_ENOSYS;
+#endif
+}
+
+/* Returns the NUMA node backing the page at addr, or a negative error */
+int ofi_mem_node(void *addr)
+{
+#if defined(__linux__) && defined(SYS_get_mempolicy)
+	int node;
+
+	if (syscall(SYS_get_mempolicy, &node, NULL, 0, addr,
+		    MPOL_F_NODE | MPOL_F_ADDR))
+		return -errno;
+	return node;
+#else
+	OFI_UNUSED(addr);
+	return -FI_ENOSYS;
+#endif
+}